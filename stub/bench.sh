@@ -0,0 +1,230 @@
+#!/bin/sh
+#
+# Benchmark tsmpipe against the simulated API library, see README.md.
+#
+#   sh stub/bench.sh [tsmpipe]
+#
+# Runs send, extract and list scenarios at several buffer sizes and
+# object counts in a scratch object store and prints GB/s or ops/s for
+# each, then checks that plain, striped, compressed, encrypted, sparse
+# and daemon stores extract to the same bytes, that objects with a codec
+# tsmpipe lacks fail to extract and that a segmented input changed in
+# place is sent again. Tuned with:
+#
+#   BENCH_SIZE      Size of the large object, with k/M/G suffix (1G)
+#   BENCH_BUFSIZES  Buffer sizes to try for it (256k 1M 4M)
+#   BENCH_OBJECTS   Object counts for the small object runs (100 1000)
+#   BENCH_OBJSIZE   Size of the small objects in bytes (4096)
+#   BENCH_STRIPES   Stripes for the striped run (4)
+#   BENCH_DIR       Scratch directory (a new one under $TMPDIR)
+#
+# The TSMSTUB_* variables, like TSMSTUB_LATENCY_US and TSMSTUB_BANDWIDTH,
+# are passed on to simulate a server.
+
+TSMPIPE=${1:-./tsmpipe-stub}
+BENCH_SIZE=${BENCH_SIZE:-1G}
+BENCH_BUFSIZES=${BENCH_BUFSIZES:-256k 1M 4M}
+BENCH_OBJECTS=${BENCH_OBJECTS:-100 1000}
+BENCH_OBJSIZE=${BENCH_OBJSIZE:-4096}
+BENCH_STRIPES=${BENCH_STRIPES:-4}
+
+if [ ! -x "$TSMPIPE" ]; then
+    echo "bench: $TSMPIPE not found, build it with make tsmpipe-stub" >&2
+    exit 1
+fi
+
+if [ -n "$BENCH_DIR" ]; then
+    dir=$BENCH_DIR
+    mkdir -p "$dir" || exit 1
+else
+    dir=$(mktemp -d "${TMPDIR:-/tmp}/tsmpipe-bench.XXXXXX") || exit 1
+    trap 'rm -rf "$dir"' 0
+    trap 'exit 1' 1 2 15
+fi
+
+# The API wants these, the stub ignores them
+DSM_DIR=$dir
+DSM_CONFIG=$dir/dsm.opt
+TSMSTUB_DIR=$dir/store
+export DSM_DIR DSM_CONFIG TSMSTUB_DIR
+unset TSMPIPE_SOCKET
+: > "$DSM_CONFIG"
+
+now() {
+    date +%s.%N
+}
+
+# result name amount unit start
+result() {
+    awk -v name="$1" -v n="$2" -v unit="$3" -v start="$4" -v end="$(now)" '
+        BEGIN {
+            t = end - start
+            if(t <= 0) {
+                t = 0.000001
+            }
+            if(unit == "GB") {
+                printf "%-32s %10.2f GB %8.2f s %10.2f GB/s\n",
+                       name, n / 1e9, t, n / 1e9 / t
+            }
+            else {
+                printf "%-32s %10d op %8.2f s %10.0f ops/s\n",
+                       name, n, t, n / t
+            }
+        }'
+}
+
+fail() {
+    echo "bench: $* failed" >&2
+    exit 1
+}
+
+bytes=$(echo "$BENCH_SIZE" | awk '
+    /[kK]$/ { print $0 * 1024; next }
+    /[mM]$/ { print $0 * 1048576; next }
+    /[gG]$/ { print $0 * 1073741824; next }
+            { print $0 + 0 }')
+
+# Random data, so a compressing server or codec gains nothing
+head -c "$bytes" /dev/urandom > "$dir/data" || fail "creating test data"
+
+echo "tsmpipe benchmark, $BENCH_SIZE object, store in $dir"
+for v in $(env | grep '^TSMSTUB_' | grep -v '^TSMSTUB_DIR='); do
+    echo "  $v"
+done
+echo
+
+for b in $BENCH_BUFSIZES; do
+    rm -rf "$TSMSTUB_DIR"
+    start=$(now)
+    "$TSMPIPE" -A -c -s /bench -f /large -i "$dir/data" -b "$b" ||
+        fail "send -b $b"
+    result "send -b $b" "$bytes" GB "$start"
+
+    start=$(now)
+    "$TSMPIPE" -A -x -s /bench -f /large -b "$b" > /dev/null ||
+        fail "extract -b $b"
+    result "extract -b $b" "$bytes" GB "$start"
+done
+
+rm -rf "$TSMSTUB_DIR"
+start=$(now)
+"$TSMPIPE" -A -c -s /bench -f /striped -i "$dir/data" -S "$BENCH_STRIPES" ||
+    fail "striped send"
+result "send -S $BENCH_STRIPES" "$bytes" GB "$start"
+
+start=$(now)
+"$TSMPIPE" -A -x -s /bench -f /striped > /dev/null || fail "striped extract"
+result "extract -S $BENCH_STRIPES" "$bytes" GB "$start"
+
+head -c "$BENCH_OBJSIZE" "$dir/data" > "$dir/small"
+
+for n in $BENCH_OBJECTS; do
+    rm -rf "$TSMSTUB_DIR"
+    awk -v n="$n" -v f="$dir/small" 'BEGIN {
+        for(i = 0; i < n; i++) {
+            printf "%s\t/bench\t/small/%06d\n", f, i
+        }
+    }' > "$dir/manifest"
+
+    start=$(now)
+    "$TSMPIPE" -A -C "$dir/manifest" > /dev/null || fail "send $n objects"
+    result "send $n objects" "$n" op "$start"
+
+    start=$(now)
+    "$TSMPIPE" -A -t -s /bench -f '/small/*' > /dev/null ||
+        fail "list $n objects"
+    result "list $n objects" "$n" op "$start"
+
+    start=$(now)
+    "$TSMPIPE" -A -X -s /bench -f '/small/*' > /dev/null ||
+        fail "extract $n objects"
+    result "extract $n objects" "$n" op "$start"
+
+    start=$(now)
+    "$TSMPIPE" -A -U -s /bench -f '/small/*' > /dev/null 2> "$dir/err" ||
+        { cat "$dir/err" >&2; fail "delete $n objects"; }
+    result "delete $n objects" "$n" op "$start"
+done
+
+# roundtrip name file "send options" "extract options"
+roundtrip() {
+    rm -rf "$TSMSTUB_DIR"
+    "$TSMPIPE" -A -c -s /bench -f /rt -i "$2" $3 || fail "$1 send"
+    "$TSMPIPE" -A -x -s /bench -f /rt $4 > "$dir/out" || fail "$1 extract"
+    cmp "$2" "$dir/out" || fail "$1 round trip"
+    printf "%-32s %10s\n" "round trip $1" ok
+}
+
+# Not a multiple of any block or buffer size
+head -c 3145733 "$dir/data" > "$dir/rt"
+# Zero runs for the sparse codec
+{
+    head -c 1048576 "$dir/data"
+    head -c 3145728 /dev/zero
+    head -c 1000 "$dir/data"
+} > "$dir/sparse"
+
+echo
+roundtrip plain "$dir/rt"
+roundtrip striped "$dir/rt" "-S $BENCH_STRIPES -Z 1M"
+roundtrip "-z zlib" "$dir/rt" "-z zlib"
+roundtrip "-z sparse" "$dir/sparse" "-z sparse"
+if "$TSMPIPE" -h 2>&1 | grep -q 'sparse+zlib'; then
+    roundtrip "-z sparse+zlib" "$dir/sparse" "-z sparse+zlib"
+fi
+if "$TSMPIPE" -h 2>&1 | grep -q -- '-K keys'; then
+    (umask 077
+     echo "bench $(head -c 32 /dev/urandom | od -An -tx1 | tr -d ' \n')" \
+        > "$dir/keys")
+    roundtrip "-K" "$dir/rt" "-K $dir/keys" "-K $dir/keys"
+    if "$TSMPIPE" -h 2>&1 | grep -q 'sparse+zlib'; then
+        roundtrip "-z sparse+zlib -K" "$dir/sparse" \
+            "-z sparse+zlib -K $dir/keys" "-K $dir/keys"
+    fi
+fi
+
+# A codec this tsmpipe doesn't have, renamed in the store, must fail
+# rather than give the stored frames as the data
+rm -rf "$TSMSTUB_DIR"
+"$TSMPIPE" -A -c -s /bench -f /rt -i "$dir/rt" -z zlib || fail "nocodec send"
+LC_ALL=C sed 's/codec=zlib/codec=nope/' "$TSMSTUB_DIR/catalog" \
+    > "$dir/catalog" && mv "$dir/catalog" "$TSMSTUB_DIR/catalog" ||
+    fail "nocodec rename"
+for op in -x -X -V; do
+    "$TSMPIPE" -A $op -s /bench -f /rt > /dev/null 2>&1 &&
+        fail "nocodec $op"
+done
+printf "%-32s %10s\n" "unknown codec fails" ok
+
+# A segmented input changed in place with its mtime kept, like a block
+# device, must be sent again rather than found already stored
+rm -rf "$TSMSTUB_DIR"
+cp "$dir/rt" "$dir/seg"
+"$TSMPIPE" -B -c -s /bench -f /seg -i "$dir/seg" -e 1M || fail "segment send"
+touch -r "$dir/seg" "$dir/stamp"
+printf changed | dd of="$dir/seg" bs=1 seek=2000000 conv=notrunc 2> /dev/null
+touch -r "$dir/stamp" "$dir/seg"
+"$TSMPIPE" -B -c -s /bench -f /seg -i "$dir/seg" -e 1M 2> "$dir/seg.log" ||
+    fail "segment resend"
+grep -q "already stored" "$dir/seg.log" && fail "segment change missed"
+"$TSMPIPE" -B -x -s /bench -f /seg > "$dir/out" || fail "segment extract"
+cmp "$dir/seg" "$dir/out" || fail "segment round trip"
+printf "%-32s %10s\n" "changed segments resent" ok
+
+# The same through a daemon worker
+rm -rf "$TSMSTUB_DIR"
+"$TSMPIPE" -W "$dir/sock" -S 1 2> "$dir/daemon.log" &
+daemon=$!
+i=0
+while [ ! -S "$dir/sock" ] && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+TSMPIPE_SOCKET=$dir/sock "$TSMPIPE" -A -c -s /bench -f /rt -i "$dir/rt" &&
+    TSMPIPE_SOCKET=$dir/sock "$TSMPIPE" -A -x -s /bench -f /rt > "$dir/out"
+ok=$?
+kill $daemon
+wait $daemon
+[ $ok -eq 0 ] || { cat "$dir/daemon.log" >&2; fail "daemon send/extract"; }
+cmp "$dir/rt" "$dir/out" || fail "daemon round trip"
+printf "%-32s %10s\n" "round trip daemon" ok
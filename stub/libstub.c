@@ -0,0 +1,1940 @@
+/*
+    Copyright (c) 2026 The tsmpipe contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"), to
+deal in the Software without restriction, including without limitation the
+rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Simulated TSM API library.
+ *
+ * Implements the subset of the dsm* API that tsmpipe uses on top of a
+ * local object store, so tsmpipe can be built, tested and benchmarked
+ * without a TSM server. Objects live in $TSMSTUB_DIR:
+ *
+ *   catalog    Append-only list of object records (struct stub_rec +
+ *              fs/hl/ll/descr strings). State changes are done in place.
+ *   nextid     Object id counter.
+ *   data/<id>  Object data.
+ *
+ * Behaviour is tuned with environment variables:
+ *
+ *   TSMSTUB_DIR          Object store directory (default ./tsmstub.store)
+ *   TSMSTUB_LATENCY_US   Delay added to every API call
+ *   TSMSTUB_INIT_US      Delay added to dsmInitEx (session setup cost)
+ *   TSMSTUB_BANDWIDTH    Per-session data rate cap, bytes/s (k/M/G suffix)
+ *   TSMSTUB_MOUNT_MS     Delay when a get switches to another volume
+ *   TSMSTUB_VOLUMES      Number of simulated volumes (default 4)
+ *   TSMSTUB_MAXOBJPERTXN Server TXNGROUPMAX (default 4096)
+ *   TSMSTUB_TXNBYTELIMIT Server TXNBYTELIMIT in bytes (default 25600k)
+ *   TSMSTUB_FAIL         func:n:rc[,func:n:rc...] makes the n:th call of
+ *                        func return rc
+ *   TSMSTUB_STATS        Print call statistics on dsmTerminate
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE_SOURCE 1
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "dsmrc.h"
+#include "dsmapitd.h"
+#include "dsmapifp.h"
+
+#define STUB_MAXSESS        64
+#define STUB_MAXPENDING     65536
+
+#define STUB_BACKUP         0
+#define STUB_ARCHIVE        1
+
+#define STUB_GRP_LEADER     0x01
+#define STUB_GRP_OPEN       0x02
+#define STUB_GRP_MEMBER     0x04
+
+/* Fixed part of a catalog record, followed by fs\0hl\0ll\0descr\0 */
+struct stub_rec {
+    dsUint32_t  reclen;
+    dsUint8_t   type;
+    dsUint8_t   state;          /* DSM_ACTIVE, DSM_INACTIVE or 0=deleted */
+    dsUint8_t   objType;
+    dsUint8_t   compressed;
+    dsUint8_t   groupflags;
+    dsUint8_t   pad[1];
+    dsUint16_t  objInfolen;
+    dsUint32_t  vol;
+    dsUint32_t  copyGroup;
+    dsUint64_t  id;
+    dsUint64_t  size;
+    dsUint64_t  sizeest;
+    dsUint64_t  groupleader;
+    dsUint64_t  insdate;
+    dsUint64_t  expdate;
+    dsUint64_t  deactdate;
+    char        mc[DSM_MAX_MC_NAME_LENGTH+1];
+    char        owner[DSM_MAX_OWNER_LENGTH+1];
+    char        objInfo[DSM_MAX_OBJINFO_LENGTH];
+};
+
+struct stub_obj {
+    struct stub_rec rec;
+    off_t           catoff;
+    char            fs[DSM_MAX_FSNAME_LENGTH+1];
+    char            hl[DSM_MAX_HL_LENGTH+1];
+    char            ll[DSM_MAX_LL_LENGTH+1];
+    char            descr[DSM_MAX_DESCR_LENGTH+1];
+};
+
+enum stub_state {
+    ss_idle = 0,
+    ss_txn,
+    ss_send,
+    ss_query,
+    ss_get,
+    ss_getobj
+};
+
+struct stub_sess {
+    int                 inuse;
+    enum stub_state     state;
+
+    /* Transaction */
+    struct stub_obj     *pending;
+    int                 npending;
+    dsUint64_t          txnbytes;
+    int                 txnfailed;
+    int                 sendfd;
+    dsUint8_t           grpaction;
+    dsUint64_t          grpleader;
+    dsUint64_t          lastleader;
+    int                 ndelete;
+    dsUint64_t          *deletes;
+
+    /* Query */
+    struct stub_obj     *qres;
+    int                 nqres;
+    int                 qpos;
+    dsmQueryType        qtype;
+
+    /* Get */
+    ObjID               *getlist;
+    PartialObjData      *getpartial;
+    dsUint32_t          ngetlist;
+    dsUint32_t          getpos;
+    int                 getfd;
+    dsUint64_t          getoff;
+    dsUint64_t          getend;
+    dsUint32_t          mountedvol;
+
+    /* Throttling and statistics */
+    double              bwstart;
+    dsUint64_t          bwbytes;
+    dsUint64_t          bytesin;
+    dsUint64_t          bytesout;
+    dsUint64_t          calls;
+    dsUint64_t          mounts;
+};
+
+struct stub_fail {
+    char        func[32];
+    long        n;
+    dsInt16_t   rc;
+};
+
+static pthread_mutex_t  stub_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stub_sess stub_sessions[STUB_MAXSESS];
+static int              stub_configured;
+static char             stub_dir[PATH_MAX/2];
+static long             stub_latency_us;
+static long             stub_init_us;
+static double           stub_bandwidth;
+static long             stub_mount_ms;
+static dsUint32_t       stub_volumes = 4;
+static dsUint16_t       stub_maxobjpertxn = 4096;
+static dsUint64_t       stub_txnbytelimit = 25600*1024ULL;
+static int              stub_stats;
+static struct stub_fail stub_fails[16];
+static int              stub_nfails;
+static long             stub_failcount[16];
+
+
+static double stub_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static void stub_usleep(long us)
+{
+    struct timespec ts;
+
+    if(us <= 0) {
+        return;
+    }
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+
+static double stub_atosize(const char *s)
+{
+    char    *end;
+    double  v;
+
+    v = strtod(s, &end);
+    switch(*end) {
+        case 'k': case 'K': v *= 1024; break;
+        case 'm': case 'M': v *= 1024*1024; break;
+        case 'g': case 'G': v *= 1024*1024*1024; break;
+    }
+    return v;
+}
+
+
+static void stub_configure(void)
+{
+    char *e;
+
+    if(stub_configured) {
+        return;
+    }
+    stub_configured = 1;
+
+    e = getenv("TSMSTUB_DIR");
+    snprintf(stub_dir, sizeof(stub_dir), "%s", e?e:"tsmstub.store");
+    if((e = getenv("TSMSTUB_LATENCY_US"))) {
+        stub_latency_us = atol(e);
+    }
+    if((e = getenv("TSMSTUB_INIT_US"))) {
+        stub_init_us = atol(e);
+    }
+    if((e = getenv("TSMSTUB_BANDWIDTH"))) {
+        stub_bandwidth = stub_atosize(e);
+    }
+    if((e = getenv("TSMSTUB_MOUNT_MS"))) {
+        stub_mount_ms = atol(e);
+    }
+    if((e = getenv("TSMSTUB_VOLUMES")) && atol(e) > 0) {
+        stub_volumes = atol(e);
+    }
+    if((e = getenv("TSMSTUB_MAXOBJPERTXN")) && atol(e) > 0) {
+        stub_maxobjpertxn = atol(e);
+    }
+    if((e = getenv("TSMSTUB_TXNBYTELIMIT")) && stub_atosize(e) > 0) {
+        stub_txnbytelimit = stub_atosize(e);
+    }
+    if((e = getenv("TSMSTUB_STATS"))) {
+        stub_stats = 1;
+    }
+    if((e = getenv("TSMSTUB_FAIL"))) {
+        char *s = strdup(e), *tok, *save = NULL;
+
+        for(tok = strtok_r(s, ",", &save); tok && stub_nfails < 16;
+                tok = strtok_r(NULL, ",", &save))
+        {
+            struct stub_fail *f = &stub_fails[stub_nfails];
+            int rc;
+
+            if(sscanf(tok, "%31[^:]:%ld:%d", f->func, &f->n, &rc) == 3) {
+                f->rc = rc;
+                stub_nfails++;
+            }
+        }
+        free(s);
+    }
+}
+
+
+/* Common entry point bookkeeping: latency, failure injection */
+static dsInt16_t stub_enter(const char *func, struct stub_sess *s)
+{
+    int i;
+
+    stub_configure();
+    stub_usleep(stub_latency_us);
+    if(s) {
+        s->calls++;
+    }
+    for(i = 0; i < stub_nfails; i++) {
+        if(strcmp(stub_fails[i].func, func) == 0) {
+            long n;
+
+            pthread_mutex_lock(&stub_lock);
+            n = ++stub_failcount[i];
+            pthread_mutex_unlock(&stub_lock);
+            if(n == stub_fails[i].n) {
+                return stub_fails[i].rc;
+            }
+        }
+    }
+    return DSM_RC_OK;
+}
+
+
+static struct stub_sess *stub_getsess(dsUint32_t h)
+{
+    if(h == 0 || h > STUB_MAXSESS || !stub_sessions[h-1].inuse) {
+        return NULL;
+    }
+    return &stub_sessions[h-1];
+}
+
+
+static void stub_throttle(struct stub_sess *s, dsUint64_t bytes)
+{
+    double due, now;
+
+    if(stub_bandwidth <= 0) {
+        return;
+    }
+    now = stub_now();
+    if(s->bwbytes == 0 || now - s->bwstart > 1.0) {
+        s->bwstart = now;
+        s->bwbytes = 0;
+    }
+    s->bwbytes += bytes;
+    due = s->bwstart + s->bwbytes / stub_bandwidth;
+    if(due > now) {
+        stub_usleep((due - now) * 1e6);
+    }
+}
+
+
+static void stub_path(char *buf, size_t len, const char *name)
+{
+    snprintf(buf, len, "%s/%s", stub_dir, name);
+}
+
+
+static void stub_datapath(char *buf, size_t len, dsUint64_t id, int tmp)
+{
+    snprintf(buf, len, "%s/data/%llu%s", stub_dir, (unsigned long long) id,
+             tmp?".tmp":"");
+}
+
+
+static int stub_mkstore(void)
+{
+    char p[PATH_MAX];
+
+    if(mkdir(stub_dir, 0777) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    stub_path(p, sizeof(p), "data");
+    if(mkdir(p, 0777) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Serialize catalog access both between threads and processes */
+static int stub_lockstore(void)
+{
+    char    p[PATH_MAX];
+    int     fd;
+
+    pthread_mutex_lock(&stub_lock);
+    stub_path(p, sizeof(p), "lock");
+    fd = open(p, O_RDWR|O_CREAT, 0666);
+    if(fd < 0) {
+        pthread_mutex_unlock(&stub_lock);
+        return -1;
+    }
+    while(flock(fd, LOCK_EX) < 0 && errno == EINTR)
+        ;
+    return fd;
+}
+
+
+static void stub_unlockstore(int fd)
+{
+    if(fd >= 0) {
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+    pthread_mutex_unlock(&stub_lock);
+}
+
+
+static dsUint64_t stub_nextid(void)
+{
+    char        p[PATH_MAX];
+    FILE        *f;
+    unsigned long long id = 0;
+    int         lfd;
+
+    lfd = stub_lockstore();
+    stub_path(p, sizeof(p), "nextid");
+    f = fopen(p, "r");
+    if(f) {
+        if(fscanf(f, "%llu", &id) != 1) {
+            id = 0;
+        }
+        fclose(f);
+    }
+    id++;
+    f = fopen(p, "w");
+    if(f) {
+        fprintf(f, "%llu\n", id);
+        fclose(f);
+    }
+    stub_unlockstore(lfd);
+
+    return id;
+}
+
+
+/* Read the whole catalog. Caller frees *objs. */
+static int stub_readcat(struct stub_obj **objs, int *nobjs)
+{
+    char            p[PATH_MAX];
+    FILE            *f;
+    int             n = 0, alloc = 0;
+    struct stub_obj *o = NULL;
+    off_t           off = 0;
+
+    stub_path(p, sizeof(p), "catalog");
+    f = fopen(p, "r");
+    if(!f) {
+        *objs = NULL;
+        *nobjs = 0;
+        return errno == ENOENT ? 0 : -1;
+    }
+    while(1) {
+        struct stub_rec rec;
+        char            strs[DSM_MAX_FSNAME_LENGTH+DSM_MAX_HL_LENGTH+
+                             DSM_MAX_LL_LENGTH+DSM_MAX_DESCR_LENGTH+8];
+        size_t          slen;
+        char            *sp;
+
+        if(fread(&rec, sizeof(rec), 1, f) != 1) {
+            break;
+        }
+        slen = rec.reclen - sizeof(rec);
+        if(slen > sizeof(strs) || fread(strs, slen, 1, f) != 1) {
+            break;
+        }
+        if(n == alloc) {
+            alloc = alloc ? alloc*2 : 1024;
+            o = realloc(o, alloc * sizeof(*o));
+            if(!o) {
+                fclose(f);
+                return -1;
+            }
+        }
+        o[n].rec = rec;
+        o[n].catoff = off;
+        sp = strs;
+        strcpy(o[n].fs, sp);    sp += strlen(sp)+1;
+        strcpy(o[n].hl, sp);    sp += strlen(sp)+1;
+        strcpy(o[n].ll, sp);    sp += strlen(sp)+1;
+        strcpy(o[n].descr, sp);
+        off += rec.reclen;
+        n++;
+    }
+    fclose(f);
+
+    *objs = o;
+    *nobjs = n;
+    return 0;
+}
+
+
+static int stub_appendcat(struct stub_obj *o)
+{
+    char    p[PATH_MAX];
+    FILE    *f;
+    size_t  l1, l2, l3, l4;
+
+    l1 = strlen(o->fs)+1;
+    l2 = strlen(o->hl)+1;
+    l3 = strlen(o->ll)+1;
+    l4 = strlen(o->descr)+1;
+    o->rec.reclen = sizeof(o->rec) + l1 + l2 + l3 + l4;
+
+    stub_path(p, sizeof(p), "catalog");
+    f = fopen(p, "a");
+    if(!f) {
+        return -1;
+    }
+    fwrite(&o->rec, sizeof(o->rec), 1, f);
+    fwrite(o->fs, l1, 1, f);
+    fwrite(o->hl, l2, 1, f);
+    fwrite(o->ll, l3, 1, f);
+    fwrite(o->descr, l4, 1, f);
+    if(fclose(f)) {
+        return -1;
+    }
+    return 0;
+}
+
+
+static int stub_updatecat(struct stub_obj *o)
+{
+    char    p[PATH_MAX];
+    int     fd;
+    ssize_t r;
+
+    stub_path(p, sizeof(p), "catalog");
+    fd = open(p, O_WRONLY);
+    if(fd < 0) {
+        return -1;
+    }
+    r = pwrite(fd, &o->rec, sizeof(o->rec), o->catoff);
+    close(fd);
+
+    return r == sizeof(o->rec) ? 0 : -1;
+}
+
+
+static time_t stub_date2time(const dsmDate *d)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = d->year - 1900;
+    tm.tm_mon = d->month - 1;
+    tm.tm_mday = d->day;
+    tm.tm_hour = d->hour;
+    tm.tm_min = d->minute;
+    tm.tm_sec = d->second;
+    tm.tm_isdst = -1;
+
+    return mktime(&tm);
+}
+
+
+static void stub_time2date(dsUint64_t t, dsmDate *d)
+{
+    struct tm   tm;
+    time_t      tt = t;
+
+    if(t == ~0ULL) {
+        memset(d, 0, sizeof(*d));
+        d->year = DATE_PLUS_INFINITE;
+        return;
+    }
+    localtime_r(&tt, &tm);
+    d->year = tm.tm_year + 1900;
+    d->month = tm.tm_mon + 1;
+    d->day = tm.tm_mday;
+    d->hour = tm.tm_hour;
+    d->minute = tm.tm_min;
+    d->second = tm.tm_sec;
+}
+
+
+/* Is t within [lo, hi]? DATE_*_INFINITE years denote open ends. */
+static int stub_inrange(dsUint64_t t, const dsmDate *lo, const dsmDate *hi)
+{
+    if(lo->year != DATE_MINUS_INFINITE && lo->year != DATE_PLUS_INFINITE &&
+            (time_t) t < stub_date2time(lo))
+    {
+        return 0;
+    }
+    if(hi->year == DATE_MINUS_INFINITE) {
+        return 0;
+    }
+    if(hi->year != DATE_PLUS_INFINITE && t != ~0ULL &&
+            (time_t) t > stub_date2time(hi))
+    {
+        return 0;
+    }
+    if(hi->year != DATE_PLUS_INFINITE && t == ~0ULL) {
+        return 0;
+    }
+    return 1;
+}
+
+
+static int stub_namematch(const dsmObjName *pat, const struct stub_obj *o)
+{
+    if(fnmatch(pat->fs, o->fs, 0) != 0) {
+        return 0;
+    }
+    if(fnmatch(*pat->hl ? pat->hl : "", o->hl, 0) != 0) {
+        return 0;
+    }
+    if(fnmatch(pat->ll, o->ll, 0) != 0) {
+        return 0;
+    }
+    return 1;
+}
+
+
+static dsUint32_t stub_volume(dsUint64_t id)
+{
+    return 1 + (dsUint32_t) ((id * 2654435761ULL) % stub_volumes);
+}
+
+
+static void stub_abort_txn(struct stub_sess *s)
+{
+    int  i;
+    char p[PATH_MAX];
+
+    if(s->sendfd >= 0) {
+        close(s->sendfd);
+        s->sendfd = -1;
+    }
+    for(i = 0; i < s->npending; i++) {
+        stub_datapath(p, sizeof(p), s->pending[i].rec.id, 1);
+        unlink(p);
+    }
+    s->npending = 0;
+    s->ndelete = 0;
+    s->txnbytes = 0;
+    s->txnfailed = 0;
+    s->grpaction = 0;
+    s->state = ss_idle;
+}
+
+
+static void stub_free_query(struct stub_sess *s)
+{
+    free(s->qres);
+    s->qres = NULL;
+    s->nqres = 0;
+    s->qpos = 0;
+}
+
+
+/* ---------------------------------------------------------------------- */
+
+void dsmQueryApiVersionEx(dsmApiVersionEx *apiVersionP)
+{
+    apiVersionP->version = DSM_API_VERSION;
+    apiVersionP->release = DSM_API_RELEASE;
+    apiVersionP->level = DSM_API_LEVEL;
+    apiVersionP->subLevel = DSM_API_SUBLEVEL;
+    apiVersionP->unicode = bFalse;
+}
+
+
+dsInt16_t dsmSetUp(dsBool_t mtFlag, envSetUp *envSetUpP)
+{
+    (void) mtFlag;
+    (void) envSetUpP;
+
+    return stub_enter("dsmSetUp", NULL);
+}
+
+
+dsInt16_t dsmCleanUp(dsBool_t mtFlag)
+{
+    (void) mtFlag;
+
+    return stub_enter("dsmCleanUp", NULL);
+}
+
+
+dsInt16_t dsmInitEx(dsUint32_t *dsmHandleP, dsmInitExIn_t *dsmInitExInP,
+                    dsmInitExOut_t *dsmInitExOutP)
+{
+    dsInt16_t   rc;
+    int         i;
+
+    (void) dsmInitExInP;
+
+    *dsmHandleP = 0;
+    rc = stub_enter("dsmInitEx", NULL);
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    stub_usleep(stub_init_us);
+
+    if(stub_mkstore() < 0) {
+        return DSM_RC_ABORT_SYSTEM_ERROR;
+    }
+
+    pthread_mutex_lock(&stub_lock);
+    for(i = 0; i < STUB_MAXSESS; i++) {
+        if(!stub_sessions[i].inuse) {
+            break;
+        }
+    }
+    if(i == STUB_MAXSESS) {
+        pthread_mutex_unlock(&stub_lock);
+        return DSM_RC_NO_SESS_BLK;
+    }
+    memset(&stub_sessions[i], 0, sizeof(stub_sessions[i]));
+    stub_sessions[i].inuse = 1;
+    stub_sessions[i].sendfd = -1;
+    stub_sessions[i].getfd = -1;
+    pthread_mutex_unlock(&stub_lock);
+
+    *dsmHandleP = i+1;
+
+    if(dsmInitExOutP) {
+        strcpy(dsmInitExOutP->adsmServerName, "TSMSTUB");
+        dsmInitExOutP->serverVer = DSM_API_VERSION;
+        dsmInitExOutP->serverRel = DSM_API_RELEASE;
+    }
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmChangePW(dsUint32_t dsmHandle, char *oldPW, char *newPW)
+{
+    (void) oldPW;
+    (void) newPW;
+
+    return stub_enter("dsmChangePW", stub_getsess(dsmHandle));
+}
+
+
+dsInt16_t dsmTerminate(dsUint32_t dsmHandle)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state == ss_txn || s->state == ss_send) {
+        stub_abort_txn(s);
+    }
+    if(s->getfd >= 0) {
+        close(s->getfd);
+    }
+    if(stub_stats) {
+        fprintf(stderr, "tsmstub: session %u: %llu calls, %llu bytes in, "
+                "%llu bytes out, %llu mounts\n", dsmHandle,
+                (unsigned long long) s->calls,
+                (unsigned long long) s->bytesin,
+                (unsigned long long) s->bytesout,
+                (unsigned long long) s->mounts);
+    }
+    stub_free_query(s);
+    free(s->pending);
+    free(s->deletes);
+    free(s->getlist);
+    free(s->getpartial);
+    pthread_mutex_lock(&stub_lock);
+    s->inuse = 0;
+    pthread_mutex_unlock(&stub_lock);
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmRCMsg(dsUint32_t dsmHandle, dsInt16_t dsmRC, char *msg)
+{
+    const char *txt;
+
+    (void) dsmHandle;
+
+    switch(dsmRC) {
+        case DSM_RC_OK:             txt = "Success"; break;
+        case DSM_RC_ABORT_SYSTEM_ERROR: txt = "Server system error"; break;
+        case DSM_RC_ABORT_NO_MATCH: txt = "No objects on server match query"; break;
+        case DSM_RC_ABORT_BY_CLIENT: txt = "Transaction aborted by client"; break;
+        case DSM_RC_ABORT_NO_REPOSIT_SPACE: txt = "Server out of storage space"; break;
+        case DSM_RC_ABORT_MOUNT_NOT_POSSIBLE: txt = "Mount not possible"; break;
+        case DSM_RC_NO_MEMORY:      txt = "Out of memory"; break;
+        case DSM_RC_INVALID_PARM:   txt = "Invalid parameter"; break;
+        case DSM_RC_FINISHED:       txt = "Finished"; break;
+        case DSM_RC_WILL_ABORT:     txt = "Transaction will abort"; break;
+        case DSM_RC_NO_SESS_BLK:    txt = "No session"; break;
+        case DSM_RC_BAD_CALL_SEQUENCE: txt = "Invalid call sequence"; break;
+        case DSM_RC_INVALID_OBJID:  txt = "Invalid object id"; break;
+        case DSM_RC_FS_NOT_REGISTERED: txt = "Filespace not registered"; break;
+        case DSM_RC_MORE_DATA:      txt = "More data"; break;
+        case DSM_RC_NEEDTO_ENDTXN:  txt = "Transaction limit reached"; break;
+        default:                    txt = "Unknown error"; break;
+    }
+    sprintf(msg, "ANS%04dE (RC%d) tsmstub: %s", dsmRC < 0 ? -dsmRC : dsmRC,
+            dsmRC, txt);
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmQuerySessInfo(dsUint32_t dsmHandle, ApiSessInfo *SessInfoP)
+{
+    dsInt16_t rc;
+
+    rc = stub_enter("dsmQuerySessInfo", stub_getsess(dsmHandle));
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!stub_getsess(dsmHandle)) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+
+    memset(SessInfoP, 0, sizeof(*SessInfoP));
+    SessInfoP->stVersion = ApiSessInfoVersion;
+    strcpy(SessInfoP->serverHost, "localhost");
+    SessInfoP->serverPort = 1500;
+    stub_time2date(time(NULL), &SessInfoP->serverDate);
+    strcpy(SessInfoP->serverType, "TSMSTUB");
+    SessInfoP->serverVer = DSM_API_VERSION;
+    SessInfoP->serverRel = DSM_API_RELEASE;
+    SessInfoP->fsdelim = '/';
+    SessInfoP->hldelim = '/';
+    SessInfoP->archDel = 1;
+    SessInfoP->backDel = 1;
+    SessInfoP->maxObjPerTxn = stub_maxobjpertxn;
+    SessInfoP->maxBytesPerTxn_64 = stub_txnbytelimit;
+    SessInfoP->maxBytesPerTxn = stub_txnbytelimit > 0xffffffffULL ?
+                                0xffffffffU : stub_txnbytelimit;
+    strcpy(SessInfoP->id, "STUBNODE");
+    strcpy(SessInfoP->domainName, "STANDARD");
+    strcpy(SessInfoP->policySetName, "STANDARD");
+    strcpy(SessInfoP->dfltMCName, "DEFAULT");
+    strcpy(SessInfoP->adsmServerName, "TSMSTUB");
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmQuerySessOptions(dsUint32_t dsmHandle, optStruct *optstructP)
+{
+    dsInt16_t   rc;
+    char        *e;
+
+    rc = stub_enter("dsmQuerySessOptions", stub_getsess(dsmHandle));
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!stub_getsess(dsmHandle)) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+
+    memset(optstructP, 0, sizeof(*optstructP));
+    optstructP->stVersion = optStructVersion;
+    if((e = getenv("DSMI_DIR"))) {
+        snprintf(optstructP->dsmiDir, sizeof(optstructP->dsmiDir), "%s", e);
+    }
+    if((e = getenv("DSMI_CONFIG"))) {
+        snprintf(optstructP->dsmiConfig, sizeof(optstructP->dsmiConfig),
+                 "%s", e);
+    }
+    e = getenv("TSMSTUB_SERVERNAME");
+    snprintf(optstructP->serverName, sizeof(optstructP->serverName), "%s",
+             e?e:"TSMSTUB");
+    strcpy(optstructP->serverAddress, "localhost");
+    strcpy(optstructP->nodeName, "STUBNODE");
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmRegisterFS(dsUint32_t dsmHandle, regFSData *regFilespaceP)
+{
+    char        p[PATH_MAX];
+    FILE        *f;
+    char        line[DSM_MAX_FSNAME_LENGTH+2];
+    dsInt16_t   rc;
+    int         lfd;
+
+    rc = stub_enter("dsmRegisterFS", stub_getsess(dsmHandle));
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!stub_getsess(dsmHandle)) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+
+    lfd = stub_lockstore();
+    stub_path(p, sizeof(p), "filespaces");
+    f = fopen(p, "r");
+    if(f) {
+        while(fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\n")] = '\0';
+            if(strcmp(line, regFilespaceP->fsName) == 0) {
+                fclose(f);
+                stub_unlockstore(lfd);
+                return DSM_RC_FS_ALREADY_REGED;
+            }
+        }
+        fclose(f);
+    }
+    f = fopen(p, "a");
+    if(f) {
+        fprintf(f, "%s\n", regFilespaceP->fsName);
+        fclose(f);
+    }
+    stub_unlockstore(lfd);
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmBindMC(dsUint32_t dsmHandle, dsmObjName *objNameP,
+                    dsmSendType sendType, mcBindKey *mcBindKeyP)
+{
+    dsInt16_t rc;
+
+    (void) objNameP;
+    (void) sendType;
+
+    rc = stub_enter("dsmBindMC", stub_getsess(dsmHandle));
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!stub_getsess(dsmHandle)) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    strcpy(mcBindKeyP->mcName, "DEFAULT");
+    mcBindKeyP->backup_cg_exists = bTrue;
+    mcBindKeyP->archive_cg_exists = bTrue;
+    strcpy(mcBindKeyP->backup_copy_dest, "BACKUPPOOL");
+    strcpy(mcBindKeyP->archive_copy_dest, "ARCHIVEPOOL");
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmBeginTxn(dsUint32_t dsmHandle)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+    dsInt16_t           rc;
+
+    rc = stub_enter("dsmBeginTxn", s);
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_idle) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+    s->state = ss_txn;
+    s->npending = 0;
+    s->ndelete = 0;
+    s->txnbytes = 0;
+    s->txnfailed = 0;
+    s->grpaction = 0;
+    s->lastleader = 0;
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmGroupHandler(dsmGroupHandlerIn_t *dsmGroupHandlerInP,
+                          dsmGroupHandlerExOut_t *dsmGroupHandlerOutP)
+{
+    struct stub_sess    *s = stub_getsess(dsmGroupHandlerInP->dsmHandle);
+    dsInt16_t           rc;
+    dsUint64_t          leader;
+
+    (void) dsmGroupHandlerOutP;
+
+    rc = stub_enter("dsmGroupHandler", s);
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_txn) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+    if(dsmGroupHandlerInP->groupType != DSM_GROUPTYPE_PEER) {
+        return DSM_RC_INVALID_PARM;
+    }
+
+    leader = ((dsUint64_t) dsmGroupHandlerInP->leaderObjId.hi << 32) |
+             dsmGroupHandlerInP->leaderObjId.lo;
+
+    switch(dsmGroupHandlerInP->actionType) {
+        case DSM_GROUP_ACTION_BEGIN:
+        case DSM_GROUP_ACTION_OPEN:
+            if(dsmGroupHandlerInP->memberType != DSM_MEMBERTYPE_LEADER) {
+                return DSM_RC_INVALID_PARM;
+            }
+            s->grpaction = dsmGroupHandlerInP->actionType;
+            s->grpleader = 0;
+            break;
+
+        case DSM_GROUP_ACTION_ADD:
+        case DSM_GROUP_ACTION_ASSIGNTO:
+            if(leader == 0) {
+                return DSM_RC_INVALID_PARM;
+            }
+            s->grpaction = DSM_GROUP_ACTION_ADD;
+            s->grpleader = leader;
+            break;
+
+        case DSM_GROUP_ACTION_CLOSE:
+        {
+            struct stub_obj *objs;
+            int             nobjs, i, lfd, found = 0;
+
+            lfd = stub_lockstore();
+            if(stub_readcat(&objs, &nobjs) < 0) {
+                stub_unlockstore(lfd);
+                return DSM_RC_ABORT_SYSTEM_ERROR;
+            }
+            for(i = 0; i < nobjs; i++) {
+                if(objs[i].rec.id == leader && objs[i].rec.state &&
+                        (objs[i].rec.groupflags & STUB_GRP_LEADER))
+                {
+                    objs[i].rec.groupflags &= ~STUB_GRP_OPEN;
+                    stub_updatecat(&objs[i]);
+                    found = 1;
+                }
+            }
+            free(objs);
+            stub_unlockstore(lfd);
+            if(!found) {
+                return DSM_RC_INVALID_OBJID;
+            }
+            break;
+        }
+
+        case DSM_GROUP_ACTION_REMOVE:
+        default:
+            return DSM_RC_INVALID_PARM;
+    }
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmSendObj(dsUint32_t dsmHandle, dsmSendType sendType,
+                     void *sendBuff, dsmObjName *objNameP,
+                     ObjAttr *objAttrPtr, DataBlk *dataBlkPtr)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+    struct stub_obj     *o;
+    dsInt16_t           rc;
+    char                p[PATH_MAX];
+
+    rc = stub_enter("dsmSendObj", s);
+    if(rc != DSM_RC_OK) {
+        if(s) {
+            s->txnfailed = rc;
+        }
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_txn) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+    if(s->npending >= stub_maxobjpertxn || s->npending >= STUB_MAXPENDING) {
+        return DSM_RC_NEEDTO_ENDTXN;
+    }
+    if(!objNameP || !objAttrPtr ||
+            strlen(objNameP->fs) > DSM_MAX_FSNAME_LENGTH ||
+            strlen(objNameP->hl) > DSM_MAX_HL_LENGTH ||
+            strlen(objNameP->ll) > DSM_MAX_LL_LENGTH ||
+            objAttrPtr->objInfoLength > DSM_MAX_OBJINFO_LENGTH)
+    {
+        return DSM_RC_INVALID_PARM;
+    }
+
+    if((s->npending % 64) == 0) {
+        o = realloc(s->pending, (s->npending+64) * sizeof(*o));
+        if(!o) {
+            return DSM_RC_NO_MEMORY;
+        }
+        s->pending = o;
+    }
+    o = &s->pending[s->npending];
+    memset(o, 0, sizeof(*o));
+
+    o->rec.id = stub_nextid();
+    o->rec.type = (sendType == stArchive || sendType == stArchiveMountWait) ?
+                  STUB_ARCHIVE : STUB_BACKUP;
+    o->rec.state = DSM_ACTIVE;
+    o->rec.objType = objNameP->objType;
+    o->rec.compressed = objAttrPtr->objCompressed;
+    o->rec.sizeest = ((dsUint64_t) objAttrPtr->sizeEstimate.hi << 32) |
+                     objAttrPtr->sizeEstimate.lo;
+    o->rec.vol = stub_volume(o->rec.id);
+    o->rec.copyGroup = 1;
+    o->rec.insdate = time(NULL);
+    if(o->rec.type == STUB_ARCHIVE) {
+        o->rec.expdate = o->rec.insdate + 365*86400;
+    }
+    else {
+        o->rec.expdate = ~0ULL;
+    }
+    strcpy(o->rec.mc, objAttrPtr->mcNameP ? objAttrPtr->mcNameP : "DEFAULT");
+    snprintf(o->rec.owner, sizeof(o->rec.owner), "%s", objAttrPtr->owner);
+    o->rec.objInfolen = objAttrPtr->objInfoLength;
+    if(o->rec.objInfolen) {
+        memcpy(o->rec.objInfo, objAttrPtr->objInfo, o->rec.objInfolen);
+    }
+    strcpy(o->fs, objNameP->fs);
+    strcpy(o->hl, objNameP->hl);
+    strcpy(o->ll, objNameP->ll);
+    if(o->rec.type == STUB_ARCHIVE && sendBuff) {
+        sndArchiveData *ad = sendBuff;
+
+        if(ad->descr) {
+            snprintf(o->descr, sizeof(o->descr), "%s", ad->descr);
+        }
+    }
+
+    if(s->grpaction == DSM_GROUP_ACTION_BEGIN ||
+            s->grpaction == DSM_GROUP_ACTION_OPEN)
+    {
+        o->rec.groupflags = STUB_GRP_LEADER;
+        if(s->grpaction == DSM_GROUP_ACTION_OPEN) {
+            o->rec.groupflags |= STUB_GRP_OPEN;
+        }
+        o->rec.groupleader = o->rec.id;
+        s->lastleader = o->rec.id;
+        /* The rest of the transaction is members */
+        s->grpaction = DSM_GROUP_ACTION_ADD;
+        s->grpleader = o->rec.id;
+    }
+    else if(s->grpaction == DSM_GROUP_ACTION_ADD) {
+        o->rec.groupflags = STUB_GRP_MEMBER;
+        o->rec.groupleader = s->grpleader;
+    }
+
+    stub_datapath(p, sizeof(p), o->rec.id, 1);
+    s->sendfd = open(p, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if(s->sendfd < 0) {
+        return DSM_RC_ABORT_SYSTEM_ERROR;
+    }
+    s->npending++;
+    s->state = ss_send;
+
+    if(dataBlkPtr && dataBlkPtr->bufferLen) {
+        return dsmSendData(dsmHandle, dataBlkPtr);
+    }
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmSendData(dsUint32_t dsmHandle, DataBlk *dataBlkPtr)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+    dsInt16_t           rc;
+    dsUint32_t          done = 0;
+
+    rc = stub_enter("dsmSendData", s);
+    if(rc != DSM_RC_OK) {
+        if(s) {
+            s->txnfailed = rc;
+        }
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_send) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+
+    while(done < dataBlkPtr->bufferLen) {
+        ssize_t len;
+
+        len = write(s->sendfd, dataBlkPtr->bufferPtr + done,
+                    dataBlkPtr->bufferLen - done);
+        if(len < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            s->txnfailed = DSM_RC_ABORT_NO_REPOSIT_SPACE;
+            return DSM_RC_ABORT_NO_REPOSIT_SPACE;
+        }
+        done += len;
+    }
+    dataBlkPtr->numBytes = done;
+    s->pending[s->npending-1].rec.size += done;
+    s->txnbytes += done;
+    s->bytesin += done;
+    stub_throttle(s, done);
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmEndSendObjEx(dsmEndSendObjExIn_t *dsmEndSendObjExInP,
+                          dsmEndSendObjExOut_t *dsmEndSendObjExOutP)
+{
+    struct stub_sess    *s = stub_getsess(dsmEndSendObjExInP->dsmHandle);
+    dsInt16_t           rc;
+    dsUint64_t          size;
+
+    rc = stub_enter("dsmEndSendObj", s);
+    if(rc != DSM_RC_OK) {
+        if(s) {
+            s->txnfailed = rc;
+        }
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_send) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+    if(close(s->sendfd) < 0) {
+        s->sendfd = -1;
+        s->txnfailed = DSM_RC_ABORT_NO_REPOSIT_SPACE;
+        return DSM_RC_ABORT_NO_REPOSIT_SPACE;
+    }
+    s->sendfd = -1;
+    s->state = ss_txn;
+
+    size = s->pending[s->npending-1].rec.size;
+    if(dsmEndSendObjExOutP) {
+        memset(dsmEndSendObjExOutP, 0, sizeof(*dsmEndSendObjExOutP));
+        dsmEndSendObjExOutP->stVersion = dsmEndSendObjExOutVersion;
+        dsmEndSendObjExOutP->totalBytesSent.hi = size >> 32;
+        dsmEndSendObjExOutP->totalBytesSent.lo = size & ~0U;
+        dsmEndSendObjExOutP->totalCompressSize =
+            dsmEndSendObjExOutP->totalBytesSent;
+        dsmEndSendObjExOutP->objCompressed = bFalse;
+        dsmEndSendObjExOutP->objDeduplicated = bFalse;
+    }
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmEndSendObj(dsUint32_t dsmHandle)
+{
+    dsmEndSendObjExIn_t in;
+
+    in.stVersion = dsmEndSendObjExInVersion;
+    in.dsmHandle = dsmHandle;
+
+    return dsmEndSendObjEx(&in, NULL);
+}
+
+
+/*
+ * Like the server, refuse partial object restores of objects sent as
+ * compressed, their offsets aren't those of the data
+ */
+static int stub_porallowed(const dsmGetList *list)
+{
+    struct stub_obj *objs;
+    int             nobjs, i, j, ok = 1;
+
+    if(stub_readcat(&objs, &nobjs) < 0) {
+        return 0;
+    }
+    for(i = 0; ok && i < (int) list->numObjId; i++) {
+        dsUint64_t id = ((dsUint64_t) list->objId[i].hi << 32) |
+                        list->objId[i].lo;
+
+        for(j = 0; j < nobjs; j++) {
+            if(objs[j].rec.id == id && objs[j].rec.state != 0 &&
+                    objs[j].rec.compressed)
+            {
+                ok = 0;
+                break;
+            }
+        }
+    }
+    free(objs);
+
+    return ok;
+}
+
+
+static int stub_samename(const struct stub_obj *a, const struct stub_obj *b)
+{
+    return strcmp(a->fs, b->fs) == 0 && strcmp(a->hl, b->hl) == 0 &&
+           strcmp(a->ll, b->ll) == 0;
+}
+
+
+static dsInt16_t stub_commit(struct stub_sess *s)
+{
+    struct stub_obj *objs = NULL;
+    int             nobjs = 0, i, j, lfd;
+    char            from[PATH_MAX], to[PATH_MAX];
+
+    lfd = stub_lockstore();
+    if(stub_readcat(&objs, &nobjs) < 0) {
+        stub_unlockstore(lfd);
+        return DSM_RC_ABORT_SYSTEM_ERROR;
+    }
+
+    /* Deletions: archive objects go away, backups get deactivated */
+    for(j = 0; j < s->ndelete; j++) {
+        for(i = 0; i < nobjs; i++) {
+            if(objs[i].rec.id != s->deletes[j] || !objs[i].rec.state) {
+                continue;
+            }
+            if(objs[i].rec.type == STUB_ARCHIVE ||
+                    objs[i].rec.state == DSM_INACTIVE)
+            {
+                objs[i].rec.state = 0;
+                stub_datapath(from, sizeof(from), objs[i].rec.id, 0);
+                unlink(from);
+            }
+            else {
+                objs[i].rec.state = DSM_INACTIVE;
+                objs[i].rec.deactdate = time(NULL);
+            }
+            stub_updatecat(&objs[i]);
+        }
+    }
+
+    for(j = 0; j < s->npending; j++) {
+        struct stub_obj *o = &s->pending[j];
+
+        if(o->rec.type == STUB_BACKUP) {
+            for(i = 0; i < nobjs; i++) {
+                if(objs[i].rec.type == STUB_BACKUP &&
+                        objs[i].rec.state == DSM_ACTIVE &&
+                        stub_samename(&objs[i], o))
+                {
+                    objs[i].rec.state = DSM_INACTIVE;
+                    objs[i].rec.deactdate = time(NULL);
+                    stub_updatecat(&objs[i]);
+                }
+            }
+        }
+        stub_datapath(from, sizeof(from), o->rec.id, 1);
+        stub_datapath(to, sizeof(to), o->rec.id, 0);
+        if(rename(from, to) < 0 || stub_appendcat(o) < 0) {
+            free(objs);
+            stub_unlockstore(lfd);
+            return DSM_RC_ABORT_SYSTEM_ERROR;
+        }
+    }
+    free(objs);
+    stub_unlockstore(lfd);
+
+    s->npending = 0;
+    s->ndelete = 0;
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmEndTxnEx(dsmEndTxnExIn_t *dsmEndTxnExInP,
+                      dsmEndTxnExOut_t *dsmEndTxnExOutP)
+{
+    struct stub_sess    *s = stub_getsess(dsmEndTxnExInP->dsmHandle);
+    dsInt16_t           rc;
+    dsUint64_t          leader;
+
+    dsmEndTxnExOutP->reason = DSM_RC_OK;
+    dsmEndTxnExOutP->groupLeaderObjId.hi = 0;
+    dsmEndTxnExOutP->groupLeaderObjId.lo = 0;
+
+    rc = stub_enter("dsmEndTxn", s);
+    if(rc != DSM_RC_OK) {
+        if(s) {
+            stub_abort_txn(s);
+        }
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_txn && s->state != ss_send) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+    if(s->state == ss_send && dsmEndTxnExInP->vote == DSM_VOTE_COMMIT) {
+        stub_abort_txn(s);
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+
+    if(dsmEndTxnExInP->vote != DSM_VOTE_COMMIT || s->txnfailed) {
+        dsUint16_t reason = s->txnfailed ? s->txnfailed :
+                            DSM_RC_ABORT_BY_CLIENT;
+
+        stub_abort_txn(s);
+        dsmEndTxnExOutP->reason = reason;
+        return DSM_RC_CHECK_REASON_CODE;
+    }
+
+    leader = s->lastleader;
+    rc = stub_commit(s);
+    stub_abort_txn(s);
+    if(rc != DSM_RC_OK) {
+        dsmEndTxnExOutP->reason = rc;
+        return DSM_RC_CHECK_REASON_CODE;
+    }
+    dsmEndTxnExOutP->groupLeaderObjId.hi = leader >> 32;
+    dsmEndTxnExOutP->groupLeaderObjId.lo = leader & ~0U;
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmEndTxn(dsUint32_t dsmHandle, dsUint8_t vote, dsUint16_t *reason)
+{
+    dsmEndTxnExIn_t     in;
+    dsmEndTxnExOut_t    out;
+    dsInt16_t           rc;
+
+    in.stVersion = dsmEndTxnExInVersion;
+    in.dsmHandle = dsmHandle;
+    in.vote = vote;
+    out.stVersion = dsmEndTxnExOutVersion;
+
+    rc = dsmEndTxnEx(&in, &out);
+    if(reason) {
+        *reason = out.reason;
+    }
+
+    return rc;
+}
+
+
+dsInt16_t dsmDeleteObj(dsUint32_t dsmHandle, dsmDelType delType,
+                       dsmDelInfo delInfo)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+    dsInt16_t           rc;
+    dsUint64_t          id = 0;
+
+    rc = stub_enter("dsmDeleteObj", s);
+    if(rc != DSM_RC_OK) {
+        if(s) {
+            s->txnfailed = rc;
+        }
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_txn) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+    if(s->ndelete >= stub_maxobjpertxn) {
+        return DSM_RC_NEEDTO_ENDTXN;
+    }
+
+    if(delType == dtArchive) {
+        id = ((dsUint64_t) delInfo.archInfo.objId.hi << 32) |
+             delInfo.archInfo.objId.lo;
+    }
+    else if(delType == dtBackupID) {
+        id = ((dsUint64_t) delInfo.backIDInfo.objId.hi << 32) |
+             delInfo.backIDInfo.objId.lo;
+    }
+    else if(delType == dtBackup) {
+        struct stub_obj *objs, key;
+        int             nobjs, i, lfd;
+
+        memset(&key, 0, sizeof(key));
+        strcpy(key.fs, delInfo.backInfo.objNameP->fs);
+        strcpy(key.hl, delInfo.backInfo.objNameP->hl);
+        strcpy(key.ll, delInfo.backInfo.objNameP->ll);
+        lfd = stub_lockstore();
+        if(stub_readcat(&objs, &nobjs) < 0) {
+            stub_unlockstore(lfd);
+            return DSM_RC_ABORT_SYSTEM_ERROR;
+        }
+        stub_unlockstore(lfd);
+        for(i = 0; i < nobjs; i++) {
+            if(objs[i].rec.type == STUB_BACKUP &&
+                    objs[i].rec.state == DSM_ACTIVE &&
+                    stub_samename(&objs[i], &key))
+            {
+                id = objs[i].rec.id;
+            }
+        }
+        free(objs);
+        if(id == 0) {
+            return DSM_RC_ABORT_NO_MATCH;
+        }
+    }
+    else {
+        return DSM_RC_INVALID_PARM;
+    }
+
+    if((s->ndelete % 256) == 0) {
+        dsUint64_t *d = realloc(s->deletes, (s->ndelete+256) * sizeof(*d));
+
+        if(!d) {
+            return DSM_RC_NO_MEMORY;
+        }
+        s->deletes = d;
+    }
+    s->deletes[s->ndelete++] = id;
+
+    return DSM_RC_OK;
+}
+
+
+/* ---------------------------------------------------------------------- */
+
+dsInt16_t dsmBeginQuery(dsUint32_t dsmHandle, dsmQueryType queryType,
+                        dsmQueryBuff *queryBuffer)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+    struct stub_obj     *objs;
+    int                 nobjs, i, n = 0, lfd;
+    dsInt16_t           rc;
+
+    rc = stub_enter("dsmBeginQuery", s);
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_idle) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+
+    lfd = stub_lockstore();
+    rc = stub_readcat(&objs, &nobjs);
+    stub_unlockstore(lfd);
+    if(rc < 0) {
+        return DSM_RC_ABORT_SYSTEM_ERROR;
+    }
+
+    for(i = 0; i < nobjs; i++) {
+        struct stub_obj *o = &objs[i];
+        int             match = 0;
+
+        if(!o->rec.state) {
+            continue;
+        }
+        if(queryType == qtArchive) {
+            qryArchiveData *qa = queryBuffer;
+
+            match = o->rec.type == STUB_ARCHIVE &&
+                    stub_namematch(qa->objName, o) &&
+                    fnmatch(qa->descr ? qa->descr : "*", o->descr, 0) == 0 &&
+                    stub_inrange(o->rec.insdate, &qa->insDateLowerBound,
+                                 &qa->insDateUpperBound) &&
+                    stub_inrange(o->rec.expdate, &qa->expDateLowerBound,
+                                 &qa->expDateUpperBound);
+        }
+        else if(queryType == qtBackup) {
+            qryBackupData *qb = queryBuffer;
+
+            match = o->rec.type == STUB_BACKUP &&
+                    stub_namematch(qb->objName, o);
+            if(match && qb->pitDate.year != DATE_MINUS_INFINITE) {
+                time_t pit = stub_date2time(&qb->pitDate);
+
+                match = (time_t) o->rec.insdate <= pit &&
+                        (o->rec.state == DSM_ACTIVE ||
+                         (time_t) o->rec.deactdate > pit);
+            }
+            else if(match) {
+                match = (o->rec.state & qb->objState) != 0;
+            }
+        }
+        else if(queryType == qtOpenGroups || queryType == qtBackupGroups) {
+            qryBackupGroups *qg = queryBuffer;
+            dsUint64_t      leader;
+
+            leader = ((dsUint64_t) qg->groupLeaderObjId.hi << 32) |
+                     qg->groupLeaderObjId.lo;
+            match = o->rec.type == STUB_BACKUP &&
+                    strcmp(o->fs, qg->fsName) == 0 &&
+                    o->rec.state == DSM_ACTIVE;
+            if(match && queryType == qtOpenGroups) {
+                match = (o->rec.groupflags & STUB_GRP_OPEN) != 0;
+            }
+            else if(match) {
+                match = o->rec.groupleader == leader;
+            }
+        }
+        else {
+            free(objs);
+            return DSM_RC_INVALID_PARM;
+        }
+        if(match) {
+            objs[n++] = *o;
+        }
+    }
+
+    s->qres = objs;
+    s->nqres = n;
+    s->qpos = 0;
+    s->qtype = queryType;
+    s->state = ss_query;
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmGetNextQObj(dsUint32_t dsmHandle, DataBlk *dataBlkPtr)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+    struct stub_obj     *o;
+    dsInt16_t           rc;
+
+    rc = stub_enter("dsmGetNextQObj", s);
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_query) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+    if(s->qpos >= s->nqres) {
+        return s->nqres ? DSM_RC_FINISHED : DSM_RC_ABORT_NO_MATCH;
+    }
+    o = &s->qres[s->qpos++];
+
+    if(s->qtype == qtArchive) {
+        qryRespArchiveData *qr = (void *) dataBlkPtr->bufferPtr;
+
+        if(dataBlkPtr->bufferLen < sizeof(*qr)) {
+            return DSM_RC_BUFF_TOO_SMALL;
+        }
+        memset(qr, 0, sizeof(*qr));
+        qr->stVersion = qryRespArchiveDataVersion;
+        strcpy(qr->objName.fs, o->fs);
+        strcpy(qr->objName.hl, o->hl);
+        strcpy(qr->objName.ll, o->ll);
+        qr->objName.objType = o->rec.objType;
+        qr->copyGroup = o->rec.copyGroup;
+        strcpy(qr->mcName, o->rec.mc);
+        strcpy(qr->owner, o->rec.owner);
+        qr->objId.hi = o->rec.id >> 32;
+        qr->objId.lo = o->rec.id & ~0U;
+        qr->mediaClass = 0x20;
+        stub_time2date(o->rec.insdate, &qr->insDate);
+        stub_time2date(o->rec.expdate, &qr->expDate);
+        strcpy(qr->descr, o->descr);
+        qr->objInfolen = o->rec.objInfolen;
+        memcpy(qr->objInfo, o->rec.objInfo, o->rec.objInfolen);
+        qr->restoreOrderExt.top = o->rec.vol;
+        qr->restoreOrderExt.lo_hi = o->rec.id >> 32;
+        qr->restoreOrderExt.lo_lo = o->rec.id & ~0U;
+        qr->sizeEstimate.hi = o->rec.sizeest >> 32;
+        qr->sizeEstimate.lo = o->rec.sizeest & ~0U;
+        qr->compressType = o->rec.compressed;
+        dataBlkPtr->numBytes = sizeof(*qr);
+    }
+    else {
+        qryRespBackupData *qr = (void *) dataBlkPtr->bufferPtr;
+
+        if(dataBlkPtr->bufferLen < sizeof(*qr)) {
+            return DSM_RC_BUFF_TOO_SMALL;
+        }
+        memset(qr, 0, sizeof(*qr));
+        qr->stVersion = qryRespBackupDataVersion;
+        strcpy(qr->objName.fs, o->fs);
+        strcpy(qr->objName.hl, o->hl);
+        strcpy(qr->objName.ll, o->ll);
+        qr->objName.objType = o->rec.objType;
+        qr->copyGroup = o->rec.copyGroup;
+        strcpy(qr->mcName, o->rec.mc);
+        strcpy(qr->owner, o->rec.owner);
+        qr->objId.hi = o->rec.id >> 32;
+        qr->objId.lo = o->rec.id & ~0U;
+        qr->mediaClass = 0x20;
+        qr->objState = o->rec.state;
+        stub_time2date(o->rec.insdate, &qr->insDate);
+        stub_time2date(o->rec.expdate, &qr->expDate);
+        qr->objInfolen = o->rec.objInfolen;
+        memcpy(qr->objInfo, o->rec.objInfo, o->rec.objInfolen);
+        qr->restoreOrderExt.top = o->rec.vol;
+        qr->restoreOrderExt.lo_hi = o->rec.id >> 32;
+        qr->restoreOrderExt.lo_lo = o->rec.id & ~0U;
+        qr->sizeEstimate.hi = o->rec.sizeest >> 32;
+        qr->sizeEstimate.lo = o->rec.sizeest & ~0U;
+        qr->baseObjId.hi = o->rec.groupleader >> 32;
+        qr->baseObjId.lo = o->rec.groupleader & ~0U;
+        qr->compressType = o->rec.compressed;
+        qr->isGroupLeader = (o->rec.groupflags & STUB_GRP_LEADER) ?
+                            bTrue : bFalse;
+        qr->isOpenGroup = (o->rec.groupflags & STUB_GRP_OPEN) ?
+                          bTrue : bFalse;
+        dataBlkPtr->numBytes = sizeof(*qr);
+    }
+
+    return DSM_RC_MORE_DATA;
+}
+
+
+dsInt16_t dsmEndQuery(dsUint32_t dsmHandle)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+    dsInt16_t           rc;
+
+    rc = stub_enter("dsmEndQuery", s);
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_query) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+    stub_free_query(s);
+    s->state = ss_idle;
+
+    return DSM_RC_OK;
+}
+
+
+/* ---------------------------------------------------------------------- */
+
+dsInt16_t dsmBeginGetData(dsUint32_t dsmHandle, dsBool_t mountWait,
+                          dsmGetType getType, dsmGetList *dsmGetObjListP)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+    dsInt16_t           rc;
+
+    (void) mountWait;
+    (void) getType;
+
+    rc = stub_enter("dsmBeginGetData", s);
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_idle) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+    if(dsmGetObjListP->numObjId == 0 ||
+            dsmGetObjListP->numObjId > DSM_MAX_GET_OBJ ||
+            (dsmGetObjListP->partialObjData &&
+             (dsmGetObjListP->numObjId > DSM_MAX_PARTIAL_GET_OBJ ||
+              dsmGetObjListP->stVersion < dsmGetListPORVersion)))
+    {
+        return DSM_RC_INVALID_PARM;
+    }
+    if(dsmGetObjListP->partialObjData &&
+            !stub_porallowed(dsmGetObjListP))
+    {
+        return DSM_RC_INVALID_PARM;
+    }
+
+    s->ngetlist = dsmGetObjListP->numObjId;
+    s->getlist = malloc(s->ngetlist * sizeof(ObjID));
+    if(!s->getlist) {
+        return DSM_RC_NO_MEMORY;
+    }
+    memcpy(s->getlist, dsmGetObjListP->objId, s->ngetlist * sizeof(ObjID));
+    if(dsmGetObjListP->partialObjData) {
+        s->getpartial = malloc(s->ngetlist * sizeof(PartialObjData));
+        if(!s->getpartial) {
+            return DSM_RC_NO_MEMORY;
+        }
+        memcpy(s->getpartial, dsmGetObjListP->partialObjData,
+               s->ngetlist * sizeof(PartialObjData));
+    }
+    s->getpos = 0;
+    s->state = ss_get;
+
+    return DSM_RC_OK;
+}
+
+
+static dsInt16_t stub_fill(struct stub_sess *s, DataBlk *dataBlkPtr)
+{
+    dsUint32_t  want, done = 0;
+
+    want = dataBlkPtr->bufferLen - dataBlkPtr->numBytes;
+    if(want > s->getend - s->getoff) {
+        want = s->getend - s->getoff;
+    }
+    while(done < want) {
+        ssize_t len;
+
+        len = pread(s->getfd, dataBlkPtr->bufferPtr + dataBlkPtr->numBytes +
+                    done, want - done, s->getoff + done);
+        if(len < 0 && errno == EINTR) {
+            continue;
+        }
+        if(len <= 0) {
+            return DSM_RC_ABORT_SYSTEM_ERROR;
+        }
+        done += len;
+    }
+    s->getoff += done;
+    dataBlkPtr->numBytes += done;
+    s->bytesout += done;
+    stub_throttle(s, done);
+
+    return s->getoff < s->getend ? DSM_RC_MORE_DATA : DSM_RC_FINISHED;
+}
+
+
+dsInt16_t dsmGetObj(dsUint32_t dsmHandle, ObjID *objIdP, DataBlk *dataBlkPtr)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+    dsInt16_t           rc;
+    char                p[PATH_MAX];
+    struct stat         st;
+    dsUint64_t          id;
+    dsUint32_t          vol;
+
+    rc = stub_enter("dsmGetObj", s);
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_get) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+
+    /* Objects must be fetched in list order, skipping is allowed */
+    while(s->getpos < s->ngetlist &&
+            (s->getlist[s->getpos].hi != objIdP->hi ||
+             s->getlist[s->getpos].lo != objIdP->lo))
+    {
+        s->getpos++;
+    }
+    if(s->getpos >= s->ngetlist) {
+        return DSM_RC_INVALID_OBJID;
+    }
+
+    id = ((dsUint64_t) objIdP->hi << 32) | objIdP->lo;
+    stub_datapath(p, sizeof(p), id, 0);
+    s->getfd = open(p, O_RDONLY);
+    if(s->getfd < 0) {
+        return DSM_RC_INVALID_OBJID;
+    }
+    if(fstat(s->getfd, &st) < 0) {
+        close(s->getfd);
+        s->getfd = -1;
+        return DSM_RC_ABORT_SYSTEM_ERROR;
+    }
+    s->getoff = 0;
+    s->getend = st.st_size;
+    if(s->getpartial) {
+        PartialObjData  *pd = &s->getpartial[s->getpos];
+        dsUint64_t      off, len;
+
+        off = ((dsUint64_t) pd->partialObjOffset.hi << 32) |
+              pd->partialObjOffset.lo;
+        len = ((dsUint64_t) pd->partialObjLength.hi << 32) |
+              pd->partialObjLength.lo;
+        s->getoff = off < s->getend ? off : s->getend;
+        if(len && s->getoff + len < s->getend) {
+            s->getend = s->getoff + len;
+        }
+    }
+
+    vol = stub_volume(id);
+    if(vol != s->mountedvol) {
+        s->mounts++;
+        s->mountedvol = vol;
+        stub_usleep(stub_mount_ms * 1000);
+    }
+
+    s->getpos++;
+    s->state = ss_getobj;
+    dataBlkPtr->numBytes = 0;
+
+    return stub_fill(s, dataBlkPtr);
+}
+
+
+dsInt16_t dsmGetData(dsUint32_t dsmHandle, DataBlk *dataBlkPtr)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+    dsInt16_t           rc;
+
+    rc = stub_enter("dsmGetData", s);
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_getobj) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+
+    return stub_fill(s, dataBlkPtr);
+}
+
+
+dsInt16_t dsmEndGetObj(dsUint32_t dsmHandle)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+    dsInt16_t           rc;
+
+    rc = stub_enter("dsmEndGetObj", s);
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_getobj) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+    close(s->getfd);
+    s->getfd = -1;
+    s->state = ss_get;
+
+    return DSM_RC_OK;
+}
+
+
+dsInt16_t dsmEndGetData(dsUint32_t dsmHandle)
+{
+    struct stub_sess    *s = stub_getsess(dsmHandle);
+    dsInt16_t           rc;
+
+    rc = stub_enter("dsmEndGetData", s);
+    if(rc != DSM_RC_OK) {
+        return rc;
+    }
+    if(!s) {
+        return DSM_RC_NO_SESS_BLK;
+    }
+    if(s->state != ss_get && s->state != ss_getobj) {
+        return DSM_RC_BAD_CALL_SEQUENCE;
+    }
+    if(s->getfd >= 0) {
+        close(s->getfd);
+        s->getfd = -1;
+    }
+    free(s->getlist);
+    free(s->getpartial);
+    s->getlist = NULL;
+    s->getpartial = NULL;
+    s->state = ss_idle;
+
+    return DSM_RC_OK;
+}
+
+
+/*
+vim:ts=4:sw=4:et:cindent
+*/
@@ -0,0 +1,58 @@
+/*
+ * dsmapifp.h - function prototypes for the tsmpipe TSM API stub.
+ */
+#ifndef _H_DSMAPIFP
+#define _H_DSMAPIFP
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern dsInt16_t dsmBeginGetData(dsUint32_t dsmHandle, dsBool_t mountWait,
+        dsmGetType getType, dsmGetList *dsmGetObjListP);
+extern dsInt16_t dsmBeginQuery(dsUint32_t dsmHandle, dsmQueryType queryType,
+        dsmQueryBuff *queryBuffer);
+extern dsInt16_t dsmBeginTxn(dsUint32_t dsmHandle);
+extern dsInt16_t dsmBindMC(dsUint32_t dsmHandle, dsmObjName *objNameP,
+        dsmSendType sendType, mcBindKey *mcBindKeyP);
+extern dsInt16_t dsmChangePW(dsUint32_t dsmHandle, char *oldPW, char *newPW);
+extern dsInt16_t dsmCleanUp(dsBool_t mtFlag);
+extern dsInt16_t dsmDeleteObj(dsUint32_t dsmHandle, dsmDelType delType,
+        dsmDelInfo delInfo);
+extern dsInt16_t dsmEndGetData(dsUint32_t dsmHandle);
+extern dsInt16_t dsmEndGetObj(dsUint32_t dsmHandle);
+extern dsInt16_t dsmEndQuery(dsUint32_t dsmHandle);
+extern dsInt16_t dsmEndSendObj(dsUint32_t dsmHandle);
+extern dsInt16_t dsmEndSendObjEx(dsmEndSendObjExIn_t *dsmEndSendObjExInP,
+        dsmEndSendObjExOut_t *dsmEndSendObjExOutP);
+extern dsInt16_t dsmEndTxn(dsUint32_t dsmHandle, dsUint8_t vote,
+        dsUint16_t *reason);
+extern dsInt16_t dsmEndTxnEx(dsmEndTxnExIn_t *dsmEndTxnExInP,
+        dsmEndTxnExOut_t *dsmEndTxnExOutP);
+extern dsInt16_t dsmGetData(dsUint32_t dsmHandle, DataBlk *dataBlkPtr);
+extern dsInt16_t dsmGetNextQObj(dsUint32_t dsmHandle, DataBlk *dataBlkPtr);
+extern dsInt16_t dsmGetObj(dsUint32_t dsmHandle, ObjID *objIdP,
+        DataBlk *dataBlkPtr);
+extern dsInt16_t dsmGroupHandler(dsmGroupHandlerIn_t *dsmGroupHandlerInP,
+        dsmGroupHandlerExOut_t *dsmGroupHandlerOutP);
+extern dsInt16_t dsmInitEx(dsUint32_t *dsmHandleP, dsmInitExIn_t *dsmInitExInP,
+        dsmInitExOut_t *dsmInitExOutP);
+extern void      dsmQueryApiVersionEx(dsmApiVersionEx *apiVersionP);
+extern dsInt16_t dsmQuerySessInfo(dsUint32_t dsmHandle,
+        ApiSessInfo *SessInfoP);
+extern dsInt16_t dsmQuerySessOptions(dsUint32_t dsmHandle,
+        optStruct *optstructP);
+extern dsInt16_t dsmRCMsg(dsUint32_t dsmHandle, dsInt16_t dsmRC, char *msg);
+extern dsInt16_t dsmRegisterFS(dsUint32_t dsmHandle, regFSData *regFilespaceP);
+extern dsInt16_t dsmSendData(dsUint32_t dsmHandle, DataBlk *dataBlkPtr);
+extern dsInt16_t dsmSendObj(dsUint32_t dsmHandle, dsmSendType sendType,
+        void *sendBuff, dsmObjName *objNameP, ObjAttr *objAttrPtr,
+        DataBlk *dataBlkPtr);
+extern dsInt16_t dsmSetUp(dsBool_t mtFlag, envSetUp *envSetUpP);
+extern dsInt16_t dsmTerminate(dsUint32_t dsmHandle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _H_DSMAPIFP */
@@ -0,0 +1,496 @@
+/*
+ * dsmapitd.h - type definitions for the tsmpipe TSM API stub.
+ *
+ * A subset of the IBM Spectrum Protect API type definitions, covering what
+ * tsmpipe uses. Structure and field names follow the real API so tsmpipe
+ * builds unmodified against either.
+ */
+#ifndef _H_DSMAPITD
+#define _H_DSMAPITD
+
+#define DSM_API_VERSION     8
+#define DSM_API_RELEASE     1
+#define DSM_API_LEVEL       0
+#define DSM_API_SUBLEVEL    0
+
+typedef unsigned char       dsUint8_t;
+typedef signed char         dsInt8_t;
+typedef unsigned short      dsUint16_t;
+typedef signed short        dsInt16_t;
+typedef unsigned int        dsUint32_t;
+typedef signed int          dsInt32_t;
+typedef unsigned long long  dsUint64_t;
+
+typedef enum {
+    bFalse = 0x00,
+    bTrue  = 0x01
+} dsmBool_t;
+typedef dsmBool_t dsBool_t;
+
+typedef struct {
+    dsUint32_t hi;
+    dsUint32_t lo;
+} dsStruct64_t;
+
+typedef dsStruct64_t ObjID;
+
+typedef struct {
+    dsUint32_t top;
+    dsUint32_t hi_hi;
+    dsUint32_t hi_lo;
+    dsUint32_t lo_hi;
+    dsUint32_t lo_lo;
+} dsUint160_t;
+
+#define DSM_MAX_SERVERNAME_LENGTH   64
+#define DSM_MAX_SERVERTYPE_LENGTH   32
+#define DSM_MAX_SERVER_ADDRESS      64
+#define DSM_MAX_NODE_LENGTH         64
+#define DSM_MAX_ID_LENGTH           64
+#define DSM_MAX_OWNER_LENGTH        64
+#define DSM_MAX_PLATFORM_LENGTH     16
+#define DSM_MAX_FSNAME_LENGTH       1024
+#define DSM_MAX_FSTYPE_LENGTH       32
+#define DSM_MAX_HL_LENGTH           1024
+#define DSM_MAX_LL_LENGTH           256
+#define DSM_MAX_DESCR_LENGTH        255
+#define DSM_MAX_MC_NAME_LENGTH      30
+#define DSM_MAX_CG_DEST_LENGTH      30
+#define DSM_MAX_OBJINFO_LENGTH      255
+#define DSM_MAX_RC_MSG_LENGTH       1024
+#define DSM_MAX_DOMAIN_LENGTH       30
+#define DSM_MAX_PS_NAME_LENGTH      30
+#define DSM_MAX_FSINFO_LENGTH       500
+#define DSM_PATH_MAX                1024
+#define DSM_NAME_MAX                255
+
+#define DSM_MAX_GET_OBJ             4080
+#define DSM_MAX_PARTIAL_GET_OBJ     1300
+
+#define DATE_MINUS_INFINITE         0x0000
+#define DATE_PLUS_INFINITE          0xFFFF
+
+#define DSM_OBJ_FILE                0x01
+#define DSM_OBJ_DIRECTORY           0x02
+
+#define DSM_ACTIVE                  0x01
+#define DSM_INACTIVE                0x02
+#define DSM_ANY_MATCH               0xFF
+
+#define DSM_VOTE_COMMIT             1
+#define DSM_VOTE_ABORT              2
+
+#define DSM_GROUPTYPE_NONE          0x00
+#define DSM_GROUPTYPE_RESERVED1     0x01
+#define DSM_GROUPTYPE_PEER          0x02
+
+#define DSM_GROUP_ACTION_BEGIN      0x01
+#define DSM_GROUP_ACTION_OPEN       0x02
+#define DSM_GROUP_ACTION_CLOSE      0x03
+#define DSM_GROUP_ACTION_ADD        0x04
+#define DSM_GROUP_ACTION_ASSIGNTO   0x05
+#define DSM_GROUP_ACTION_REMOVE     0x06
+
+#define DSM_MEMBERTYPE_LEADER       0x01
+#define DSM_MEMBERTYPE_MEMBER       0x02
+
+typedef struct {
+    dsUint16_t  year;
+    dsUint8_t   month;
+    dsUint8_t   day;
+    dsUint8_t   hour;
+    dsUint8_t   minute;
+    dsUint8_t   second;
+} dsmDate;
+
+typedef struct {
+    char        fs[DSM_MAX_FSNAME_LENGTH + 1];
+    char        hl[DSM_MAX_HL_LENGTH + 1];
+    char        ll[DSM_MAX_LL_LENGTH + 1];
+    dsUint8_t   objType;
+} dsmObjName;
+
+typedef struct {
+    dsUint16_t  stVersion;
+    dsUint16_t  version;
+    dsUint16_t  release;
+    dsUint16_t  level;
+    dsUint16_t  subLevel;
+    dsmBool_t   unicode;
+} dsmApiVersionEx;
+#define apiVersionExVer 2
+
+typedef struct {
+    dsUint16_t  stVersion;
+    dsUint16_t  version;
+    dsUint16_t  release;
+    dsUint16_t  level;
+    dsUint16_t  subLevel;
+} dsmAppVersion;
+#define appVersionVer 1
+
+typedef struct {
+    dsUint16_t          stVersion;
+    dsmApiVersionEx     *apiVersionExP;
+    char                *clientNodeNameP;
+    char                *clientOwnerNameP;
+    char                *clientPasswordP;
+    char                *userNameP;
+    char                *userPasswordP;
+    char                *applicationTypeP;
+    char                *configfile;
+    char                *options;
+    char                dirDelimiter;
+    dsmBool_t           useUnicode;
+    dsmBool_t           bCrossPlatform;
+    dsmBool_t           bService;
+    dsmBool_t           bEncryptKeyEnabled;
+    char                *encryptionPasswordP;
+    dsmBool_t           useTsmBuffers;
+    dsUint8_t           numTsmBuffers;
+    dsmAppVersion       *appVersionP;
+} dsmInitExIn_t;
+#define dsmInitExInVersion 5
+
+typedef struct {
+    dsUint16_t  stVersion;
+    dsInt16_t   userNameAuthorities;
+    dsInt16_t   infoRC;
+    char        adsmServerName[DSM_MAX_SERVERNAME_LENGTH + 1];
+    dsUint16_t  serverVer;
+    dsUint16_t  serverRel;
+    dsUint16_t  serverLev;
+    dsUint16_t  serverSubLev;
+    dsmBool_t   bIsFailOverMode;
+    char        replServerName[DSM_MAX_SERVERNAME_LENGTH + 1];
+    char        homeServerName[DSM_MAX_SERVERNAME_LENGTH + 1];
+} dsmInitExOut_t;
+#define dsmInitExOutVersion 3
+
+typedef struct {
+    dsUint16_t  stVersion;
+    char        dsmiDir[DSM_PATH_MAX + DSM_NAME_MAX + 1];
+    char        dsmiConfig[DSM_PATH_MAX + DSM_NAME_MAX + 1];
+    char        dsmiLog[DSM_PATH_MAX + DSM_NAME_MAX + 1];
+    char        **argv;
+    char        logName[DSM_NAME_MAX + 1];
+    dsmBool_t   reserved1;
+    dsmBool_t   reserved2;
+} envSetUp;
+#define envSetUpVersion 4
+
+#define DSM_MULTITHREAD     bTrue
+#define DSM_SINGLETHREAD    bFalse
+
+typedef struct {
+    dsUint16_t  stVersion;
+    char        dsmiDir[DSM_PATH_MAX + DSM_NAME_MAX + 1];
+    char        dsmiConfig[DSM_PATH_MAX + DSM_NAME_MAX + 1];
+    char        serverName[DSM_MAX_SERVERNAME_LENGTH + 1];
+    dsInt16_t   commMethod;
+    char        serverAddress[DSM_MAX_SERVER_ADDRESS];
+    char        nodeName[DSM_MAX_NODE_LENGTH + 1];
+    dsmBool_t   compression;
+    dsmBool_t   compressalways;
+    dsmBool_t   passwordAccess;
+} optStruct;
+#define optStructVersion 1
+
+typedef struct {
+    dsUint16_t  stVersion;
+    char        serverHost[DSM_MAX_SERVERNAME_LENGTH + 1];
+    dsUint16_t  serverPort;
+    dsmDate     serverDate;
+    char        serverType[DSM_MAX_SERVERTYPE_LENGTH + 1];
+    dsInt16_t   serverVer;
+    dsInt16_t   serverRel;
+    dsInt16_t   serverLev;
+    dsInt16_t   serverSubLev;
+    char        nodeType[DSM_MAX_PLATFORM_LENGTH + 1];
+    char        fsdelim;
+    char        hldelim;
+    dsUint8_t   compression;
+    dsUint8_t   archDel;
+    dsUint8_t   backDel;
+    dsUint32_t  maxBytesPerTxn;
+    dsUint16_t  maxObjPerTxn;
+    char        id[DSM_MAX_ID_LENGTH + 1];
+    char        owner[DSM_MAX_OWNER_LENGTH + 1];
+    char        confFile[DSM_PATH_MAX + DSM_NAME_MAX + 1];
+    dsUint8_t   opNoTrace;
+    char        domainName[DSM_MAX_DOMAIN_LENGTH + 1];
+    char        policySetName[DSM_MAX_PS_NAME_LENGTH + 1];
+    dsmDate     polActDate;
+    char        dfltMCName[DSM_MAX_MC_NAME_LENGTH + 1];
+    dsUint16_t  gpBackRetn;
+    dsUint16_t  gpArchRetn;
+    char        adsmServerName[DSM_MAX_SERVERNAME_LENGTH + 1];
+    dsmBool_t   archiveRetentionProtection;
+    dsUint64_t  maxBytesPerTxn_64;
+    dsmBool_t   lanFreeEnabled;
+} ApiSessInfo;
+#define ApiSessInfoVersion 6
+
+typedef struct {
+    dsUint16_t      stVersion;
+    char            *fsName;
+    char            *fsType;
+    dsStruct64_t    occupancy;
+    dsStruct64_t    capacity;
+    char            fsAttr[DSM_MAX_FSINFO_LENGTH + 1];
+} regFSData;
+#define regFSDataVersion 1
+
+typedef struct {
+    dsUint16_t  stVersion;
+    char        mcName[DSM_MAX_MC_NAME_LENGTH + 1];
+    dsmBool_t   backup_cg_exists;
+    dsmBool_t   archive_cg_exists;
+    char        backup_copy_dest[DSM_MAX_CG_DEST_LENGTH + 1];
+    char        archive_copy_dest[DSM_MAX_CG_DEST_LENGTH + 1];
+} mcBindKey;
+#define mcBindKeyVersion 1
+
+typedef enum {
+    stBackup = 0x00,
+    stArchive,
+    stBackupMountWait,
+    stArchiveMountWait
+} dsmSendType;
+
+typedef struct {
+    dsUint16_t  stVersion;
+    char        *descr;
+} sndArchiveData;
+#define sndArchiveDataVersion 1
+
+typedef struct {
+    dsUint16_t      stVersion;
+    char            owner[DSM_MAX_OWNER_LENGTH + 1];
+    dsStruct64_t    sizeEstimate;
+    dsmBool_t       objCompressed;
+    dsUint16_t      objInfoLength;
+    char            *objInfo;
+    char            *mcNameP;
+    dsmBool_t       disableDeduplication;
+    dsmBool_t       useExtObjInfo;
+} ObjAttr;
+#define ObjAttrVersion 4
+
+typedef struct {
+    dsUint16_t  stVersion;
+    dsUint32_t  bufferLen;
+    dsUint32_t  numBytes;
+    char        *bufferPtr;
+    dsUint32_t  numBytesCompressed;
+    dsUint16_t  reserved;
+} DataBlk;
+#define DataBlkVersion 3
+
+typedef struct {
+    dsUint16_t  stVersion;
+    dsUint32_t  dsmHandle;
+} dsmEndSendObjExIn_t;
+#define dsmEndSendObjExInVersion 1
+
+typedef struct {
+    dsUint16_t      stVersion;
+    dsStruct64_t    totalBytesSent;
+    dsmBool_t       objCompressed;
+    dsStruct64_t    totalCompressSize;
+    dsStruct64_t    totalLFBytesSent;
+    dsUint8_t       encryptionType;
+    dsmBool_t       objDeduplicated;
+    dsStruct64_t    totalDedupSize;
+} dsmEndSendObjExOut_t;
+#define dsmEndSendObjExOutVersion 3
+
+typedef struct {
+    dsUint16_t  stVersion;
+    dsUint32_t  dsmHandle;
+    dsUint8_t   vote;
+} dsmEndTxnExIn_t;
+#define dsmEndTxnExInVersion 1
+
+typedef struct {
+    dsUint16_t      stVersion;
+    dsUint16_t      reason;
+    dsStruct64_t    groupLeaderObjId;
+} dsmEndTxnExOut_t;
+#define dsmEndTxnExOutVersion 1
+
+typedef enum {
+    qtArchive = 0x00,
+    qtBackup,
+    qtBackupActive,
+    qtFilespace,
+    qtMC,
+    qtReserved1,
+    qtReserved2,
+    qtReserved3,
+    qtReserved4,
+    qtBackupGroups,
+    qtOpenGroups
+} dsmQueryType;
+
+typedef void dsmQueryBuff;
+
+typedef struct {
+    dsUint16_t  stVersion;
+    dsmObjName  *objName;
+    char        *owner;
+    dsmDate     insDateLowerBound;
+    dsmDate     insDateUpperBound;
+    dsmDate     expDateLowerBound;
+    dsmDate     expDateUpperBound;
+    char        *descr;
+} qryArchiveData;
+#define qryArchiveDataVersion 1
+
+typedef struct {
+    dsUint16_t      stVersion;
+    dsmObjName      objName;
+    dsUint32_t      copyGroup;
+    char            mcName[DSM_MAX_MC_NAME_LENGTH + 1];
+    char            owner[DSM_MAX_OWNER_LENGTH + 1];
+    dsStruct64_t    objId;
+    dsStruct64_t    reserved;
+    dsUint8_t       mediaClass;
+    dsmDate         insDate;
+    dsmDate         expDate;
+    char            descr[DSM_MAX_DESCR_LENGTH + 1];
+    dsUint16_t      objInfolen;
+    char            objInfo[DSM_MAX_OBJINFO_LENGTH];
+    dsUint160_t     restoreOrderExt;
+    dsStruct64_t    sizeEstimate;
+    dsUint8_t       compressType;
+    dsUint8_t       retentionInitiated;
+    dsUint8_t       objHeld;
+    dsUint8_t       encryptionType;
+    dsmBool_t       clientDeduplicated;
+} qryRespArchiveData;
+#define qryRespArchiveDataVersion 6
+
+typedef struct {
+    dsUint16_t      stVersion;
+    dsmObjName      *objName;
+    char            *owner;
+    dsUint8_t       objState;
+    dsmDate         pitDate;
+} qryBackupData;
+#define qryBackupDataVersion 2
+
+typedef struct {
+    dsUint16_t      stVersion;
+    dsmObjName      objName;
+    dsUint32_t      copyGroup;
+    char            mcName[DSM_MAX_MC_NAME_LENGTH + 1];
+    char            owner[DSM_MAX_OWNER_LENGTH + 1];
+    dsStruct64_t    objId;
+    dsStruct64_t    reserved;
+    dsUint8_t       mediaClass;
+    dsUint8_t       objState;
+    dsmDate         insDate;
+    dsmDate         expDate;
+    dsUint16_t      objInfolen;
+    char            objInfo[DSM_MAX_OBJINFO_LENGTH];
+    dsUint160_t     restoreOrderExt;
+    dsStruct64_t    sizeEstimate;
+    dsStruct64_t    baseObjId;
+    dsUint16_t      baseObjInfolen;
+    dsUint8_t       baseObjInfo[DSM_MAX_OBJINFO_LENGTH];
+    dsUint160_t     baseRestoreOrder;
+    dsUint32_t      fsID;
+    dsUint8_t       compressType;
+    dsmBool_t       isGroupLeader;
+    dsmBool_t       isOpenGroup;
+    dsUint8_t       reserved1;
+    dsmBool_t       reserved2;
+    dsUint16_t      reserved3;
+    void            *reserved4;
+    dsUint8_t       encryptionType;
+    dsmBool_t       clientDeduplicated;
+} qryRespBackupData;
+#define qryRespBackupDataVersion 8
+
+typedef struct {
+    dsUint16_t      stVersion;
+    dsUint8_t       groupType;
+    char            *fsName;
+    char            *owner;
+    dsStruct64_t    groupLeaderObjId;
+    dsUint8_t       objType;
+} qryBackupGroups;
+#define qryBackupGroupsVersion 1
+
+typedef enum {
+    dtArchive = 0x00,
+    dtBackup,
+    dtBackupID
+} dsmDelType;
+
+typedef struct {
+    dsUint16_t      stVersion;
+    dsStruct64_t    objId;
+} delArch;
+#define delArchVersion 1
+
+typedef struct {
+    dsUint16_t      stVersion;
+    dsmObjName      *objNameP;
+    dsUint32_t      copyGroup;
+} delBack;
+#define delBackVersion 1
+
+typedef struct {
+    dsUint16_t      stVersion;
+    dsStruct64_t    objId;
+} delBackID;
+#define delBackIDVersion 1
+
+typedef union {
+    delBack     backInfo;
+    delArch     archInfo;
+    delBackID   backIDInfo;
+} dsmDelInfo;
+
+typedef enum {
+    gtBackup = 0x00,
+    gtArchive
+} dsmGetType;
+
+typedef struct {
+    dsUint16_t      stVersion;
+    dsStruct64_t    partialObjOffset;
+    dsStruct64_t    partialObjLength;
+} PartialObjData;
+#define PartialObjDataVersion 1
+
+typedef struct {
+    dsUint16_t      stVersion;
+    dsUint32_t      numObjId;
+    ObjID           *objId;
+    PartialObjData  *partialObjData;
+} dsmGetList;
+#define dsmGetListVersion       2   /* default if not using Partial Obj data */
+#define dsmGetListPORVersion    3   /* version if using Partial Obj data */
+
+typedef struct {
+    dsUint16_t      stVersion;
+    dsUint32_t      dsmHandle;
+    dsUint8_t       groupType;
+    dsUint8_t       actionType;
+    dsUint8_t       memberType;
+    dsStruct64_t    leaderObjId;
+    char            *uniqueGroupTagP;
+    dsmObjName      *objNameP;
+    dsmGetList      memberObjList;
+} dsmGroupHandlerIn_t;
+#define dsmGroupHandlerInVersion 1
+
+typedef struct {
+    dsUint16_t      stVersion;
+} dsmGroupHandlerExOut_t;
+#define dsmGroupHandlerExOutVersion 1
+
+#endif /* _H_DSMAPITD */
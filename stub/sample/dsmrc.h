@@ -0,0 +1,34 @@
+/*
+ * dsmrc.h - return codes for the tsmpipe TSM API stub.
+ *
+ * Only the codes used by tsmpipe and the stub library are defined. The
+ * values match the ones in the IBM Spectrum Protect API headers.
+ */
+#ifndef _H_DSMRC
+#define _H_DSMRC
+
+#define DSM_RC_OK                       0
+#define DSM_RC_ABORT_SYSTEM_ERROR       1
+#define DSM_RC_ABORT_NO_MATCH           2
+#define DSM_RC_ABORT_BY_CLIENT          3
+#define DSM_RC_ABORT_NO_REPOSIT_SPACE   11
+#define DSM_RC_ABORT_MOUNT_NOT_POSSIBLE 17
+#define DSM_RC_ABORT_NODE_NOT_AUTHORIZED 33
+#define DSM_RC_REJECT_VERIFIER_EXPIRED  52
+#define DSM_RC_NO_MEMORY                102
+#define DSM_RC_INVALID_PARM             109
+#define DSM_RC_FINISHED                 121
+#define DSM_RC_WILL_ABORT               157
+#define DSM_RC_INVALID_OPT              400
+#define DSM_RC_NO_SESS_BLK              2006
+#define DSM_RC_BAD_CALL_SEQUENCE        2041
+#define DSM_RC_INVALID_OBJID            2043
+#define DSM_RC_UNKNOWN_ERROR            2046
+#define DSM_RC_FS_ALREADY_REGED         2062
+#define DSM_RC_FS_NOT_REGISTERED        2065
+#define DSM_RC_MORE_DATA                2200
+#define DSM_RC_BUFF_TOO_SMALL           2210
+#define DSM_RC_CHECK_REASON_CODE        2302
+#define DSM_RC_NEEDTO_ENDTXN            2070
+
+#endif /* _H_DSMRC */
@@ -28,13 +28,49 @@ static const char rcsid[] = /*Add RCS version string to binary */
 #define _LARGEFILE_SOURCE 1
 #define _LARGE_FILES 1
 
+/* vmsplice() and O_DIRECT */
+#ifdef __linux__
+#define _GNU_SOURCE 1
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <errno.h>
 #include <signal.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <poll.h>
+#include <fnmatch.h>
+#include <dirent.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#endif
 
 #include "dsmrc.h"
 #include "dsmapitd.h"
@@ -44,27 +80,100 @@ typedef enum
 {
     listmode_unknown = 0,
     listmode_fsize,
-    listmode_volser
+    listmode_volser,
+    listmode_sums
 } tsmpipe_listmode_t;
 
+/* Output format for -t and -T, -F */
+typedef enum
+{
+    listfmt_text = 0,
+    listfmt_nul,
+    listfmt_json,
+    listfmt_bin
+} tsmpipe_listfmt_t;
+
+struct tsm_codec;
+struct tsm_key;
+
+/* Transfer buffer setup, see tsm_tcpbuffsize() */
+typedef struct
+{
+    size_t      bufsize;        /* Buffer size to start with */
+    size_t      slotsize;       /* Size of each buffer in the ring */
+    size_t      tcpbuff;        /* TCPBUFFSIZE, the step for -a */
+    int         qdepth;
+    char        hugepages;
+    char        adaptive;
+    char        checksum;       /* -k, see struct tsm_sum */
+
+    /* Compression, see struct tsm_zpool */
+    const struct tsm_codec *codec;  /* Compress when storing, -z */
+    int         zlevel;
+    int         zthreads;       /* -j */
+    size_t      zblock;
+
+    const struct tsm_key *key;      /* Encrypt when storing, -K */
+} tsmpipe_xfer_t;
+
 /* 
- * The recommended buffer size is n*TCPBUFFLEN - 4 bytes.
- * To get your buffer size, do: dsmc query options|grep TCPBUF
- * 32kB seems to be the new default, 31kB was the old.
- *
- * An additional factor is the pipe buffer size. Since we don't do threading
- * (yet), we hide a little bit of latency if we don't read more than the pipe
- * buffer can hold at a time. On Linux 2.6 this is 64kB.
+ * The recommended buffer size is n*TCPBUFFSIZE - 4 bytes.
+ * The API doesn't tell us the TCPBUFFSIZE in use, so tsm_tcpbuffsize() looks
+ * it up the same way the API does: -tcpbuffsize in the -O options, or the
+ * server stanza in dsm.sys. 32kB seems to be the new default, 31kB was the
+ * old.
  *
- * So, I would recommend a BUFLEN of 64kB if your TCPBUFLEN is above the
- * 64kB + 4 bytes limit or if your TCPBUFLEN is lower, the 
- * n*TCPBUFFLEN - 4 bytes that gets you closest to 64kB.
+ * Reading stdin and writing stdout is done by a separate thread that
+ * fills/drains a ring of buffers (see struct tsm_ring), so the pipe buffer
+ * size no longer limits how much latency we can hide. We still enlarge the
+ * pipe when possible so the other end doesn't stall while we're waiting for
+ * a free buffer.
  *
- * For a default tuned TSM client on Linux, BUFLEN should thus be 32*1024*2-4.
+ * So we use the largest n that keeps the buffer size within BUFTARGET, but
+ * at least n=1. This can be overridden with -b. With -a the buffer size is
+ * instead adjusted in TCPBUFFSIZE steps during the transfer, up to
+ * ADAPT_MAXBUF, depending on the throughput we get (see struct tsm_adapt).
  */
 
-/* We (HPC2N) have 512kB tcpbuff */
-#define BUFLEN (64*1024-4)
+/* TCPBUFFSIZE when not set in the options, in kB */
+#define DEF_TCPBUFFSIZE 32
+
+/* Buffer size we aim for */
+#define BUFTARGET       (256*1024)
+
+/* Largest buffer size used with -a */
+#define ADAPT_MAXBUF    (4*1024*1024)
+
+/* Sanity limit for -b */
+#define MAX_BUFSIZE     (256*1024*1024)
+
+/* Seconds between buffer size adjustments with -a */
+#define ADAPT_INTERVAL  2.0
+
+/* Default number of buffers in the transfer ring, see -q and -m */
+#define DEF_QUEUEDEPTH  16
+
+/* Pipe size we try to get with F_SETPIPE_SZ */
+#define PIPESIZE        (1024*1024)
+
+/* Huge page size assumed when rounding -H allocations */
+#define HUGEPAGESIZE    (2*1024*1024)
+
+/* Alignment of offsets and lengths for O_DIRECT */
+#define DIRECT_ALIGN    4096
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* How tsm_writer() gets the data out, see ring_output() */
+typedef enum
+{
+    outmode_write = 0,
+    outmode_vmsplice,
+    outmode_direct,
+    outmode_sparse
+} tsmpipe_outmode_t;
 
 
 off_t atooff(const char *s)
@@ -84,6 +193,357 @@ off_t atooff(const char *s)
 }
 
 
+/*
+ * Parse a size with an optional k, M or G suffix. Returns -1 on error,
+ * also if it doesn't fit in an off_t.
+ */
+off_t atosize(const char *s)
+{
+    long long   o;
+    char        *end;
+    int         shift;
+
+    errno = 0;
+    o = strtoll(s, &end, 10);
+    if(end == s || o < 0 || errno == ERANGE) {
+        return -1;
+    }
+    switch(*end) {
+        case '\0':
+            shift = 0;
+            break;
+        case 'k': case 'K':
+            shift = 10;
+            break;
+        case 'm': case 'M':
+            shift = 20;
+            break;
+        case 'g': case 'G':
+            shift = 30;
+            break;
+        default:
+            return -1;
+    }
+    if(o > (sizeof(off_t) == 4 ? 0x7fffffffLL : LLONG_MAX) >> shift) {
+        return -1;
+    }
+
+    return o << shift;
+}
+
+
+double timenow(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+/*
+ * Transfer statistics for -v and -M. Each stage adds the time it spends
+ * blocked in its calls: the reader and writer threads in read() and
+ * write(), the main thread in dsmSendData()/dsmGetData(). The stages run
+ * at the same time, so the one whose time is closest to the elapsed time
+ * is the bottleneck.
+ */
+typedef enum {
+    stat_input = 0,
+    stat_api,
+    stat_output,
+    stat_session,
+    stat_query,
+    stat_commit,
+    stat_throttle,
+    STAT_STAGES
+} tsmpipe_stage_t;
+
+const char *stat_names[STAT_STAGES] = {
+    "input", "api", "output", "session", "query", "commit", "throttle"
+};
+
+struct tsm_stats {
+    double              start;
+    double              seconds[STAT_STAGES];
+    unsigned long long  bytes[STAT_STAGES];
+    unsigned long long  calls[STAT_STAGES];
+    unsigned long long  objects;
+    /* Summed from dsmEndSendObjEx() */
+    unsigned long long  srvsent;
+    unsigned long long  srvcompressed;
+    unsigned long long  srvlanfree;
+    unsigned long long  srvdedup;
+    unsigned long long  compressedobjs;
+    unsigned long long  dedupobjs;
+};
+
+pthread_mutex_t     stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct tsm_stats    stats;
+
+
+void stats_reset(void) {
+    pthread_mutex_lock(&stats_mutex);
+    memset(&stats, 0, sizeof(stats));
+    stats.start = timenow();
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+
+/* Account for one call of a stage that started at since */
+void stats_add(tsmpipe_stage_t stage, double since, unsigned long long bytes)
+{
+    double t = timenow() - since;
+
+    pthread_mutex_lock(&stats_mutex);
+    stats.seconds[stage] += t;
+    stats.bytes[stage] += bytes;
+    stats.calls[stage]++;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+
+/* Take a consistent copy for reporting */
+void stats_get(struct tsm_stats *s) {
+    pthread_mutex_lock(&stats_mutex);
+    *s = stats;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+
+/*
+ * Throttling, -Q [bytes/s][,ops=n][,burst=size][,file=path]. Token buckets
+ * for the bytes going through dsmSendData()/dsmGetData() and for the
+ * objects started, shared by all threads and stripes. The buckets may go
+ * into debt for a buffer larger than the burst, the next caller waits it
+ * off. A control file with the same limits, without file=, is checked
+ * once a second and replaces them when it changes, so a running transfer
+ * can be slowed down or let loose. 0 is no limit.
+ */
+#define THROTTLE_CHECK  1.0         /* Seconds between control file checks */
+#define THROTTLE_SLICE  0.5         /* Longest sleep before checking again */
+
+struct tsm_bucket {
+    double  rate;                   /* Per second, 0 for no limit */
+    double  burst;
+    double  tokens;
+    double  last;
+};
+
+struct tsm_throttle {
+    struct tsm_bucket   bytes;
+    struct tsm_bucket   ops;
+    char                *file;
+    struct stat         filest;
+    double              checked;
+    char                verbose;
+};
+
+pthread_mutex_t     throttle_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct tsm_throttle throttle;
+
+
+/* Parse limits into rate, ops and burst. Returns 0 on error. */
+int throttle_parse(char *spec, double *rate, double *ops, double *burst,
+                   char **file)
+{
+    char    *tok, *save = NULL, *end;
+    off_t   o;
+    int     first = 1;
+
+    *rate = *ops = *burst = 0;
+
+    for(tok = strtok_r(spec, ", \t\n", &save); tok != NULL;
+            tok = strtok_r(NULL, ", \t\n", &save), first = 0)
+    {
+        if(strncmp(tok, "ops=", 4) == 0) {
+            *ops = strtod(tok + 4, &end);
+            if(end == tok + 4 || *end != '\0' || *ops < 0) {
+                return 0;
+            }
+        }
+        else if(strncmp(tok, "burst=", 6) == 0) {
+            if((o = atosize(tok + 6)) < 0) {
+                return 0;
+            }
+            *burst = o;
+        }
+        else if(file && strncmp(tok, "file=", 5) == 0 && tok[5] != '\0') {
+            *file = tok + 5;
+        }
+        else if(first && (o = atosize(tok)) >= 0) {
+            *rate = o;
+        }
+        else {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+void throttle_bucket(struct tsm_bucket *b, double rate, double burst) {
+    b->rate = rate;
+    b->burst = burst;
+    if(b->tokens > burst) {
+        b->tokens = burst;
+    }
+}
+
+
+/* Set new limits, a second's worth is the default burst */
+void throttle_set(double rate, double ops, double burst) {
+    throttle_bucket(&throttle.bytes, rate, burst > 0 ? burst : rate);
+    throttle_bucket(&throttle.ops, ops, ops > 1 ? ops : 1);
+
+    if(throttle.verbose > 0) {
+        fprintf(stderr, "tsmpipe: Throttling to ");
+        if(rate > 0) {
+            fprintf(stderr, "%.1f MB/s", rate / 1048576);
+        }
+        else {
+            fprintf(stderr, "unlimited bytes");
+        }
+        if(ops > 0) {
+            fprintf(stderr, ", %g objects/s\n", ops);
+        }
+        else {
+            fprintf(stderr, ", unlimited objects\n");
+        }
+    }
+}
+
+
+/* Pick up a changed control file. Called with throttle_mutex held. */
+void throttle_reload(double now) {
+    struct stat st;
+    char        buf[256];
+    ssize_t     n;
+    double      rate, ops, burst;
+    int         fd;
+
+    if(!throttle.file || now - throttle.checked < THROTTLE_CHECK) {
+        return;
+    }
+    throttle.checked = now;
+
+    if(stat(throttle.file, &st) < 0 ||
+            (st.st_mtime == throttle.filest.st_mtime &&
+             st.st_size == throttle.filest.st_size &&
+             st.st_ino == throttle.filest.st_ino))
+    {
+        return;
+    }
+    throttle.filest = st;
+
+    fd = open(throttle.file, O_RDONLY);
+    if(fd < 0) {
+        return;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n < 0) {
+        return;
+    }
+    buf[n] = '\0';
+
+    if(!throttle_parse(buf, &rate, &ops, &burst, NULL)) {
+        fprintf(stderr, "tsmpipe: %s: Invalid limits, keeping the old "
+                "ones\n", throttle.file);
+        return;
+    }
+    throttle_set(rate, ops, burst);
+}
+
+
+/* Take amount from a bucket, waiting for it to be out of debt first */
+void throttle_take(struct tsm_bucket *b, double amount) {
+    double  now, wait, start = 0;
+
+    if(!throttle.file && b->rate <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&throttle_mutex);
+    for(;;) {
+        now = timenow();
+        throttle_reload(now);
+        if(b->rate <= 0) {
+            break;
+        }
+        b->tokens += (now - b->last) * b->rate;
+        b->last = now;
+        if(b->tokens > b->burst) {
+            b->tokens = b->burst;
+        }
+        if(b->tokens >= 0) {
+            b->tokens -= amount;
+            break;
+        }
+        wait = -b->tokens / b->rate;
+        if(wait > THROTTLE_SLICE) {
+            wait = THROTTLE_SLICE;
+        }
+        if(start == 0) {
+            start = now;
+        }
+        pthread_mutex_unlock(&throttle_mutex);
+        usleep(wait * 1000000);
+        pthread_mutex_lock(&throttle_mutex);
+    }
+    b->last = now;
+    pthread_mutex_unlock(&throttle_mutex);
+
+    if(start != 0) {
+        stats_add(stat_throttle, start, 0);
+    }
+}
+
+
+void throttle_bytes(size_t len) {
+    throttle_take(&throttle.bytes, len);
+}
+
+
+void throttle_object(void) {
+    throttle_take(&throttle.ops, 1);
+}
+
+
+/* A 64-bit object id or size from the API */
+unsigned long long u64(const dsStruct64_t *v) {
+    return ((unsigned long long) v->hi << 32) | v->lo;
+}
+
+
+/* Account for what the server did with an object we sent */
+void stats_sent(const dsmEndSendObjExOut_t *out) {
+    pthread_mutex_lock(&stats_mutex);
+    stats.objects++;
+    stats.srvsent += u64(&out->totalBytesSent);
+    stats.srvcompressed += u64(&out->totalCompressSize);
+    stats.srvlanfree += u64(&out->totalLFBytesSent);
+    stats.srvdedup += u64(&out->totalDedupSize);
+    if(out->objCompressed) {
+        stats.compressedobjs++;
+    }
+    if(out->objDeduplicated) {
+        stats.dedupobjs++;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+
+/* Account for an object we got */
+void stats_got(void) {
+    pthread_mutex_lock(&stats_mutex);
+    stats.objects++;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+
 ssize_t read_full(int fd, char *buf, size_t count) {
     ssize_t done=0;
 
@@ -138,744 +598,13033 @@ ssize_t write_full(int fd, const char *buf, size_t count)
 }
 
 
-int tsm_checkapi(void) {
-    dsmApiVersionEx     apiLibVer;
-    dsUint32_t          apiVersion;
-    dsUint32_t          applVersion = (10000 * DSM_API_VERSION) + 
-                                      (1000 * DSM_API_RELEASE) + 
-                                      (100 * DSM_API_LEVEL) + DSM_API_SUBLEVEL;
-
-    memset(&apiLibVer, 0, sizeof(apiLibVer));
-    apiLibVer.stVersion = apiVersionExVer;
-    dsmQueryApiVersionEx(&apiLibVer);
+ssize_t pread_full(int fd, char *buf, size_t count, off_t offset)
+{
+    ssize_t done=0;
 
-    apiVersion = (10000 * apiLibVer.version) + (1000 * apiLibVer.release) + 
-                 (100 * apiLibVer.level) + apiLibVer.subLevel;
+    while(count) {
+        ssize_t len;
 
-    if (apiVersion < applVersion)
-    { 
-        printf("The Tivoli Storage Manager API library Version = %d.%d.%d.%d "
-                "is at a lower version\n",
-                apiLibVer.version,
-                apiLibVer.release,
-                apiLibVer.level,
-                apiLibVer.subLevel);
-        printf("than the application version = %d.%d.%d.%d.\n",
-                DSM_API_VERSION,
-                DSM_API_RELEASE,
-                DSM_API_LEVEL,
-                DSM_API_SUBLEVEL);
-        printf("Please upgrade the API accordingly.\n");
-        return 0;
+        len = pread(fd, buf+done, count, offset+done);
+        if(len == 0) {
+            break;
+        }
+        else if(len < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            else {
+                if(done == 0) {
+                    done = -1;
+                }
+                break;
+            }
+        }
+        count -= len;
+        done += len;
     }
 
-    return 1;
+    return(done);
 }
 
 
-void tsm_printerr(dsUint32_t sesshandle, dsInt16_t rc, char *str) {
-    char                rcStr[DSM_MAX_RC_MSG_LENGTH];
+ssize_t pwrite_full(int fd, const char *buf, size_t count, off_t offset)
+{
+    ssize_t done=0;
 
-    if(rc == DSM_RC_WILL_ABORT) {
-        dsUint16_t reason;
+    while(count) {
+        ssize_t len;
 
-        rc = dsmEndTxn(sesshandle, DSM_VOTE_COMMIT, &reason);
-        if(rc == DSM_RC_CHECK_REASON_CODE) {
-            rc = reason;
+        len = pwrite(fd, buf+done, count, offset+done);
+        if(len < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            else {
+                done = -1;
+                break;
+            }
         }
+        count -= len;
+        done += len;
     }
 
-    dsmRCMsg(sesshandle, rc, rcStr);
-    fprintf(stderr, "tsmpipe: %s\n"
-                    "        rc=%s\n", str, rcStr);
+    return(done);
 }
 
 
-dsUint32_t tsm_initsess(char *options) {
-    dsmApiVersionEx     applApi;
-    dsUint32_t          sesshandle = 0;
-    dsmInitExIn_t       initIn;
-    dsmInitExOut_t      initOut;
-    dsInt16_t           rc;
+/*
+ * In a daemon worker, the connection of the client the command runs for.
+ * The input of a killed client can still end normally, so what it sent
+ * must not be committed.
+ */
+int daemon_conn = -1;
 
-    memset(&applApi, 0, sizeof(applApi));
-    applApi.version  = DSM_API_VERSION;
-    applApi.release  = DSM_API_RELEASE;
-    applApi.level    = DSM_API_LEVEL  ;
-    applApi.subLevel = DSM_API_SUBLEVEL;
+/* Whether the daemon client has closed its connection, never otherwise */
+int daemon_hungup(void) {
+    struct pollfd   pfd;
+    char            c;
 
-    memset(&initIn, 0, sizeof(initIn));
-    initIn.stVersion        = dsmInitExInVersion;
-    initIn.apiVersionExP    = &applApi;
-    initIn.clientNodeNameP  = NULL;
-    initIn.clientOwnerNameP = NULL;
-    initIn.clientPasswordP  = NULL;
-    initIn.applicationTypeP = NULL;
-    initIn.configfile       = NULL;
-    initIn.options          = options;
-    initIn.userNameP        = NULL;
-    initIn.userPasswordP    = NULL;
+    if(daemon_conn < 0) {
+        return 0;
+    }
+    pfd.fd = daemon_conn;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if(poll(&pfd, 1, 0) <= 0) {
+        return 0;
+    }
 
-    memset(&initOut, 0, sizeof(initOut));
+    /* The client sends nothing more, readable means end of file */
+    return (pfd.revents & (POLLHUP | POLLERR)) ||
+           recv(daemon_conn, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
 
-    rc = dsmInitEx(&sesshandle, &initIn, &initOut);
-    if(rc == DSM_RC_REJECT_VERIFIER_EXPIRED) {
-        rc = dsmChangePW(sesshandle, NULL, NULL);
-        if(rc != DSM_RC_OK) {
-            tsm_printerr(sesshandle, rc, "dsmChangePW failed");
-            return 0;
-        }
-    }
-    else if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmInitEx failed");
-        dsmTerminate(sesshandle);
-        return 0;
-    }
 
-    return sesshandle;
-}
+/*
+ * Single producer, single consumer ring of page aligned buffers. Used to
+ * decouple our end of the pipe from the TSM session, so reads/writes on
+ * stdin/stdout and the TSM API calls can run at the same time.
+ *
+ * The producer gets an empty slot with ring_getfree(), fills it and hands
+ * it over with ring_put(). When done it calls ring_close() with 0 or an
+ * errno value. The consumer gets filled slots with ring_getfull() and
+ * returns them with ring_release(). Either side can call ring_abort() to
+ * make the other one stop.
+ */
+struct tsm_ring {
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    char                *mem;
+    size_t              memlen;
+    size_t              slotsize;
+    size_t              fill;       /* How much the producer should fill */
+    size_t              stride;
+    size_t              *len;
+    int                 nslots;
+    int                 head;       /* Next slot to fill */
+    int                 tail;       /* Next slot to drain */
+    int                 count;      /* Number of filled slots */
+    int                 closed;
+    int                 aborted;
+    int                 err;
+    int                 hugepages;  /* Got MAP_HUGETLB memory */
+    int                 fd;         /* What the helper thread reads/writes */
+    size_t              align;      /* Fill is rounded down to this */
+    off_t               inpos;      /* tsm_reader() reads inleft bytes at */
+    off_t               inleft;     /* inpos with pread, if not -1 */
+    int                 dropcache;  /* Drop what it read from the cache */
+
+    /* Output state of tsm_writer(), see ring_output() */
+    tsmpipe_outmode_t   outmode;
+    int                 (*sink)(void *, const char *, size_t);
+    void                *sinkarg;   /* If sink is set it gets the data */
+    int                 directfd;
+    off_t               outbase;
+    off_t               outpos;
+    off_t               splicebytes;
+    off_t               directbytes;
+    off_t               oldsize;    /* Holes below this must be punched */
+    off_t               holebytes;
+
+    /* Statistics, reported by ring_report() */
+    int                 highwater;
+    unsigned long       fullwaits;  /* Producer waited for a free slot */
+    unsigned long       emptywaits; /* Consumer waited for data */
+};
 
 
-int tsm_regfs(dsUint32_t sesshandle, char *fsname) {
-    regFSData       regFS;
-    dsInt16_t       rc;
+int ring_init(struct tsm_ring *ring, int nslots, size_t slotsize,
+              char hugepages, char verbose)
+{
+    long pagesize;
 
-    memset(&regFS, 0, sizeof(regFS));
+    memset(ring, 0, sizeof(*ring));
 
-    regFS.fsName = fsname;
-    regFS.fsType = "TSMPIPE";
+    pagesize = sysconf(_SC_PAGESIZE);
+    if(pagesize <= 0) {
+        pagesize = 4096;
+    }
 
-    rc = dsmRegisterFS(sesshandle, &regFS);
-    if(rc != DSM_RC_OK && rc != DSM_RC_FS_ALREADY_REGED) {
-        tsm_printerr(sesshandle, rc, "dsmRegisterFS failed");
+    ring->nslots = nslots;
+    ring->slotsize = slotsize;
+    ring->fill = slotsize;
+    ring->align = 1;
+    ring->directfd = -1;
+    ring->inleft = -1;
+    ring->stride = (slotsize + pagesize - 1) & ~(pagesize - 1);
+    ring->memlen = ring->stride * nslots;
+
+    ring->len = calloc(nslots, sizeof(size_t));
+    if(!ring->len) {
+        perror("tsmpipe: malloc");
         return 0;
     }
 
-    return 1;
-}
-
-
-void tsm_name2obj(char *fsname, char *filename, dsmObjName *objName) {
-    char            *p;
-
-    /* fs == "/filesystem", hl == "/directory/path", ll == "/filename" */
-    strcpy(objName->fs, fsname);
-    *objName->hl = '\0';
-    *objName->ll = '\0';
-    p = strrchr(filename, '/');
-    if(p) {
-        *p = '\0';
-        if(*filename && *filename != '/') {
-            strcpy(objName->hl, "/");
+    ring->mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if(hugepages) {
+        /* Round up to a whole number of (2MB) huge pages */
+        size_t hlen = (ring->memlen + HUGEPAGESIZE - 1) & ~(HUGEPAGESIZE - 1);
+
+        ring->mem = mmap(NULL, hlen, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if(ring->mem != MAP_FAILED) {
+            ring->memlen = hlen;
+            ring->hugepages = 1;
+        }
+        else if(verbose > 0) {
+            fprintf(stderr, "tsmpipe: No huge pages available (%s), "
+                    "using normal pages\n", strerror(errno));
         }
-        strcat(objName->hl, filename);
-        sprintf(objName->ll, "/%s", p+1);
-        *p = '/';
     }
-    else {
-        if(*filename && *filename != '/') {
-            strcpy(objName->ll, "/");
+#endif
+    if(ring->mem == MAP_FAILED) {
+        ring->mem = mmap(NULL, ring->memlen, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(ring->mem == MAP_FAILED) {
+            perror("tsmpipe: mmap");
+            free(ring->len);
+            return 0;
         }
-        strcat(objName->ll, filename);
+#ifdef MADV_HUGEPAGE
+        if(hugepages) {
+            /* Transparent huge pages are better than nothing */
+            madvise(ring->mem, ring->memlen, MADV_HUGEPAGE);
+        }
+#endif
     }
-    objName->objType = DSM_OBJ_FILE;
-}
 
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->cond, NULL);
 
-int tsm_sendfile(dsUint32_t sesshandle, char *fsname, char *filename, 
-                 off_t length, char *description, dsmSendType sendtype,
-                 char verbose)
-{
-    char            *buffer;
-    dsInt16_t       rc;
-    dsUint16_t      reason=0;
-    dsmObjName      objName;
-    mcBindKey       mcBindKey;
-    sndArchiveData  archData, *archDataP=NULL;
-    ObjAttr         objAttr;
-    DataBlk         dataBlk;
-    ssize_t         nbytes;
+    return 1;
+}
 
-    buffer = malloc(BUFLEN);
-    if(!buffer) {
-        perror("tsmpipe: malloc");
-        return 0;
-    }
 
-    rc = dsmBeginTxn(sesshandle);
-    if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmBeginTxn failed");
-        return 0;
+/* Make the ring ready for another transfer, keeping the statistics */
+void ring_reset(struct tsm_ring *ring, int fd) {
+    if(ring->directfd >= 0) {
+        close(ring->directfd);
     }
+    ring->fd = fd;
+    ring->fill = ring->slotsize;
+    ring->align = 1;
+    ring->dropcache = 0;
+    ring->outmode = outmode_write;
+    ring->sink = NULL;
+    ring->directfd = -1;
+    ring->outpos = 0;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->count = 0;
+    ring->closed = 0;
+    ring->aborted = 0;
+    ring->err = 0;
+}
 
-    tsm_name2obj(fsname, filename, &objName);
 
-    if(verbose > 0) {
-        fprintf(stderr, "tsmpipe: Starting to send stdin as %s%s%s\n",
-                objName.fs, objName.hl, objName.ll);
+void ring_free(struct tsm_ring *ring) {
+    if(ring->directfd >= 0) {
+        close(ring->directfd);
     }
+    munmap(ring->mem, ring->memlen);
+    free(ring->len);
+    pthread_mutex_destroy(&ring->mutex);
+    pthread_cond_destroy(&ring->cond);
+}
 
-    mcBindKey.stVersion = mcBindKeyVersion;
-    rc = dsmBindMC(sesshandle, &objName, sendtype, &mcBindKey);
-    if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmBindMC failed");
-        return 0;
-    }
 
-    if(verbose > 1) {
-        char *cgdest=NULL;
+/*
+ * Returns NULL if the consumer has aborted. *fill is set to the amount of
+ * data the producer should put in the slot.
+ */
+char *ring_getfree(struct tsm_ring *ring, size_t *fill) {
+    char *buf = NULL;
 
-        fprintf(stderr, "tsmpipe: Bound to Management Class: %s\n", mcBindKey.mcName);
-        if((sendtype == stArchiveMountWait || sendtype == stArchive) &&
-                mcBindKey.archive_cg_exists)
-        {
-            cgdest = mcBindKey.archive_copy_dest;
-        }
-        else if(mcBindKey.backup_cg_exists) {
-            cgdest = mcBindKey.backup_copy_dest;
-        }
-        if(cgdest) {
-            fprintf(stderr, "tsmpipe: Destination Copy Group: %s\n", cgdest);
-        }
+    pthread_mutex_lock(&ring->mutex);
+    if(ring->count == ring->nslots) {
+        ring->fullwaits++;
+    }
+    while(ring->count == ring->nslots && !ring->aborted) {
+        pthread_cond_wait(&ring->cond, &ring->mutex);
     }
+    if(!ring->aborted) {
+        buf = ring->mem + ring->head * ring->stride;
+        *fill = ring->fill;
+    }
+    pthread_mutex_unlock(&ring->mutex);
 
-    memset(&objAttr, 0, sizeof(objAttr));
-    objAttr.stVersion = ObjAttrVersion;
-    *objAttr.owner = '\0';
-    objAttr.sizeEstimate.hi = length >> 32;
-    objAttr.sizeEstimate.lo = length & ~0U;
-    objAttr.objCompressed = bFalse;
+    return buf;
+}
 
-    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
-        archData.stVersion = sndArchiveDataVersion;
-        archData.descr = description;
-        archDataP = &archData;
-    }
 
-    rc = dsmSendObj(sesshandle, sendtype, archDataP, &objName, &objAttr, NULL);
-    if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmSendObj failed");
-        return(0);
+void ring_put(struct tsm_ring *ring, size_t len) {
+    pthread_mutex_lock(&ring->mutex);
+    ring->len[ring->head] = len;
+    ring->head = (ring->head + 1) % ring->nslots;
+    ring->count++;
+    if(ring->count > ring->highwater) {
+        ring->highwater = ring->count;
     }
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+}
 
-    dataBlk.stVersion   = DataBlkVersion;
 
-    while(1) {
-        nbytes = read_full(STDIN_FILENO, buffer, BUFLEN);
+/*
+ * Copy len bytes into the ring, zeroes if buf is NULL. Used for the small
+ * bits of framing (archive headers and padding) that go between objects.
+ * Returns 0 if the consumer has aborted.
+ */
+int ring_write(struct tsm_ring *ring, const char *buf, size_t len) {
+    char    *slot;
+    size_t  fill;
 
-        if(nbytes < 0) {
-            perror("tsmpipe: read");
+    while(len > 0) {
+        slot = ring_getfree(ring, &fill);
+        if(slot == NULL) {
             return 0;
         }
-        else if(nbytes == 0) {
-            break;
+        if(fill > len) {
+            fill = len;
         }
+        if(buf != NULL) {
+            memcpy(slot, buf, fill);
+            buf += fill;
+        }
+        else {
+            memset(slot, 0, fill);
+        }
+        ring_put(ring, fill);
+        len -= fill;
+    }
 
-        dataBlk.bufferLen   = nbytes;
-        dataBlk.numBytes    = 0;
-        dataBlk.bufferPtr   = buffer;
+    return 1;
+}
 
-        rc = dsmSendData(sesshandle, &dataBlk);
-        if(rc != DSM_RC_OK) {
-            tsm_printerr(sesshandle, rc, "dsmSendData failed");
-            return 0;
-        }
+
+void ring_setfill(struct tsm_ring *ring, size_t fill) {
+    if(fill >= ring->align) {
+        fill -= fill % ring->align;
     }
+    pthread_mutex_lock(&ring->mutex);
+    ring->fill = fill;
+    pthread_mutex_unlock(&ring->mutex);
+}
 
-    rc = dsmEndSendObj(sesshandle);
-    if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmEndSendObj failed");
-        return(0);
+
+void ring_close(struct tsm_ring *ring, int err) {
+    pthread_mutex_lock(&ring->mutex);
+    ring->closed = 1;
+    if(err) {
+        ring->err = err;
     }
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+}
 
-    rc = dsmEndTxn(sesshandle, DSM_VOTE_COMMIT, &reason);
-    if(rc == DSM_RC_CHECK_REASON_CODE || 
-            (rc == DSM_RC_OK && reason != DSM_RC_OK))
-    {
-        tsm_printerr(sesshandle, reason, "dsmEndTxn failed, reason");
-        return(0);
+
+/*
+ * Returns NULL when the producer has closed the ring and it is drained,
+ * or if the producer has aborted.
+ */
+char *ring_getfull(struct tsm_ring *ring, size_t *len) {
+    char *buf = NULL;
+
+    pthread_mutex_lock(&ring->mutex);
+    if(ring->count == 0 && !ring->closed) {
+        ring->emptywaits++;
     }
-    else if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmEndTxn failed");
-        return(0);
+    while(ring->count == 0 && !ring->closed && !ring->aborted) {
+        pthread_cond_wait(&ring->cond, &ring->mutex);
+    }
+    if(ring->count > 0 && !ring->aborted) {
+        buf = ring->mem + ring->tail * ring->stride;
+        *len = ring->len[ring->tail];
     }
+    pthread_mutex_unlock(&ring->mutex);
 
-    return 1;
+    return buf;
 }
 
-/* Typedef for the callback used in tsm_queryfile() */
-/* Returns: -1 upon error condition, application should exit.
- *           0 if tsm_queryfile() should skip processing the remaining
- *             matches.
- *           1 otherwise.
- */
-typedef int (*tsm_query_callback)(dsmQueryType, DataBlk *, void *);
 
+void ring_release(struct tsm_ring *ring) {
+    pthread_mutex_lock(&ring->mutex);
+    ring->tail = (ring->tail + 1) % ring->nslots;
+    ring->count--;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+}
 
-dsInt16_t tsm_queryfile(dsUint32_t sesshandle, dsmObjName *objName, 
-                        char *description, dsmSendType sendtype, char verbose,
-                        tsm_query_callback usercb, void * userdata)
-{
-    dsmQueryType        qType;
-    qryArchiveData      qaData;
-    qryRespArchiveData  qaResp;
-    qryBackupData       qbData;
-    qryRespBackupData   qbResp;
-    dsmQueryBuff        *qDataP;
-    DataBlk             qResp;
-    dsInt16_t           rc;
 
-    qResp.stVersion = DataBlkVersion;
+void ring_abort(struct tsm_ring *ring, int err) {
+    pthread_mutex_lock(&ring->mutex);
+    ring->aborted = 1;
+    if(err) {
+        ring->err = err;
+    }
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+}
 
-    if(verbose > 1) {
-        fprintf(stderr, "tsmpipe: Query file %s%s%s\n",
-                objName->fs, objName->hl, objName->ll);
+
+void ring_report(struct tsm_ring *ring, const char *what) {
+    fprintf(stderr, "tsmpipe: %s ring: %d x %lu bytes%s, high-water mark "
+            "%d (%d%%)\n", what, ring->nslots, (unsigned long) ring->slotsize,
+            ring->hugepages?" in huge pages":"", ring->highwater,
+            ring->highwater * 100 / ring->nslots);
+    fprintf(stderr, "tsmpipe: %s ring: producer waited %lu times, "
+            "consumer waited %lu times\n", what, ring->fullwaits,
+            ring->emptywaits);
+    if(ring->splicebytes) {
+        fprintf(stderr, "tsmpipe: %s ring: %lld bytes spliced into the "
+                "pipe\n", what, (long long) ring->splicebytes);
+    }
+    if(ring->directbytes) {
+        fprintf(stderr, "tsmpipe: %s ring: %lld bytes written with "
+                "O_DIRECT\n", what, (long long) ring->directbytes);
     }
+    if(ring->holebytes) {
+        fprintf(stderr, "tsmpipe: %s ring: %lld bytes of zeroes left as "
+                "holes\n", what, (long long) ring->holebytes);
+    }
+}
 
-    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
-        qType               = qtArchive;
 
-        qaData.stVersion    = qryArchiveDataVersion;
-        qaData.objName      = objName;
-        qaData.owner        = "";
-        qaData.insDateLowerBound.year = DATE_MINUS_INFINITE;
-        qaData.insDateUpperBound.year = DATE_PLUS_INFINITE;
-        qaData.expDateLowerBound.year = DATE_MINUS_INFINITE;
-        qaData.expDateUpperBound.year = DATE_PLUS_INFINITE;
-        qaData.descr        = description?description:"*";
+/* Leave the signals to the main thread, where the TSM api expects them */
+void block_signals(void) {
+    sigset_t set;
 
-        qDataP              = &qaData;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
 
-        qaResp.stVersion    = qryRespArchiveDataVersion;
 
-        qResp.bufferPtr     = (char *) &qaResp;
-        qResp.bufferLen     = sizeof(qaResp);
+/*
+ * Input from a file or block device, -i, instead of stdin. With direct it
+ * is opened with O_DIRECT if possible, for callers that keep the reads
+ * aligned, otherwise it gets sequential readahead and ring_input() drops
+ * what was read from the page cache. Returns the fd and its size in
+ * length, or -1.
+ */
+int input_open(const char *path, int direct, off_t *length) {
+    struct stat st;
+    int         fd = -1;
+
+#ifdef O_DIRECT
+    if(direct) {
+        fd = open(path, O_RDONLY|O_DIRECT);
+    }
+#else
+    (void) direct;
+#endif
+    if(fd < 0) {
+        fd = open(path, O_RDONLY);
+    }
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", path, strerror(errno));
+        if(fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    if(S_ISREG(st.st_mode)) {
+        *length = st.st_size;
+    }
+    else if(S_ISBLK(st.st_mode)) {
+        *length = lseek(fd, 0, SEEK_END);
+        if(*length < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+            fprintf(stderr, "tsmpipe: %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
     }
     else {
-        qType               = qtBackup;
+        fprintf(stderr, "tsmpipe: %s: Not a regular file or block device\n",
+                path);
+        close(fd);
+        return -1;
+    }
 
-        qbData.stVersion    = qryBackupDataVersion;
-        qbData.objName      = objName;
-        qbData.owner        = "";
-        qbData.objState     = DSM_ACTIVE;
-        qbData.pitDate.year = DATE_MINUS_INFINITE;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-        qDataP              = &qbData;
+    return fd;
+}
 
-        qbResp.stVersion    = qryRespBackupDataVersion;
 
-        qResp.bufferPtr     = (char *) &qbResp;
-        qResp.bufferLen     = sizeof(qbResp);
-    }
+/* Drop input we are done with from the page cache */
+void input_drop(int fd, off_t offset, off_t len) {
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+#else
+    (void) fd;
+    (void) offset;
+    (void) len;
+#endif
+}
 
-    rc = dsmBeginQuery(sesshandle, qType, qDataP);
-    if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmBeginQuery failed");
-        return rc;
+
+/*
+ * Set up tsm_reader() for ring->fd, after ring_reset(). An O_DIRECT fd
+ * gets its fill aligned, a file or block device read through the page
+ * cache is dropped from it as we go.
+ */
+void ring_input(struct tsm_ring *ring, char verbose) {
+    struct stat st;
+    int         flags;
+
+    flags = fcntl(ring->fd, F_GETFL);
+#ifdef O_DIRECT
+    if(flags >= 0 && (flags & O_DIRECT) && ring->slotsize >= DIRECT_ALIGN) {
+        ring->align = DIRECT_ALIGN;
+        if(verbose > 1) {
+            fprintf(stderr, "tsmpipe: Reading input with O_DIRECT\n");
+        }
+        return;
+    }
+#endif
+    if(flags < 0 || fstat(ring->fd, &st) < 0 ||
+            !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+    {
+        return;
     }
+    if(ring->inleft < 0) {
+        ring->inpos = lseek(ring->fd, 0, SEEK_CUR);
+        if(ring->inpos < 0) {
+            return;
+        }
+    }
+    ring->dropcache = 1;
+    if(verbose > 1) {
+        fprintf(stderr, "tsmpipe: Dropping input from the page cache\n");
+    }
+}
 
-    /* Loop and apply our callback to the result */
-    while((rc = dsmGetNextQObj(sesshandle, &qResp)) == DSM_RC_MORE_DATA) {
-        int cbret;
 
-        if(verbose > 1) {
-            dsmObjName *rObjName;
-            
-            if(qType == qtArchive) {
-                qryRespArchiveData *qr = (void *) qResp.bufferPtr;
-                rObjName = &(qr->objName);
+/*
+ * Reader thread for tsm_sendfile(): stdin or -i input -> ring
+ *
+ * Cancellation is only allowed while blocked on the input, see
+ * stop_helper().
+ */
+void *tsm_reader(void *arg) {
+    struct tsm_ring *ring = arg;
+    char            *buf;
+    size_t          fill;
+    ssize_t         nbytes;
+    double          t;
+
+    block_signals();
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while(ring->inleft != 0 && (buf = ring_getfree(ring, &fill)) != NULL) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        t = timenow();
+        if(ring->inleft > 0) {
+            /* Rounded up for O_DIRECT, the excess is ignored */
+            if((off_t) fill > ring->inleft) {
+                fill = (ring->inleft + ring->align - 1) / ring->align *
+                       ring->align;
             }
-            else if(qType == qtBackup) {
-                qryRespBackupData *qr = (void *) qResp.bufferPtr;
-                rObjName = &(qr->objName);
+            nbytes = pread_full(ring->fd, buf, fill, ring->inpos);
+            if(nbytes > ring->inleft) {
+                nbytes = ring->inleft;
             }
-            else {
-                fprintf(stderr,
-                        "tsm_queryfile: Internal error: Unknown qType %d\n",
+        }
+        else {
+            nbytes = read_full(ring->fd, buf, fill);
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        stats_add(stat_input, t, nbytes > 0 ? nbytes : 0);
+        if(nbytes >= 0 && daemon_hungup()) {
+            nbytes = -1;
+            errno = EPIPE;
+        }
+        if(nbytes < 0) {
+            ring_close(ring, errno);
+            return NULL;
+        }
+        else if(nbytes == 0) {
+            break;
+        }
+        if(ring->dropcache) {
+            input_drop(ring->fd, ring->inpos, nbytes);
+        }
+        if(ring->inleft > 0) {
+            ring->inleft -= nbytes;
+        }
+        ring->inpos += nbytes;
+        ring_put(ring, nbytes);
+    }
+    ring_close(ring, 0);
+
+    return NULL;
+}
+
+
+/*
+ * Zero detection, for the sparse codec and for leaving holes in the output
+ * with ring_sparse(). Done in SPARSE_CHUNK pieces, the usual filesystem
+ * block size. With GCC the vector extensions give SSE2 code, and AVX2 code
+ * picked at runtime when the CPU has it.
+ */
+#define SPARSE_CHUNK    4096
+
+int             (*zero_fn)(const char *, size_t);
+pthread_once_t  zero_once = PTHREAD_ONCE_INIT;
+
+
+int zero_sw(const char *p, size_t len) {
+    unsigned long   w;
+
+    while(len >= sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+        if(w != 0) {
+            return 0;
+        }
+        p += sizeof(w);
+        len -= sizeof(w);
+    }
+    while(len-- > 0) {
+        if(*p++ != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+#ifdef __GNUC__
+typedef unsigned long long zero_vec __attribute__((vector_size(32)));
+
+int zero_vec128(const char *p, size_t len) {
+    zero_vec    acc, v;
+    int         i;
+
+    for(; len >= 256; p += 256, len -= 256) {
+        memcpy(&acc, p, 32);
+        for(i = 32; i < 256; i += 32) {
+            memcpy(&v, p + i, 32);
+            acc |= v;
+        }
+        if((acc[0] | acc[1] | acc[2] | acc[3]) != 0) {
+            return 0;
+        }
+    }
+
+    return zero_sw(p, len);
+}
+
+#ifdef __x86_64__
+__attribute__((target("avx2")))
+int zero_avx2(const char *p, size_t len) {
+    zero_vec    acc, v;
+    int         i;
+
+    for(; len >= 256; p += 256, len -= 256) {
+        memcpy(&acc, p, 32);
+        for(i = 32; i < 256; i += 32) {
+            memcpy(&v, p + i, 32);
+            acc |= v;
+        }
+        if((acc[0] | acc[1] | acc[2] | acc[3]) != 0) {
+            return 0;
+        }
+    }
+
+    return zero_sw(p, len);
+}
+#endif
+#endif /* __GNUC__ */
+
+
+void zero_init(void) {
+#ifdef __GNUC__
+    zero_fn = zero_vec128;
+#else
+    zero_fn = zero_sw;
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        zero_fn = zero_avx2;
+    }
+#endif
+}
+
+
+/* Returns 1 if the len bytes at buf are all zero */
+int is_zero(const char *buf, size_t len) {
+    pthread_once(&zero_once, zero_init);
+
+    return zero_fn(buf, len);
+}
+
+
+/*
+ * Leave zeroes written by tsm_writer() to the regular file ring->fd as
+ * holes instead, for objects stored with -z sparse. Whole SPARSE_CHUNKs of
+ * zeroes are skipped with lseek(), and where the file already had data,
+ * punched out with fallocate(). Returns 0 if fd isn't suitable, the caller
+ * then uses ring_output().
+ */
+int ring_sparse(struct tsm_ring *ring, char verbose) {
+    struct stat st;
+    int         flags;
+
+    if(fstat(ring->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    flags = fcntl(ring->fd, F_GETFL);
+    ring->outbase = lseek(ring->fd, 0, SEEK_CUR);
+    if(flags < 0 || (flags & O_APPEND) || ring->outbase < 0) {
+        return 0;
+    }
+    ring->oldsize = st.st_size;
+    ring->outmode = outmode_sparse;
+    if(verbose > 1) {
+        fprintf(stderr, "tsmpipe: Restoring zeroes as holes\n");
+    }
+
+    return 1;
+}
+
+
+/* Write len bytes of zeroes at buf as a hole. Returns -1 on failure. */
+int ring_hole(struct tsm_ring *ring, const char *buf, size_t len) {
+    off_t   pos = ring->outbase + ring->outpos;
+    int     punched = 0;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    punched = fallocate(ring->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                        pos, len) == 0;
+#endif
+    if(!punched && pos < ring->oldsize) {
+        /* Can't punch, overwrite what was there */
+        return write_full(ring->fd, buf, len) < 0 ? -1 : 0;
+    }
+    if(lseek(ring->fd, len, SEEK_CUR) < 0) {
+        return -1;
+    }
+    ring->holebytes += len;
+
+    return 0;
+}
+
+
+/* ring_out() for outmode_sparse, writing runs of data and holes */
+int ring_outsparse(struct tsm_ring *ring, char *buf, size_t len) {
+    size_t  off, run, n;
+    int     zero, runzero = 0;
+
+    for(off = 0, run = 0; off < len; off += n) {
+        n = len - off < SPARSE_CHUNK ? len - off : SPARSE_CHUNK;
+        zero = is_zero(buf + off, n);
+        if(run > 0 && zero != runzero) {
+            if(runzero ? ring_hole(ring, buf + off - run, run) < 0 :
+                         write_full(ring->fd, buf + off - run, run) < 0)
+            {
+                return -1;
+            }
+            ring->outpos += run;
+            run = 0;
+        }
+        runzero = zero;
+        run += n;
+    }
+    if(run > 0) {
+        if(runzero ? ring_hole(ring, buf + len - run, run) < 0 :
+                     write_full(ring->fd, buf + len - run, run) < 0)
+        {
+            return -1;
+        }
+        ring->outpos += run;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Zero copy output on Linux, set up by the producer before starting
+ * tsm_writer() on ring->fd.
+ *
+ * A pipe gets the pages of the ring with vmsplice(). The pipe keeps
+ * referencing them until the data is consumed (or longer, if it is spliced
+ * on), so the slot gets fresh pages with MADV_DONTNEED afterwards instead
+ * of being overwritten.
+ *
+ * A regular file is written with O_DIRECT through a second open of it, at
+ * the offset where fd is, and fd is moved past the data when done. The
+ * fill is kept DIRECT_ALIGN aligned, and at the first unaligned write (the
+ * end, normally) we go back to plain writes.
+ *
+ * Anything else, huge pages, or not being on Linux uses write().
+ */
+void ring_output(struct tsm_ring *ring, char verbose) {
+#if defined(SPLICE_F_GIFT) && defined(O_DIRECT) && defined(MADV_DONTNEED)
+    struct stat st;
+    char        path[64];
+    int         flags;
+
+    if(fstat(ring->fd, &st) < 0) {
+        return;
+    }
+    if(S_ISFIFO(st.st_mode) && !ring->hugepages) {
+        ring->outmode = outmode_vmsplice;
+    }
+    else if(S_ISREG(st.st_mode)) {
+        flags = fcntl(ring->fd, F_GETFL);
+        ring->outbase = lseek(ring->fd, 0, SEEK_CUR);
+        if(flags < 0 || (flags & O_APPEND) || ring->outbase < 0 ||
+                ring->outbase % DIRECT_ALIGN != 0 ||
+                ring->slotsize < DIRECT_ALIGN)
+        {
+            return;
+        }
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", ring->fd);
+        ring->directfd = open(path, O_WRONLY|O_DIRECT);
+        if(ring->directfd < 0) {
+            if(verbose > 1) {
+                fprintf(stderr, "tsmpipe: No O_DIRECT output: %s\n",
+                        strerror(errno));
+            }
+            return;
+        }
+        ring->outmode = outmode_direct;
+        ring->align = DIRECT_ALIGN;
+    }
+#else
+    (void) ring;
+    (void) verbose;
+#endif
+}
+
+
+/* Write a slot for tsm_writer(). Returns -1 on failure. */
+int ring_out(struct tsm_ring *ring, char *buf, size_t len) {
+#if defined(SPLICE_F_GIFT) && defined(O_DIRECT) && defined(MADV_DONTNEED)
+    struct iovec    iov;
+    struct pollfd   pfd;
+    ssize_t         n;
+    long            pagesize;
+#endif
+
+    if(ring->sink) {
+        if(ring->sink(ring->sinkarg, buf, len) < 0) {
+            return -1;
+        }
+        ring->outpos += len;
+        return 0;
+    }
+    if(ring->outmode == outmode_sparse) {
+        return ring_outsparse(ring, buf, len);
+    }
+
+#if defined(SPLICE_F_GIFT) && defined(O_DIRECT) && defined(MADV_DONTNEED)
+    if(ring->outmode == outmode_vmsplice) {
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        while(iov.iov_len > 0) {
+            n = vmsplice(ring->fd, &iov, 1, SPLICE_F_GIFT|SPLICE_F_NONBLOCK);
+            if(n < 0 && errno == EAGAIN) {
+                /* Wait in poll(), where we can be cancelled */
+                pfd.fd = ring->fd;
+                pfd.events = POLLOUT;
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            else if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            else if(n < 0 && ring->outpos == 0 && iov.iov_len == len &&
+                    (errno == EINVAL || errno == ENOSYS))
+            {
+                /* Not a pipe after all, or no vmsplice */
+                ring->outmode = outmode_write;
+                break;
+            }
+            else if(n < 0) {
+                return -1;
+            }
+            iov.iov_base = (char *) iov.iov_base + n;
+            iov.iov_len -= n;
+        }
+        if(ring->outmode == outmode_vmsplice) {
+            pagesize = sysconf(_SC_PAGESIZE);
+            madvise(buf, (len + pagesize - 1) & ~(pagesize - 1),
+                    MADV_DONTNEED);
+            ring->outpos += len;
+            ring->splicebytes += len;
+            return 0;
+        }
+    }
+    else if(ring->outmode == outmode_direct) {
+        if(len % DIRECT_ALIGN == 0) {
+            if(pwrite_full(ring->directfd, buf, len,
+                           ring->outbase + ring->outpos) >= 0)
+            {
+                ring->outpos += len;
+                ring->directbytes += len;
+                return 0;
+            }
+            if(ring->outpos > 0 || errno != EINVAL) {
+                return -1;
+            }
+        }
+        /* Unaligned, the rest goes through the page cache */
+        close(ring->directfd);
+        ring->directfd = -1;
+        ring->outmode = outmode_write;
+        if(lseek(ring->fd, ring->outbase + ring->outpos, SEEK_SET) < 0) {
+            return -1;
+        }
+    }
+#endif
+
+    if(write_full(ring->fd, buf, len) < 0) {
+        return -1;
+    }
+    ring->outpos += len;
+
+    return 0;
+}
+
+
+/* Finish the output after the last ring_out() */
+void ring_outdone(struct tsm_ring *ring) {
+    struct stat st;
+
+    if(ring->outmode == outmode_sparse) {
+        /* A hole at the end needs the file extended over it */
+        if(fstat(ring->fd, &st) < 0 ||
+                (st.st_size < ring->outbase + ring->outpos &&
+                 ftruncate(ring->fd, ring->outbase + ring->outpos) < 0))
+        {
+            ring_abort(ring, errno);
+        }
+    }
+    else if(ring->outmode == outmode_direct) {
+        /* Leave fd where plain writes would have */
+        close(ring->directfd);
+        ring->directfd = -1;
+        if(lseek(ring->fd, ring->outbase + ring->outpos, SEEK_SET) < 0) {
+            ring_abort(ring, errno);
+        }
+    }
+}
+
+
+/* Writer thread for tsm_restorefile(): ring -> fd */
+void *tsm_writer(void *arg) {
+    struct tsm_ring *ring = arg;
+    char            *buf;
+    size_t          nbytes;
+    double          t;
+
+    block_signals();
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while((buf = ring_getfull(ring, &nbytes)) != NULL) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        t = timenow();
+        if(ring_out(ring, buf, nbytes) < 0) {
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            ring_abort(ring, errno);
+            return NULL;
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        stats_add(stat_output, t, nbytes);
+        ring_release(ring);
+    }
+    ring_outdone(ring);
+
+    return NULL;
+}
+
+
+/*
+ * Preallocate length bytes at the end of a regular output file, so a large
+ * restore gets its blocks in one go. The file size isn't changed, as the
+ * length may be an estimate. Returns where the preallocation ends, to give
+ * to output_trim() when done, or 0 if nothing was preallocated.
+ */
+off_t output_prealloc(int fd, off_t length, char verbose) {
+#ifdef FALLOC_FL_KEEP_SIZE
+    struct stat st;
+    off_t       pos;
+
+    if(length <= 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+            (fcntl(fd, F_GETFL) & O_APPEND))
+    {
+        return 0;
+    }
+    /* Only when writing at the end, so we don't trim away anything */
+    pos = lseek(fd, 0, SEEK_CUR);
+    if(pos < 0 || pos != st.st_size) {
+        return 0;
+    }
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, pos, length) < 0) {
+        if(verbose > 1) {
+            fprintf(stderr, "tsmpipe: Unable to preallocate output: %s\n",
+                    strerror(errno));
+        }
+        return 0;
+    }
+    if(verbose > 1) {
+        fprintf(stderr, "tsmpipe: Preallocated %lld bytes of output\n",
+                (long long) length);
+    }
+
+    return pos + length;
+#else
+    (void) fd;
+    (void) length;
+    (void) verbose;
+
+    return 0;
+#endif
+}
+
+
+/*
+ * Free what output_prealloc() allocated beyond the end of the data. Blocks
+ * past the end of the file are freed by truncating it to its own size,
+ * punching a hole there doesn't work on all filesystems.
+ */
+void output_trim(int fd, off_t end) {
+#ifdef FALLOC_FL_KEEP_SIZE
+    struct stat st;
+    off_t       pos;
+
+    pos = lseek(fd, 0, SEEK_CUR);
+    if(end > 0 && pos >= 0 && pos < end && fstat(fd, &st) == 0 &&
+            st.st_size == pos && ftruncate(fd, pos) < 0)
+    {
+        fprintf(stderr, "tsmpipe: Unable to trim preallocated output: %s\n",
+                strerror(errno));
+    }
+#else
+    (void) fd;
+    (void) end;
+#endif
+}
+
+
+/* Stop a helper thread when the TSM side has failed */
+void stop_helper(struct tsm_ring *ring, pthread_t thread) {
+    ring_abort(ring, 0);
+    pthread_cancel(thread);
+    pthread_join(thread, NULL);
+}
+
+
+/*
+ * Buffer size tuning for -a. Every ADAPT_INTERVAL seconds the throughput
+ * is compared to the previous interval. The buffer size keeps moving in the
+ * same direction (doubling or halving the TCPBUFFSIZE multiple) as long as
+ * that helps, otherwise it turns around.
+ */
+struct tsm_adapt {
+    size_t              unit;
+    int                 n;
+    int                 maxn;
+    int                 grow;
+    double              start;
+    double              lastrate;
+    unsigned long long  bytes;
+};
+
+
+void adapt_init(struct tsm_adapt *ad, tsmpipe_xfer_t *xfer) {
+    ad->unit = xfer->tcpbuff;
+    ad->n = (xfer->bufsize + 4) / ad->unit;
+    if(ad->n < 1) {
+        ad->n = 1;
+    }
+    ad->maxn = (xfer->slotsize + 4) / ad->unit;
+    if(ad->maxn < ad->n) {
+        ad->maxn = ad->n;
+    }
+    ad->grow = 1;
+    ad->start = timenow();
+    ad->lastrate = 0;
+    ad->bytes = 0;
+}
+
+
+size_t adapt_size(struct tsm_adapt *ad) {
+    return ad->n * ad->unit - 4;
+}
+
+
+/* Returns 1 if the buffer size was changed */
+int adapt_update(struct tsm_adapt *ad, size_t nbytes, char verbose) {
+    double  now, rate;
+    int     oldn = ad->n;
+
+    ad->bytes += nbytes;
+    now = timenow();
+    if(now - ad->start < ADAPT_INTERVAL) {
+        return 0;
+    }
+
+    rate = ad->bytes / (now - ad->start);
+    if(rate < ad->lastrate) {
+        ad->grow = !ad->grow;
+    }
+    if(ad->grow) {
+        ad->n = ad->n * 2 > ad->maxn ? ad->maxn : ad->n * 2;
+    }
+    else {
+        ad->n = ad->n / 2 < 1 ? 1 : ad->n / 2;
+    }
+    if(ad->n == oldn) {
+        /* Hit a limit, try the other way next time */
+        ad->grow = !ad->grow;
+    }
+
+    if(verbose > 1) {
+        fprintf(stderr, "tsmpipe: %.1f MB/s with %lu byte buffers, "
+                "now using %lu\n", rate / (1024*1024),
+                (unsigned long) (oldn * ad->unit - 4),
+                (unsigned long) adapt_size(ad));
+    }
+
+    ad->lastrate = rate;
+    ad->start = now;
+    ad->bytes = 0;
+
+    return ad->n != oldn;
+}
+
+
+/* Try to enlarge a pipe to hide latency in the process feeding us */
+void set_pipesize(int fd, int size, char verbose) {
+#ifdef F_SETPIPE_SZ
+    struct stat st;
+
+    if(fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+        return;
+    }
+    if(fcntl(fd, F_SETPIPE_SZ, size) < 0 && verbose > 1) {
+        fprintf(stderr, "tsmpipe: Unable to set pipe size to %d: %s\n",
+                size, strerror(errno));
+    }
+#else
+    (void) fd;
+    (void) size;
+    (void) verbose;
+#endif
+}
+
+
+int tsm_checkapi(void) {
+    dsmApiVersionEx     apiLibVer;
+    dsUint32_t          apiVersion;
+    dsUint32_t          applVersion = (10000 * DSM_API_VERSION) + 
+                                      (1000 * DSM_API_RELEASE) + 
+                                      (100 * DSM_API_LEVEL) + DSM_API_SUBLEVEL;
+
+    memset(&apiLibVer, 0, sizeof(apiLibVer));
+    apiLibVer.stVersion = apiVersionExVer;
+    dsmQueryApiVersionEx(&apiLibVer);
+
+    apiVersion = (10000 * apiLibVer.version) + (1000 * apiLibVer.release) + 
+                 (100 * apiLibVer.level) + apiLibVer.subLevel;
+
+    if (apiVersion < applVersion)
+    { 
+        printf("The Tivoli Storage Manager API library Version = %d.%d.%d.%d "
+                "is at a lower version\n",
+                apiLibVer.version,
+                apiLibVer.release,
+                apiLibVer.level,
+                apiLibVer.subLevel);
+        printf("than the application version = %d.%d.%d.%d.\n",
+                DSM_API_VERSION,
+                DSM_API_RELEASE,
+                DSM_API_LEVEL,
+                DSM_API_SUBLEVEL);
+        printf("Please upgrade the API accordingly.\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+void tsm_printerr(dsUint32_t sesshandle, dsInt16_t rc, char *str) {
+    char                rcStr[DSM_MAX_RC_MSG_LENGTH];
+
+    if(rc == DSM_RC_WILL_ABORT) {
+        dsUint16_t reason;
+
+        rc = dsmEndTxn(sesshandle, DSM_VOTE_COMMIT, &reason);
+        if(rc == DSM_RC_CHECK_REASON_CODE) {
+            rc = reason;
+        }
+    }
+
+    dsmRCMsg(sesshandle, rc, rcStr);
+    fprintf(stderr, "tsmpipe: %s\n"
+                    "        rc=%s\n", str, rcStr);
+}
+
+
+/* Sessions are used from several threads with -S */
+int tsm_setup(void) {
+    dsInt16_t   rc;
+
+    rc = dsmSetUp(DSM_MULTITHREAD, NULL);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(0, rc, "dsmSetUp failed");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+dsUint32_t tsm_initsess(char *options) {
+    dsmApiVersionEx     applApi;
+    dsUint32_t          sesshandle = 0;
+    dsmInitExIn_t       initIn;
+    dsmInitExOut_t      initOut;
+    dsInt16_t           rc;
+    double              t = timenow();
+
+    memset(&applApi, 0, sizeof(applApi));
+    applApi.version  = DSM_API_VERSION;
+    applApi.release  = DSM_API_RELEASE;
+    applApi.level    = DSM_API_LEVEL  ;
+    applApi.subLevel = DSM_API_SUBLEVEL;
+
+    memset(&initIn, 0, sizeof(initIn));
+    initIn.stVersion        = dsmInitExInVersion;
+    initIn.apiVersionExP    = &applApi;
+    initIn.clientNodeNameP  = NULL;
+    initIn.clientOwnerNameP = NULL;
+    initIn.clientPasswordP  = NULL;
+    initIn.applicationTypeP = NULL;
+    initIn.configfile       = NULL;
+    initIn.options          = options;
+    initIn.userNameP        = NULL;
+    initIn.userPasswordP    = NULL;
+
+    memset(&initOut, 0, sizeof(initOut));
+
+    rc = dsmInitEx(&sesshandle, &initIn, &initOut);
+    stats_add(stat_session, t, 0);
+    if(rc == DSM_RC_REJECT_VERIFIER_EXPIRED) {
+        rc = dsmChangePW(sesshandle, NULL, NULL);
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmChangePW failed");
+            return 0;
+        }
+    }
+    else if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmInitEx failed");
+        dsmTerminate(sesshandle);
+        return 0;
+    }
+
+    return sesshandle;
+}
+
+
+/* Does key abbreviate option name opt, given its minimum abbreviation? */
+int optmatch(const char *key, size_t keylen, const char *opt, size_t minlen) {
+    return keylen >= minlen && keylen <= strlen(opt) &&
+           strncasecmp(key, opt, keylen) == 0;
+}
+
+
+/*
+ * Find the TCPBUFFSIZE in effect for the session, in bytes. Options given
+ * to dsmInitEx win over the server stanza in dsm.sys, like in the API.
+ */
+size_t tsm_tcpbuffsize(dsUint32_t sesshandle, char *options, char verbose) {
+    optStruct   opts;
+    dsInt16_t   rc;
+    char        path[DSM_PATH_MAX+DSM_NAME_MAX+16];
+    char        line[1024];
+    char        *p, *key, *val;
+    size_t      keylen;
+    FILE        *f;
+    long        kb = 0;
+    int         instanza = 0;
+
+    /* -O "-tcpbuffsize=512 ..." */
+    for(p = options; p && *p; ) {
+        while(isspace((unsigned char) *p)) {
+            p++;
+        }
+        key = *p == '-' ? p+1 : p;
+        keylen = strcspn(key, "= \t");
+        if(key[keylen] == '=' && optmatch(key, keylen, "tcpbuffsize", 4)) {
+            kb = atol(key+keylen+1);
+            if(verbose > 1) {
+                fprintf(stderr, "tsmpipe: TCPBUFFSIZE %ldkB from options\n", kb);
+            }
+        }
+        p += strcspn(p, " \t");
+    }
+
+    if(kb <= 0) {
+        memset(&opts, 0, sizeof(opts));
+        opts.stVersion = optStructVersion;
+        rc = dsmQuerySessOptions(sesshandle, &opts);
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmQuerySessOptions failed");
+            opts.dsmiDir[0] = '\0';
+        }
+        if(!opts.dsmiDir[0] && getenv("DSMI_DIR")) {
+            snprintf(opts.dsmiDir, sizeof(opts.dsmiDir), "%s",
+                     getenv("DSMI_DIR"));
+        }
+        snprintf(path, sizeof(path), "%s/dsm.sys", opts.dsmiDir);
+
+        f = fopen(path, "r");
+        if(f) {
+            while(fgets(line, sizeof(line), f)) {
+                key = line + strspn(line, " \t");
+                if(*key == '*' || *key == '#') {
+                    continue;
+                }
+                keylen = strcspn(key, " \t\r\n");
+                val = key + keylen;
+                val += strspn(val, " \t");
+                val[strcspn(val, " \t\r\n")] = '\0';
+                if(optmatch(key, keylen, "servername", 2)) {
+                    instanza = strcasecmp(val, opts.serverName) == 0;
+                }
+                else if(instanza && optmatch(key, keylen, "tcpbuffsize", 4)) {
+                    kb = atol(val);
+                }
+            }
+            fclose(f);
+            if(kb > 0 && verbose > 1) {
+                fprintf(stderr, "tsmpipe: TCPBUFFSIZE %ldkB from %s "
+                        "server %s\n", kb, path, opts.serverName);
+            }
+        }
+    }
+
+    if(kb <= 0) {
+        kb = DEF_TCPBUFFSIZE;
+    }
+
+    return kb * 1024;
+}
+
+
+int tsm_regfs(dsUint32_t sesshandle, char *fsname) {
+    regFSData       regFS;
+    dsInt16_t       rc;
+
+    memset(&regFS, 0, sizeof(regFS));
+
+    regFS.fsName = fsname;
+    regFS.fsType = "TSMPIPE";
+
+    rc = dsmRegisterFS(sesshandle, &regFS);
+    if(rc != DSM_RC_OK && rc != DSM_RC_FS_ALREADY_REGED) {
+        tsm_printerr(sesshandle, rc, "dsmRegisterFS failed");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+void tsm_name2obj(char *fsname, char *filename, dsmObjName *objName) {
+    char            *p;
+
+    /* fs == "/filesystem", hl == "/directory/path", ll == "/filename" */
+    strcpy(objName->fs, fsname);
+    *objName->hl = '\0';
+    *objName->ll = '\0';
+    p = strrchr(filename, '/');
+    if(p) {
+        *p = '\0';
+        if(*filename && *filename != '/') {
+            strcpy(objName->hl, "/");
+        }
+        strcat(objName->hl, filename);
+        sprintf(objName->ll, "/%s", p+1);
+        *p = '/';
+    }
+    else {
+        if(*filename && *filename != '/') {
+            strcpy(objName->ll, "/");
+        }
+        strcat(objName->ll, filename);
+    }
+    objName->objType = DSM_OBJ_FILE;
+}
+
+
+/*
+ * Commit or abort the current transaction. Returns 1 if committed, never
+ * for a daemon client that went away.
+ */
+int tsm_endtxn(dsUint32_t sesshandle, dsUint8_t vote) {
+    dsInt16_t       rc;
+    dsUint16_t      reason=0;
+    double          t = timenow();
+
+    if(vote == DSM_VOTE_COMMIT && daemon_hungup()) {
+        fprintf(stderr, "tsmpipe: The client went away, aborting the "
+                "transaction\n");
+        vote = DSM_VOTE_ABORT;
+    }
+
+    rc = dsmEndTxn(sesshandle, vote, &reason);
+    stats_add(stat_commit, t, 0);
+    if(vote != DSM_VOTE_COMMIT) {
+        return 0;
+    }
+    if(rc == DSM_RC_CHECK_REASON_CODE || 
+            (rc == DSM_RC_OK && reason != DSM_RC_OK))
+    {
+        tsm_printerr(sesshandle, reason, "dsmEndTxn failed, reason");
+        return(0);
+    }
+    else if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmEndTxn failed");
+        return(0);
+    }
+
+    return 1;
+}
+
+
+/*
+ * Like tsm_endtxn(), but also gives the objId of a group leader sent in
+ * the transaction.
+ */
+int tsm_endtxnex(dsUint32_t sesshandle, dsUint8_t vote, dsStruct64_t *leader)
+{
+    dsmEndTxnExIn_t     in;
+    dsmEndTxnExOut_t    out;
+    dsInt16_t           rc;
+    double              t = timenow();
+
+    if(vote == DSM_VOTE_COMMIT && daemon_hungup()) {
+        fprintf(stderr, "tsmpipe: The client went away, aborting the "
+                "transaction\n");
+        vote = DSM_VOTE_ABORT;
+    }
+
+    memset(&in, 0, sizeof(in));
+    in.stVersion = dsmEndTxnExInVersion;
+    in.dsmHandle = sesshandle;
+    in.vote = vote;
+    memset(&out, 0, sizeof(out));
+    out.stVersion = dsmEndTxnExOutVersion;
+
+    rc = dsmEndTxnEx(&in, &out);
+    stats_add(stat_commit, t, 0);
+    if(vote != DSM_VOTE_COMMIT) {
+        return 0;
+    }
+    if(rc == DSM_RC_CHECK_REASON_CODE || 
+            (rc == DSM_RC_OK && out.reason != DSM_RC_OK))
+    {
+        tsm_printerr(sesshandle, out.reason, "dsmEndTxnEx failed, reason");
+        return(0);
+    }
+    else if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmEndTxnEx failed");
+        return(0);
+    }
+    *leader = out.groupLeaderObjId;
+
+    return 1;
+}
+
+
+/*
+ * Peer group action within the current transaction. leader is the group
+ * leader, NULL when opening a group with the next object as its leader.
+ */
+int tsm_group(dsUint32_t sesshandle, dsUint8_t action, dsUint8_t member,
+              dsStruct64_t *leader, char *tag, dsmObjName *objName)
+{
+    dsmGroupHandlerIn_t     in;
+    dsmGroupHandlerExOut_t  out;
+    dsInt16_t               rc;
+
+    memset(&in, 0, sizeof(in));
+    in.stVersion = dsmGroupHandlerInVersion;
+    in.dsmHandle = sesshandle;
+    in.groupType = DSM_GROUPTYPE_PEER;
+    in.actionType = action;
+    in.memberType = member;
+    if(leader) {
+        in.leaderObjId = *leader;
+    }
+    in.uniqueGroupTagP = tag;
+    in.objNameP = objName;
+    memset(&out, 0, sizeof(out));
+    out.stVersion = dsmGroupHandlerExOutVersion;
+
+    rc = dsmGroupHandler(&in, &out);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmGroupHandler failed");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * The objInfo of objects we store is "tsmpipe" followed by key=value
+ * pairs, e.g. "tsmpipe codec=zlib block=1048576".
+ */
+#define OBJINFO_MAGIC   "tsmpipe"
+
+
+/* Append key=value to the objInfo in buf. Returns 0 if it doesn't fit. */
+int objinfo_add(char *buf, size_t size, const char *key, const char *value) {
+    size_t  len;
+    int     n;
+
+    if(*buf == '\0') {
+        snprintf(buf, size, "%s", OBJINFO_MAGIC);
+    }
+    len = strlen(buf);
+    n = snprintf(buf + len, size - len, " %s=%s", key, value);
+    if(n < 0 || (size_t) n >= size - len) {
+        buf[len] = '\0';
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Look up key in an objInfo as returned by a query (not NUL terminated).
+ * Returns 0 if it isn't there.
+ */
+int objinfo_get(const char *info, int infolen, const char *key, char *value,
+                size_t size)
+{
+    char    buf[DSM_MAX_OBJINFO_LENGTH + 1];
+    char    *tok, *save = NULL;
+    size_t  keylen = strlen(key);
+
+    memcpy(buf, info, infolen);
+    buf[infolen] = '\0';
+
+    tok = strtok_r(buf, " ", &save);
+    if(tok == NULL || strcmp(tok, OBJINFO_MAGIC) != 0) {
+        return 0;
+    }
+    while((tok = strtok_r(NULL, " ", &save)) != NULL) {
+        if(strncmp(tok, key, keylen) == 0 && tok[keylen] == '=') {
+            snprintf(value, size, "%s", tok + keylen + 1);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * The length of the data, before compression and encryption, when the
+ * sender knows it up front. tsm_sendobj() fails if it gets another amount,
+ * so -X can give the member size without getting the object first.
+ */
+int objinfo_addrawlen(char *buf, size_t size, off_t length) {
+    char    num[32];
+
+    snprintf(num, sizeof(num), "%lld", (long long) length);
+
+    return objinfo_add(buf, size, "rawlen", num);
+}
+
+
+/* Returns the rawlen of an objInfo from a query, -1 if it has none */
+off_t objinfo_rawlen(const char *info, int infolen) {
+    char        val[DSM_MAX_OBJINFO_LENGTH + 1];
+    long long   len;
+    char        *end;
+
+    if(!objinfo_get(info, infolen, "rawlen", val, sizeof(val))) {
+        return -1;
+    }
+    len = strtoll(val, &end, 10);
+
+    return end == val || *end != '\0' || len < 0 ? -1 : len;
+}
+
+
+/*
+ * Checksums, -k. The data is checksummed with CRC32C as it is sent, using
+ * the SSE4.2 crc32 instruction when the CPU has it. The exact size and the
+ * checksum go in the objInfo of a small companion object, named after the
+ * object with SUM_SUFFIX appended and stored in the same transaction. The
+ * object gets "sum=<id>" in its objInfo and the companion "sumof=<id>",
+ * which pairs them up among versions and duplicates. Striped objects have
+ * the checksum in the descriptor object instead.
+ */
+#define SUM_SUFFIX      ".tsmsum"
+
+/* Reflected CRC32C (Castagnoli) polynomial */
+#define CRC32C_POLY     0x82F63B78U
+
+struct tsm_sum {
+    int         valid;
+    off_t       size;
+    dsUint32_t  crc;
+};
+
+dsUint32_t      crc32c_table[8][256];
+dsUint32_t      (*crc32c_fn)(dsUint32_t, const unsigned char *, size_t);
+pthread_once_t  crc32c_once = PTHREAD_ONCE_INIT;
+
+
+/* Slicing-by-8 */
+dsUint32_t crc32c_sw(dsUint32_t crc, const unsigned char *p, size_t len) {
+    dsUint32_t  (*t)[256] = crc32c_table;
+
+    while(len > 0 && ((unsigned long) p & 7) != 0) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while(len >= 8) {
+        crc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((dsUint32_t) p[3] << 24);
+        crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^
+              t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24] ^
+              t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while(len-- > 0) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+dsUint32_t crc32c_sse42(dsUint32_t crc, const unsigned char *p, size_t len) {
+    unsigned long long  c = crc, v;
+
+    while(len > 0 && ((unsigned long) p & 7) != 0) {
+        c = __builtin_ia32_crc32qi(c, *p++);
+        len--;
+    }
+    while(len >= 8) {
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while(len-- > 0) {
+        c = __builtin_ia32_crc32qi(c, *p++);
+    }
+
+    return c;
+}
+#endif
+
+
+void crc32c_init(void) {
+    dsUint32_t  c;
+    int         i, j;
+
+    for(i = 0; i < 256; i++) {
+        c = i;
+        for(j = 0; j < 8; j++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc32c_table[0][i] = c;
+    }
+    for(i = 0; i < 256; i++) {
+        c = crc32c_table[0][i];
+        for(j = 1; j < 8; j++) {
+            c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+            crc32c_table[j][i] = c;
+        }
+    }
+
+    crc32c_fn = crc32c_sw;
+#if defined(__GNUC__) && defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) {
+        crc32c_fn = crc32c_sse42;
+    }
+#endif
+}
+
+
+/* Continue the CRC32C crc (0 to start with) over len bytes of buf */
+dsUint32_t crc32c(dsUint32_t crc, const char *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+
+    return ~crc32c_fn(~crc, (const unsigned char *) buf, len);
+}
+
+
+void sum_add(struct tsm_sum *sum, const char *buf, size_t len) {
+    sum->crc = crc32c(sum->crc, buf, len);
+    sum->size += len;
+}
+
+
+/* Add the size and checksum to an objInfo */
+int sum_objinfo(char *info, size_t size, struct tsm_sum *sum) {
+    char    num[32];
+
+    snprintf(num, sizeof(num), "%lld", (long long) sum->size);
+    if(!objinfo_add(info, size, "size", num)) {
+        return 0;
+    }
+    snprintf(num, sizeof(num), "%08x", (unsigned int) sum->crc);
+
+    return objinfo_add(info, size, "crc32c", num);
+}
+
+
+/* Get the size and checksum from an objInfo. Returns 0 if there is none. */
+int sum_parse(const char *info, int infolen, struct tsm_sum *sum) {
+    char    val[DSM_MAX_OBJINFO_LENGTH + 1];
+
+    memset(sum, 0, sizeof(*sum));
+    if(!objinfo_get(info, infolen, "crc32c", val, sizeof(val))) {
+        return 0;
+    }
+    sum->crc = strtoul(val, NULL, 16);
+    /* Stripe descriptors already have the length */
+    if(!objinfo_get(info, infolen, "size", val, sizeof(val)) &&
+            !objinfo_get(info, infolen, "length", val, sizeof(val)))
+    {
+        return 0;
+    }
+    sum->size = strtoll(val, NULL, 10);
+    sum->valid = 1;
+
+    return 1;
+}
+
+
+/*
+ * Make an id for naming sub-objects or pairing objects. Unique enough
+ * within a node: time, pid and a sequence number after the first.
+ */
+void tsm_setid(char *buf, size_t len) {
+    static unsigned int seq;
+
+    if(seq == 0) {
+        snprintf(buf, len, "%lx.%lx", (unsigned long) time(NULL),
+                 (unsigned long) getpid());
+    }
+    else {
+        snprintf(buf, len, "%lx.%lx.%x", (unsigned long) time(NULL),
+                 (unsigned long) getpid(), seq);
+    }
+    seq++;
+}
+
+
+/*
+ * Returns 1 if the object with objinfo is stored as sub-objects, named
+ * after it with .id.NNN appended, and sets id. Those are the stripes or
+ * segments of their descriptor, or the containers of a pack index.
+ */
+int tsm_subid(const char *objinfo, int len, char *id, size_t idlen) {
+    char    val[DSM_MAX_OBJINFO_LENGTH + 1];
+
+    /* The containers carry the pack id too, only the index has this */
+    if(objinfo_get(objinfo, len, "containers", val, sizeof(val))) {
+        return objinfo_get(objinfo, len, "pack", id, idlen) && *id != '\0';
+    }
+    if(!objinfo_get(objinfo, len, "stripes", val, sizeof(val)) &&
+            !objinfo_get(objinfo, len, "segments", val, sizeof(val)))
+    {
+        return 0;
+    }
+
+    return objinfo_get(objinfo, len, "id", id, idlen) && *id != '\0';
+}
+
+
+/*
+ * Verification, -V. The data is checksummed and compared with a reference
+ * file, if there is one, by the writer thread instead of being written.
+ */
+struct tsm_verify {
+    struct tsm_sum  sum;        /* Of the data we got */
+    int             hasref;
+    int             reffd;
+    char            *ref;       /* The reference file, mapped */
+    off_t           reflen;
+    off_t           differs;    /* First offset differing from ref, or -1 */
+    struct tsm_ring *pass;      /* -X: the data goes on here too, */
+    off_t           passleft;   /* at most this much of it */
+};
+
+
+/* Set up v, comparing with the file reference if not NULL */
+int verify_init(struct tsm_verify *v, const char *reference) {
+    struct stat st;
+
+    memset(v, 0, sizeof(*v));
+    v->reffd = -1;
+    v->differs = -1;
+    if(reference == NULL) {
+        return 1;
+    }
+
+    v->reffd = open(reference, O_RDONLY);
+    if(v->reffd < 0 || fstat(v->reffd, &st) < 0) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", reference, strerror(errno));
+        if(v->reffd >= 0) {
+            close(v->reffd);
+        }
+        return 0;
+    }
+    v->hasref = 1;
+    v->reflen = st.st_size;
+    if(v->reflen > 0) {
+        v->ref = mmap(NULL, v->reflen, PROT_READ, MAP_SHARED, v->reffd, 0);
+        if(v->ref == MAP_FAILED) {
+            fprintf(stderr, "tsmpipe: mmap %s: %s\n", reference,
+                    strerror(errno));
+            close(v->reffd);
+            return 0;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(v->ref, v->reflen, MADV_SEQUENTIAL);
+#endif
+    }
+
+    return 1;
+}
+
+
+void verify_free(struct tsm_verify *v) {
+    if(v->ref != NULL) {
+        munmap(v->ref, v->reflen);
+    }
+    if(v->reffd >= 0) {
+        close(v->reffd);
+    }
+}
+
+
+/* Sink for the ring, see ring_out() */
+int verify_sink(void *arg, const char *buf, size_t len) {
+    struct tsm_verify   *v = arg;
+    off_t               pos = v->sum.size;
+    size_t              n = len, i;
+
+    if(v->hasref && v->differs < 0) {
+        if(pos + (off_t) n > v->reflen) {
+            n = pos < v->reflen ? v->reflen - pos : 0;
+        }
+        if(n > 0 && memcmp(v->ref + pos, buf, n) != 0) {
+            for(i = 0; v->ref[pos + i] == buf[i]; i++) {
+            }
+            v->differs = pos + i;
+        }
+        else if(n < len) {
+            v->differs = pos + n;
+        }
+    }
+    sum_add(&v->sum, buf, len);
+
+    if(v->pass) {
+        n = (off_t) len < v->passleft ? len : (size_t) v->passleft;
+        if(!ring_write(v->pass, buf, n)) {
+            errno = EPIPE;
+            return -1;
+        }
+        v->passleft -= n;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Compression, -z. The data is cut in blocks of xfer->zblock bytes that
+ * are compressed independently by a pool of threads (struct tsm_zpool),
+ * so the stored object is a sequence of frames:
+ *
+ *   raw length (4 bytes, big endian)
+ *   stored length (4 bytes, big endian, ZRAWBIT set if not compressed)
+ *   stored data
+ *
+ * Blocks that don't compress are stored as they are. The codec and block
+ * size go in the objInfo, which is how -x knows to decompress.
+ */
+
+/* Default compression block size */
+#define DEF_ZBLOCK      (1024*1024)
+
+/* Largest block size we accept in an objInfo */
+#define MAX_ZBLOCK      (64*1024*1024)
+
+/* Frame header size, and the flag for blocks stored uncompressed */
+#define ZHDRLEN         8
+#define ZRAWBIT         0x80000000U
+
+/*
+ * The first ZPROBE bytes of a block are compressed first; unless they
+ * shrink to at most ZPROBE_PCT percent the block is stored raw without
+ * trying the rest.
+ */
+#define ZPROBE          (16*1024)
+#define ZPROBE_PCT      97
+
+/* Limit for -j */
+#define MAX_ZTHREADS    64
+
+struct tsm_codec {
+    const char  *name;
+    int         deflevel;
+    int         minlevel;
+    int         maxlevel;
+    int         sparse;     /* Only elides zeroes, no ZPROBE, see below */
+    size_t      (*bound)(size_t len);
+    /* Both return the resulting length, 0 on failure */
+    size_t      (*compress)(const char *in, size_t inlen, char *out,
+                            size_t outlen, int level);
+    size_t      (*decompress)(const char *in, size_t inlen, char *out,
+                              size_t outlen);
+};
+
+#ifdef HAVE_ZLIB
+size_t zlib_bound(size_t len) {
+    return compressBound(len);
+}
+
+size_t zlib_compress(const char *in, size_t inlen, char *out, size_t outlen,
+                     int level)
+{
+    uLongf  n = outlen;
+
+    if(compress2((Bytef *) out, &n, (const Bytef *) in, inlen,
+                 level) != Z_OK)
+    {
+        return 0;
+    }
+
+    return n;
+}
+
+size_t zlib_decompress(const char *in, size_t inlen, char *out,
+                       size_t outlen)
+{
+    uLongf  n = outlen;
+
+    if(uncompress((Bytef *) out, &n, (const Bytef *) in, inlen) != Z_OK) {
+        return 0;
+    }
+
+    return n;
+}
+#endif /* HAVE_ZLIB */
+
+#ifdef HAVE_ZSTD
+size_t zstd_bound(size_t len) {
+    return ZSTD_compressBound(len);
+}
+
+size_t zstd_compress(const char *in, size_t inlen, char *out, size_t outlen,
+                     int level)
+{
+    size_t  n = ZSTD_compress(out, outlen, in, inlen, level);
+
+    return ZSTD_isError(n) ? 0 : n;
+}
+
+size_t zstd_decompress(const char *in, size_t inlen, char *out,
+                       size_t outlen)
+{
+    size_t  n = ZSTD_decompress(out, outlen, in, inlen);
+
+    return ZSTD_isError(n) ? 0 : n;
+}
+#endif /* HAVE_ZSTD */
+
+#ifdef HAVE_LZ4
+size_t lz4_bound(size_t len) {
+    return LZ4_compressBound(len);
+}
+
+/* The level is the LZ4 acceleration, higher is faster */
+size_t lz4_compress(const char *in, size_t inlen, char *out, size_t outlen,
+                    int level)
+{
+    int     n = LZ4_compress_fast(in, out, inlen, outlen, level);
+
+    return n > 0 ? n : 0;
+}
+
+size_t lz4_decompress(const char *in, size_t inlen, char *out,
+                      size_t outlen)
+{
+    int     n = LZ4_decompress_safe(in, out, inlen, outlen);
+
+    return n > 0 ? n : 0;
+}
+#endif /* HAVE_LZ4 */
+
+/*
+ * The sparse codec only drops the zeroes, for disk images and other files
+ * with large runs of them. A block becomes a bitmap of its SPARSE_CHUNKs,
+ * bit set for those with data, followed by those chunks. Blocks without
+ * any zero chunk are stored raw. Probing the start of the block tells
+ * nothing here, and on restore to a regular file the zeroes are left as
+ * holes, see ring_sparse().
+ */
+#define SPARSE_MAPLEN(len) (((len) + 8*SPARSE_CHUNK - 1) / (8*SPARSE_CHUNK))
+
+size_t sparse_bound(size_t len) {
+    return SPARSE_MAPLEN(len) + len;
+}
+
+/* The bitmap and chunks of in, counting the zero chunks in *zeroes */
+size_t sparse_pack(const char *in, size_t inlen, char *out, size_t outlen,
+                   int *zeroes)
+{
+    size_t  maplen = SPARSE_MAPLEN(inlen), n, off, i, len;
+
+    *zeroes = 0;
+    if(maplen > outlen) {
+        return 0;
+    }
+    memset(out, 0, maplen);
+    n = maplen;
+    for(i = 0, off = 0; off < inlen; i++, off += len) {
+        len = inlen - off < SPARSE_CHUNK ? inlen - off : SPARSE_CHUNK;
+        if(is_zero(in + off, len)) {
+            (*zeroes)++;
+            continue;
+        }
+        if(n + len > outlen) {
+            return 0;
+        }
+        ((unsigned char *) out)[i / 8] |= 1 << (i % 8);
+        memcpy(out + n, in + off, len);
+        n += len;
+    }
+
+    return n;
+}
+
+size_t sparse_compress(const char *in, size_t inlen, char *out,
+                       size_t outlen, int level)
+{
+    size_t  n;
+    int     zeroes;
+
+    (void) level;
+
+    n = sparse_pack(in, inlen, out, outlen, &zeroes);
+
+    return zeroes > 0 ? n : 0;
+}
+
+size_t sparse_decompress(const char *in, size_t inlen, char *out,
+                         size_t outlen)
+{
+    size_t  maplen = SPARSE_MAPLEN(outlen), n, off, i, len;
+
+    if(inlen < maplen) {
+        return 0;
+    }
+    n = maplen;
+    for(i = 0, off = 0; off < outlen; i++, off += len) {
+        len = outlen - off < SPARSE_CHUNK ? outlen - off : SPARSE_CHUNK;
+        if(((const unsigned char *) in)[i / 8] & (1 << (i % 8))) {
+            if(n + len > inlen) {
+                return 0;
+            }
+            memcpy(out + off, in + n, len);
+            n += len;
+        }
+        else {
+            memset(out + off, 0, len);
+        }
+    }
+
+    return n == inlen ? outlen : 0;
+}
+
+/*
+ * sparse+codec: the zeroes are dropped as by the sparse codec and what is
+ * left is compressed. A tag byte in front says whether the codec got it
+ * any smaller (1) or not (0), so blocks of incompressible data still lose
+ * their zeroes. The packed block is kept in a buffer per thread.
+ */
+pthread_key_t   sparse_key;
+pthread_once_t  sparse_once = PTHREAD_ONCE_INIT;
+
+struct sparse_buf {
+    char    *buf;
+    size_t  len;
+};
+
+void sparse_freebuf(void *arg) {
+    struct sparse_buf   *b = arg;
+
+    free(b->buf);
+    free(b);
+}
+
+void sparse_mkkey(void) {
+    pthread_key_create(&sparse_key, sparse_freebuf);
+}
+
+char *sparse_scratch(size_t len) {
+    struct sparse_buf   *b;
+    char                *p;
+
+    pthread_once(&sparse_once, sparse_mkkey);
+    b = pthread_getspecific(sparse_key);
+    if(b == NULL) {
+        b = calloc(1, sizeof(*b));
+        if(b == NULL || pthread_setspecific(sparse_key, b) != 0) {
+            free(b);
+            return NULL;
+        }
+    }
+    if(b->len < len) {
+        p = realloc(b->buf, len);
+        if(p == NULL) {
+            return NULL;
+        }
+        b->buf = p;
+        b->len = len;
+    }
+
+    return b->buf;
+}
+
+size_t sparse_over_compress(size_t (*compress)(const char *, size_t, char *,
+                                               size_t, int),
+                            const char *in, size_t inlen, char *out,
+                            size_t outlen, int level)
+{
+    size_t  packlen = sparse_bound(inlen), m, n;
+    char    *packed = sparse_scratch(packlen);
+    int     zeroes;
+
+    if(packed == NULL || outlen < 1) {
+        return 0;
+    }
+    m = sparse_pack(in, inlen, packed, packlen, &zeroes);
+    if(m == 0) {
+        return 0;
+    }
+    n = compress(packed, m, out + 1, outlen - 1, level);
+    if(n > 0 && n < m) {
+        out[0] = 1;
+        return n + 1;
+    }
+    if(zeroes == 0 || m + 1 > outlen) {
+        return 0;
+    }
+    out[0] = 0;
+    memcpy(out + 1, packed, m);
+
+    return m + 1;
+}
+
+size_t sparse_over_decompress(size_t (*decompress)(const char *, size_t,
+                                                   char *, size_t),
+                              const char *in, size_t inlen, char *out,
+                              size_t outlen)
+{
+    size_t  packlen = sparse_bound(outlen), m;
+    char    *packed;
+
+    if(inlen < 1) {
+        return 0;
+    }
+    if(in[0] == 0) {
+        return sparse_decompress(in + 1, inlen - 1, out, outlen);
+    }
+    packed = sparse_scratch(packlen);
+    if(in[0] != 1 || packed == NULL) {
+        return 0;
+    }
+    m = decompress(in + 1, inlen - 1, packed, packlen);
+    if(m == 0) {
+        return 0;
+    }
+
+    return sparse_decompress(packed, m, out, outlen);
+}
+
+#define SPARSE_OVER(c) \
+size_t sparse_##c##_bound(size_t len) { \
+    return 1 + c##_bound(sparse_bound(len)); \
+} \
+size_t sparse_##c##_compress(const char *in, size_t inlen, char *out, \
+                             size_t outlen, int level) \
+{ \
+    return sparse_over_compress(c##_compress, in, inlen, out, outlen, \
+                                level); \
+} \
+size_t sparse_##c##_decompress(const char *in, size_t inlen, char *out, \
+                               size_t outlen) \
+{ \
+    return sparse_over_decompress(c##_decompress, in, inlen, out, outlen); \
+}
+
+#ifdef HAVE_ZSTD
+SPARSE_OVER(zstd)
+#endif
+#ifdef HAVE_LZ4
+SPARSE_OVER(lz4)
+#endif
+#ifdef HAVE_ZLIB
+SPARSE_OVER(zlib)
+#endif
+
+const struct tsm_codec codecs[] = {
+#ifdef HAVE_ZSTD
+    { "zstd", 3, 1, 22, 0, zstd_bound, zstd_compress, zstd_decompress },
+#endif
+#ifdef HAVE_LZ4
+    { "lz4", 1, 1, 65537, 0, lz4_bound, lz4_compress, lz4_decompress },
+#endif
+#ifdef HAVE_ZLIB
+    { "zlib", 1, 1, 9, 0, zlib_bound, zlib_compress, zlib_decompress },
+#endif
+    { "sparse", 0, 0, 0, 1, sparse_bound, sparse_compress,
+      sparse_decompress },
+#ifdef HAVE_ZSTD
+    { "sparse+zstd", 3, 1, 22, 1, sparse_zstd_bound, sparse_zstd_compress,
+      sparse_zstd_decompress },
+#endif
+#ifdef HAVE_LZ4
+    { "sparse+lz4", 1, 1, 65537, 1, sparse_lz4_bound, sparse_lz4_compress,
+      sparse_lz4_decompress },
+#endif
+#ifdef HAVE_ZLIB
+    { "sparse+zlib", 1, 1, 9, 1, sparse_zlib_bound, sparse_zlib_compress,
+      sparse_zlib_decompress },
+#endif
+    { NULL, 0, 0, 0, 0, NULL, NULL, NULL }
+};
+
+
+const struct tsm_codec *codec_find(const char *name) {
+    const struct tsm_codec *codec;
+
+    for(codec = codecs; codec->name != NULL; codec++) {
+        if(strcmp(codec->name, name) == 0) {
+            return codec;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Parse -z codec[:level] into xfer */
+int codec_parse(tsmpipe_xfer_t *xfer, char *spec) {
+    const struct tsm_codec *codec;
+    char    *level;
+
+    level = strchr(spec, ':');
+    if(level != NULL) {
+        *level++ = '\0';
+    }
+
+    codec = codec_find(spec);
+    if(codec == NULL) {
+        fprintf(stderr, "tsmpipe: ERROR: Unknown -z codec %s, available:",
+                spec);
+        for(codec = codecs; codec->name != NULL; codec++) {
+            fprintf(stderr, " %s", codec->name);
+        }
+        fprintf(stderr, "\n");
+        return 0;
+    }
+
+    xfer->codec = codec;
+    xfer->zlevel = level ? atoi(level) : codec->deflevel;
+    if(xfer->zlevel < codec->minlevel || xfer->zlevel > codec->maxlevel) {
+        fprintf(stderr, "tsmpipe: ERROR: %s level must be %d to %d\n",
+                codec->name, codec->minlevel, codec->maxlevel);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Find the codec and block size of a compressed object from its objInfo.
+ * Returns 1 if compressed, 0 if not and -1 if we can't decompress it.
+ */
+int codec_objinfo(const char *info, int infolen,
+                  const struct tsm_codec **codec, size_t *block)
+{
+    char    val[DSM_MAX_OBJINFO_LENGTH + 1];
+
+    if(!objinfo_get(info, infolen, "codec", val, sizeof(val))) {
+        return 0;
+    }
+    *codec = codec_find(val);
+    if(*codec == NULL) {
+        fprintf(stderr, "tsmpipe: FAILED: Object is compressed with %s, "
+                "which this tsmpipe doesn't support\n", val);
+        return -1;
+    }
+    *block = 0;
+    if(objinfo_get(info, infolen, "block", val, sizeof(val))) {
+        *block = strtoul(val, NULL, 10);
+    }
+    if(*block == 0 || *block > MAX_ZBLOCK) {
+        fprintf(stderr, "tsmpipe: FAILED: Invalid compression block "
+                "size in objInfo\n");
+        return -1;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Encryption, -K keyfile. Each frame is sealed with AES-256-GCM after
+ * compression (if any), by the same pool of threads, so a frame is
+ *
+ *   raw length (4 bytes, big endian)
+ *   stored length (4 bytes, big endian, including the tag)
+ *   ciphertext
+ *   GCM tag (CRYPT_TAGLEN bytes)
+ *
+ * with the header as additional authenticated data. Each object is
+ * encrypted with its own key, derived with HKDF-SHA256 from the key in the
+ * key file and a random 128-bit salt, so a key and nonce pair is never
+ * used twice however many objects share the key. The nonce is then just
+ * the frame number, so frames can't be reordered, and a last frame with
+ * raw length 0 marks the end, so the object can't be truncated unnoticed.
+ * Without -z all frames but the last two hold exactly a block, which is
+ * what makes partial restores of encrypted objects possible. The objInfo
+ * gets the cipher, the id of the key and the salt; the key itself never
+ * leaves the key file.
+ *
+ * Objects stored before that, cipher aes256gcm, used the key from the key
+ * file directly with a 64-bit salt in the nonce, and are still restored.
+ *
+ * A key file has one key per line, "id hexkey" with 64 hex digits, blank
+ * lines and # comments ignored. The first key is used for storing, all of
+ * them for restoring, so keys can be rotated by adding a new first line.
+ */
+#define CRYPT_CIPHER    "aes256gcm-hkdf"
+#define CRYPT_CIPHER1   "aes256gcm"     /* Key file key, 64-bit salt */
+#define CRYPT_HKDFINFO  "tsmpipe " CRYPT_CIPHER
+#define CRYPT_KEYLEN    32
+#define CRYPT_TAGLEN    16
+#define CRYPT_SALTLEN   16
+#define CRYPT_SALT1LEN  8
+#define CRYPT_NONCELEN  12
+#define CRYPT_MAXID     32
+#define CRYPT_MAXKEYS   64
+#define CRYPT_MAXFILE   (CRYPT_MAXKEYS * 128)
+
+struct tsm_key {
+    char            id[CRYPT_MAXID + 1];
+    unsigned char   key[CRYPT_KEYLEN];
+};
+
+/* How an object is encrypted */
+struct tsm_crypt {
+    const struct tsm_key    *key;
+    unsigned char           salt[CRYPT_SALTLEN];
+    unsigned char           objkey[CRYPT_KEYLEN];
+    unsigned char           nonce[CRYPT_NONCELEN];  /* Before the frame */
+};
+
+struct tsm_key  keyring[CRYPT_MAXKEYS];
+int             nkeys;
+
+
+void keyring_clear(void) {
+    volatile unsigned char *p = (volatile unsigned char *) keyring;
+    size_t                 i;
+
+    for(i = 0; i < sizeof(keyring); i++) {
+        p[i] = 0;
+    }
+    nkeys = 0;
+}
+
+
+int hexval(int c) {
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = tolower(c);
+    if(c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    return -1;
+}
+
+
+/* Parse len bytes of hex. Returns 0 unless it is exactly that. */
+int hex_parse(const char *s, unsigned char *out, size_t len) {
+    size_t  i;
+    int     hi, lo;
+
+    if(strlen(s) != 2 * len) {
+        return 0;
+    }
+    for(i = 0; i < len; i++) {
+        hi = hexval(s[2*i]);
+        lo = hexval(s[2*i + 1]);
+        if(hi < 0 || lo < 0) {
+            return 0;
+        }
+        out[i] = hi << 4 | lo;
+    }
+
+    return 1;
+}
+
+
+int keyid_valid(const char *id) {
+    size_t  len = strlen(id);
+
+    return len > 0 && len <= CRYPT_MAXID &&
+           strspn(id, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                      "0123456789._-") == len;
+}
+
+
+/* Load the keys from spec, a file or fd:N. Returns 0 on failure. */
+int keyring_load(const char *spec) {
+    char        buf[CRYPT_MAXFILE + 1];
+    char        *line, *save = NULL, *lsave, *id, *hex, *end;
+    struct stat st;
+    ssize_t     n;
+    int         fd, lineno = 0, ok = 1;
+
+    keyring_clear();
+
+    if(strncmp(spec, "fd:", 3) == 0) {
+        fd = strtol(spec + 3, &end, 10);
+        if(end == spec + 3 || *end != '\0' || fd < 0) {
+            fprintf(stderr, "tsmpipe: ERROR: Invalid -K %s\n", spec);
+            return 0;
+        }
+    }
+    else {
+        fd = open(spec, O_RDONLY);
+        if(fd < 0) {
+            fprintf(stderr, "tsmpipe: %s: %s\n", spec, strerror(errno));
+            return 0;
+        }
+        if(fstat(fd, &st) == 0 && (st.st_mode & 077)) {
+            fprintf(stderr, "tsmpipe: Warning: Key file %s is accessible "
+                    "by others\n", spec);
+        }
+    }
+
+    n = read_full(fd, buf, sizeof(buf));
+    if(n < 0) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", spec, strerror(errno));
+    }
+    if(strncmp(spec, "fd:", 3) != 0) {
+        close(fd);
+    }
+    if(n < 0) {
+        return 0;
+    }
+    if(n > CRYPT_MAXFILE) {
+        fprintf(stderr, "tsmpipe: %s: Too large for a key file\n", spec);
+        return 0;
+    }
+    buf[n] = '\0';
+
+    for(line = strtok_r(buf, "\n", &save); ok && line != NULL;
+            line = strtok_r(NULL, "\n", &save))
+    {
+        lineno++;
+        id = strtok_r(line, " \t\r", &lsave);
+        if(id == NULL || *id == '#') {
+            continue;
+        }
+        hex = strtok_r(NULL, " \t\r", &lsave);
+        if(nkeys == CRYPT_MAXKEYS) {
+            fprintf(stderr, "tsmpipe: %s: More than %d keys\n", spec,
+                    CRYPT_MAXKEYS);
+            ok = 0;
+        }
+        else if(!keyid_valid(id) || hex == NULL ||
+                strtok_r(NULL, " \t\r", &lsave) != NULL ||
+                !hex_parse(hex, keyring[nkeys].key, CRYPT_KEYLEN))
+        {
+            fprintf(stderr, "tsmpipe: %s:%d: Expected \"id hexkey\" with "
+                    "an id of letters, digits, ., _ or - and %d hex "
+                    "digits\n", spec, lineno, 2 * CRYPT_KEYLEN);
+            ok = 0;
+        }
+        else {
+            strcpy(keyring[nkeys++].id, id);
+        }
+    }
+    memset(buf, 0, sizeof(buf));
+
+    if(ok && nkeys == 0) {
+        fprintf(stderr, "tsmpipe: %s: No keys\n", spec);
+        ok = 0;
+    }
+    if(!ok) {
+        keyring_clear();
+    }
+
+    return ok;
+}
+
+
+const struct tsm_key *keyring_find(const char *id) {
+    int i;
+
+    for(i = 0; i < nkeys; i++) {
+        if(strcmp(keyring[i].id, id) == 0) {
+            return &keyring[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+#ifdef HAVE_OPENSSL
+/* Nonce: zeroes, or the salt of an aes256gcm object, and the frame number */
+void crypt_nonce(const struct tsm_crypt *c, unsigned long long seq,
+                 unsigned char *nonce)
+{
+    memcpy(nonce, c->nonce, CRYPT_NONCELEN);
+    nonce[8] = seq >> 24; nonce[9] = seq >> 16;
+    nonce[10] = seq >> 8; nonce[11] = seq;
+}
+
+
+/*
+ * Set up the object key of c, derived from the key and the salt, or with
+ * v1 the key itself and the salt in the nonce. Returns 0 on failure.
+ */
+int crypt_setkey(struct tsm_crypt *c, int v1) {
+    EVP_PKEY_CTX    *pctx;
+    size_t          len = CRYPT_KEYLEN;
+    int             ok;
+
+    memset(c->nonce, 0, sizeof(c->nonce));
+    if(v1) {
+        memcpy(c->objkey, c->key->key, CRYPT_KEYLEN);
+        memcpy(c->nonce, c->salt, CRYPT_SALT1LEN);
+        return 1;
+    }
+
+    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    ok = pctx != NULL &&
+         EVP_PKEY_derive_init(pctx) > 0 &&
+         EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) > 0 &&
+         EVP_PKEY_CTX_set1_hkdf_salt(pctx, c->salt, CRYPT_SALTLEN) > 0 &&
+         EVP_PKEY_CTX_set1_hkdf_key(pctx, (unsigned char *) c->key->key,
+                                    CRYPT_KEYLEN) > 0 &&
+         EVP_PKEY_CTX_add1_hkdf_info(pctx,
+                                     (unsigned char *) CRYPT_HKDFINFO,
+                                     strlen(CRYPT_HKDFINFO)) > 0 &&
+         EVP_PKEY_derive(pctx, c->objkey, &len) > 0 && len == CRYPT_KEYLEN;
+    EVP_PKEY_CTX_free(pctx);
+    if(!ok) {
+        fprintf(stderr, "tsmpipe: Deriving the object key failed\n");
+    }
+
+    return ok;
+}
+
+
+/*
+ * Encrypt len bytes of data in place and put the tag after them, with hdr
+ * (ZHDRLEN bytes) authenticated too. Returns 0 on failure.
+ */
+int crypt_seal(const struct tsm_crypt *c, unsigned long long seq,
+               const char *hdr, char *data, size_t len)
+{
+    EVP_CIPHER_CTX  *ctx;
+    unsigned char   nonce[CRYPT_NONCELEN];
+    int             n, ok;
+
+    if(seq > 0xffffffffULL || (ctx = EVP_CIPHER_CTX_new()) == NULL) {
+        return 0;
+    }
+    crypt_nonce(c, seq, nonce);
+
+    ok = EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, c->objkey,
+                            nonce) == 1 &&
+         EVP_EncryptUpdate(ctx, NULL, &n, (const unsigned char *) hdr,
+                           ZHDRLEN) == 1 &&
+         (len == 0 ||
+          EVP_EncryptUpdate(ctx, (unsigned char *) data, &n,
+                            (const unsigned char *) data, len) == 1) &&
+         EVP_EncryptFinal_ex(ctx, (unsigned char *) data + len, &n) == 1 &&
+         EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CRYPT_TAGLEN,
+                             data + len) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+
+    return ok;
+}
+
+
+/*
+ * Decrypt len bytes of data, followed by the tag, in place. Returns 0 if
+ * it fails authentication.
+ */
+int crypt_open(const struct tsm_crypt *c, unsigned long long seq,
+               const char *hdr, char *data, size_t len)
+{
+    EVP_CIPHER_CTX  *ctx;
+    unsigned char   nonce[CRYPT_NONCELEN];
+    int             n, ok;
+
+    if(seq > 0xffffffffULL || (ctx = EVP_CIPHER_CTX_new()) == NULL) {
+        return 0;
+    }
+    crypt_nonce(c, seq, nonce);
+
+    ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, c->objkey,
+                            nonce) == 1 &&
+         EVP_DecryptUpdate(ctx, NULL, &n, (const unsigned char *) hdr,
+                           ZHDRLEN) == 1 &&
+         (len == 0 ||
+          EVP_DecryptUpdate(ctx, (unsigned char *) data, &n,
+                            (const unsigned char *) data, len) == 1) &&
+         EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, CRYPT_TAGLEN,
+                             data + len) == 1 &&
+         EVP_DecryptFinal_ex(ctx, (unsigned char *) data + len, &n) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+
+    return ok;
+}
+
+
+/* Set up encryption of a new object with key */
+int crypt_init(struct tsm_crypt *c, const struct tsm_key *key) {
+    c->key = key;
+
+    if(RAND_bytes(c->salt, CRYPT_SALTLEN) != 1) {
+        fprintf(stderr, "tsmpipe: No random data for the salt\n");
+        return 0;
+    }
+
+    return crypt_setkey(c, 0);
+}
+#else
+int crypt_seal(const struct tsm_crypt *c, unsigned long long seq,
+               const char *hdr, char *data, size_t len)
+{
+    (void) c;
+    (void) seq;
+    (void) hdr;
+    (void) data;
+    (void) len;
+
+    return 0;
+}
+
+int crypt_open(const struct tsm_crypt *c, unsigned long long seq,
+               const char *hdr, char *data, size_t len)
+{
+    (void) c;
+    (void) seq;
+    (void) hdr;
+    (void) data;
+    (void) len;
+
+    return 0;
+}
+
+int crypt_init(struct tsm_crypt *c, const struct tsm_key *key) {
+    (void) c;
+    (void) key;
+
+    fprintf(stderr, "tsmpipe: Built without encryption support\n");
+
+    return 0;
+}
+
+int crypt_setkey(struct tsm_crypt *c, int v1) {
+    (void) c;
+    (void) v1;
+
+    fprintf(stderr, "tsmpipe: Built without encryption support\n");
+
+    return 0;
+}
+#endif /* HAVE_OPENSSL */
+
+
+/* Add the cipher, key id and salt of c to an objInfo */
+int crypt_addinfo(char *info, size_t size, const struct tsm_crypt *c) {
+    char    salt[2 * CRYPT_SALTLEN + 1];
+    int     i;
+
+    for(i = 0; i < CRYPT_SALTLEN; i++) {
+        snprintf(salt + 2*i, 3, "%02x", c->salt[i]);
+    }
+
+    return objinfo_add(info, size, "cipher", CRYPT_CIPHER) &&
+           objinfo_add(info, size, "key", c->key->id) &&
+           objinfo_add(info, size, "salt", salt);
+}
+
+
+/*
+ * Find out how an object is encrypted from its objInfo, and its block
+ * size. Returns 1 if encrypted, 0 if not and -1 if we can't decrypt it.
+ */
+int crypt_objinfo(const char *info, int infolen, struct tsm_crypt *c,
+                  size_t *block)
+{
+    char    val[DSM_MAX_OBJINFO_LENGTH + 1];
+    int     v1;
+
+    if(!objinfo_get(info, infolen, "cipher", val, sizeof(val))) {
+        return 0;
+    }
+    v1 = strcmp(val, CRYPT_CIPHER1) == 0;
+    if(!v1 && strcmp(val, CRYPT_CIPHER) != 0) {
+        fprintf(stderr, "tsmpipe: FAILED: Object is encrypted with %s, "
+                "which this tsmpipe doesn't support\n", val);
+        return -1;
+    }
+    if(!objinfo_get(info, infolen, "key", val, sizeof(val))) {
+        val[0] = '\0';
+    }
+    c->key = keyring_find(val);
+    if(c->key == NULL) {
+        fprintf(stderr, "tsmpipe: FAILED: Object is encrypted with key %s, "
+                "give a key file with it to -K\n", val);
+        return -1;
+    }
+    if(!objinfo_get(info, infolen, "salt", val, sizeof(val)) ||
+            !hex_parse(val, c->salt, v1 ? CRYPT_SALT1LEN : CRYPT_SALTLEN))
+    {
+        fprintf(stderr, "tsmpipe: FAILED: Invalid salt in objInfo\n");
+        return -1;
+    }
+    if(!crypt_setkey(c, v1)) {
+        return -1;
+    }
+    *block = 0;
+    if(objinfo_get(info, infolen, "block", val, sizeof(val))) {
+        *block = strtoul(val, NULL, 10);
+    }
+    if(*block == 0 || *block > MAX_ZBLOCK) {
+        fprintf(stderr, "tsmpipe: FAILED: Invalid block size in objInfo\n");
+        return -1;
+    }
+
+    return 1;
+}
+
+
+void zframe_put(char *buf, size_t rawlen, size_t storedlen, int raw) {
+    unsigned char   *p = (unsigned char *) buf;
+    unsigned long   s = storedlen | (raw ? ZRAWBIT : 0);
+
+    p[0] = rawlen >> 24; p[1] = rawlen >> 16; p[2] = rawlen >> 8; p[3] = rawlen;
+    p[4] = s >> 24;      p[5] = s >> 16;      p[6] = s >> 8;      p[7] = s;
+}
+
+
+void zframe_get(const char *buf, size_t *rawlen, size_t *storedlen, int *raw)
+{
+    const unsigned char *p = (const unsigned char *) buf;
+    unsigned long       s;
+
+    *rawlen = ((unsigned long) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    s = ((unsigned long) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+    *raw = (s & ZRAWBIT) != 0;
+    *storedlen = s & ~ZRAWBIT;
+}
+
+
+/*
+ * Pool of threads that compress or decompress, and encrypt or decrypt, the
+ * slots of a ring. The producer fills the ring as usual, the workers pick
+ * the filled slots in order and put the result in an output buffer of
+ * their own for the slot, and the consumer takes the results in order
+ * with zpool_getfull() and hands the slot back with zpool_release().
+ * Everything is protected by the mutex of the ring.
+ */
+struct tsm_zpool {
+    struct tsm_ring         *ring;
+    const struct tsm_codec  *codec;     /* NULL to only encrypt */
+    const struct tsm_crypt  *crypt;     /* NULL to not encrypt */
+    int                     level;
+    int                     decompress;
+    unsigned long long      released;   /* Frame number of the tail */
+    char                    *out;
+    size_t                  outmemlen;
+    size_t                  outsize;    /* Usable size of each output */
+    size_t                  outstride;
+    size_t                  *outlen;
+    char                    *done;      /* Output ready, per slot */
+    int                     taken;      /* Slots from tail picked by workers */
+    int                     corrupt;
+    int                     nthreads;
+    int                     started;
+    pthread_t               *threads;
+
+    /* Statistics, reported by zpool_report() */
+    unsigned long long      inbytes;
+    unsigned long long      outbytes;
+    unsigned long           blocks;
+    unsigned long           rawblocks;
+};
+
+
+/* For compression outsize is a whole frame, for decompression a block */
+int zpool_init(struct tsm_zpool *pool, struct tsm_ring *ring,
+               const struct tsm_codec *codec, const struct tsm_crypt *crypt,
+               int level, int decompress, int nthreads, size_t outsize)
+{
+    long pagesize;
+
+    memset(pool, 0, sizeof(*pool));
+
+    pagesize = sysconf(_SC_PAGESIZE);
+    if(pagesize <= 0) {
+        pagesize = 4096;
+    }
+
+    pool->ring = ring;
+    pool->codec = codec;
+    pool->crypt = crypt;
+    pool->level = level;
+    pool->decompress = decompress;
+    pool->nthreads = nthreads;
+    pool->outsize = outsize;
+    pool->outstride = (outsize + pagesize - 1) & ~(pagesize - 1);
+    pool->outmemlen = pool->outstride * ring->nslots;
+
+    pool->outlen = calloc(ring->nslots, sizeof(size_t));
+    pool->done = calloc(ring->nslots, 1);
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if(!pool->outlen || !pool->done || !pool->threads) {
+        perror("tsmpipe: malloc");
+        free(pool->outlen);
+        free(pool->done);
+        free(pool->threads);
+        return 0;
+    }
+
+    /* Page aligned, for vmsplice() and O_DIRECT in ring_out() */
+    pool->out = mmap(NULL, pool->outmemlen, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(pool->out == MAP_FAILED) {
+        perror("tsmpipe: mmap");
+        free(pool->outlen);
+        free(pool->done);
+        free(pool->threads);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+void zpool_free(struct tsm_zpool *pool) {
+    munmap(pool->out, pool->outmemlen);
+    free(pool->outlen);
+    free(pool->done);
+    free(pool->threads);
+}
+
+
+/*
+ * Compress in to frame seq in out, or store it raw if it doesn't compress,
+ * and encrypt it. Returns the frame length, or -1 if encryption fails.
+ */
+ssize_t zpool_compress(struct tsm_zpool *pool, unsigned long long seq,
+                       const char *in, size_t inlen, char *out, int *raw)
+{
+    const struct tsm_codec *codec = pool->codec;
+    size_t  space = pool->outsize - ZHDRLEN - (pool->crypt ? CRYPT_TAGLEN : 0);
+    size_t  n = 0;
+
+    *raw = codec == NULL;
+    if(!*raw && !codec->sparse && inlen > 2*ZPROBE) {
+        n = codec->compress(in, ZPROBE, out + ZHDRLEN, space, pool->level);
+        if(n == 0 || n * 100 > ZPROBE * ZPROBE_PCT) {
+            *raw = 1;
+        }
+    }
+    if(!*raw) {
+        n = codec->compress(in, inlen, out + ZHDRLEN, space, pool->level);
+        if(n == 0 || n >= inlen) {
+            *raw = 1;
+        }
+    }
+    if(*raw) {
+        memcpy(out + ZHDRLEN, in, inlen);
+        n = inlen;
+    }
+    if(pool->crypt) {
+        zframe_put(out, inlen, n + CRYPT_TAGLEN, *raw);
+        if(!crypt_seal(pool->crypt, seq, out, out + ZHDRLEN, n)) {
+            fprintf(stderr, "tsmpipe: Encryption failed\n");
+            return -1;
+        }
+        n += CRYPT_TAGLEN;
+    }
+    else {
+        zframe_put(out, inlen, n, *raw);
+    }
+
+    return ZHDRLEN + n;
+}
+
+
+/*
+ * Decrypt and decompress frame seq in in (in place) to out. Returns the
+ * data length, or -1 if the frame is corrupt.
+ */
+ssize_t zpool_decompress(struct tsm_zpool *pool, unsigned long long seq,
+                         char *in, size_t inlen, char *out, int *raw)
+{
+    size_t  rawlen, storedlen;
+
+    if(inlen < ZHDRLEN) {
+        return -1;
+    }
+    zframe_get(in, &rawlen, &storedlen, raw);
+    if(storedlen != inlen - ZHDRLEN || rawlen > pool->outsize) {
+        return -1;
+    }
+    if(pool->crypt) {
+        if(storedlen < CRYPT_TAGLEN) {
+            return -1;
+        }
+        storedlen -= CRYPT_TAGLEN;
+        if(!crypt_open(pool->crypt, seq, in, in + ZHDRLEN, storedlen)) {
+            return -1;
+        }
+    }
+    if(*raw) {
+        if(storedlen != rawlen) {
+            return -1;
+        }
+        memcpy(out, in + ZHDRLEN, rawlen);
+    }
+    else if(pool->codec == NULL ||
+            pool->codec->decompress(in + ZHDRLEN, storedlen, out,
+                                    rawlen) != rawlen)
+    {
+        return -1;
+    }
+
+    return rawlen;
+}
+
+
+void *zpool_worker(void *arg) {
+    struct tsm_zpool    *pool = arg;
+    struct tsm_ring     *ring = pool->ring;
+    int                 slot, raw = 0;
+    unsigned long long  seq;
+    size_t              len;
+    ssize_t             n;
+    char                *in, *out;
+
+    block_signals();
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    pthread_mutex_lock(&ring->mutex);
+    for(;;) {
+        while(pool->taken == ring->count && !ring->closed &&
+                !ring->aborted)
+        {
+            pthread_cond_wait(&ring->cond, &ring->mutex);
+        }
+        if(ring->aborted || pool->taken == ring->count) {
+            break;
+        }
+        slot = (ring->tail + pool->taken) % ring->nslots;
+        seq = pool->released + pool->taken;
+        pool->taken++;
+        len = ring->len[slot];
+        pthread_mutex_unlock(&ring->mutex);
+
+        in = ring->mem + slot * ring->stride;
+        out = pool->out + slot * pool->outstride;
+        if(pool->decompress) {
+            n = zpool_decompress(pool, seq, in, len, out, &raw);
+        }
+        else {
+            n = zpool_compress(pool, seq, in, len, out, &raw);
+        }
+
+        pthread_mutex_lock(&ring->mutex);
+        if(n < 0) {
+            pool->corrupt = 1;
+            ring->aborted = 1;
+            pthread_cond_broadcast(&ring->cond);
+            break;
+        }
+        pool->outlen[slot] = n;
+        pool->done[slot] = 1;
+        pool->inbytes += len;
+        pool->outbytes += n;
+        pool->blocks++;
+        pool->rawblocks += raw;
+        pthread_cond_broadcast(&ring->cond);
+    }
+    pthread_mutex_unlock(&ring->mutex);
+
+    return NULL;
+}
+
+
+int zpool_start(struct tsm_zpool *pool) {
+    int err;
+
+    for(pool->started = 0; pool->started < pool->nthreads; pool->started++) {
+        err = pthread_create(&pool->threads[pool->started], NULL,
+                             zpool_worker, pool);
+        if(err) {
+            fprintf(stderr, "tsmpipe: pthread_create: %s\n", strerror(err));
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/* Wait for the workers, after the ring is drained or aborted */
+void zpool_join(struct tsm_zpool *pool) {
+    int i;
+
+    for(i = 0; i < pool->started; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pool->started = 0;
+}
+
+
+void zpool_stop(struct tsm_zpool *pool) {
+    ring_abort(pool->ring, 0);
+    zpool_join(pool);
+}
+
+
+/*
+ * Like ring_getfull(), but returns the output for the slot. *inlen is set
+ * to the length of the input.
+ */
+char *zpool_getfull(struct tsm_zpool *pool, size_t *len, size_t *inlen) {
+    struct tsm_ring *ring = pool->ring;
+    char            *buf = NULL;
+
+    pthread_mutex_lock(&ring->mutex);
+    if(!pool->done[ring->tail] && !(ring->count == 0 && ring->closed)) {
+        ring->emptywaits++;
+    }
+    while(!pool->done[ring->tail] && !(ring->count == 0 && ring->closed) &&
+            !ring->aborted)
+    {
+        pthread_cond_wait(&ring->cond, &ring->mutex);
+    }
+    if(pool->done[ring->tail] && !ring->aborted) {
+        buf = pool->out + ring->tail * pool->outstride;
+        *len = pool->outlen[ring->tail];
+        *inlen = ring->len[ring->tail];
+    }
+    pthread_mutex_unlock(&ring->mutex);
+
+    return buf;
+}
+
+
+void zpool_release(struct tsm_zpool *pool) {
+    struct tsm_ring *ring = pool->ring;
+
+    pthread_mutex_lock(&ring->mutex);
+    pool->done[ring->tail] = 0;
+    ring->tail = (ring->tail + 1) % ring->nslots;
+    ring->count--;
+    pool->taken--;
+    pool->released++;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+
+void zpool_report(struct tsm_zpool *pool) {
+    unsigned long long  raw, stored;
+
+    if(pool->decompress) {
+        raw = pool->outbytes;
+        stored = pool->inbytes;
+    }
+    else {
+        raw = pool->inbytes;
+        stored = pool->outbytes;
+    }
+    fprintf(stderr, "tsmpipe: %s%s: %llu bytes stored as %llu (%.1f%%), "
+            "%lu of %lu blocks uncompressed, %d threads\n",
+            pool->codec ? pool->codec->name : "uncompressed",
+            pool->crypt ? ", encrypted" : "", raw, stored,
+            raw ? stored * 100.0 / raw : 100.0, pool->rawblocks,
+            pool->blocks, pool->nthreads);
+}
+
+
+/*
+ * Send one object within an already started transaction, reading the data
+ * from fd through ring (set up by the caller with ring_init()). If fd is
+ * -1 the caller feeds the ring itself. objinfo, if not NULL, is stored as
+ * the objInfo of the object. With xfer->codec the data is compressed on
+ * the way, with xfer->key encrypted, see struct tsm_crypt.
+ * The number of bytes read (before compression) is stored in *sent, and
+ * added to sum if not NULL. If objinfo has a rawlen, that must be it.
+ */
+int tsm_sendobj(dsUint32_t sesshandle, dsmObjName *objName, off_t length,
+                char *description, char *objinfo, dsmSendType sendtype,
+                int fd, char verbose, tsmpipe_xfer_t *xfer,
+                struct tsm_ring *ring, off_t *sent, struct tsm_sum *sum)
+{
+    char            *buffer;
+    size_t          nbytes, inbytes;
+    struct tsm_adapt adapt;
+    struct tsm_zpool zpool;
+    struct tsm_crypt crypt;
+    unsigned long long nframes = 0;
+    char            end[ZHDRLEN + CRYPT_TAGLEN];
+    int             framed = xfer->codec || xfer->key;
+    pthread_t       reader;
+    dsInt16_t       rc;
+    mcBindKey       mcBindKey;
+    sndArchiveData  archData, *archDataP=NULL;
+    ObjAttr         objAttr;
+    DataBlk         dataBlk;
+    dsmEndSendObjExIn_t  endIn;
+    dsmEndSendObjExOut_t endOut;
+    char            info[DSM_MAX_OBJINFO_LENGTH + 1];
+    char            num[32];
+    off_t           rawlen;
+    int             err;
+    double          t;
+
+    *sent = 0;
+    rawlen = objinfo ? objinfo_rawlen(objinfo, strlen(objinfo)) : -1;
+
+    if(xfer->key && !crypt_init(&crypt, xfer->key)) {
+        return 0;
+    }
+    if(framed) {
+        snprintf(info, sizeof(info), "%s", objinfo ? objinfo : "");
+        snprintf(num, sizeof(num), "%lu", (unsigned long) xfer->zblock);
+        if((xfer->codec &&
+            !objinfo_add(info, sizeof(info), "codec", xfer->codec->name)) ||
+           (xfer->key && !crypt_addinfo(info, sizeof(info), &crypt)) ||
+           !objinfo_add(info, sizeof(info), "block", num))
+        {
+            fprintf(stderr, "tsmpipe: objInfo too long for %s\n",
+                    xfer->codec ? "compression" : "encryption");
+            return 0;
+        }
+        objinfo = info;
+        /* Room for the frame headers, tags and the end frame */
+        if(length > 0) {
+            length += (length / xfer->zblock + 2) * (ZHDRLEN + CRYPT_TAGLEN);
+        }
+    }
+
+    mcBindKey.stVersion = mcBindKeyVersion;
+    rc = dsmBindMC(sesshandle, objName, sendtype, &mcBindKey);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmBindMC failed");
+        return 0;
+    }
+
+    if(verbose > 1) {
+        char *cgdest=NULL;
+
+        fprintf(stderr, "tsmpipe: Bound to Management Class: %s\n", mcBindKey.mcName);
+        if((sendtype == stArchiveMountWait || sendtype == stArchive) &&
+                mcBindKey.archive_cg_exists)
+        {
+            cgdest = mcBindKey.archive_copy_dest;
+        }
+        else if(mcBindKey.backup_cg_exists) {
+            cgdest = mcBindKey.backup_copy_dest;
+        }
+        if(cgdest) {
+            fprintf(stderr, "tsmpipe: Destination Copy Group: %s\n", cgdest);
+        }
+    }
+
+    memset(&objAttr, 0, sizeof(objAttr));
+    objAttr.stVersion = ObjAttrVersion;
+    *objAttr.owner = '\0';
+    objAttr.sizeEstimate.hi = length >> 32;
+    objAttr.sizeEstimate.lo = length & ~0U;
+    /*
+     * Keeps the API from compressing it again, but the server then won't
+     * do partial restores of it: only for -z, -K alone is partially
+     * restored
+     */
+    objAttr.objCompressed = xfer->codec ? bTrue : bFalse;
+    if(objinfo) {
+        objAttr.objInfoLength = strlen(objinfo);
+        objAttr.objInfo = objinfo;
+    }
+
+    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
+        archData.stVersion = sndArchiveDataVersion;
+        archData.descr = description;
+        archDataP = &archData;
+    }
+
+    throttle_object();
+    rc = dsmSendObj(sesshandle, sendtype, archDataP, objName, &objAttr, NULL);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmSendObj failed");
+        return(0);
+    }
+
+    adapt_init(&adapt, xfer);
+
+    if(fd >= 0) {
+        ring_reset(ring, fd);
+        ring_input(ring, verbose);
+        /* Compression and encryption blocks are always whole */
+        ring_setfill(ring, framed ? xfer->zblock : xfer->bufsize);
+
+        set_pipesize(fd, PIPESIZE, verbose);
+    }
+
+    if(framed) {
+        if(!zpool_init(&zpool, ring, xfer->codec, xfer->key ? &crypt : NULL,
+                       xfer->zlevel, 0, xfer->zthreads, ZHDRLEN +
+                       (xfer->codec ? xfer->codec->bound(xfer->zblock) :
+                                      xfer->zblock) +
+                       (xfer->key ? CRYPT_TAGLEN : 0)))
+        {
+            return 0;
+        }
+        if(!zpool_start(&zpool)) {
+            zpool_stop(&zpool);
+            zpool_free(&zpool);
+            return 0;
+        }
+    }
+
+    if(fd >= 0) {
+        err = pthread_create(&reader, NULL, tsm_reader, ring);
+        if(err) {
+            fprintf(stderr, "tsmpipe: pthread_create: %s\n", strerror(err));
+            if(framed) {
+                zpool_stop(&zpool);
+                zpool_free(&zpool);
+            }
+            return 0;
+        }
+    }
+
+    dataBlk.stVersion   = DataBlkVersion;
+
+    for(;;) {
+        if(framed) {
+            buffer = zpool_getfull(&zpool, &nbytes, &inbytes);
+        }
+        else {
+            buffer = ring_getfull(ring, &nbytes);
+            inbytes = nbytes;
+        }
+        if(buffer == NULL) {
+            break;
+        }
+
+        dataBlk.bufferLen   = nbytes;
+        dataBlk.numBytes    = 0;
+        dataBlk.bufferPtr   = buffer;
+
+        throttle_bytes(nbytes);
+        t = timenow();
+        rc = dsmSendData(sesshandle, &dataBlk);
+        stats_add(stat_api, t, nbytes);
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmSendData failed");
+            if(fd >= 0) {
+                stop_helper(ring, reader);
+            }
+            if(framed) {
+                zpool_stop(&zpool);
+                zpool_free(&zpool);
+            }
+            return 0;
+        }
+
+        if(sum) {
+            /* The plain data is still in the ring slot */
+            sum_add(sum, framed ? ring->mem + ring->tail * ring->stride :
+                                       buffer, inbytes);
+        }
+        if(framed) {
+            zpool_release(&zpool);
+        }
+        else {
+            ring_release(ring);
+        }
+        *sent += inbytes;
+
+        if(xfer->adaptive && !framed &&
+                adapt_update(&adapt, nbytes, verbose))
+        {
+            ring_setfill(ring, adapt_size(&adapt));
+        }
+    }
+
+    if(fd >= 0) {
+        pthread_join(reader, NULL);
+    }
+    if(framed) {
+        zpool_join(&zpool);
+        if(verbose > 0) {
+            zpool_report(&zpool);
+        }
+        nframes = zpool.released;
+        zpool_free(&zpool);
+    }
+
+    if(ring->err) {
+        fprintf(stderr, "tsmpipe: read: %s\n", strerror(ring->err));
+        return 0;
+    }
+    if(ring->aborted) {
+        return 0;
+    }
+    if(rawlen >= 0 && *sent != rawlen) {
+        fprintf(stderr, "tsmpipe: FAILED: Got %lld bytes, expected %lld, "
+                "the input changed while being sent\n", (long long) *sent,
+                (long long) rawlen);
+        return 0;
+    }
+
+    /* An empty frame at the end, so truncation can't go unnoticed */
+    if(xfer->key) {
+        zframe_put(end, 0, CRYPT_TAGLEN, 1);
+        if(!crypt_seal(&crypt, nframes, end, end + ZHDRLEN, 0)) {
+            fprintf(stderr, "tsmpipe: Encryption failed\n");
+            return 0;
+        }
+        dataBlk.bufferLen   = sizeof(end);
+        dataBlk.numBytes    = 0;
+        dataBlk.bufferPtr   = end;
+
+        t = timenow();
+        rc = dsmSendData(sesshandle, &dataBlk);
+        stats_add(stat_api, t, sizeof(end));
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmSendData failed");
+            return 0;
+        }
+    }
+
+    memset(&endIn, 0, sizeof(endIn));
+    endIn.stVersion = dsmEndSendObjExInVersion;
+    endIn.dsmHandle = sesshandle;
+    memset(&endOut, 0, sizeof(endOut));
+    endOut.stVersion = dsmEndSendObjExOutVersion;
+
+    rc = dsmEndSendObjEx(&endIn, &endOut);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmEndSendObjEx failed");
+        return(0);
+    }
+    stats_sent(&endOut);
+
+    return 1;
+}
+
+
+/* Name of the checksum companion of objName. Returns 0 if too long. */
+int tsm_sumname(dsmObjName *objName, dsmObjName *sumName) {
+    if(strlen(objName->ll) + strlen(SUM_SUFFIX) > DSM_MAX_LL_LENGTH) {
+        return 0;
+    }
+    *sumName = *objName;
+    strcat(sumName->ll, SUM_SUFFIX);
+
+    return 1;
+}
+
+
+/*
+ * Send the checksum companion of objName, within the transaction the
+ * object was sent in. ring is reused for the data, which is the objInfo
+ * as text.
+ */
+int tsm_sendsum(dsUint32_t sesshandle, dsmObjName *objName, const char *id,
+                struct tsm_sum *sum, char *description, dsmSendType sendtype,
+                char verbose, tsmpipe_xfer_t *xfer, struct tsm_ring *ring)
+{
+    char            objinfo[DSM_MAX_OBJINFO_LENGTH + 1] = "";
+    char            text[DSM_MAX_OBJINFO_LENGTH + 2];
+    dsmObjName      sumName;
+    tsmpipe_xfer_t  plain = *xfer;
+    off_t           sent;
+
+    if(!tsm_sumname(objName, &sumName)) {
+        fprintf(stderr, "tsmpipe: Name too long for the checksum object\n");
+        return 0;
+    }
+
+    objinfo_add(objinfo, sizeof(objinfo), "sumof", id);
+    sum_objinfo(objinfo, sizeof(objinfo), sum);
+    snprintf(text, sizeof(text), "%s\n", objinfo);
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: %lld bytes, crc32c %08x\n",
+                (long long) sum->size, (unsigned int) sum->crc);
+    }
+
+    ring_reset(ring, -1);
+    ring_write(ring, text, strlen(text));
+    ring_close(ring, 0);
+
+    plain.codec = NULL;
+    plain.key = NULL;
+
+    return tsm_sendobj(sesshandle, &sumName, strlen(text), description,
+                       objinfo, sendtype, -1, verbose, &plain, ring, &sent,
+                       NULL);
+}
+
+
+/* Store what is read from infd, stdin or -i path */
+int tsm_sendfile(dsUint32_t sesshandle, char *fsname, char *filename, 
+                 off_t length, int infd, char *description,
+                 dsmSendType sendtype, char verbose, tsmpipe_xfer_t *xfer)
+{
+    struct tsm_ring ring;
+    struct tsm_sum  sum;
+    dsInt16_t       rc;
+    dsmObjName      objName;
+    char            objinfo[DSM_MAX_OBJINFO_LENGTH + 1] = "";
+    char            id[32];
+    off_t           sent;
+    int             ok;
+
+    rc = dsmBeginTxn(sesshandle);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmBeginTxn failed");
+        return 0;
+    }
+
+    tsm_name2obj(fsname, filename, &objName);
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Starting to send %s as %s%s%s\n",
+                infd == STDIN_FILENO ? "stdin" : "input", objName.fs,
+                objName.hl, objName.ll);
+    }
+
+    if(!ring_init(&ring, xfer->qdepth, xfer->slotsize, xfer->hugepages,
+                  verbose))
+    {
+        return 0;
+    }
+
+    memset(&sum, 0, sizeof(sum));
+    if(xfer->checksum) {
+        tsm_setid(id, sizeof(id));
+        objinfo_add(objinfo, sizeof(objinfo), "sum", id);
+    }
+    /* -i inputs have their exact length, stdin just an estimate */
+    if(infd != STDIN_FILENO) {
+        objinfo_addrawlen(objinfo, sizeof(objinfo), length);
+    }
+
+    ok = tsm_sendobj(sesshandle, &objName, length, description,
+                     *objinfo ? objinfo : NULL, sendtype, infd, verbose,
+                     xfer, &ring, &sent, &sum);
+    if(ok && verbose > 0) {
+        ring_report(&ring, infd == STDIN_FILENO ? "stdin" : "input");
+    }
+    if(ok && xfer->checksum) {
+        ok = tsm_sendsum(sesshandle, &objName, id, &sum, description,
+                         sendtype, verbose, xfer, &ring);
+    }
+    ring_free(&ring);
+    if(!ok) {
+        return 0;
+    }
+
+    return tsm_endtxn(sesshandle, DSM_VOTE_COMMIT);
+}
+
+
+/* Transaction limits the server imposes on us */
+int tsm_txnlimits(dsUint32_t sesshandle, dsUint32_t *maxobj,
+                  unsigned long long *maxbytes)
+{
+    ApiSessInfo     sessInfo;
+    dsInt16_t       rc;
+
+    memset(&sessInfo, 0, sizeof(sessInfo));
+    sessInfo.stVersion = ApiSessInfoVersion;
+    rc = dsmQuerySessInfo(sesshandle, &sessInfo);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmQuerySessInfo failed");
+        return 0;
+    }
+
+    *maxobj = sessInfo.maxObjPerTxn ? sessInfo.maxObjPerTxn : 1;
+    *maxbytes = sessInfo.maxBytesPerTxn;
+
+    return 1;
+}
+
+
+/* Objects in the current transaction of tsm_sendbatch() */
+struct batch_obj {
+    int     lineno;
+    char    *name;
+    off_t   sent;
+};
+
+
+/* Print the status record for the objects in a finished transaction */
+void batch_status(struct batch_obj *objs, int nobjs, int ok, const char *msg)
+{
+    int i;
+
+    for(i = 0; i < nobjs; i++) {
+        if(ok) {
+            printf("OK\t%d\t%s\t%lld\n", objs[i].lineno, objs[i].name,
+                   (long long) objs[i].sent);
+        }
+        else {
+            printf("FAILED\t%d\t%s\t%s\n", objs[i].lineno, objs[i].name, msg);
+        }
+        free(objs[i].name);
+    }
+    fflush(stdout);
+}
+
+
+/* Open the data source of a manifest line: a path, fd:N or - for stdin */
+int batch_open(const char *source, char *manifest) {
+    int fd;
+
+    if(strcmp(source, "-") == 0) {
+        if(strcmp(manifest, "-") == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        return STDIN_FILENO;
+    }
+    if(strncmp(source, "fd:", 3) == 0) {
+        fd = atoi(source+3);
+        if(fcntl(fd, F_GETFD) < 0) {
+            return -1;
+        }
+        return fd;
+    }
+
+    return open(source, O_RDONLY);
+}
+
+
+/*
+ * Store all objects listed in a manifest using one session, packing as
+ * many objects into each transaction as the server allows. Each line is
+ *
+ *   source <TAB> fsname <TAB> filepath [<TAB> length [<TAB> description]]
+ *
+ * The length can be left out (or given as -) for regular files. A status
+ * record is printed on stdout for each object:
+ *
+ *   OK <TAB> lineno <TAB> name <TAB> bytes
+ *   FAILED <TAB> lineno <TAB> name <TAB> message
+ *
+ * Returns the number of failed objects, or -1 on fatal errors.
+ */
+int tsm_sendbatch(dsUint32_t sesshandle, char *manifest, dsmSendType sendtype,
+                  char verbose, tsmpipe_xfer_t *xfer)
+{
+    FILE                *mf;
+    char                line[DSM_MAX_FSNAME_LENGTH+DSM_MAX_HL_LENGTH+
+                             DSM_MAX_LL_LENGTH+DSM_MAX_DESCR_LENGTH+PATH_MAX+64];
+    char                regfs[DSM_MAX_FSNAME_LENGTH+1] = "";
+    char                name[sizeof(line)];
+    char                *field[5];
+    struct batch_obj    *txnobjs;
+    struct tsm_ring     ring;
+    struct tsm_sum      sum;
+    char                objinfo[DSM_MAX_OBJINFO_LENGTH + 1];
+    char                id[32];
+    dsUint32_t          perobj = xfer->checksum ? 2 : 1;
+    dsUint32_t          maxobj;
+    unsigned long long  maxbytes, txnbytes=0;
+    dsmObjName          objName;
+    dsInt16_t           rc;
+    int                 lineno=0, nfields, ntxn=0, failed=0, fd, i;
+    off_t               length, rawlen;
+    struct stat         st;
+    char                *p;
+
+    if(!tsm_txnlimits(sesshandle, &maxobj, &maxbytes)) {
+        return -1;
+    }
+    if(verbose > 1) {
+        fprintf(stderr, "tsmpipe: Server allows %u objects and %llu bytes "
+                "per transaction\n", maxobj, maxbytes);
+    }
+
+    if(strcmp(manifest, "-") == 0) {
+        mf = stdin;
+    }
+    else {
+        mf = fopen(manifest, "r");
+        if(!mf) {
+            fprintf(stderr, "tsmpipe: %s: %s\n", manifest, strerror(errno));
+            return -1;
+        }
+    }
+
+    txnobjs = calloc(maxobj, sizeof(*txnobjs));
+    if(!txnobjs) {
+        perror("tsmpipe: malloc");
+        return -1;
+    }
+
+    if(!ring_init(&ring, xfer->qdepth, xfer->slotsize, xfer->hugepages,
+                  verbose))
+    {
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), mf)) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if(*line == '\0' || *line == '#') {
+            continue;
+        }
+
+        for(nfields = 0, p = line; p && nfields < 5; nfields++) {
+            field[nfields] = p;
+            p = strchr(p, '\t');
+            if(p) {
+                *p++ = '\0';
+            }
+        }
+        if(nfields < 3 || !*field[0] || !*field[1] || !*field[2]) {
+            printf("FAILED\t%d\t-\tMalformed manifest line\n", lineno);
+            failed++;
+            continue;
+        }
+        snprintf(name, sizeof(name), "%s\t%s", field[1], field[2]);
+
+        p = strrchr(field[2], '/');
+        if(strlen(field[1]) > DSM_MAX_FSNAME_LENGTH ||
+                (p && p - field[2] + 1 > DSM_MAX_HL_LENGTH) ||
+                strlen(p ? p : field[2]) + 1 > DSM_MAX_LL_LENGTH)
+        {
+            printf("FAILED\t%d\t%s\tName too long\n", lineno, name);
+            failed++;
+            continue;
+        }
+
+        fd = batch_open(field[0], manifest);
+        if(fd < 0) {
+            printf("FAILED\t%d\t%s\t%s: %s\n", lineno, name, field[0],
+                   strerror(errno));
+            failed++;
+            continue;
+        }
+
+        length = 0;
+        rawlen = -1;
+        if(nfields > 3 && strcmp(field[3], "-") != 0) {
+            length = atooff(field[3]);
+        }
+        else if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            /* The API doesn't like 0 estimates */
+            length = st.st_size ? st.st_size : 1;
+            rawlen = st.st_size;
+        }
+        if(length <= 0) {
+            printf("FAILED\t%d\t%s\tNeed a positive length\n", lineno, name);
+            failed++;
+            if(fd != STDIN_FILENO) {
+                close(fd);
+            }
+            continue;
+        }
+
+        /* Commit when the next object won't fit, or to register a new fs */
+        if(ntxn > 0 && ((dsUint32_t) (ntxn + 1) * perobj > maxobj ||
+                    (maxbytes && txnbytes + length > maxbytes) ||
+                    strcmp(regfs, field[1]) != 0))
+        {
+            i = tsm_endtxn(sesshandle, DSM_VOTE_COMMIT);
+            batch_status(txnobjs, ntxn, i, "Transaction failed");
+            if(!i) {
+                failed += ntxn;
+            }
+            else if(verbose > 0) {
+                fprintf(stderr, "tsmpipe: Committed %d objects, %llu bytes\n",
+                        ntxn, txnbytes);
+            }
+            ntxn = 0;
+            txnbytes = 0;
+        }
+
+        if(strcmp(regfs, field[1]) != 0) {
+            if(!tsm_regfs(sesshandle, field[1])) {
+                printf("FAILED\t%d\t%s\tdsmRegisterFS failed\n", lineno,
+                       name);
+                failed++;
+                if(fd != STDIN_FILENO) {
+                    close(fd);
+                }
+                continue;
+            }
+            strcpy(regfs, field[1]);
+        }
+
+        if(ntxn == 0) {
+            rc = dsmBeginTxn(sesshandle);
+            if(rc != DSM_RC_OK) {
+                tsm_printerr(sesshandle, rc, "dsmBeginTxn failed");
+                failed = -1;
+                break;
+            }
+        }
+
+        tsm_name2obj(field[1], field[2], &objName);
+        if(verbose > 0) {
+            fprintf(stderr, "tsmpipe: Starting to send %s as %s%s%s\n",
+                    field[0], objName.fs, objName.hl, objName.ll);
+        }
+
+        memset(&sum, 0, sizeof(sum));
+        *objinfo = '\0';
+        if(xfer->checksum) {
+            tsm_setid(id, sizeof(id));
+            objinfo_add(objinfo, sizeof(objinfo), "sum", id);
+        }
+        if(rawlen >= 0) {
+            objinfo_addrawlen(objinfo, sizeof(objinfo), rawlen);
+        }
+
+        txnobjs[ntxn].lineno = lineno;
+        txnobjs[ntxn].name = strdup(name);
+        i = tsm_sendobj(sesshandle, &objName, length,
+                        nfields > 4 ? field[4] : NULL,
+                        *objinfo ? objinfo : NULL, sendtype, fd,
+                        verbose, xfer, &ring, &txnobjs[ntxn].sent, &sum);
+        if(i && xfer->checksum) {
+            i = tsm_sendsum(sesshandle, &objName, id, &sum,
+                            nfields > 4 ? field[4] : NULL, sendtype, verbose,
+                            xfer, &ring);
+        }
+        ntxn++;
+        txnbytes += length;
+        if(fd != STDIN_FILENO) {
+            close(fd);
+        }
+
+        if(!i) {
+            /* Everything in this transaction is lost */
+            tsm_endtxn(sesshandle, DSM_VOTE_ABORT);
+            batch_status(txnobjs, ntxn, 0, "Transaction aborted");
+            failed += ntxn;
+            ntxn = 0;
+            txnbytes = 0;
+        }
+    }
+
+    if(ntxn > 0) {
+        i = tsm_endtxn(sesshandle, DSM_VOTE_COMMIT);
+        batch_status(txnobjs, ntxn, i, "Transaction failed");
+        if(!i) {
+            failed += ntxn;
+        }
+        else if(verbose > 0) {
+            fprintf(stderr, "tsmpipe: Committed %d objects, %llu bytes\n",
+                    ntxn, txnbytes);
+        }
+    }
+
+    if(verbose > 0) {
+        ring_report(&ring, "input");
+    }
+    ring_free(&ring);
+    free(txnobjs);
+    if(mf != stdin) {
+        fclose(mf);
+    }
+
+    return failed;
+}
+
+
+/*
+ * Query filters, -I, -E, -y and -P. Archive queries can be limited to
+ * insert and expiry date ranges, backup queries to a state and to what
+ * was there at a point in time.
+ */
+struct tsm_qfilter {
+    dsmDate     insLower;
+    dsmDate     insUpper;
+    dsmDate     expLower;
+    dsmDate     expUpper;
+    dsUint8_t   objState;   /* DSM_ACTIVE, DSM_INACTIVE or DSM_ANY_MATCH */
+    dsmDate     pitDate;
+    char        maymiss;    /* No match is not worth an error message */
+};
+
+/* Set by -I, -E, -y and -P */
+struct tsm_qfilter *qfilter = NULL;
+
+
+/* What tsm_querylive() did before there were filters */
+void qfilter_default(struct tsm_qfilter *f) {
+    memset(f, 0, sizeof(*f));
+    f->insLower.year = DATE_MINUS_INFINITE;
+    f->insUpper.year = DATE_PLUS_INFINITE;
+    f->expLower.year = DATE_MINUS_INFINITE;
+    f->expUpper.year = DATE_PLUS_INFINITE;
+    f->objState = DSM_ACTIVE;
+    f->pitDate.year = DATE_MINUS_INFINITE;
+}
+
+
+/*
+ * Parse a date: YYYY-MM-DD[ HH:MM[:SS]] (or with T), or N followed by
+ * s, m, h, d or w for that long ago. A date without time is the start of
+ * the day, or the end of it if upper.
+ */
+int qfilter_date(const char *s, dsmDate *d, int upper) {
+    struct tm   tm;
+    time_t      t;
+    char        unit, rest;
+    long        n;
+    int         year, mon, day, hour = 0, min = 0, sec = 0, f;
+
+    memset(d, 0, sizeof(*d));
+    if(sscanf(s, "%ld%c%c", &n, &unit, &rest) == 2 && n >= 0 &&
+            strchr("smhdw", unit))
+    {
+        switch(unit) {
+            case 'm': n *= 60; break;
+            case 'h': n *= 60*60; break;
+            case 'd': n *= 24*60*60; break;
+            case 'w': n *= 7*24*60*60; break;
+        }
+        t = time(NULL) - n;
+        localtime_r(&t, &tm);
+        year = tm.tm_year + 1900;
+        mon = tm.tm_mon + 1;
+        day = tm.tm_mday;
+        hour = tm.tm_hour;
+        min = tm.tm_min;
+        sec = tm.tm_sec;
+    }
+    else {
+        f = sscanf(s, "%4d-%2d-%2d%*1[ T]%2d:%2d:%2d%c", &year, &mon, &day,
+                   &hour, &min, &sec, &rest);
+        if(f != 3 && f != 5 && f != 6) {
+            return 0;
+        }
+        if(f == 3 && upper) {
+            hour = 23;
+            min = 59;
+            sec = 59;
+        }
+        if(year < 1 || year >= DATE_PLUS_INFINITE || mon < 1 || mon > 12 ||
+                day < 1 || day > 31 || hour > 23 || min > 59 || sec > 59)
+        {
+            return 0;
+        }
+    }
+    d->year = year;
+    d->month = mon;
+    d->day = day;
+    d->hour = hour;
+    d->minute = min;
+    d->second = sec;
+
+    return 1;
+}
+
+
+/* Parse a from,to date range for -I and -E, either end can be left out */
+int qfilter_range(const char *s, dsmDate *lower, dsmDate *upper) {
+    char    buf[64], *comma;
+
+    snprintf(buf, sizeof(buf), "%s", s);
+    comma = strchr(buf, ',');
+    if(comma) {
+        *comma++ = '\0';
+    }
+    if(*buf && !qfilter_date(buf, lower, 0)) {
+        return 0;
+    }
+    if(comma && *comma && !qfilter_date(comma, upper, 1)) {
+        return 0;
+    }
+
+    return *buf || (comma && *comma);
+}
+
+
+/* Whether a backup query with f can be answered from the active objects */
+int qfilter_activeonly(const struct tsm_qfilter *f) {
+    return f == NULL || (f->objState == DSM_ACTIVE &&
+                         f->pitDate.year == DATE_MINUS_INFINITE);
+}
+
+
+/* Typedef for the callback used in tsm_queryfile() */
+/* Returns: -1 upon error condition, application should exit.
+ *           0 if tsm_queryfile() should skip processing the remaining
+ *             matches.
+ *           1 otherwise.
+ */
+typedef int (*tsm_query_callback)(dsmQueryType, DataBlk *, void *);
+
+
+/*
+ * Query the server for the objects matching objName and filter, the
+ * defaults if NULL, and call usercb for each.
+ */
+dsInt16_t tsm_querylive(dsUint32_t sesshandle, dsmObjName *objName, 
+                        char *description, dsmSendType sendtype, char verbose,
+                        const struct tsm_qfilter *filter,
+                        tsm_query_callback usercb, void * userdata)
+{
+    struct tsm_qfilter  deffilter;
+    dsmQueryType        qType;
+    qryArchiveData      qaData;
+    qryRespArchiveData  qaResp;
+    qryBackupData       qbData;
+    qryRespBackupData   qbResp;
+    dsmQueryBuff        *qDataP;
+    DataBlk             qResp;
+    dsInt16_t           rc;
+    double              t;
+
+    qResp.stVersion = DataBlkVersion;
+
+    if(filter == NULL) {
+        qfilter_default(&deffilter);
+        filter = &deffilter;
+    }
+
+    if(verbose > 1) {
+        fprintf(stderr, "tsmpipe: Query file %s%s%s\n",
+                objName->fs, objName->hl, objName->ll);
+    }
+
+    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
+        qType               = qtArchive;
+
+        qaData.stVersion    = qryArchiveDataVersion;
+        qaData.objName      = objName;
+        qaData.owner        = "";
+        qaData.insDateLowerBound = filter->insLower;
+        qaData.insDateUpperBound = filter->insUpper;
+        qaData.expDateLowerBound = filter->expLower;
+        qaData.expDateUpperBound = filter->expUpper;
+        qaData.descr        = description?description:"*";
+
+        qDataP              = &qaData;
+
+        qaResp.stVersion    = qryRespArchiveDataVersion;
+
+        qResp.bufferPtr     = (char *) &qaResp;
+        qResp.bufferLen     = sizeof(qaResp);
+    }
+    else {
+        qType               = qtBackup;
+
+        qbData.stVersion    = qryBackupDataVersion;
+        qbData.objName      = objName;
+        qbData.owner        = "";
+        qbData.objState     = filter->objState;
+        qbData.pitDate      = filter->pitDate;
+
+        qDataP              = &qbData;
+
+        qbResp.stVersion    = qryRespBackupDataVersion;
+
+        qResp.bufferPtr     = (char *) &qbResp;
+        qResp.bufferLen     = sizeof(qbResp);
+    }
+
+    t = timenow();
+    rc = dsmBeginQuery(sesshandle, qType, qDataP);
+    stats_add(stat_query, t, 0);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmBeginQuery failed");
+        return rc;
+    }
+
+    /* Loop and apply our callback to the result */
+    while((rc = dsmGetNextQObj(sesshandle, &qResp)) == DSM_RC_MORE_DATA) {
+        int cbret;
+
+        if(verbose > 1) {
+            dsmObjName *rObjName;
+            
+            if(qType == qtArchive) {
+                qryRespArchiveData *qr = (void *) qResp.bufferPtr;
+                rObjName = &(qr->objName);
+            }
+            else if(qType == qtBackup) {
+                qryRespBackupData *qr = (void *) qResp.bufferPtr;
+                rObjName = &(qr->objName);
+            }
+            else {
+                fprintf(stderr,
+                        "tsm_queryfile: Internal error: Unknown qType %d\n",
                         qType);
                 return DSM_RC_UNKNOWN_ERROR;
             }
-            fprintf(stderr, "tsmpipe: Matched file %s%s%s\n",
-                    rObjName->fs, rObjName->hl, rObjName->ll);
+            fprintf(stderr, "tsmpipe: Matched file %s%s%s\n",
+                    rObjName->fs, rObjName->hl, rObjName->ll);
+        }
+        if(usercb == NULL) {
+            continue;
+        }
+        cbret = usercb(qType, &qResp, userdata);
+        if (cbret < 0) {
+            dsmEndQuery(sesshandle);
+            return DSM_RC_UNKNOWN_ERROR;
+        }
+        else if(cbret == 0) {
+            break;
+        }
+    }
+
+    /* The query must be ended either way, the session may be reused */
+    if(rc != DSM_RC_FINISHED && rc != DSM_RC_MORE_DATA) {
+        if(rc != DSM_RC_ABORT_NO_MATCH || !filter->maymiss) {
+            tsm_printerr(sesshandle, rc, "dsmGetNextObj failed");
+        }
+        dsmEndQuery(sesshandle);
+        return rc;
+    }
+
+    rc = dsmEndQuery(sesshandle);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmEndQuery failed");
+        return rc;
+    }
+
+    return DSM_RC_OK;
+}
+
+/*
+ * Local catalog, -g. The objects of a filespace, as returned by the query,
+ * are kept sorted by name in a file per node, filespace and object type:
+ *
+ *   struct catalog_hdr
+ *   struct catalog_ent[nents], sorted by hl, ll and objId
+ *   strings (NUL terminated), that the entries point into
+ *
+ * tsm_queryfile() answers from the mapped catalog, after refreshing it:
+ * archive objects with a query for those inserted since the newest one we
+ * have, backup objects with a full query since the API has no insert date
+ * bound for those. If the catalog can't be used or has no match the query
+ * goes to the server after all. An incremental refresh doesn't see
+ * archive objects deleted by others, so the catalog is rebuilt with a full
+ * query once it is CATALOG_REBUILD old, or with -G. Until then a get or
+ * delete of such a stale entry fails, and catalog_recheck() drops it so the
+ * caller can try again.
+ */
+
+#define CATALOG_MAGIC       "tsmpcat"
+#define CATALOG_VERSION     2
+#define CATALOG_SUFFIX      ".cat"
+#define CATALOG_REBUILD     (24*60*60)
+
+struct catalog_hdr {
+    char                magic[8];
+    dsUint32_t          version;
+    dsUint32_t          entsize;    /* Catches catalogs from other ABIs */
+    unsigned long long  nents;
+    unsigned long long  strsize;
+    long long           refreshed;  /* time() of the last refresh */
+    long long           rebuilt;    /* and of the last full one */
+    dsmDate             newest;     /* Newest insDate in the catalog */
+    dsUint8_t           archive;
+};
+
+struct catalog_ent {
+    dsStruct64_t        objId;
+    dsStruct64_t        sizeEstimate;
+    dsUint160_t         restoreOrder;
+    dsmDate             insDate;
+    dsmDate             expDate;
+    dsUint8_t           state;
+    dsUint8_t           mediaClass;
+    dsUint16_t          objInfolen;
+    dsUint32_t          copyGroup;
+    dsUint32_t          hl;         /* Offsets in the strings */
+    dsUint32_t          ll;
+    dsUint32_t          owner;
+    dsUint32_t          mcName;
+    dsUint32_t          descr;
+    dsUint32_t          objInfo;
+};
+
+/* A mapped catalog */
+struct catalog_fs {
+    char                *fs;
+    int                 archive;
+    int                 failed;     /* Use live queries instead */
+    char                *path;
+    char                *map;
+    size_t              maplen;
+    struct catalog_hdr  *hdr;
+    struct catalog_ent  *ents;
+    char                *strs;
+    long long           rebuilt;
+    struct catalog_fs   *next;
+};
+
+struct tsm_catalog {
+    char                *dir;
+    long                maxage;     /* Refresh if older, seconds */
+    char                rebuild;    /* -G */
+    char                *node;
+    dsmDate             now;        /* Server time, for expiry */
+    int                 answered;   /* Queries answered from the catalog */
+    pthread_mutex_t     mutex;
+    struct catalog_fs   *open;
+};
+
+/* An entry being built, with its strings on the side */
+struct catalog_new {
+    struct catalog_ent  ent;
+    char                *hl, *ll, *owner, *mcName, *descr;
+    char                objInfo[DSM_MAX_OBJINFO_LENGTH];
+};
+
+struct catalog_cb_data {
+    int                 nnew;
+    int                 maxnew;
+    struct catalog_new  *new;
+};
+
+/* Set by -g */
+struct tsm_catalog *catalog = NULL;
+
+
+int date_cmp(const dsmDate *a, const dsmDate *b) {
+    if(a->year != b->year) {
+        return a->year < b->year ? -1 : 1;
+    }
+    if(a->month != b->month) {
+        return a->month < b->month ? -1 : 1;
+    }
+    if(a->day != b->day) {
+        return a->day < b->day ? -1 : 1;
+    }
+    if(a->hour != b->hour) {
+        return a->hour < b->hour ? -1 : 1;
+    }
+    if(a->minute != b->minute) {
+        return a->minute < b->minute ? -1 : 1;
+    }
+    if(a->second != b->second) {
+        return a->second < b->second ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+/* Parse -g dir[:maxage] and set up the catalog */
+int catalog_init(char *arg, char rebuild) {
+    char        *p, *end;
+
+    catalog = calloc(1, sizeof(*catalog));
+    if(catalog == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+    catalog->dir = strdup(arg);
+    if(catalog->dir == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+    p = strrchr(catalog->dir, ':');
+    if(p && p[1] != '\0') {
+        catalog->maxage = strtol(p + 1, &end, 10);
+        if(*end != '\0' || catalog->maxage < 0) {
+            fprintf(stderr, "tsmpipe: ERROR: Invalid -g max age %s\n", p + 1);
+            return 0;
+        }
+        *p = '\0';
+    }
+    catalog->rebuild = rebuild;
+    pthread_mutex_init(&catalog->mutex, NULL);
+
+    return 1;
+}
+
+
+/* dir/node.archive|backup.fs.cat, with the filespace name %-escaped */
+char *catalog_path(const char *fs, int archive) {
+    char        *path, *p;
+    size_t      len;
+
+    len = strlen(catalog->dir) + strlen(catalog->node) + 3 * strlen(fs) +
+          sizeof(CATALOG_SUFFIX) + 16;
+    path = malloc(len);
+    if(path == NULL) {
+        perror("tsmpipe: malloc");
+        return NULL;
+    }
+    p = path + sprintf(path, "%s/%s.%s.", catalog->dir, catalog->node,
+                       archive ? "archive" : "backup");
+    for(; *fs; fs++) {
+        if(isalnum((unsigned char) *fs) || *fs == '-' || *fs == '_') {
+            *p++ = *fs;
+        }
+        else {
+            p += sprintf(p, "%%%02X", (unsigned char) *fs);
+        }
+    }
+    strcpy(p, CATALOG_SUFFIX);
+
+    return path;
+}
+
+
+void catalog_unmap(struct catalog_fs *cfs) {
+    if(cfs->map != NULL) {
+        munmap(cfs->map, cfs->maplen);
+    }
+    cfs->map = NULL;
+    cfs->hdr = NULL;
+    cfs->ents = NULL;
+    cfs->strs = NULL;
+}
+
+
+/* A NUL terminated string in the catalog of at most max characters */
+int catalog_strok(const struct catalog_hdr *hdr, const char *strs,
+                  dsUint32_t off, size_t max)
+{
+    size_t  n;
+
+    if(off >= hdr->strsize) {
+        return 0;
+    }
+    n = strnlen(strs + off, hdr->strsize - off);
+
+    return n < hdr->strsize - off && n <= max;
+}
+
+
+/* Whether the offsets and lengths of e stay within the catalog */
+int catalog_entok(const struct catalog_hdr *hdr, const char *strs,
+                  const struct catalog_ent *e)
+{
+    return catalog_strok(hdr, strs, e->hl, DSM_MAX_HL_LENGTH) &&
+           catalog_strok(hdr, strs, e->ll, DSM_MAX_LL_LENGTH) &&
+           catalog_strok(hdr, strs, e->owner, DSM_MAX_OWNER_LENGTH) &&
+           catalog_strok(hdr, strs, e->mcName, DSM_MAX_MC_NAME_LENGTH) &&
+           catalog_strok(hdr, strs, e->descr, DSM_MAX_DESCR_LENGTH) &&
+           e->objInfolen <= DSM_MAX_OBJINFO_LENGTH &&
+           e->objInfo <= hdr->strsize &&
+           e->objInfolen <= hdr->strsize - e->objInfo;
+}
+
+
+/* Map the catalog file. Returns 0 if there is none or it is unusable */
+int catalog_map(struct catalog_fs *cfs, char verbose) {
+    struct catalog_hdr  *hdr;
+    struct catalog_ent  *ents;
+    struct stat         st;
+    unsigned long long  i;
+    int                 fd, ok;
+
+    catalog_unmap(cfs);
+    fd = open(cfs->path, O_RDONLY);
+    if(fd < 0) {
+        if(errno != ENOENT) {
+            fprintf(stderr, "tsmpipe: %s: %s\n", cfs->path, strerror(errno));
+        }
+        return 0;
+    }
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*hdr)) {
+        close(fd);
+        return 0;
+    }
+    cfs->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(cfs->map == MAP_FAILED) {
+        cfs->map = NULL;
+        fprintf(stderr, "tsmpipe: mmap %s: %s\n", cfs->path, strerror(errno));
+        return 0;
+    }
+    cfs->maplen = st.st_size;
+
+    hdr = (struct catalog_hdr *) cfs->map;
+    ents = (struct catalog_ent *) (cfs->map + sizeof(*hdr));
+    ok = memcmp(hdr->magic, CATALOG_MAGIC, sizeof(hdr->magic)) == 0 &&
+         hdr->version == CATALOG_VERSION &&
+         hdr->entsize == sizeof(struct catalog_ent) &&
+         hdr->archive == cfs->archive &&
+         hdr->nents <= cfs->maplen / sizeof(struct catalog_ent) &&
+         hdr->strsize <= cfs->maplen &&
+         sizeof(*hdr) + hdr->nents * sizeof(struct catalog_ent) +
+            hdr->strsize == cfs->maplen;
+    /* A damaged entry could point anywhere */
+    for(i = 0; ok && i < hdr->nents; i++) {
+        ok = catalog_entok(hdr, (char *) (ents + hdr->nents), &ents[i]);
+    }
+    if(!ok) {
+        if(verbose > 0) {
+            fprintf(stderr, "tsmpipe: %s is not a usable catalog, "
+                    "rebuilding\n", cfs->path);
+        }
+        catalog_unmap(cfs);
+        return 0;
+    }
+    cfs->hdr = hdr;
+    cfs->ents = ents;
+    cfs->strs = (char *) (cfs->ents + hdr->nents);
+    cfs->rebuilt = hdr->rebuilt;
+
+    return 1;
+}
+
+
+/* Gathers the query results for catalog_refresh() */
+int tsm_catalog_cb(dsmQueryType qType, DataBlk *qResp, void * userdata)
+{
+    struct catalog_cb_data  *cbdata = userdata;
+    struct catalog_new      *n;
+
+    if(cbdata->nnew == cbdata->maxnew) {
+        void *p;
+
+        cbdata->maxnew = cbdata->maxnew ? cbdata->maxnew * 2 : 1024;
+        p = realloc(cbdata->new, cbdata->maxnew * sizeof(*cbdata->new));
+        if(p == NULL) {
+            perror("tsmpipe: malloc");
+            return -1;
+        }
+        cbdata->new = p;
+    }
+    n = &cbdata->new[cbdata->nnew];
+    memset(n, 0, sizeof(*n));
+
+    if(qType == qtArchive) {
+        qryRespArchiveData *qr = (void *) qResp->bufferPtr;
+
+        n->ent.objId        = qr->objId;
+        n->ent.sizeEstimate = qr->sizeEstimate;
+        n->ent.restoreOrder = qr->restoreOrderExt;
+        n->ent.insDate      = qr->insDate;
+        n->ent.expDate      = qr->expDate;
+        n->ent.mediaClass   = qr->mediaClass;
+        n->ent.objInfolen   = qr->objInfolen;
+        memcpy(n->objInfo, qr->objInfo, qr->objInfolen);
+        n->hl       = strdup(qr->objName.hl);
+        n->ll       = strdup(qr->objName.ll);
+        n->owner    = strdup(qr->owner);
+        n->mcName   = strdup(qr->mcName);
+        n->descr    = strdup(qr->descr);
+    }
+    else if(qType == qtBackup) {
+        qryRespBackupData *qr = (void *) qResp->bufferPtr;
+
+        n->ent.objId        = qr->objId;
+        n->ent.sizeEstimate = qr->sizeEstimate;
+        n->ent.restoreOrder = qr->restoreOrderExt;
+        n->ent.insDate      = qr->insDate;
+        n->ent.expDate      = qr->expDate;
+        n->ent.state        = qr->objState;
+        n->ent.mediaClass   = qr->mediaClass;
+        n->ent.copyGroup    = qr->copyGroup;
+        n->ent.objInfolen   = qr->objInfolen;
+        memcpy(n->objInfo, qr->objInfo, qr->objInfolen);
+        n->hl       = strdup(qr->objName.hl);
+        n->ll       = strdup(qr->objName.ll);
+        n->owner    = strdup(qr->owner);
+        n->mcName   = strdup(qr->mcName);
+        n->descr    = strdup("");
+    }
+    else {
+        fprintf(stderr,
+                "tsm_catalog_cb: Internal error: Unknown qType %d\n", qType);
+        return -1;
+    }
+    cbdata->nnew++;
+    if(!n->hl || !n->ll || !n->owner || !n->mcName || !n->descr) {
+        perror("tsmpipe: malloc");
+        return -1;
+    }
+
+    return 1;
+}
+
+
+void catalog_freenew(struct catalog_cb_data *cbdata) {
+    int i;
+
+    for(i = 0; i < cbdata->nnew; i++) {
+        free(cbdata->new[i].hl);
+        free(cbdata->new[i].ll);
+        free(cbdata->new[i].owner);
+        free(cbdata->new[i].mcName);
+        free(cbdata->new[i].descr);
+    }
+    free(cbdata->new);
+}
+
+
+int catalog_objidcmp(const void *a, const void *b) {
+    const dsStruct64_t  *x = &((const struct catalog_new *) a)->ent.objId;
+    const dsStruct64_t  *y = &((const struct catalog_new *) b)->ent.objId;
+
+    if(x->hi != y->hi) {
+        return x->hi < y->hi ? -1 : 1;
+    }
+    if(x->lo != y->lo) {
+        return x->lo < y->lo ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+/* Sort order of the catalog entries */
+int catalog_namecmp(const void *a, const void *b) {
+    const struct catalog_new    *x = *(struct catalog_new * const *) a;
+    const struct catalog_new    *y = *(struct catalog_new * const *) b;
+    int                         c;
+
+    c = strcmp(x->hl, y->hl);
+    if(c == 0) {
+        c = strcmp(x->ll, y->ll);
+    }
+    if(c == 0) {
+        c = catalog_objidcmp(x, y);
+    }
+
+    return c;
+}
+
+
+/* Put s in the strings, returns its offset */
+dsUint32_t catalog_putstr(char *strs, unsigned long long *strsize,
+                          const char *s, size_t len)
+{
+    dsUint32_t  off = *strsize;
+
+    memcpy(strs + off, s, len);
+    strs[off + len] = '\0';
+    *strsize += len + 1;
+
+    return off;
+}
+
+
+/*
+ * Write a new catalog for cfs with the entries in ents, old entries from
+ * the current map and new ones. Written to a temporary file and renamed
+ * in place, so readers always see a whole catalog.
+ */
+int catalog_write(struct catalog_fs *cfs, struct catalog_new **ents,
+                  int nents, char verbose)
+{
+    struct catalog_hdr  hdr;
+    struct catalog_ent  *out;
+    unsigned long long  strsize = 0, strmax = 0;
+    char                *strs, *tmp;
+    size_t              entlen;
+    int                 fd, ok, i;
+
+    for(i = 0; i < nents; i++) {
+        strmax += strlen(ents[i]->hl) + strlen(ents[i]->ll) +
+                  strlen(ents[i]->owner) + strlen(ents[i]->mcName) +
+                  strlen(ents[i]->descr) + ents[i]->ent.objInfolen + 6;
+    }
+    if(strmax > 0xffffffffULL) {
+        fprintf(stderr, "tsmpipe: %s: Catalog too large\n", cfs->path);
+        return 0;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CATALOG_MAGIC, sizeof(hdr.magic));
+    hdr.version = CATALOG_VERSION;
+    hdr.entsize = sizeof(struct catalog_ent);
+    hdr.nents = nents;
+    hdr.refreshed = time(NULL);
+    hdr.rebuilt = cfs->rebuilt;
+    hdr.archive = cfs->archive;
+
+    entlen = nents * sizeof(struct catalog_ent);
+    out = malloc(entlen + strmax + 1);
+    tmp = malloc(strlen(cfs->path) + 32);
+    if(out == NULL || tmp == NULL) {
+        perror("tsmpipe: malloc");
+        free(out);
+        free(tmp);
+        return 0;
+    }
+    strs = (char *) out + entlen;
+
+    for(i = 0; i < nents; i++) {
+        struct catalog_new  *n = ents[i];
+
+        out[i] = n->ent;
+        out[i].hl = catalog_putstr(strs, &strsize, n->hl, strlen(n->hl));
+        out[i].ll = catalog_putstr(strs, &strsize, n->ll, strlen(n->ll));
+        out[i].owner = catalog_putstr(strs, &strsize, n->owner,
+                                      strlen(n->owner));
+        out[i].mcName = catalog_putstr(strs, &strsize, n->mcName,
+                                       strlen(n->mcName));
+        out[i].descr = catalog_putstr(strs, &strsize, n->descr,
+                                      strlen(n->descr));
+        out[i].objInfo = catalog_putstr(strs, &strsize, n->objInfo,
+                                        n->ent.objInfolen);
+        if(date_cmp(&n->ent.insDate, &hdr.newest) > 0) {
+            hdr.newest = n->ent.insDate;
+        }
+    }
+    hdr.strsize = strsize;
+
+    sprintf(tmp, "%s.%ld", cfs->path, (long) getpid());
+    fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if(fd < 0) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", tmp, strerror(errno));
+        free(out);
+        free(tmp);
+        return 0;
+    }
+    ok = write_full(fd, (char *) &hdr, sizeof(hdr)) == sizeof(hdr) &&
+         write_full(fd, (char *) out, entlen + strsize) ==
+            (ssize_t) (entlen + strsize);
+    if(close(fd) < 0) {
+        ok = 0;
+    }
+    if(ok && rename(tmp, cfs->path) < 0) {
+        ok = 0;
+    }
+    if(!ok) {
+        fprintf(stderr, "tsmpipe: Writing %s: %s\n", cfs->path,
+                strerror(errno));
+        unlink(tmp);
+    }
+    else if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Catalog %s has %d objects\n", cfs->path,
+                nents);
+    }
+    free(out);
+    free(tmp);
+
+    return ok;
+}
+
+
+/* Turn an entry of the current map back into one for catalog_write() */
+void catalog_old(struct catalog_fs *cfs, struct catalog_ent *e,
+                 struct catalog_new *n)
+{
+    n->ent = *e;
+    n->hl = cfs->strs + e->hl;
+    n->ll = cfs->strs + e->ll;
+    n->owner = cfs->strs + e->owner;
+    n->mcName = cfs->strs + e->mcName;
+    n->descr = cfs->strs + e->descr;
+    memcpy(n->objInfo, cfs->strs + e->objInfo, e->objInfolen);
+}
+
+
+/*
+ * Merge the mapped catalog, minus expired entries and those in drop or
+ * found again in cbdata, with cbdata and write it out. drop is sorted like
+ * catalog_objidcmp().
+ */
+int catalog_merge(struct catalog_fs *cfs, struct catalog_cb_data *cbdata,
+                  struct catalog_new *drop, int ndrop, char verbose)
+{
+    struct catalog_new  **ents, *old = NULL;
+    unsigned long long  nold = 0, i;
+    int                 nents = 0, ok;
+
+    if(cfs->hdr) {
+        nold = cfs->hdr->nents;
+    }
+    if(cbdata->nnew > 0) {
+        qsort(cbdata->new, cbdata->nnew, sizeof(*cbdata->new),
+              catalog_objidcmp);
+    }
+
+    ents = malloc((nold + cbdata->nnew + 1) * sizeof(*ents));
+    if(nold > 0) {
+        old = malloc(nold * sizeof(*old));
+    }
+    if(ents == NULL || (nold > 0 && old == NULL)) {
+        perror("tsmpipe: malloc");
+        free(ents);
+        free(old);
+        return 0;
+    }
+
+    for(i = 0; i < nold; i++) {
+        catalog_old(cfs, &cfs->ents[i], &old[i]);
+        if(date_cmp(&old[i].ent.expDate, &catalog->now) < 0) {
+            continue;
+        }
+        if(cbdata->nnew > 0 && bsearch(&old[i], cbdata->new, cbdata->nnew,
+                                       sizeof(*cbdata->new),
+                                       catalog_objidcmp))
+        {
+            continue;
+        }
+        if(ndrop > 0 && bsearch(&old[i], drop, ndrop, sizeof(*drop),
+                                catalog_objidcmp))
+        {
+            continue;
+        }
+        ents[nents++] = &old[i];
+    }
+    for(i = 0; i < (unsigned long long) cbdata->nnew; i++) {
+        ents[nents++] = &cbdata->new[i];
+    }
+
+    qsort(ents, nents, sizeof(*ents), catalog_namecmp);
+    ok = catalog_write(cfs, ents, nents, verbose);
+
+    free(ents);
+    free(old);
+
+    return ok && catalog_map(cfs, verbose);
+}
+
+
+/*
+ * Refresh the catalog of cfs from the server, unless it is younger than
+ * the max age. Serialized between processes with a lock file; whoever
+ * gets it second finds the catalog fresh.
+ */
+int catalog_refresh(dsUint32_t sesshandle, struct catalog_fs *cfs,
+                    char verbose)
+{
+    struct catalog_cb_data  cbdata;
+    dsmObjName              objName;
+    struct tsm_qfilter      filter;
+    dsInt16_t               rc;
+    char                    *lockpath;
+    int                     lockfd, ok, full;
+    double                  start = timenow();
+
+    lockpath = malloc(strlen(cfs->path) + 6);
+    if(lockpath == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+    sprintf(lockpath, "%s.lock", cfs->path);
+    lockfd = open(lockpath, O_RDWR|O_CREAT, 0666);
+    if(lockfd < 0 || lockf(lockfd, F_LOCK, 0) < 0) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", lockpath, strerror(errno));
+        if(lockfd >= 0) {
+            close(lockfd);
+        }
+        free(lockpath);
+        return 0;
+    }
+    free(lockpath);
+
+    catalog_map(cfs, verbose);
+    if(cfs->hdr && !catalog->rebuild &&
+            time(NULL) - cfs->hdr->refreshed < catalog->maxage)
+    {
+        close(lockfd);
+        return 1;
+    }
+
+    full = cfs->hdr == NULL || catalog->rebuild || !cfs->archive ||
+           time(NULL) - cfs->hdr->rebuilt >= CATALOG_REBUILD;
+    qfilter_default(&filter);
+    if(full) {
+        catalog_unmap(cfs);
+        cfs->rebuilt = time(NULL);
+    }
+    else {
+        filter.insLower = cfs->hdr->newest;
+    }
+
+    snprintf(objName.fs, sizeof(objName.fs), "%s", cfs->fs);
+    strcpy(objName.hl, "*");
+    strcpy(objName.ll, "*");
+    objName.objType = DSM_OBJ_FILE;
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Refreshing catalog of %s %s objects%s\n",
+                cfs->fs, cfs->archive ? "archive" : "backup",
+                full ? "" : ", incrementally");
+    }
+
+    memset(&cbdata, 0, sizeof(cbdata));
+    rc = tsm_querylive(sesshandle, &objName, NULL,
+                       cfs->archive ? stArchive : stBackup, verbose,
+                       &filter, tsm_catalog_cb, &cbdata);
+    ok = rc == DSM_RC_OK || rc == DSM_RC_ABORT_NO_MATCH;
+    if(ok) {
+        ok = catalog_merge(cfs, &cbdata, NULL, 0, verbose);
+    }
+    if(ok && verbose > 0) {
+        fprintf(stderr, "tsmpipe: Catalog refreshed with %d objects in "
+                "%.1f seconds\n", cbdata.nnew, timenow() - start);
+    }
+    catalog_freenew(&cbdata);
+    close(lockfd);
+
+    return ok;
+}
+
+
+/* The catalog for fs, opened and refreshed if needed. NULL if unusable */
+struct catalog_fs *catalog_get(dsUint32_t sesshandle, const char *fs,
+                               int archive, char verbose)
+{
+    struct catalog_fs   *cfs;
+    ApiSessInfo         sessInfo;
+    dsInt16_t           rc;
+
+    pthread_mutex_lock(&catalog->mutex);
+    for(cfs = catalog->open; cfs != NULL; cfs = cfs->next) {
+        if(cfs->archive == archive && strcmp(cfs->fs, fs) == 0) {
+            break;
+        }
+    }
+    if(cfs != NULL) {
+        pthread_mutex_unlock(&catalog->mutex);
+        return cfs->failed ? NULL : cfs;
+    }
+
+    if(catalog->node == NULL) {
+        memset(&sessInfo, 0, sizeof(sessInfo));
+        sessInfo.stVersion = ApiSessInfoVersion;
+        rc = dsmQuerySessInfo(sesshandle, &sessInfo);
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmQuerySessInfo failed");
+            pthread_mutex_unlock(&catalog->mutex);
+            return NULL;
+        }
+        catalog->node = strdup(sessInfo.id);
+        catalog->now = sessInfo.serverDate;
+    }
+
+    cfs = calloc(1, sizeof(*cfs));
+    if(cfs == NULL || catalog->node == NULL ||
+            (cfs->fs = strdup(fs)) == NULL)
+    {
+        perror("tsmpipe: malloc");
+        free(cfs);
+        pthread_mutex_unlock(&catalog->mutex);
+        return NULL;
+    }
+    cfs->archive = archive;
+    cfs->path = catalog_path(fs, archive);
+    if(cfs->path == NULL || !catalog_refresh(sesshandle, cfs, verbose)) {
+        fprintf(stderr, "tsmpipe: Not using the catalog for %s, querying "
+                "the server\n", fs);
+        cfs->failed = 1;
+        catalog_unmap(cfs);
+    }
+    cfs->next = catalog->open;
+    catalog->open = cfs;
+    pthread_mutex_unlock(&catalog->mutex);
+
+    return cfs->failed ? NULL : cfs;
+}
+
+
+/* Unmap and free the catalog, for the next command of a daemon worker */
+void catalog_free(void) {
+    struct catalog_fs   *cfs, *next;
+
+    if(catalog == NULL) {
+        return;
+    }
+    for(cfs = catalog->open; cfs != NULL; cfs = next) {
+        next = cfs->next;
+        catalog_unmap(cfs);
+        free(cfs->fs);
+        free(cfs->path);
+        free(cfs);
+    }
+    pthread_mutex_destroy(&catalog->mutex);
+    free(catalog->dir);
+    free(catalog->node);
+    free(catalog);
+    catalog = NULL;
+}
+
+
+/* Length of the part of a pattern before any wildcard */
+size_t catalog_literal(const char *pattern) {
+    return strcspn(pattern, "*?[\\");
+}
+
+
+/* Index of the first entry with hl >= hl, or ll >= ll if hl is given */
+unsigned long long catalog_lower(struct catalog_fs *cfs, const char *hl,
+                                 size_t hllen, const char *ll, size_t lllen)
+{
+    unsigned long long  lo = 0, hi = cfs->hdr->nents, mid;
+    struct catalog_ent  *e;
+    int                 c;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        e = &cfs->ents[mid];
+        if(ll) {
+            c = strcmp(cfs->strs + e->hl, hl);
+            if(c == 0) {
+                c = strncmp(cfs->strs + e->ll, ll, lllen);
+            }
+        }
+        else {
+            c = strncmp(cfs->strs + e->hl, hl, hllen);
+        }
+        if(c < 0) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+
+/*
+ * Answer a query from the catalog, calling usercb like tsm_querylive().
+ * Returns DSM_RC_ABORT_NO_MATCH if nothing matched or the catalog can't
+ * be used, so the caller asks the server instead. The catalog only has
+ * active backup objects, so filters for others go to the server.
+ */
+dsInt16_t catalog_query(dsUint32_t sesshandle, dsmObjName *objName,
+                        char *description, dsmSendType sendtype,
+                        char verbose, const struct tsm_qfilter *filter,
+                        tsm_query_callback usercb, void *userdata)
+{
+    struct catalog_fs   *cfs;
+    struct catalog_ent  *e;
+    qryRespArchiveData  qaResp;
+    qryRespBackupData   qbResp;
+    DataBlk             qResp;
+    dsmQueryType        qType;
+    dsmObjName          *rObjName;
+    size_t              hllen, lllen;
+    unsigned long long  i;
+    int                 archive, exacthl, nmatch = 0, cbret;
+    char                *hl, *ll, *descr = description ? description : "*";
+
+    archive = sendtype == stArchiveMountWait || sendtype == stArchive;
+    if(catalog_literal(objName->fs) != strlen(objName->fs) ||
+            (!archive && !qfilter_activeonly(filter)))
+    {
+        return DSM_RC_ABORT_NO_MATCH;
+    }
+    cfs = catalog_get(sesshandle, objName->fs, archive, verbose);
+    if(cfs == NULL) {
+        return DSM_RC_ABORT_NO_MATCH;
+    }
+
+    qResp.stVersion = DataBlkVersion;
+    if(archive) {
+        qType = qtArchive;
+        memset(&qaResp, 0, sizeof(qaResp));
+        qaResp.stVersion = qryRespArchiveDataVersion;
+        qResp.bufferPtr = (char *) &qaResp;
+        qResp.bufferLen = sizeof(qaResp);
+        rObjName = &qaResp.objName;
+    }
+    else {
+        qType = qtBackup;
+        memset(&qbResp, 0, sizeof(qbResp));
+        qbResp.stVersion = qryRespBackupDataVersion;
+        qResp.bufferPtr = (char *) &qbResp;
+        qResp.bufferLen = sizeof(qbResp);
+        rObjName = &qbResp.objName;
+    }
+    strcpy(rObjName->fs, cfs->fs);
+    rObjName->objType = DSM_OBJ_FILE;
+
+    /* Only look at the entries that can match the literal prefix */
+    hllen = catalog_literal(objName->hl);
+    lllen = catalog_literal(objName->ll);
+    exacthl = hllen == strlen(objName->hl);
+    i = catalog_lower(cfs, objName->hl, hllen,
+                      exacthl ? objName->ll : NULL, lllen);
+
+    for(; i < cfs->hdr->nents; i++) {
+        e = &cfs->ents[i];
+        hl = cfs->strs + e->hl;
+        ll = cfs->strs + e->ll;
+        if(exacthl ? strcmp(hl, objName->hl) != 0 ||
+                        strncmp(ll, objName->ll, lllen) != 0
+                   : strncmp(hl, objName->hl, hllen) != 0)
+        {
+            break;
+        }
+        if(fnmatch(objName->hl, hl, 0) != 0 ||
+                fnmatch(objName->ll, ll, 0) != 0 ||
+                date_cmp(&e->expDate, &catalog->now) < 0 ||
+                (archive && fnmatch(descr, cfs->strs + e->descr, 0) != 0))
+        {
+            continue;
+        }
+        if(archive && filter &&
+                (date_cmp(&e->insDate, &filter->insLower) < 0 ||
+                 date_cmp(&e->insDate, &filter->insUpper) > 0 ||
+                 date_cmp(&e->expDate, &filter->expLower) < 0 ||
+                 date_cmp(&e->expDate, &filter->expUpper) > 0))
+        {
+            continue;
+        }
+
+        strcpy(rObjName->hl, hl);
+        strcpy(rObjName->ll, ll);
+        if(archive) {
+            qaResp.copyGroup = e->copyGroup;
+            snprintf(qaResp.mcName, sizeof(qaResp.mcName), "%s",
+                     cfs->strs + e->mcName);
+            snprintf(qaResp.owner, sizeof(qaResp.owner), "%s",
+                     cfs->strs + e->owner);
+            qaResp.objId = e->objId;
+            qaResp.mediaClass = e->mediaClass;
+            qaResp.insDate = e->insDate;
+            qaResp.expDate = e->expDate;
+            snprintf(qaResp.descr, sizeof(qaResp.descr), "%s",
+                     cfs->strs + e->descr);
+            qaResp.objInfolen = e->objInfolen;
+            memcpy(qaResp.objInfo, cfs->strs + e->objInfo, e->objInfolen);
+            qaResp.restoreOrderExt = e->restoreOrder;
+            qaResp.sizeEstimate = e->sizeEstimate;
+        }
+        else {
+            qbResp.copyGroup = e->copyGroup;
+            snprintf(qbResp.mcName, sizeof(qbResp.mcName), "%s",
+                     cfs->strs + e->mcName);
+            snprintf(qbResp.owner, sizeof(qbResp.owner), "%s",
+                     cfs->strs + e->owner);
+            qbResp.objId = e->objId;
+            qbResp.mediaClass = e->mediaClass;
+            qbResp.objState = e->state;
+            qbResp.insDate = e->insDate;
+            qbResp.expDate = e->expDate;
+            qbResp.objInfolen = e->objInfolen;
+            memcpy(qbResp.objInfo, cfs->strs + e->objInfo, e->objInfolen);
+            qbResp.restoreOrderExt = e->restoreOrder;
+            qbResp.sizeEstimate = e->sizeEstimate;
+        }
+        if(nmatch++ == 0) {
+            catalog->answered++;
+        }
+
+        if(verbose > 1) {
+            fprintf(stderr, "tsmpipe: Matched file %s%s%s in the catalog\n",
+                    rObjName->fs, rObjName->hl, rObjName->ll);
+        }
+        if(usercb == NULL) {
+            continue;
+        }
+        cbret = usercb(qType, &qResp, userdata);
+        if(cbret < 0) {
+            return DSM_RC_UNKNOWN_ERROR;
+        }
+        else if(cbret == 0) {
+            break;
+        }
+    }
+
+    if(nmatch == 0) {
+        if(verbose > 0) {
+            fprintf(stderr, "tsmpipe: No match for %s%s%s in the catalog, "
+                    "querying the server\n", objName->fs, objName->hl,
+                    objName->ll);
+        }
+        return DSM_RC_ABORT_NO_MATCH;
+    }
+
+    return DSM_RC_OK;
+}
+
+
+/* Drop deleted objects of filespace fs from the catalog, if it has one */
+void catalog_forget(dsUint32_t sesshandle, const char *fs,
+                    dsmSendType sendtype, dsStruct64_t *objIds, int n,
+                    char verbose)
+{
+    struct catalog_fs       *cfs;
+    struct catalog_cb_data  none;
+    struct catalog_new      *drop;
+    int                     archive, i;
+
+    archive = sendtype == stArchiveMountWait || sendtype == stArchive;
+    cfs = catalog_get(sesshandle, fs, archive, verbose);
+    if(cfs == NULL) {
+        return;
+    }
+
+    drop = malloc(n * sizeof(*drop));
+    if(drop == NULL) {
+        perror("tsmpipe: malloc");
+        return;
+    }
+    for(i = 0; i < n; i++) {
+        drop[i].ent.objId = objIds[i];
+    }
+    qsort(drop, n, sizeof(*drop), catalog_objidcmp);
+
+    memset(&none, 0, sizeof(none));
+    pthread_mutex_lock(&catalog->mutex);
+    if(!catalog_merge(cfs, &none, drop, n, verbose)) {
+        cfs->failed = 1;
+    }
+    pthread_mutex_unlock(&catalog->mutex);
+    free(drop);
+}
+
+
+/* Collects the object ids of catalog_query() answers */
+int tsm_catalogids_cb(dsmQueryType qType, DataBlk *qResp, void * userdata)
+{
+    struct catalog_cb_data  *cbdata = userdata;
+    struct catalog_new      *n;
+
+    if(cbdata->nnew == cbdata->maxnew) {
+        void *p;
+
+        cbdata->maxnew = cbdata->maxnew ? cbdata->maxnew * 2 : 1024;
+        p = realloc(cbdata->new, cbdata->maxnew * sizeof(*cbdata->new));
+        if(p == NULL) {
+            perror("tsmpipe: malloc");
+            return -1;
+        }
+        cbdata->new = p;
+    }
+    n = &cbdata->new[cbdata->nnew++];
+    memset(n, 0, sizeof(*n));
+    if(qType == qtArchive) {
+        n->ent.objId = ((qryRespArchiveData *) qResp->bufferPtr)->objId;
+    }
+    else {
+        n->ent.objId = ((qryRespBackupData *) qResp->bufferPtr)->objId;
+    }
+
+    return 1;
+}
+
+
+/*
+ * A get or delete of objects the catalog answered for failed. Compare its
+ * entries matching objName with the server and drop those that are gone,
+ * so the caller can try again. Returns 1 if there were any.
+ */
+int catalog_recheck(dsUint32_t sesshandle, char *fsname, char *filename,
+                    char *description, dsmSendType sendtype, char verbose)
+{
+    struct catalog_cb_data  had, live;
+    struct catalog_fs       *cfs;
+    struct tsm_qfilter      filter;
+    dsmObjName              objName;
+    dsInt16_t               rc;
+    int                     archive, i, n = 0, ok;
+
+    if(catalog == NULL || catalog->answered == 0) {
+        return 0;
+    }
+    archive = sendtype == stArchiveMountWait || sendtype == stArchive;
+    tsm_name2obj(fsname, filename, &objName);
+    cfs = catalog_get(sesshandle, objName.fs, archive, verbose);
+    if(cfs == NULL) {
+        return 0;
+    }
+
+    memset(&had, 0, sizeof(had));
+    memset(&live, 0, sizeof(live));
+    qfilter_default(&filter);
+    filter.maymiss = 1;
+    rc = catalog_query(sesshandle, &objName, description, sendtype, 0,
+                       &filter, tsm_catalogids_cb, &had);
+    ok = rc == DSM_RC_OK || rc == DSM_RC_ABORT_NO_MATCH;
+    if(ok) {
+        rc = tsm_querylive(sesshandle, &objName, description, sendtype,
+                           verbose, &filter, tsm_catalog_cb, &live);
+        ok = rc == DSM_RC_OK || rc == DSM_RC_ABORT_NO_MATCH;
+    }
+    if(ok && live.nnew > 0) {
+        qsort(live.new, live.nnew, sizeof(*live.new), catalog_objidcmp);
+    }
+    for(i = 0; ok && i < had.nnew; i++) {
+        if(live.nnew == 0 || !bsearch(&had.new[i], live.new, live.nnew,
+                                      sizeof(*live.new), catalog_objidcmp))
+        {
+            had.new[n++] = had.new[i];
+        }
+    }
+
+    if(ok && n > 0) {
+        fprintf(stderr, "tsmpipe: %d objects in the catalog are gone from "
+                "the server, trying again\n", n);
+        qsort(had.new, n, sizeof(*had.new), catalog_objidcmp);
+        pthread_mutex_lock(&catalog->mutex);
+        if(!catalog_merge(cfs, &live, had.new, n, verbose)) {
+            cfs->failed = 1;
+        }
+        pthread_mutex_unlock(&catalog->mutex);
+    }
+    free(had.new);
+    catalog_freenew(&live);
+
+    return ok && n > 0;
+}
+
+
+/* Query from the catalog with -g, or the server */
+dsInt16_t tsm_query(dsUint32_t sesshandle, dsmObjName *objName,
+                    char *description, dsmSendType sendtype, char verbose,
+                    const struct tsm_qfilter *filter,
+                    tsm_query_callback usercb, void * userdata)
+{
+    dsInt16_t   rc;
+
+    if(catalog != NULL) {
+        rc = catalog_query(sesshandle, objName, description, sendtype,
+                           verbose, filter, usercb, userdata);
+        if(rc != DSM_RC_ABORT_NO_MATCH) {
+            return rc;
+        }
+    }
+
+    return tsm_querylive(sesshandle, objName, description, sendtype,
+                         verbose, filter, usercb, userdata);
+}
+
+
+/*
+ * Query the objects matching objName and the -I/-E/-y/-P filters, and
+ * call usercb for each of them.
+ */
+dsInt16_t tsm_queryfile(dsUint32_t sesshandle, dsmObjName *objName,
+                        char *description, dsmSendType sendtype, char verbose,
+                        tsm_query_callback usercb, void * userdata)
+{
+    return tsm_query(sesshandle, objName, description, sendtype, verbose,
+                     qfilter, usercb, userdata);
+}
+
+
+/*
+ * Look up the objects that belong to one we already found: stripe
+ * sub-objects, segments and checksum companions. They are inserted
+ * together with it, but don't necessarily share its backup state or fall
+ * in the same date ranges, so only the point in time applies. Callers say
+ * what is missing themselves.
+ */
+dsInt16_t tsm_queryname(dsUint32_t sesshandle, dsmObjName *objName,
+                        char *description, dsmSendType sendtype, char verbose,
+                        tsm_query_callback usercb, void * userdata)
+{
+    struct tsm_qfilter  filter;
+
+    qfilter_default(&filter);
+    filter.maymiss = 1;
+    if(qfilter != NULL) {
+        filter.pitDate = qfilter->pitDate;
+        if(!qfilter_activeonly(qfilter)) {
+            filter.objState = DSM_ANY_MATCH;
+        }
+    }
+
+    return tsm_query(sesshandle, objName, description, sendtype, verbose,
+                     &filter, usercb, userdata);
+}
+
+
+struct matchone_cb_data {
+    int             numfound;
+    dsStruct64_t    objId;
+    dsStruct64_t    sizeEstimate;
+    dsUint32_t      copyGroup;
+    dsUint16_t      objInfolen;
+    char            objInfo[DSM_MAX_OBJINFO_LENGTH];
+};
+
+int tsm_matchone_cb(dsmQueryType qType, DataBlk *qResp, void * userdata)
+{
+    struct matchone_cb_data *cbdata = userdata;
+
+    cbdata->numfound++;
+
+    if(qType == qtArchive) {
+        qryRespArchiveData *qr = (void *) qResp->bufferPtr;
+        
+        cbdata->objId       = qr->objId;
+        cbdata->sizeEstimate = qr->sizeEstimate;
+        cbdata->objInfolen  = qr->objInfolen;
+        memcpy(cbdata->objInfo, qr->objInfo, qr->objInfolen);
+    }
+    else if(qType == qtBackup) {
+        qryRespBackupData *qr = (void *) qResp->bufferPtr;
+        
+        cbdata->objId       = qr->objId;
+        cbdata->sizeEstimate = qr->sizeEstimate;
+        cbdata->copyGroup   = qr->copyGroup;
+        cbdata->objInfolen  = qr->objInfolen;
+        memcpy(cbdata->objInfo, qr->objInfo, qr->objInfolen);
+    }
+    else {
+        fprintf(stderr,
+                "tsm_matchone_cb: Internal error: Unknown qType %d\n",
+                qType);
+        return -1;
+    }
+
+    if(cbdata->numfound > 1) {
+        fprintf(stderr, "tsmpipe: FAILED: The file specification matched multiple files.\n");
+        return -1;
+    }
+
+    return 1;
+}
+
+
+struct findsum_cb_data {
+    const char      *id;
+    struct tsm_sum  *sum;
+};
+
+int tsm_findsum_cb(dsmQueryType qType, DataBlk *qResp, void * userdata)
+{
+    struct findsum_cb_data  *cbdata = userdata;
+    char                    *rObjInfo;
+    dsUint16_t              rObjInfolen;
+    char                    id[DSM_MAX_OBJINFO_LENGTH + 1];
+
+    if(qType == qtArchive) {
+        qryRespArchiveData *qr = (void *) qResp->bufferPtr;
+
+        rObjInfo = qr->objInfo;
+        rObjInfolen = qr->objInfolen;
+    }
+    else if(qType == qtBackup) {
+        qryRespBackupData *qr = (void *) qResp->bufferPtr;
+
+        rObjInfo = qr->objInfo;
+        rObjInfolen = qr->objInfolen;
+    }
+    else {
+        fprintf(stderr,
+                "tsm_findsum_cb: Internal error: Unknown qType %d\n", qType);
+        return -1;
+    }
+
+    if(objinfo_get(rObjInfo, rObjInfolen, "sumof", id, sizeof(id)) &&
+            strcmp(id, cbdata->id) == 0)
+    {
+        sum_parse(rObjInfo, rObjInfolen, cbdata->sum);
+    }
+
+    return 1;
+}
+
+
+/*
+ * Find the size and checksum of objName given its objInfo, either in the
+ * objInfo itself or in its companion object.
+ * Returns 1 if found, 0 if there is none and -1 if the query failed.
+ */
+int tsm_findsum(dsUint32_t sesshandle, dsmObjName *objName,
+                const char *objinfo, int objinfolen, char *description,
+                dsmSendType sendtype, char verbose, struct tsm_sum *sum)
+{
+    struct findsum_cb_data  cbdata;
+    char                    id[DSM_MAX_OBJINFO_LENGTH + 1];
+    dsmObjName              sumName;
+    dsInt16_t               rc;
+
+    if(sum_parse(objinfo, objinfolen, sum)) {
+        return 1;
+    }
+    if(!objinfo_get(objinfo, objinfolen, "sum", id, sizeof(id)) ||
+            !tsm_sumname(objName, &sumName))
+    {
+        return 0;
+    }
+
+    cbdata.id = id;
+    cbdata.sum = sum;
+    rc = tsm_queryname(sesshandle, &sumName, description, sendtype, verbose,
+                       tsm_findsum_cb, &cbdata);
+    if(rc != DSM_RC_OK && rc != DSM_RC_ABORT_NO_MATCH) {
+        return -1;
+    }
+
+    return sum->valid;
+}
+
+
+/*
+ * Bulk delete, -U. All matching objects are collected with one query and
+ * deleted in transactions of up to maxObjPerTxn, optionally spread over
+ * several sessions with -S. The sub-objects of a striped object and the
+ * checksum companion of a -k one go right before it, in the same
+ * transaction if they fit, and it is only deleted if they were.
+ */
+
+/* An object to delete */
+struct bulkdel_obj {
+    dsStruct64_t    objId;
+    dsUint32_t      copyGroup;
+    char            *fs, *hl, *ll;
+    dsmDate         insDate;
+    char            *subid;     /* See tsm_subid() */
+    char            *sumid;     /* -k: sum=, of the object */
+    char            *sumof;     /* and sumof=, of the companion */
+    int             nsubs;      /* Sub-objects in front of this one */
+    int             sub;        /* This is one of them */
+    int             status;     /* 1 deleted, -1 failed */
+};
+
+struct bulkdel_cb_data {
+    int                 nobjs;
+    int                 maxobjs;
+    struct bulkdel_obj  *objs;
+};
+
+/* What each session deletes */
+struct bulkdel_worker {
+    dsUint32_t          sesshandle;
+    struct bulkdel_obj  *objs;
+    int                 nobjs;
+    dsmDelType          dType;
+    dsUint32_t          maxobj;
+    char                verbose;
+    int                 ntxns;
+    pthread_t           thread;
+    int                 started;
+};
+
+
+int tsm_bulkdel_cb(dsmQueryType qType, DataBlk *qResp, void * userdata)
+{
+    struct bulkdel_cb_data  *cbdata = userdata;
+    struct bulkdel_obj      *o;
+    dsmObjName              *rObjName;
+    char                    *rObjInfo;
+    dsUint16_t              rObjInfolen;
+    char                    id[DSM_MAX_OBJINFO_LENGTH + 1];
+    int                     nomem = 0;
+
+    if(cbdata->nobjs == cbdata->maxobjs) {
+        void *p;
+
+        cbdata->maxobjs = cbdata->maxobjs ? cbdata->maxobjs * 2 : 1024;
+        p = realloc(cbdata->objs, cbdata->maxobjs * sizeof(*cbdata->objs));
+        if(p == NULL) {
+            perror("tsmpipe: malloc");
+            return -1;
+        }
+        cbdata->objs = p;
+    }
+    o = &cbdata->objs[cbdata->nobjs];
+    memset(o, 0, sizeof(*o));
+
+    if(qType == qtArchive) {
+        qryRespArchiveData *qr = (void *) qResp->bufferPtr;
+
+        rObjName    = &qr->objName;
+        rObjInfo    = qr->objInfo;
+        rObjInfolen = qr->objInfolen;
+        o->objId    = qr->objId;
+        o->insDate  = qr->insDate;
+    }
+    else if(qType == qtBackup) {
+        qryRespBackupData *qr = (void *) qResp->bufferPtr;
+
+        rObjName        = &qr->objName;
+        rObjInfo        = qr->objInfo;
+        rObjInfolen     = qr->objInfolen;
+        o->objId        = qr->objId;
+        o->copyGroup    = qr->copyGroup;
+        o->insDate      = qr->insDate;
+    }
+    else {
+        fprintf(stderr,
+                "tsm_bulkdel_cb: Internal error: Unknown qType %d\n", qType);
+        return -1;
+    }
+
+    o->fs = strdup(rObjName->fs);
+    o->hl = strdup(rObjName->hl);
+    o->ll = strdup(rObjName->ll);
+    if(tsm_subid(rObjInfo, rObjInfolen, id, sizeof(id))) {
+        nomem |= (o->subid = strdup(id)) == NULL;
+    }
+    if(objinfo_get(rObjInfo, rObjInfolen, "sum", id, sizeof(id))) {
+        nomem |= (o->sumid = strdup(id)) == NULL;
+    }
+    if(objinfo_get(rObjInfo, rObjInfolen, "sumof", id, sizeof(id))) {
+        nomem |= (o->sumof = strdup(id)) == NULL;
+    }
+    cbdata->nobjs++;
+    if(!o->fs || !o->hl || !o->ll || nomem) {
+        perror("tsmpipe: malloc");
+        return -1;
+    }
+
+    return 1;
+}
+
+
+/* By filespace, for dropping them from the catalog a filespace at a time */
+int bulkdel_cmp(const void *a, const void *b) {
+    const struct bulkdel_obj    *x = a, *y = b;
+    int                         c;
+
+    c = strcmp(x->fs, y->fs);
+    if(c == 0) {
+        c = strcmp(x->hl, y->hl);
+    }
+    if(c == 0) {
+        c = strcmp(x->ll, y->ll);
+    }
+
+    return c;
+}
+
+
+/* Returns 1 if a sub-object of objs[i] could not be deleted */
+int bulkdel_subfailed(struct bulkdel_obj *objs, int i) {
+    int j;
+
+    for(j = i - objs[i].nsubs; j < i; j++) {
+        if(objs[j].status < 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Delete the objects of one worker, a transaction per maxobj objects.
+ * When a transaction fails, all its objects are marked failed. An object
+ * whose sub-objects failed in an earlier transaction is left alone, so
+ * they can still be found through it.
+ */
+void *bulkdel_worker(void *arg) {
+    struct bulkdel_worker   *w = arg;
+    delArch                 daInfo;
+    delBack                 dbInfo;
+    delBackID               dbidInfo;
+    dsmDelInfo              *dInfoP;
+    dsmObjName              objName;
+    dsInt16_t               rc;
+    int                     first, i, ok;
+
+    block_signals();
+
+    for(first = 0; first < w->nobjs; first = i) {
+        if(bulkdel_subfailed(w->objs, first)) {
+            w->objs[first].status = -1;
+            i = first + 1;
+            continue;
+        }
+        rc = dsmBeginTxn(w->sesshandle);
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(w->sesshandle, rc, "dsmBeginTxn failed");
+            break;
+        }
+        ok = 1;
+        for(i = first; i < w->nobjs && i - first < (int) w->maxobj; i++) {
+            struct bulkdel_obj *o = &w->objs[i];
+
+            if(i > first && bulkdel_subfailed(w->objs, i)) {
+                break;
+            }
+
+            if(w->dType == dtArchive) {
+                daInfo.stVersion = delArchVersion;
+                daInfo.objId = o->objId;
+                dInfoP = (dsmDelInfo *) &daInfo;
+            }
+            else if(w->dType == dtBackupID) {
+                dbidInfo.stVersion = delBackIDVersion;
+                dbidInfo.objId = o->objId;
+                dInfoP = (dsmDelInfo *) &dbidInfo;
+            }
+            else {
+                snprintf(objName.fs, sizeof(objName.fs), "%s", o->fs);
+                snprintf(objName.hl, sizeof(objName.hl), "%s", o->hl);
+                snprintf(objName.ll, sizeof(objName.ll), "%s", o->ll);
+                objName.objType = DSM_OBJ_FILE;
+                dbInfo.stVersion = delBackVersion;
+                dbInfo.objNameP = &objName;
+                dbInfo.copyGroup = o->copyGroup;
+                dInfoP = (dsmDelInfo *) &dbInfo;
+            }
+
+            rc = dsmDeleteObj(w->sesshandle, w->dType, *dInfoP);
+            if(rc == DSM_RC_NEEDTO_ENDTXN && i > first) {
+                /* The server wants a smaller transaction */
+                break;
+            }
+            if(rc != DSM_RC_OK) {
+                tsm_printerr(w->sesshandle, rc, "dsmDeleteObj failed");
+                ok = 0;
+                i++;
+                break;
+            }
+        }
+
+        ok = tsm_endtxn(w->sesshandle,
+                        ok ? DSM_VOTE_COMMIT : DSM_VOTE_ABORT);
+        w->ntxns++;
+        if(w->verbose > 1) {
+            fprintf(stderr, "tsmpipe: Transaction of %d deletes %s\n",
+                    i - first, ok ? "committed" : "failed");
+        }
+        for(; first < i; first++) {
+            w->objs[first].status = ok ? 1 : -1;
+        }
+    }
+
+    return NULL;
+}
+
+
+void bulkdel_freeobj(struct bulkdel_obj *o) {
+    free(o->fs);
+    free(o->hl);
+    free(o->ll);
+    free(o->subid);
+    free(o->sumid);
+    free(o->sumof);
+}
+
+
+void bulkdel_free(struct bulkdel_cb_data *cbdata) {
+    int i;
+
+    for(i = 0; i < cbdata->nobjs; i++) {
+        bulkdel_freeobj(&cbdata->objs[i]);
+    }
+    free(cbdata->objs);
+}
+
+
+/*
+ * Spread the objects over nsessions workers, worker 0 using our own
+ * session, and wait for them. Returns 0 if they couldn't all be started.
+ */
+int bulkdel_run(dsUint32_t sesshandle, struct bulkdel_cb_data *cbdata,
+                dsmDelType dType, dsUint32_t maxobj, int nsessions,
+                char *options, char verbose, int *ntxns)
+{
+    struct bulkdel_worker   *workers;
+    int                     n, per, i, err, ok = 1;
+    int                     start, end;
+
+    n = nsessions > cbdata->nobjs ? cbdata->nobjs : nsessions;
+    workers = calloc(n, sizeof(*workers));
+    if(workers == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+
+    /*
+     * Each worker gets a contiguous share, with sub-objects in the same
+     * one as the object they belong to
+     */
+    per = (cbdata->nobjs + n - 1) / n;
+    for(i = 0, start = 0; ok && i < n && start < cbdata->nobjs; i++) {
+        end = i == n - 1 || start + per > cbdata->nobjs ? cbdata->nobjs :
+              start + per;
+        while(end < cbdata->nobjs && cbdata->objs[end - 1].sub) {
+            end++;
+        }
+        workers[i].objs = cbdata->objs + start;
+        workers[i].nobjs = end - start;
+        start = end;
+        workers[i].dType = dType;
+        workers[i].maxobj = maxobj;
+        workers[i].verbose = verbose;
+        workers[i].sesshandle = i ? tsm_initsess(options) : sesshandle;
+        ok = workers[i].sesshandle != 0;
+    }
+    n = i;
+    if(ok && verbose > 1 && n > 1) {
+        fprintf(stderr, "tsmpipe: %d sessions initiated\n", n);
+    }
+
+    for(i = 0; ok && i < n; i++) {
+        err = pthread_create(&workers[i].thread, NULL, bulkdel_worker,
+                             &workers[i]);
+        if(err) {
+            fprintf(stderr, "tsmpipe: pthread_create: %s\n", strerror(err));
+            ok = 0;
+            break;
+        }
+        workers[i].started = 1;
+    }
+
+    for(i = 0; i < n; i++) {
+        if(workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        *ntxns += workers[i].ntxns;
+        if(i > 0 && workers[i].sesshandle) {
+            dsmTerminate(workers[i].sesshandle);
+        }
+    }
+    free(workers);
+
+    return ok;
+}
+
+
+/* Drop the deleted objects from the catalog, a filespace at a time */
+void bulkdel_forget(dsUint32_t sesshandle, struct bulkdel_cb_data *cbdata,
+                    dsmSendType sendtype, char verbose)
+{
+    dsStruct64_t    *objIds;
+    int             i, j, n;
+
+    objIds = malloc(cbdata->nobjs * sizeof(*objIds));
+    if(objIds == NULL) {
+        perror("tsmpipe: malloc");
+        return;
+    }
+    for(i = 0; i < cbdata->nobjs; i = j) {
+        for(j = i, n = 0; j < cbdata->nobjs &&
+                strcmp(cbdata->objs[j].fs, cbdata->objs[i].fs) == 0; j++)
+        {
+            if(cbdata->objs[j].status > 0) {
+                objIds[n++] = cbdata->objs[j].objId;
+            }
+        }
+        if(n > 0) {
+            catalog_forget(sesshandle, cbdata->objs[i].fs, sendtype, objIds,
+                           n, verbose);
+        }
+    }
+    free(objIds);
+}
+
+
+dsmDelType bulkdel_type(dsmSendType sendtype) {
+    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
+        return dtArchive;
+    }
+    if(!qfilter_activeonly(qfilter)) {
+        /* Not necessarily the active version, delete it by id */
+        return dtBackupID;
+    }
+
+    return dtBackup;
+}
+
+
+int bulkdel_objidcmp(const void *a, const void *b) {
+    const dsStruct64_t  *x = a, *y = b;
+
+    if(x->hi != y->hi) {
+        return x->hi < y->hi ? -1 : 1;
+    }
+    if(x->lo != y->lo) {
+        return x->lo < y->lo ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Append the objects matching objName to subs. With sumof, only keep
+ * the checksum companion of that object version. Returns 0 on errors.
+ */
+int bulkdel_querysubs(dsUint32_t sesshandle, dsmObjName *objName,
+                      char *description, dsmSendType sendtype, char verbose,
+                      char *sumof, struct bulkdel_cb_data *subs)
+{
+    dsInt16_t   rc;
+    int         i, n = subs->nobjs;
+
+    rc = tsm_queryname(sesshandle, objName, description, sendtype,
+                       verbose, tsm_bulkdel_cb, subs);
+    if(rc != DSM_RC_OK && rc != DSM_RC_ABORT_NO_MATCH) {
+        return 0;
+    }
+    if(sumof == NULL) {
+        return 1;
+    }
+
+    for(i = n; i < subs->nobjs; i++) {
+        if(subs->objs[i].sumof && strcmp(subs->objs[i].sumof, sumof) == 0) {
+            subs->objs[n++] = subs->objs[i];
+        }
+        else {
+            bulkdel_freeobj(&subs->objs[i]);
+        }
+    }
+    subs->nobjs = n;
+
+    return 1;
+}
+
+
+/*
+ * Look up the sub-objects and checksum companions of the objects in
+ * cbdata, sorted by name, and put them in front of the object they belong
+ * to. Those that matched by themselves are moved there. Returns 0 on
+ * fatal errors.
+ */
+int bulkdel_addsubs(dsUint32_t sesshandle, struct bulkdel_cb_data *cbdata,
+                    char *description, dsmSendType sendtype, char verbose)
+{
+    struct bulkdel_cb_data  subs;
+    struct bulkdel_obj      *objs, *o, *prev;
+    dsStruct64_t            *subIds;
+    dsmObjName              objName, sumName;
+    int                     i, j, k, n;
+
+    memset(&subs, 0, sizeof(subs));
+    for(i = 0; i < cbdata->nobjs; i++) {
+        o = &cbdata->objs[i];
+        prev = i > 0 ? &cbdata->objs[i - 1] : NULL;
+        n = subs.nobjs;
+        snprintf(objName.fs, sizeof(objName.fs), "%s", o->fs);
+        snprintf(objName.hl, sizeof(objName.hl), "%s", o->hl);
+        objName.objType = DSM_OBJ_FILE;
+
+        /* Backup versions can share their sub-objects */
+        if(o->subid && !(prev && prev->subid &&
+                         strcmp(prev->subid, o->subid) == 0 &&
+                         bulkdel_cmp(prev, o) == 0))
+        {
+            snprintf(objName.ll, sizeof(objName.ll), "%s.%s.*", o->ll,
+                     o->subid);
+            if(!bulkdel_querysubs(sesshandle, &objName, description,
+                                  sendtype, verbose, NULL, &subs))
+            {
+                bulkdel_free(&subs);
+                return 0;
+            }
+        }
+        if(o->sumid) {
+            snprintf(objName.ll, sizeof(objName.ll), "%s", o->ll);
+            if(tsm_sumname(&objName, &sumName) &&
+                    !bulkdel_querysubs(sesshandle, &sumName, description,
+                                       sendtype, verbose, o->sumid, &subs))
+            {
+                bulkdel_free(&subs);
+                return 0;
+            }
+        }
+        o->nsubs = subs.nobjs - n;
+    }
+    if(subs.nobjs == 0) {
+        return 1;
+    }
+
+    subIds = malloc(subs.nobjs * sizeof(*subIds));
+    objs = malloc((cbdata->nobjs + subs.nobjs) * sizeof(*objs));
+    if(subIds == NULL || objs == NULL) {
+        perror("tsmpipe: malloc");
+        free(subIds);
+        free(objs);
+        bulkdel_free(&subs);
+        return 0;
+    }
+    for(j = 0; j < subs.nobjs; j++) {
+        subIds[j] = subs.objs[j].objId;
+    }
+    qsort(subIds, subs.nobjs, sizeof(*subIds), bulkdel_objidcmp);
+
+    for(i = 0, j = 0, k = 0; i < cbdata->nobjs; i++) {
+        o = &cbdata->objs[i];
+        if(bsearch(&o->objId, subIds, subs.nobjs, sizeof(*subIds),
+                   bulkdel_objidcmp))
+        {
+            bulkdel_freeobj(o);
+            continue;
+        }
+        for(n = 0; n < o->nsubs; n++) {
+            objs[k] = subs.objs[j++];
+            objs[k++].sub = 1;
+        }
+        objs[k++] = *o;
+    }
+
+    free(cbdata->objs);
+    cbdata->objs = objs;
+    cbdata->maxobjs = cbdata->nobjs + subs.nobjs;
+    cbdata->nobjs = k;
+    free(subs.objs);
+    free(subIds);
+
+    return 1;
+}
+
+
+/* -d: delete the object matching the file specification */
+int tsm_deletefile(dsUint32_t sesshandle, char *fsname, char *filename, 
+                   char *description, dsmSendType sendtype, char verbose)
+{
+    struct bulkdel_cb_data  cbdata;
+    dsmObjName              objName;
+    dsUint32_t              maxobj;
+    unsigned long long      maxbytes;
+    dsInt16_t               rc;
+    int                     i, ok, failed = 0, ntxns = 0;
+
+    tsm_name2obj(fsname, filename, &objName);
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Deleting file %s%s%s\n",
+                objName.fs, objName.hl, objName.ll);
+    }
+
+    memset(&cbdata, 0, sizeof(cbdata));
+    rc = tsm_queryfile(sesshandle, &objName, description, sendtype, 
+                       verbose, tsm_bulkdel_cb, &cbdata);
+    ok = rc == DSM_RC_OK;
+
+    if(ok && cbdata.nobjs == 0) {
+        fprintf(stderr, "tsmpipe: FAILED: The file specification did not match any file.\n");
+        ok = 0;
+    }
+    else if(ok && cbdata.nobjs > 1) {
+        fprintf(stderr, "tsmpipe: FAILED: The file specification matched multiple files.\n");
+        ok = 0;
+    }
+
+    if(ok) {
+        ok = bulkdel_addsubs(sesshandle, &cbdata, description, sendtype,
+                             verbose) &&
+             tsm_txnlimits(sesshandle, &maxobj, &maxbytes) &&
+             bulkdel_run(sesshandle, &cbdata, bulkdel_type(sendtype), maxobj,
+                         1, NULL, verbose, &ntxns);
+    }
+    if(ok) {
+        for(i = 0; i < cbdata.nobjs; i++) {
+            failed += cbdata.objs[i].status <= 0;
+        }
+        if(failed) {
+            fprintf(stderr, "tsmpipe: FAILED: %d of %d objects, with the "
+                    "sub-objects, not deleted\n", failed, cbdata.nobjs);
+            ok = 0;
+        }
+        if(catalog != NULL) {
+            bulkdel_forget(sesshandle, &cbdata, sendtype, verbose);
+        }
+    }
+
+    bulkdel_free(&cbdata);
+
+    return ok;
+}
+
+
+/*
+ * Delete the sub-objects filename.id.* of an object that failed to be
+ * stored or, only inactivating them, of one replaced by a new backup
+ * version. Returns 0 if that failed.
+ */
+int tsm_deletesubs(dsUint32_t sesshandle, char *fsname, char *filename,
+                   char *id, char *description, dsmSendType sendtype,
+                   char verbose)
+{
+    struct bulkdel_cb_data  cbdata;
+    struct tsm_qfilter      filter;
+    dsmObjName              objName;
+    char                    name[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 1];
+    dsUint32_t              maxobj;
+    unsigned long long      maxbytes;
+    dsInt16_t               rc;
+    int                     i, ok, ntxns = 0;
+
+    snprintf(name, sizeof(name), "%s.%s.*", filename, id);
+    tsm_name2obj(fsname, name, &objName);
+    qfilter_default(&filter);
+    filter.maymiss = 1;
+
+    memset(&cbdata, 0, sizeof(cbdata));
+    rc = tsm_querylive(sesshandle, &objName, description, sendtype, verbose,
+                       &filter, tsm_bulkdel_cb, &cbdata);
+    ok = rc == DSM_RC_OK || rc == DSM_RC_ABORT_NO_MATCH;
+
+    if(ok && cbdata.nobjs > 0) {
+        ok = tsm_txnlimits(sesshandle, &maxobj, &maxbytes) &&
+             bulkdel_run(sesshandle, &cbdata,
+                         sendtype == stArchiveMountWait ||
+                         sendtype == stArchive ? dtArchive : dtBackup,
+                         maxobj, 1, NULL, verbose, &ntxns);
+        for(i = 0; ok && i < cbdata.nobjs; i++) {
+            ok = cbdata.objs[i].status > 0;
+        }
+        if(catalog != NULL) {
+            bulkdel_forget(sesshandle, &cbdata, sendtype, verbose);
+        }
+        if(ok && verbose > 0) {
+            fprintf(stderr, "tsmpipe: Deleted %d sub-objects %s%s\n",
+                    cbdata.nobjs, objName.fs, name);
+        }
+    }
+    bulkdel_free(&cbdata);
+
+    return ok;
+}
+
+
+/*
+ * -B: find the sub-object id of the active version of filename into id,
+ * empty if it has none, to inactivate its sub-objects once a new version
+ * has replaced it. Returns 0 if the query failed.
+ */
+int tsm_activesubid(dsUint32_t sesshandle, char *fsname, char *filename,
+                    char *description, char verbose, char *id, size_t len)
+{
+    struct bulkdel_cb_data  cbdata;
+    struct tsm_qfilter      filter;
+    dsmObjName              objName;
+    dsInt16_t               rc;
+
+    *id = '\0';
+    tsm_name2obj(fsname, filename, &objName);
+    qfilter_default(&filter);
+    filter.maymiss = 1;
+
+    memset(&cbdata, 0, sizeof(cbdata));
+    rc = tsm_querylive(sesshandle, &objName, description, stBackup, verbose,
+                       &filter, tsm_bulkdel_cb, &cbdata);
+    if(rc == DSM_RC_OK && cbdata.nobjs > 0 && cbdata.objs[0].subid) {
+        snprintf(id, len, "%s", cbdata.objs[0].subid);
+    }
+    bulkdel_free(&cbdata);
+
+    return rc == DSM_RC_OK || rc == DSM_RC_ABORT_NO_MATCH;
+}
+
+
+/*
+ * Delete all objects matching the file specification and filters, -U, or
+ * with dryrun only print what would be deleted. Prints
+ * DELETED/FAILED/DRYRUN<TAB>objid<TAB>filepath per object on stdout.
+ *
+ * Returns the number of objects that failed, or -1 on fatal errors.
+ */
+int tsm_bulkdelete(dsUint32_t sesshandle, char *fsname, char *filename,
+                   char *description, dsmSendType sendtype, char verbose,
+                   char *options, int nsessions, int dryrun)
+{
+    struct bulkdel_cb_data  cbdata;
+    struct bulkdel_obj      *o;
+    struct tsm_qfilter      filter;
+    dsmObjName              objName;
+    dsmDelType              dType;
+    dsUint32_t              maxobj;
+    unsigned long long      maxbytes;
+    dsInt16_t               rc;
+    int                     i, ok, failed = 0, ntxns = 0;
+    double                  start = timenow();
+
+    tsm_name2obj(fsname, filename, &objName);
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Deleting files matching %s%s%s\n",
+                objName.fs, objName.hl, objName.ll);
+    }
+
+    /* A sweep that finds nothing left to delete is fine */
+    if(qfilter != NULL) {
+        filter = *qfilter;
+    }
+    else {
+        qfilter_default(&filter);
+    }
+    filter.maymiss = 1;
+
+    memset(&cbdata, 0, sizeof(cbdata));
+    rc = tsm_query(sesshandle, &objName, description, sendtype, verbose,
+                   &filter, tsm_bulkdel_cb, &cbdata);
+    if(rc != DSM_RC_OK && rc != DSM_RC_ABORT_NO_MATCH) {
+        bulkdel_free(&cbdata);
+        return -1;
+    }
+    if(cbdata.nobjs == 0) {
+        fprintf(stderr, "tsmpipe: %s 0 objects, none matched\n",
+                dryrun ? "Would delete" : "Deleted");
+        return 0;
+    }
+    qsort(cbdata.objs, cbdata.nobjs, sizeof(*cbdata.objs), bulkdel_cmp);
+    if(!bulkdel_addsubs(sesshandle, &cbdata, description, sendtype,
+                        verbose))
+    {
+        bulkdel_free(&cbdata);
+        return -1;
+    }
+
+    if(dryrun) {
+        for(i = 0; i < cbdata.nobjs; i++) {
+            o = &cbdata.objs[i];
+            printf("DRYRUN\t%llu\t%s%s%s\n", u64(&o->objId), o->fs, o->hl,
+                   o->ll);
+        }
+        fprintf(stderr, "tsmpipe: Would delete %d objects\n", cbdata.nobjs);
+        bulkdel_free(&cbdata);
+        return 0;
+    }
+
+    dType = bulkdel_type(sendtype);
+
+    if(!tsm_txnlimits(sesshandle, &maxobj, &maxbytes)) {
+        bulkdel_free(&cbdata);
+        return -1;
+    }
+
+    ok = bulkdel_run(sesshandle, &cbdata, dType, maxobj, nsessions, options,
+                     verbose, &ntxns);
+
+    for(i = 0; i < cbdata.nobjs; i++) {
+        o = &cbdata.objs[i];
+        printf("%s\t%llu\t%s%s%s\n", o->status > 0 ? "DELETED" : "FAILED",
+               u64(&o->objId), o->fs, o->hl, o->ll);
+        failed += o->status <= 0;
+    }
+    if(catalog != NULL) {
+        bulkdel_forget(sesshandle, &cbdata, sendtype, verbose);
+    }
+
+    fprintf(stderr, "tsmpipe: Deleted %d objects in %d transactions in %.1f "
+            "seconds, %d failed\n", cbdata.nobjs - failed, ntxns,
+            timenow() - start, failed);
+
+    bulkdel_free(&cbdata);
+
+    return ok ? failed : -1;
+}
+
+
+/*
+ * Get the data of the current object in a dsmBeginGetData list into the
+ * ring, at most limit bytes if limit >= 0. *got is set to the number of
+ * bytes put in the ring.
+ * Returns 1 when the object is complete, 2 if there is more data than
+ * limit and 0 on failure (API error, or the consumer aborted).
+ */
+int tsm_getobj(dsUint32_t sesshandle, dsStruct64_t *objId,
+               struct tsm_ring *ring, tsmpipe_xfer_t *xfer,
+               struct tsm_adapt *adapt, off_t limit, off_t *got,
+               char verbose)
+{
+    dsInt16_t   rc;
+    DataBlk     dataBlk;
+    size_t      fill;
+    size_t      len;
+    char        first = 1;
+    double      t;
+
+    *got = 0;
+
+    /* Keep the API busy filling buffers while the writer drains them */
+    dataBlk.stVersion = DataBlkVersion;
+    while((dataBlk.bufferPtr = ring_getfree(ring, &fill)) != NULL) {
+        dataBlk.bufferLen = fill;
+        dataBlk.numBytes = 0;
+        if(first) {
+            throttle_object();
+            t = timenow();
+            rc = dsmGetObj(sesshandle, objId, &dataBlk);
+            first = 0;
+        }
+        else {
+            t = timenow();
+            rc = dsmGetData(sesshandle, &dataBlk);
+        }
+        if(rc != DSM_RC_MORE_DATA && rc != DSM_RC_FINISHED) {
+            tsm_printerr(sesshandle, rc, "dsmGetObj/dsmGetData failed");
+            return 0;
+        }
+        stats_add(stat_api, t, dataBlk.numBytes);
+        throttle_bytes(dataBlk.numBytes);
+        len = dataBlk.numBytes;
+        if(limit >= 0 && *got + (off_t) len > limit) {
+            len = limit - *got;
+            rc = DSM_RC_MORE_DATA;
+        }
+        if(len > 0) {
+            ring_put(ring, len);
+            *got += len;
+        }
+        if(xfer->adaptive && adapt_update(adapt, dataBlk.numBytes, verbose)) {
+            ring_setfill(ring, adapt_size(adapt));
+        }
+        if(rc == DSM_RC_FINISHED) {
+            stats_got();
+            return 1;
+        }
+        if(limit >= 0 && *got == limit) {
+            stats_got();
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Get exactly len bytes of the current object in a dsmBeginGetData list,
+ * fewer only at the end of the object. *state is 0 before the first call
+ * for an object, and is then kept by us: 1 while there is more data, 2 at
+ * the end.
+ * Returns the number of bytes got, or -1 on failure.
+ */
+ssize_t tsm_getbytes(dsUint32_t sesshandle, dsStruct64_t *objId, char *buf,
+                     size_t len, int *state)
+{
+    dsInt16_t   rc;
+    DataBlk     dataBlk;
+    size_t      got = 0;
+    double      t;
+
+    dataBlk.stVersion = DataBlkVersion;
+    while(got < len && *state != 2) {
+        dataBlk.bufferPtr = buf + got;
+        dataBlk.bufferLen = len - got;
+        dataBlk.numBytes = 0;
+        if(*state == 0) {
+            throttle_object();
+            t = timenow();
+            rc = dsmGetObj(sesshandle, objId, &dataBlk);
+            *state = 1;
+        }
+        else {
+            t = timenow();
+            rc = dsmGetData(sesshandle, &dataBlk);
+        }
+        if(rc == DSM_RC_FINISHED) {
+            *state = 2;
+            stats_got();
+        }
+        else if(rc != DSM_RC_MORE_DATA) {
+            tsm_printerr(sesshandle, rc, "dsmGetObj/dsmGetData failed");
+            return -1;
+        }
+        stats_add(stat_api, t, dataBlk.numBytes);
+        throttle_bytes(dataBlk.numBytes);
+        got += dataBlk.numBytes;
+    }
+
+    return got;
+}
+
+
+/* Writer thread for tsm_getcompressed(): zpool -> fd */
+void *zpool_writer(void *arg) {
+    struct tsm_zpool    *pool = arg;
+    struct tsm_ring     *ring = pool->ring;
+    char                *buf;
+    size_t              nbytes, inbytes;
+    double              t;
+
+    block_signals();
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while((buf = zpool_getfull(pool, &nbytes, &inbytes)) != NULL) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        t = timenow();
+        /* The end frame of an encrypted object is empty */
+        if(nbytes > 0 && ring_out(ring, buf, nbytes) < 0) {
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            ring_abort(ring, errno);
+            return NULL;
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        stats_add(stat_output, t, nbytes);
+        zpool_release(pool);
+    }
+    ring_outdone(ring);
+
+    return NULL;
+}
+
+
+/*
+ * Get the current object in a dsmBeginGetData list, stored by -z with
+ * codec and/or by -K with crypt, and the given block size, and write it
+ * decompressed and decrypted to outfd (or give it to verify). The frames
+ * are read whole into the ring, one per slot, so they can be handled in
+ * parallel.
+ */
+int tsm_getcompressed(dsUint32_t sesshandle, dsStruct64_t *objId,
+                      const struct tsm_codec *codec,
+                      const struct tsm_crypt *crypt, size_t block,
+                      tsmpipe_xfer_t *xfer, int outfd,
+                      struct tsm_verify *verify, char verbose)
+{
+    struct tsm_ring     ring;
+    struct tsm_zpool    zpool;
+    pthread_t           writer;
+    char                *buf;
+    size_t              fill, rawlen = 0, storedlen = 0, maxstored;
+    ssize_t             n;
+    int                 raw, err, state = 0;
+    char                done = 0, ended = 0;
+
+    maxstored = codec ? codec->bound(block) : block;
+    if(maxstored < block) {
+        maxstored = block;
+    }
+    if(crypt) {
+        maxstored += CRYPT_TAGLEN;
+    }
+
+    if(!ring_init(&ring, xfer->qdepth, ZHDRLEN + maxstored, xfer->hugepages,
+                  verbose))
+    {
+        return 0;
+    }
+    ring_reset(&ring, outfd);
+    if(verify) {
+        ring.sink = verify_sink;
+        ring.sinkarg = verify;
+    }
+    else if(!codec || !codec->sparse || !ring_sparse(&ring, verbose)) {
+        ring_output(&ring, verbose);
+        set_pipesize(outfd, PIPESIZE, verbose);
+    }
+
+    if(!zpool_init(&zpool, &ring, codec, crypt, 0, 1, xfer->zthreads,
+                   block))
+    {
+        ring_free(&ring);
+        return 0;
+    }
+    if(!zpool_start(&zpool)) {
+        zpool_stop(&zpool);
+        zpool_free(&zpool);
+        ring_free(&ring);
+        return 0;
+    }
+
+    err = pthread_create(&writer, NULL, zpool_writer, &zpool);
+    if(err) {
+        fprintf(stderr, "tsmpipe: pthread_create: %s\n", strerror(err));
+        zpool_stop(&zpool);
+        zpool_free(&zpool);
+        ring_free(&ring);
+        return 0;
+    }
+
+    while((buf = ring_getfree(&ring, &fill)) != NULL) {
+        n = tsm_getbytes(sesshandle, objId, buf, ZHDRLEN, &state);
+        if(n == 0) {
+            done = 1;
+            break;
+        }
+        if(n < 0) {
+            break;
+        }
+        if(n == ZHDRLEN) {
+            zframe_get(buf, &rawlen, &storedlen, &raw);
+        }
+        if(n < ZHDRLEN || rawlen > block || storedlen > maxstored ||
+                ended)
+        {
+            zpool.corrupt = 1;
+            break;
+        }
+        /* Only the end frame of an encrypted object is empty */
+        ended = crypt && rawlen == 0;
+        n = tsm_getbytes(sesshandle, objId, buf + ZHDRLEN, storedlen, &state);
+        if(n < 0) {
+            break;
+        }
+        if((size_t) n < storedlen) {
+            zpool.corrupt = 1;
+            break;
+        }
+        ring_put(&ring, ZHDRLEN + storedlen);
+    }
+
+    if(done && crypt && !ended) {
+        zpool.corrupt = 1;
+        done = 0;
+    }
+    if(done) {
+        ring_close(&ring, 0);
+        pthread_join(writer, NULL);
+        zpool_join(&zpool);
+        done = !ring.aborted;
+    }
+    else {
+        stop_helper(&ring, writer);
+        zpool_join(&zpool);
+    }
+
+    if(zpool.corrupt && crypt) {
+        fprintf(stderr, "tsmpipe: FAILED: Encrypted data failed "
+                "authentication or is truncated, wrong key or tampered "
+                "with\n");
+    }
+    else if(zpool.corrupt) {
+        fprintf(stderr, "tsmpipe: FAILED: Corrupt %s compressed data\n",
+                codec->name);
+    }
+    if(ring.err) {
+        fprintf(stderr, "tsmpipe: write: %s\n", strerror(ring.err));
+    }
+    if(done && verbose > 0) {
+        zpool_report(&zpool);
+        ring_report(&ring, verify ? "verify" :
+                           outfd == STDOUT_FILENO ? "stdout" : "output");
+    }
+    zpool_free(&zpool);
+    ring_free(&ring);
+
+    return done;
+}
+
+
+/*
+ * Striping, -S. The data is cut in stripes of stripesize bytes that are
+ * dealt round-robin to nstripes sub-objects, each of which is sent or got
+ * over its own session by its own thread. A descriptor object with the
+ * original name records the layout in its objInfo, so -x finds the
+ * sub-objects by itself.
+ */
+
+/* Default -Z. The worker rings should hold a few stripes each. */
+#define DEF_STRIPESIZE  (1024*1024)
+
+/* Limit for -S */
+#define MAX_STRIPES     64
+
+struct stripe_layout {
+    int                 nstripes;
+    unsigned long long  stripesize;
+    unsigned long long  length;
+    char                id[32];     /* Tells this set of sub-objects apart */
+};
+
+/* What the workers share */
+struct stripe_job {
+    char                    *fsname;
+    char                    *filename;
+    char                    *description;
+    dsmSendType             sendtype;
+    dsmGetType              getType;
+    char                    verbose;
+    tsmpipe_xfer_t          *xfer;
+    struct stripe_layout    layout;
+    off_t                   estimate;   /* Size estimate per sub-object */
+    int                     outfd;      /* Written with pwrite, or -1 */
+    off_t                   outbase;    /* Where the data starts in outfd */
+    struct tsm_sum          sum;        /* Of all the data, with -k */
+};
+
+struct stripe_worker {
+    int                     idx;
+    dsUint32_t              sesshandle;
+    pthread_t               thread;
+    char                    started;
+    struct tsm_ring         ring;
+    struct stripe_job       *job;
+    off_t                   bytes;
+    int                     ok;
+};
+
+
+/* Filename of sub-object idx */
+void stripe_name(char *buf, size_t len, char *filename,
+                 struct stripe_layout *layout, int idx)
+{
+    snprintf(buf, len, "%s.%s.%03d", filename, layout->id, idx);
+}
+
+
+/* Returns 1 if objInfo is that of a descriptor object */
+int stripe_parse(const char *objinfo, int len, struct stripe_layout *layout) {
+    char    val[DSM_MAX_OBJINFO_LENGTH + 1];
+
+    if(!objinfo_get(objinfo, len, "stripes", val, sizeof(val))) {
+        return 0;
+    }
+    layout->nstripes = atoi(val);
+    if(!objinfo_get(objinfo, len, "stripesize", val, sizeof(val))) {
+        return 0;
+    }
+    layout->stripesize = strtoull(val, NULL, 10);
+    if(!objinfo_get(objinfo, len, "length", val, sizeof(val))) {
+        return 0;
+    }
+    layout->length = strtoull(val, NULL, 10);
+    if(!objinfo_get(objinfo, len, "id", layout->id, sizeof(layout->id))) {
+        return 0;
+    }
+
+    return layout->nstripes >= 1 && layout->nstripes <= MAX_STRIPES &&
+           layout->stripesize > 0;
+}
+
+
+void stripe_abort(struct stripe_worker *workers, int n) {
+    int i;
+
+    for(i = 0; i < n; i++) {
+        ring_abort(&workers[i].ring, 0);
+    }
+}
+
+
+/* Wait for the workers and tear down what stripe_start() set up */
+void stripe_stop(struct stripe_worker *workers, int n) {
+    int i;
+
+    for(i = 0; i < n; i++) {
+        if(workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+            workers[i].started = 0;
+        }
+    }
+    for(i = 0; i < n; i++) {
+        if(workers[i].ring.mem) {
+            ring_free(&workers[i].ring);
+        }
+        /* Worker 0 borrows the main session */
+        if(i > 0 && workers[i].sesshandle) {
+            dsmTerminate(workers[i].sesshandle);
+        }
+    }
+}
+
+
+/*
+ * Open a session and a ring for each worker and start them. Worker 0 uses
+ * our own session so it doesn't time out while idle. Returns 0 if it
+ * failed, in which case everything has been torn down again.
+ */
+int stripe_start(struct stripe_worker *workers, struct stripe_job *job,
+                 dsUint32_t sesshandle, char *options, void *(*func)(void *))
+{
+    tsmpipe_xfer_t  *xfer = job->xfer;
+    int             n = job->layout.nstripes;
+    int             i, err;
+
+    memset(workers, 0, n * sizeof(*workers));
+
+    for(i = 0; i < n; i++) {
+        workers[i].idx = i;
+        workers[i].job = job;
+        workers[i].sesshandle = i ? tsm_initsess(options) : sesshandle;
+        if(!workers[i].sesshandle) {
+            stripe_stop(workers, n);
+            return 0;
+        }
+        if(!ring_init(&workers[i].ring, xfer->qdepth, xfer->slotsize,
+                      xfer->hugepages, job->verbose))
+        {
+            workers[i].ring.mem = NULL;
+            stripe_stop(workers, n);
+            return 0;
+        }
+        ring_reset(&workers[i].ring, -1);
+        ring_setfill(&workers[i].ring, xfer->bufsize);
+    }
+
+    if(job->verbose > 1) {
+        fprintf(stderr, "tsmpipe: %d sessions initiated\n", n);
+    }
+
+    for(i = 0; i < n; i++) {
+        err = pthread_create(&workers[i].thread, NULL, func, &workers[i]);
+        if(err) {
+            fprintf(stderr, "tsmpipe: pthread_create: %s\n", strerror(err));
+            stripe_abort(workers, n);
+            stripe_stop(workers, n);
+            return 0;
+        }
+        workers[i].started = 1;
+    }
+
+    return 1;
+}
+
+
+/* Sends the sub-object of one worker, fed by tsm_sendstriped() */
+void *stripe_sender(void *arg) {
+    struct stripe_worker    *w = arg;
+    struct stripe_job       *job = w->job;
+    char                    name[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 1];
+    dsmObjName              objName;
+    dsInt16_t               rc;
+
+    block_signals();
+
+    stripe_name(name, sizeof(name), job->filename, &job->layout, w->idx);
+    tsm_name2obj(job->fsname, name, &objName);
+
+    rc = dsmBeginTxn(w->sesshandle);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(w->sesshandle, rc, "dsmBeginTxn failed");
+    }
+    else if(tsm_sendobj(w->sesshandle, &objName, job->estimate,
+                        job->description, NULL, job->sendtype, -1,
+                        job->verbose, job->xfer, &w->ring, &w->bytes, NULL))
+    {
+        w->ok = tsm_endtxn(w->sesshandle, DSM_VOTE_COMMIT);
+    }
+    else {
+        tsm_endtxn(w->sesshandle, DSM_VOTE_ABORT);
+    }
+
+    if(!w->ok) {
+        /* Make tsm_sendstriped() stop feeding us */
+        ring_abort(&w->ring, 0);
+    }
+
+    return NULL;
+}
+
+
+/* Send a small descriptor object with the layout as its objInfo */
+int stripe_senddesc(dsUint32_t sesshandle, struct stripe_job *job,
+                    struct tsm_ring *ring)
+{
+    struct stripe_layout    *layout = &job->layout;
+    char                    objinfo[DSM_MAX_OBJINFO_LENGTH + 1] = "";
+    char                    text[DSM_MAX_OBJINFO_LENGTH + 2];
+    char                    num[32];
+    dsmObjName              objName;
+    dsInt16_t               rc;
+    off_t                   sent;
+
+    snprintf(num, sizeof(num), "%d", layout->nstripes);
+    objinfo_add(objinfo, sizeof(objinfo), "stripes", num);
+    snprintf(num, sizeof(num), "%llu", layout->stripesize);
+    objinfo_add(objinfo, sizeof(objinfo), "stripesize", num);
+    snprintf(num, sizeof(num), "%llu", layout->length);
+    objinfo_add(objinfo, sizeof(objinfo), "length", num);
+    objinfo_add(objinfo, sizeof(objinfo), "id", layout->id);
+    if(job->xfer->checksum) {
+        snprintf(num, sizeof(num), "%08x", (unsigned int) job->sum.crc);
+        objinfo_add(objinfo, sizeof(objinfo), "crc32c", num);
+    }
+    snprintf(text, sizeof(text), "%s\n", objinfo);
+
+    ring_reset(ring, -1);
+    ring_write(ring, text, strlen(text));
+    ring_close(ring, 0);
+
+    tsm_name2obj(job->fsname, job->filename, &objName);
+
+    rc = dsmBeginTxn(sesshandle);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmBeginTxn failed");
+        return 0;
+    }
+    if(!tsm_sendobj(sesshandle, &objName, strlen(text), job->description,
+                    objinfo, job->sendtype, -1, job->verbose, job->xfer, ring,
+                    &sent, NULL))
+    {
+        tsm_endtxn(sesshandle, DSM_VOTE_ABORT);
+        return 0;
+    }
+
+    return tsm_endtxn(sesshandle, DSM_VOTE_COMMIT);
+}
+
+
+/*
+ * Read infd, stdin or -i path, and deal it out to nstripes workers, each
+ * storing one sub-object over its own session. The descriptor object is
+ * sent last, when all sub-objects are committed. If anything fails, the
+ * sub-objects that were stored are deleted again.
+ */
+int tsm_sendstriped(dsUint32_t sesshandle, char *fsname, char *filename,
+                    off_t length, int infd, char *description,
+                    dsmSendType sendtype, char verbose, tsmpipe_xfer_t *xfer,
+                    char *options, int nstripes, off_t stripesize)
+{
+    struct stripe_job       job;
+    struct stripe_worker    *workers;
+    struct tsm_ring         *ring;
+    struct stat             st;
+    char                    *buf;
+    char                    what[32];
+    size_t                  fill;
+    ssize_t                 nbytes;
+    off_t                   left, total = 0, inpos = -1;
+    int                     i, ok = 1, eof = 0, err = 0;
+    long long               s;
+    double                  start, t;
+
+    workers = calloc(nstripes, sizeof(*workers));
+    if(!workers) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.fsname = fsname;
+    job.filename = filename;
+    job.description = description;
+    job.sendtype = sendtype;
+    job.verbose = verbose;
+    job.xfer = xfer;
+    job.outfd = -1;
+    job.layout.nstripes = nstripes;
+    job.layout.stripesize = stripesize;
+    tsm_setid(job.layout.id, sizeof(job.layout.id));
+
+    /* Every sub-object gets its share of the stripes, rounded up */
+    s = (length + stripesize - 1) / stripesize;
+    job.estimate = (s + nstripes - 1) / nstripes * stripesize;
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Starting to send %s as %s%s in %d "
+                "stripes of %lld bytes\n",
+                infd == STDIN_FILENO ? "stdin" : "input", fsname, filename,
+                nstripes, (long long) stripesize);
+    }
+
+    /* A file or block device is dropped from the page cache as we go */
+    if(fstat(infd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+        inpos = lseek(infd, 0, SEEK_CUR);
+    }
+
+    if(!stripe_start(workers, &job, sesshandle, options, stripe_sender)) {
+        free(workers);
+        return 0;
+    }
+
+    start = timenow();
+
+    for(s = 0; ok && !eof; s++) {
+        ring = &workers[s % nstripes].ring;
+        for(left = stripesize; left > 0; left -= nbytes) {
+            buf = ring_getfree(ring, &fill);
+            if(buf == NULL) {
+                /* The worker failed */
+                ok = 0;
+                break;
+            }
+            if((off_t) fill > left) {
+                fill = left;
+            }
+            t = timenow();
+            nbytes = read_full(infd, buf, fill);
+            if(nbytes >= 0 && daemon_hungup()) {
+                nbytes = -1;
+                errno = EPIPE;
+            }
+            if(nbytes < 0) {
+                err = errno;
+                ok = 0;
+                break;
+            }
+            stats_add(stat_input, t, nbytes);
+            if(nbytes > 0 && inpos >= 0) {
+                input_drop(infd, inpos, nbytes);
+                inpos += nbytes;
+            }
+            if(nbytes > 0) {
+                if(xfer->checksum) {
+                    sum_add(&job.sum, buf, nbytes);
+                }
+                ring_put(ring, nbytes);
+                total += nbytes;
+            }
+            if((size_t) nbytes < fill) {
+                eof = 1;
+                break;
+            }
+        }
+    }
+
+    if(err) {
+        fprintf(stderr, "tsmpipe: read: %s\n", strerror(err));
+    }
+    for(i = 0; i < nstripes; i++) {
+        if(ok) {
+            ring_close(&workers[i].ring, 0);
+        }
+        else {
+            ring_abort(&workers[i].ring, 0);
+        }
+    }
+    for(i = 0; i < nstripes; i++) {
+        pthread_join(workers[i].thread, NULL);
+        workers[i].started = 0;
+        if(!workers[i].ok) {
+            ok = 0;
+        }
+        if(verbose > 1) {
+            fprintf(stderr, "tsmpipe: Stripe %d: %lld bytes\n", i,
+                    (long long) workers[i].bytes);
+        }
+        if(verbose > 0) {
+            snprintf(what, sizeof(what), "stripe %d", i);
+            ring_report(&workers[i].ring, what);
+        }
+    }
+
+    if(ok) {
+        job.layout.length = total;
+        ok = stripe_senddesc(sesshandle, &job, &workers[0].ring);
+    }
+
+    if(ok && verbose > 0) {
+        fprintf(stderr, "tsmpipe: Sent %lld bytes in %.1f seconds\n",
+                (long long) total, timenow() - start);
+    }
+
+    stripe_stop(workers, nstripes);
+    free(workers);
+
+    if(!ok && !tsm_deletesubs(sesshandle, fsname, filename, job.layout.id,
+                              description, sendtype, verbose))
+    {
+        fprintf(stderr, "tsmpipe: Sub-objects %s%s.%s.* that were stored "
+                "need to be deleted\n", fsname, filename, job.layout.id);
+    }
+
+    return ok;
+}
+
+
+/*
+ * Writer thread for striped restores into a regular file: puts the data
+ * of one sub-object in place with pwrite.
+ */
+void *stripe_pwriter(void *arg) {
+    struct stripe_worker    *w = arg;
+    struct stripe_layout    *layout = &w->job->layout;
+    char                    *buf;
+    size_t                  nbytes, done, len;
+    unsigned long long      stripe, within;
+    off_t                   pos = 0, off;
+    double                  t;
+
+    block_signals();
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while((buf = ring_getfull(&w->ring, &nbytes)) != NULL) {
+        for(done = 0; done < nbytes; done += len) {
+            stripe = pos / layout->stripesize;
+            within = pos % layout->stripesize;
+            len = nbytes - done;
+            if(len > layout->stripesize - within) {
+                len = layout->stripesize - within;
+            }
+            off = w->job->outbase +
+                  (stripe * layout->nstripes + w->idx) * layout->stripesize +
+                  within;
+
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            t = timenow();
+            if(pwrite_full(w->job->outfd, buf + done, len, off) < 0) {
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+                ring_abort(&w->ring, errno);
+                return NULL;
+            }
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            stats_add(stat_output, t, len);
+            pos += len;
+        }
+        ring_release(&w->ring);
+    }
+
+    return NULL;
+}
+
+
+/* Gets the sub-object of one worker, into its ring or with pwrite */
+void *stripe_getter(void *arg) {
+    struct stripe_worker    *w = arg;
+    struct stripe_job       *job = w->job;
+    char                    name[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 1];
+    struct matchone_cb_data cbdata;
+    struct tsm_adapt        adapt;
+    dsmObjName              objName;
+    dsmGetList              getList;
+    dsInt16_t               rc;
+    pthread_t               writer;
+    int                     err;
+
+    block_signals();
+
+    stripe_name(name, sizeof(name), job->filename, &job->layout, w->idx);
+    tsm_name2obj(job->fsname, name, &objName);
+
+    cbdata.numfound = 0;
+    rc = tsm_queryname(w->sesshandle, &objName, job->description,
+                       job->sendtype, job->verbose, tsm_matchone_cb, &cbdata);
+    if(rc == DSM_RC_ABORT_NO_MATCH) {
+        rc = DSM_RC_OK;
+    }
+    if(rc == DSM_RC_OK && cbdata.numfound == 0) {
+        fprintf(stderr, "tsmpipe: FAILED: Sub-object %s%s%s not found\n",
+                objName.fs, objName.hl, objName.ll);
+    }
+    if(rc != DSM_RC_OK || cbdata.numfound == 0) {
+        ring_abort(&w->ring, 0);
+        return NULL;
+    }
+
+    getList.stVersion = dsmGetListVersion;
+    getList.numObjId = 1;
+    getList.objId = &cbdata.objId;
+    getList.partialObjData = NULL;
+
+    rc = dsmBeginGetData(w->sesshandle, bTrue, job->getType, &getList);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(w->sesshandle, rc, "dsmBeginGetData failed");
+        ring_abort(&w->ring, 0);
+        return NULL;
+    }
+
+    if(job->outfd >= 0) {
+        err = pthread_create(&writer, NULL, stripe_pwriter, w);
+        if(err) {
+            fprintf(stderr, "tsmpipe: pthread_create: %s\n", strerror(err));
+            ring_abort(&w->ring, 0);
+            return NULL;
+        }
+    }
+
+    adapt_init(&adapt, job->xfer);
+    if(!tsm_getobj(w->sesshandle, &cbdata.objId, &w->ring, job->xfer, &adapt,
+                   -1, &w->bytes, job->verbose))
+    {
+        if(job->outfd >= 0) {
+            stop_helper(&w->ring, writer);
+        }
+        else {
+            ring_abort(&w->ring, 0);
+        }
+        return NULL;
+    }
+
+    ring_close(&w->ring, 0);
+    if(job->outfd >= 0) {
+        pthread_join(writer, NULL);
+        if(w->ring.err) {
+            fprintf(stderr, "tsmpipe: write: %s\n", strerror(w->ring.err));
+            return NULL;
+        }
+    }
+
+    rc = dsmEndGetObj(w->sesshandle);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(w->sesshandle, rc, "dsmEndGetObj failed");
+        return NULL;
+    }
+
+    rc = dsmEndGetData(w->sesshandle);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(w->sesshandle, rc, "dsmEndGetData failed");
+        return NULL;
+    }
+
+    w->ok = 1;
+
+    return NULL;
+}
+
+
+/*
+ * Put the stripes back together in order on outfd, which isn't seekable,
+ * or give them to verify.
+ * Returns the number of bytes written, or -1 on failure.
+ */
+off_t stripe_reassemble(struct stripe_worker *workers,
+                        struct stripe_layout *layout, int outfd,
+                        struct tsm_verify *verify)
+{
+    struct tsm_ring *ring;
+    char            *buf;
+    size_t          *used, len, chunk;
+    off_t           left, total = 0;
+    long long       s;
+    int             i, done = 0, ok = 1;
+    double          t;
+
+    /* How much of the current slot of each ring we have written */
+    used = calloc(layout->nstripes, sizeof(*used));
+    if(!used) {
+        perror("tsmpipe: malloc");
+        return -1;
+    }
+
+    for(s = 0; ok && !done; s++) {
+        i = s % layout->nstripes;
+        ring = &workers[i].ring;
+        for(left = layout->stripesize; left > 0; left -= chunk) {
+            buf = ring_getfull(ring, &len);
+            if(buf == NULL) {
+                /* The end, unless the worker failed */
+                ok = !ring->aborted;
+                done = 1;
+                break;
+            }
+            chunk = len - used[i];
+            if((off_t) chunk > left) {
+                chunk = left;
+            }
+            t = timenow();
+            if(verify) {
+                if(verify_sink(verify, buf + used[i], chunk) < 0) {
+                    ok = 0;
+                    break;
+                }
+            }
+            else if(write_full(outfd, buf + used[i], chunk) < 0) {
+                fprintf(stderr, "tsmpipe: write: %s\n", strerror(errno));
+                ok = 0;
+                break;
+            }
+            stats_add(stat_output, t, chunk);
+            total += chunk;
+            used[i] += chunk;
+            if(used[i] == len) {
+                ring_release(ring);
+                used[i] = 0;
+            }
+        }
+    }
+
+    /* The rest of the sub-objects should be empty by now */
+    for(i = 0; ok && i < layout->nstripes; i++) {
+        ring = &workers[i].ring;
+        while((buf = ring_getfull(ring, &len)) != NULL) {
+            total += len - used[i];
+            used[i] = 0;
+            ring_release(ring);
+        }
+        if(ring->aborted) {
+            ok = 0;
+        }
+    }
+    if(!ok) {
+        stripe_abort(workers, layout->nstripes);
+    }
+
+    free(used);
+
+    return ok ? total : -1;
+}
+
+
+/*
+ * Get the sub-objects of a striped object concurrently, one session each.
+ * If outfd is a regular file the workers write their stripes in place,
+ * otherwise they are reassembled in order here. With verify they are
+ * reassembled for it instead of written.
+ */
+int tsm_restorestriped(dsUint32_t sesshandle, char *fsname, char *filename,
+                       char *description, dsmSendType sendtype, char verbose,
+                       tsmpipe_xfer_t *xfer, char *options,
+                       struct stripe_layout *layout, int outfd,
+                       struct tsm_verify *verify)
+{
+    struct stripe_job       job;
+    struct stripe_worker    *workers;
+    struct stat             st;
+    char                    what[32];
+    off_t                   total = 0;
+    int                     i, ok = 1;
+    double                  start;
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: %s%s is %llu bytes in %d stripes of %llu "
+                "bytes\n", fsname, filename, layout->length,
+                layout->nstripes, layout->stripesize);
+    }
+
+    workers = calloc(layout->nstripes, sizeof(*workers));
+    if(!workers) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.fsname = fsname;
+    job.filename = filename;
+    job.description = description;
+    job.sendtype = sendtype;
+    job.verbose = verbose;
+    job.xfer = xfer;
+    job.layout = *layout;
+    job.outfd = -1;
+
+    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
+        job.getType = gtArchive;
+    }
+    else {
+        job.getType = gtBackup;
+    }
+
+    /* A regular file (not opened for append) can be written out of order */
+    if(!verify && fstat(outfd, &st) == 0 && S_ISREG(st.st_mode) &&
+            !(fcntl(outfd, F_GETFL) & O_APPEND))
+    {
+        job.outbase = lseek(outfd, 0, SEEK_CUR);
+        if(job.outbase >= 0) {
+            job.outfd = outfd;
+        }
+    }
+    if(verbose > 1 && job.outfd >= 0) {
+        fprintf(stderr, "tsmpipe: Writing stripes in place\n");
+    }
+
+    if(!stripe_start(workers, &job, sesshandle, options, stripe_getter)) {
+        free(workers);
+        return 0;
+    }
+
+    start = timenow();
+
+    if(job.outfd < 0) {
+        if(!verify) {
+            set_pipesize(outfd, PIPESIZE, verbose);
+        }
+        total = stripe_reassemble(workers, layout, outfd, verify);
+        if(total < 0) {
+            ok = 0;
+        }
+    }
+
+    for(i = 0; i < layout->nstripes; i++) {
+        pthread_join(workers[i].thread, NULL);
+        workers[i].started = 0;
+        if(!workers[i].ok) {
+            ok = 0;
+        }
+        if(job.outfd >= 0) {
+            total += workers[i].bytes;
+        }
+        if(verbose > 1) {
+            fprintf(stderr, "tsmpipe: Stripe %d: %lld bytes\n", i,
+                    (long long) workers[i].bytes);
+        }
+        if(verbose > 0) {
+            snprintf(what, sizeof(what), "stripe %d", i);
+            ring_report(&workers[i].ring, what);
+        }
+    }
+
+    stripe_stop(workers, layout->nstripes);
+    free(workers);
+
+    if(ok && job.outfd >= 0) {
+        lseek(outfd, job.outbase + total, SEEK_SET);
+    }
+    if(ok && (unsigned long long) total != layout->length) {
+        fprintf(stderr, "tsmpipe: FAILED: Got %lld bytes, the descriptor "
+                "says %llu\n", (long long) total, layout->length);
+        ok = 0;
+    }
+    if(ok && verbose > 0) {
+        fprintf(stderr, "tsmpipe: Got %lld bytes in %.1f seconds\n",
+                (long long) total, timenow() - start);
+    }
+
+    return ok;
+}
+
+
+/*
+ * Partial restores, -o/-L and -R. The server only sends the requested
+ * byte ranges, given in the partialObjData of the dsmGetList. Several
+ * ranges of one object are fetched by listing the object once per range.
+ */
+struct tsm_range {
+    off_t       offset;
+    off_t       length;     /* 0 means to the end of the object */
+    int         obj;        /* Which object in the objId list */
+};
+
+
+/* Add a range to a growing array. Returns 0 if out of memory. */
+int range_add(struct tsm_range **ranges, int *nranges, off_t offset,
+              off_t length, int obj)
+{
+    struct tsm_range *r;
+
+    if((*nranges & 63) == 0) {
+        r = realloc(*ranges, (*nranges + 64) * sizeof(*r));
+        if(r == NULL) {
+            perror("tsmpipe: realloc");
+            return 0;
+        }
+        *ranges = r;
+    }
+    r = &(*ranges)[(*nranges)++];
+    r->offset = offset;
+    r->length = length;
+    r->obj = obj;
+
+    return 1;
+}
+
+
+/*
+ * Parse -R: either offset:length[,offset:length...] or @file (@- for
+ * stdin) with one "offset length" per line. Sizes may have k/M/G suffixes.
+ * Returns 0 on error.
+ */
+int range_parse(char *spec, struct tsm_range **ranges, int *nranges) {
+    char    line[256];
+    char    *tok, *len, *save = NULL;
+    FILE    *f = NULL;
+    off_t   offset, length;
+    int     lineno = 0, ok;
+
+    if(*spec == '@') {
+        f = strcmp(spec + 1, "-") == 0 ? stdin : fopen(spec + 1, "r");
+        if(f == NULL) {
+            fprintf(stderr, "tsmpipe: %s: %s\n", spec + 1, strerror(errno));
+            return 0;
+        }
+    }
+    else {
+        spec = strdup(spec);
+        if(spec == NULL) {
+            perror("tsmpipe: strdup");
+            return 0;
+        }
+    }
+
+    for(;;) {
+        if(f) {
+            if(!fgets(line, sizeof(line), f)) {
+                break;
+            }
+            lineno++;
+            line[strcspn(line, "#\r\n")] = '\0';
+            tok = line + strspn(line, " \t");
+            if(*tok == '\0') {
+                continue;
+            }
+            len = tok + strcspn(tok, " \t");
+            if(*len) {
+                *len++ = '\0';
+                len += strspn(len, " \t");
+                len[strcspn(len, " \t")] = '\0';
+            }
+        }
+        else {
+            tok = strtok_r(save ? NULL : spec, ",", &save);
+            if(tok == NULL) {
+                break;
+            }
+            len = strchr(tok, ':');
+            if(len) {
+                *len++ = '\0';
+            }
+            else {
+                len = "";
+            }
+        }
+
+        offset = atosize(tok);
+        length = atosize(len);
+        if(offset < 0 || length <= 0) {
+            if(f) {
+                fprintf(stderr, "tsmpipe: %s:%d: Invalid range, should be "
+                        "offset length\n", spec + 1, lineno);
+            }
+            else {
+                fprintf(stderr, "tsmpipe: Invalid range %s:%s, should be "
+                        "offset:length\n", tok, len);
+            }
+            break;
+        }
+        if(!range_add(ranges, nranges, offset, length, 0)) {
+            break;
+        }
+    }
+
+    if(f) {
+        ok = feof(f) && !ferror(f);
+        if(f != stdin) {
+            fclose(f);
+        }
+        if(!ok) {
+            return 0;
+        }
+    }
+    else {
+        free(spec);
+        if(tok != NULL) {
+            return 0;
+        }
+    }
+
+    return *nranges > 0;
+}
+
+
+/*
+ * Map ranges of a striped object onto its sub-objects, one piece per
+ * stripe touched.
+ */
+int range_stripes(struct tsm_range *ranges, int nranges,
+                  struct stripe_layout *layout, struct tsm_range **pieces,
+                  int *npieces)
+{
+    unsigned long long  ss = layout->stripesize;
+    unsigned long long  stripe, within;
+    off_t               offset, left, len;
+    int                 i;
+
+    for(i = 0; i < nranges; i++) {
+        offset = ranges[i].offset;
+        left = ranges[i].length;
+        if(left == 0 && (unsigned long long) offset < layout->length) {
+            /* To the end */
+            left = layout->length - offset;
+        }
+        while(left > 0) {
+            stripe = offset / ss;
+            within = offset % ss;
+            len = ss - within;
+            if(len > left) {
+                len = left;
+            }
+            if(!range_add(pieces, npieces,
+                          stripe / layout->nstripes * ss + within, len,
+                          stripe % layout->nstripes))
+            {
+                return 0;
+            }
+            offset += len;
+            left -= len;
+        }
+    }
+
+    return 1;
+}
+
+
+/*
+ * Get the ranges in order to outfd, DSM_MAX_PARTIAL_GET_OBJ at a time.
+ * A range that ends beyond the end of its object is an error.
+ */
+int tsm_getranges(dsUint32_t sesshandle, dsStruct64_t *objIds,
+                  struct tsm_range *ranges, int nranges, dsmGetType getType,
+                  char verbose, tsmpipe_xfer_t *xfer, int outfd)
+{
+    dsInt16_t           rc;
+    struct tsm_ring     ring;
+    struct tsm_adapt    adapt;
+    pthread_t           writer;
+    dsStruct64_t        getIds[DSM_MAX_PARTIAL_GET_OBJ];
+    PartialObjData      partial[DSM_MAX_PARTIAL_GET_OBJ];
+    dsmGetList          getList;
+    off_t               got;
+    int                 i, j, n, err, status;
+    int                 ok = 1;
+
+    if(!ring_init(&ring, xfer->qdepth, xfer->slotsize, xfer->hugepages,
+                  verbose))
+    {
+        return 0;
+    }
+    ring_reset(&ring, outfd);
+    ring_output(&ring, verbose);
+    ring_setfill(&ring, xfer->bufsize);
+    adapt_init(&adapt, xfer);
+
+    set_pipesize(outfd, PIPESIZE, verbose);
+
+    err = pthread_create(&writer, NULL, tsm_writer, &ring);
+    if(err) {
+        fprintf(stderr, "tsmpipe: pthread_create: %s\n", strerror(err));
+        ring_free(&ring);
+        return 0;
+    }
+
+    for(i = 0; ok && i < nranges; i += n) {
+        n = nranges - i;
+        if(n > DSM_MAX_PARTIAL_GET_OBJ) {
+            n = DSM_MAX_PARTIAL_GET_OBJ;
+        }
+        for(j = 0; j < n; j++) {
+            getIds[j] = objIds[ranges[i + j].obj];
+            partial[j].stVersion = PartialObjDataVersion;
+            partial[j].partialObjOffset.hi = ranges[i + j].offset >> 32;
+            partial[j].partialObjOffset.lo = ranges[i + j].offset & ~0U;
+            partial[j].partialObjLength.hi = ranges[i + j].length >> 32;
+            partial[j].partialObjLength.lo = ranges[i + j].length & ~0U;
+        }
+
+        getList.stVersion = dsmGetListPORVersion;
+        getList.numObjId = n;
+        getList.objId = getIds;
+        getList.partialObjData = partial;
+
+        rc = dsmBeginGetData(sesshandle, bTrue, getType, &getList);
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmBeginGetData failed");
+            ok = 0;
+            break;
+        }
+
+        for(j = 0; ok && j < n; j++) {
+            struct tsm_range *r = &ranges[i + j];
+
+            if(verbose > 1) {
+                fprintf(stderr, "tsmpipe: Range %lld+%lld of object %d\n",
+                        (long long) r->offset, (long long) r->length, r->obj);
+            }
+            status = tsm_getobj(sesshandle, &getIds[j], &ring, xfer, &adapt,
+                                r->length ? r->length : -1, &got, verbose);
+            if(status == 0) {
+                ok = 0;
+                break;
+            }
+            if(r->length && got < r->length) {
+                fprintf(stderr, "tsmpipe: FAILED: Range %lld+%lld ends "
+                        "beyond the end of the object, got %lld bytes\n",
+                        (long long) r->offset, (long long) r->length,
+                        (long long) got);
+                ok = 0;
+                break;
+            }
+
+            rc = dsmEndGetObj(sesshandle);
+            if(rc != DSM_RC_OK) {
+                tsm_printerr(sesshandle, rc, "dsmEndGetObj failed");
+                ok = 0;
+            }
+        }
+
+        if(ok) {
+            rc = dsmEndGetData(sesshandle);
+            if(rc != DSM_RC_OK) {
+                tsm_printerr(sesshandle, rc, "dsmEndGetData failed");
+                ok = 0;
+            }
+        }
+    }
+
+    if(ok) {
+        ring_close(&ring, 0);
+        pthread_join(writer, NULL);
+        if(verbose > 0) {
+            ring_report(&ring, outfd == STDOUT_FILENO ? "stdout" : "output");
+        }
+    }
+    else {
+        stop_helper(&ring, writer);
+    }
+    if(ring.err) {
+        fprintf(stderr, "tsmpipe: write: %s\n", strerror(ring.err));
+        ok = 0;
+    }
+    ring_free(&ring);
+
+    return ok;
+}
+
+
+/*
+ * Get one range of an encrypted, uncompressed object of block byte
+ * blocks, started with a partial get from the frame holding its first
+ * byte. Each frame is authenticated before any of it is written.
+ */
+int tsm_getcryptrange(dsUint32_t sesshandle, dsStruct64_t *objId,
+                      const struct tsm_crypt *crypt, size_t block,
+                      struct tsm_range *r, char *buf, int outfd)
+{
+    unsigned long long  seq = r->offset / block;
+    size_t              skip = r->offset % block;
+    size_t              rawlen = 0, storedlen = 0, len;
+    off_t               left = r->length;
+    ssize_t             n;
+    int                 raw = 0, state = 0;
+    double              t;
+
+    for(;;) {
+        n = tsm_getbytes(sesshandle, objId, buf, ZHDRLEN, &state);
+        if(n < 0) {
+            return 0;
+        }
+        if(n == 0 && seq == r->offset / block) {
+            fprintf(stderr, "tsmpipe: FAILED: Range %lld+%lld starts "
+                    "beyond the end of the object\n",
+                    (long long) r->offset, (long long) r->length);
+            return 0;
+        }
+        if(n == ZHDRLEN) {
+            zframe_get(buf, &rawlen, &storedlen, &raw);
+        }
+        if(n < ZHDRLEN || !raw || rawlen > block ||
+                storedlen != rawlen + CRYPT_TAGLEN)
+        {
+            break;
+        }
+        n = tsm_getbytes(sesshandle, objId, buf + ZHDRLEN, storedlen,
+                         &state);
+        if(n < 0) {
+            return 0;
+        }
+        if((size_t) n < storedlen ||
+                !crypt_open(crypt, seq, buf, buf + ZHDRLEN, rawlen))
+        {
+            break;
+        }
+        seq++;
+
+        if(rawlen == 0) {
+            /* The end frame, nothing may follow it */
+            if(tsm_getbytes(sesshandle, objId, buf, 1, &state) != 0) {
+                break;
+            }
+            if(left > 0 || skip > 0) {
+                fprintf(stderr, "tsmpipe: FAILED: Range %lld+%lld ends "
+                        "beyond the end of the object\n",
+                        (long long) r->offset, (long long) r->length);
+                return 0;
+            }
+            return 1;
+        }
+        if(skip >= rawlen) {
+            skip -= rawlen;
+            continue;
+        }
+
+        len = rawlen - skip;
+        if(r->length && (off_t) len > left) {
+            len = left;
+        }
+        t = timenow();
+        if(write_full(outfd, buf + ZHDRLEN + skip, len) < 0) {
+            fprintf(stderr, "tsmpipe: write: %s\n", strerror(errno));
+            return 0;
+        }
+        stats_add(stat_output, t, len);
+        skip = 0;
+        left -= len;
+        if(r->length && left == 0) {
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "tsmpipe: FAILED: Encrypted data failed authentication "
+            "or is truncated, wrong key or tampered with\n");
+
+    return 0;
+}
+
+
+/*
+ * Ranges of an object encrypted without compression. Its frames all hold
+ * a whole block but the last two, so a range maps onto a range of frames
+ * which can be got with a partial get and decrypted on their own.
+ */
+int tsm_getcryptranges(dsUint32_t sesshandle, dsStruct64_t *objId,
+                       const struct tsm_crypt *crypt, size_t block,
+                       struct tsm_range *ranges, int nranges,
+                       dsmGetType getType, char verbose, int outfd)
+{
+    dsInt16_t           rc;
+    dsStruct64_t        getIds[DSM_MAX_PARTIAL_GET_OBJ];
+    PartialObjData      partial[DSM_MAX_PARTIAL_GET_OBJ];
+    dsmGetList          getList;
+    off_t               frame = ZHDRLEN + block + CRYPT_TAGLEN;
+    off_t               first, last;
+    char                *buf;
+    int                 i, j, n;
+    int                 ok = 1;
+
+    buf = malloc(frame);
+    if(buf == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+
+    for(i = 0; ok && i < nranges; i += n) {
+        n = nranges - i;
+        if(n > DSM_MAX_PARTIAL_GET_OBJ) {
+            n = DSM_MAX_PARTIAL_GET_OBJ;
+        }
+        for(j = 0; j < n; j++) {
+            struct tsm_range *r = &ranges[i + j];
+
+            first = r->offset / block * frame;
+            /* Up to the end frame if the range could reach it */
+            last = r->length ? ((r->offset + r->length - 1) / block + 2) *
+                               frame : 0;
+            getIds[j] = *objId;
+            partial[j].stVersion = PartialObjDataVersion;
+            partial[j].partialObjOffset.hi = first >> 32;
+            partial[j].partialObjOffset.lo = first & ~0U;
+            partial[j].partialObjLength.hi = last ? (last - first) >> 32 : 0;
+            partial[j].partialObjLength.lo = last ? (last - first) & ~0U : 0;
+        }
+
+        getList.stVersion = dsmGetListPORVersion;
+        getList.numObjId = n;
+        getList.objId = getIds;
+        getList.partialObjData = partial;
+
+        rc = dsmBeginGetData(sesshandle, bTrue, getType, &getList);
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmBeginGetData failed");
+            ok = 0;
+            break;
+        }
+
+        for(j = 0; ok && j < n; j++) {
+            struct tsm_range *r = &ranges[i + j];
+
+            if(verbose > 1) {
+                fprintf(stderr, "tsmpipe: Range %lld+%lld, encrypted\n",
+                        (long long) r->offset, (long long) r->length);
+            }
+            ok = tsm_getcryptrange(sesshandle, &getIds[j], crypt, block, r,
+                                   buf, outfd);
+            if(!ok) {
+                break;
+            }
+
+            rc = dsmEndGetObj(sesshandle);
+            if(rc != DSM_RC_OK) {
+                tsm_printerr(sesshandle, rc, "dsmEndGetObj failed");
+                ok = 0;
+            }
+        }
+
+        if(ok) {
+            rc = dsmEndGetData(sesshandle);
+            if(rc != DSM_RC_OK) {
+                tsm_printerr(sesshandle, rc, "dsmEndGetData failed");
+                ok = 0;
+            }
+        }
+    }
+
+    memset(buf, 0, frame);
+    free(buf);
+
+    return ok;
+}
+
+
+/*
+ * Restore ranges of an object. For a striped object the ranges are split
+ * over the sub-objects, which are all got in the same session. An
+ * encrypted object is decrypted in blocks of zblock bytes.
+ */
+int tsm_restoreranges(dsUint32_t sesshandle, char *fsname, char *filename,
+                      char *description, dsmSendType sendtype, char verbose,
+                      tsmpipe_xfer_t *xfer, dsStruct64_t *objId,
+                      struct stripe_layout *layout,
+                      const struct tsm_crypt *crypt, size_t zblock,
+                      struct tsm_range *ranges, int nranges, int outfd)
+{
+    struct matchone_cb_data cbdata;
+    struct tsm_range        *pieces = NULL;
+    dsStruct64_t            *objIds = objId;
+    dsmObjName              objName;
+    dsmGetType              getType;
+    dsInt16_t               rc;
+    char                    name[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 1];
+    int                     npieces = 0, i, ok;
+
+    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
+        getType = gtArchive;
+    }
+    else {
+        getType = gtBackup;
+    }
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Getting %d range(s)\n", nranges);
+    }
+
+    if(crypt) {
+        return tsm_getcryptranges(sesshandle, objId, crypt, zblock, ranges,
+                                  nranges, getType, verbose, outfd);
+    }
+    if(layout == NULL) {
+        return tsm_getranges(sesshandle, objIds, ranges, nranges, getType,
+                             verbose, xfer, outfd);
+    }
+
+    objIds = calloc(layout->nstripes, sizeof(*objIds));
+    if(objIds == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+
+    ok = range_stripes(ranges, nranges, layout, &pieces, &npieces);
+
+    for(i = 0; ok && i < layout->nstripes; i++) {
+        stripe_name(name, sizeof(name), filename, layout, i);
+        tsm_name2obj(fsname, name, &objName);
+
+        cbdata.numfound = 0;
+        rc = tsm_queryname(sesshandle, &objName, description, sendtype,
+                           verbose, tsm_matchone_cb, &cbdata);
+        if(rc == DSM_RC_ABORT_NO_MATCH) {
+            rc = DSM_RC_OK;
+        }
+        if(rc == DSM_RC_OK && cbdata.numfound == 0) {
+            fprintf(stderr, "tsmpipe: FAILED: Sub-object %s%s%s not found\n",
+                    objName.fs, objName.hl, objName.ll);
+        }
+        if(rc != DSM_RC_OK || cbdata.numfound == 0) {
+            ok = 0;
+        }
+        objIds[i] = cbdata.objId;
+    }
+
+    if(ok && verbose > 1) {
+        fprintf(stderr, "tsmpipe: %d piece(s) from %d stripes\n", npieces,
+                layout->nstripes);
+    }
+    if(ok && npieces > 0) {
+        ok = tsm_getranges(sesshandle, objIds, pieces, npieces, getType,
+                           verbose, xfer, outfd);
+    }
+
+    free(pieces);
+    free(objIds);
+
+    return ok;
+}
+
+
+/*
+ * Get the current object in a dsmBeginGetData list to outfd as it is, or
+ * give it to verify
+ */
+int tsm_getplain(dsUint32_t sesshandle, dsStruct64_t *objId,
+                 tsmpipe_xfer_t *xfer, int outfd, struct tsm_verify *verify,
+                 char verbose)
+{
+    struct tsm_ring         ring;
+    struct tsm_adapt        adapt;
+    pthread_t               writer;
+    int                     err;
+    off_t                   got;
+
+    if(!ring_init(&ring, xfer->qdepth, xfer->slotsize, xfer->hugepages,
+                  verbose))
+    {
+        return 0;
+    }
+    ring_reset(&ring, outfd);
+    if(verify) {
+        ring.sink = verify_sink;
+        ring.sinkarg = verify;
+    }
+    else {
+        ring_output(&ring, verbose);
+        set_pipesize(outfd, PIPESIZE, verbose);
+    }
+    ring_setfill(&ring, xfer->bufsize);
+    adapt_init(&adapt, xfer);
+
+    err = pthread_create(&writer, NULL, tsm_writer, &ring);
+    if(err) {
+        fprintf(stderr, "tsmpipe: pthread_create: %s\n", strerror(err));
+        ring_free(&ring);
+        return 0;
+    }
+
+    if(!tsm_getobj(sesshandle, objId, &ring, xfer, &adapt, -1, &got,
+                   verbose))
+    {
+        stop_helper(&ring, writer);
+        if(ring.err) {
+            fprintf(stderr, "tsmpipe: write: %s\n", strerror(ring.err));
+        }
+        ring_free(&ring);
+        return 0;
+    }
+
+    ring_close(&ring, 0);
+    pthread_join(writer, NULL);
+    err = ring.err;
+    if(verbose > 0) {
+        ring_report(&ring, verify ? "verify" :
+                           outfd == STDOUT_FILENO ? "stdout" : "output");
+    }
+    ring_free(&ring);
+
+    if(err) {
+        fprintf(stderr, "tsmpipe: write: %s\n", strerror(err));
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Segmented uploads, -e. A seekable input is stored as fixed size segments
+ * named filepath.id.NNNNNN, each committed in its own transaction, and a
+ * descriptor object under filepath with the layout as its objInfo. The id
+ * is derived from the input, so running the same command again finds the
+ * segments that are already stored and only sends the missing ones.
+ * Each segment has a checksum object in its transaction, numbered nsegs on
+ * from it, with the size and CRC32C of what was read in its objInfo. What
+ * is already stored is only used if it still matches the input, as the
+ * id can't tell that a block device was written to. If not, the upload
+ * starts over with the next generation of the id.
+ *
+ * Backup segments are a peer group with the descriptor as leader. The
+ * group is opened before the first segment and closed after the last, so
+ * an interrupted upload is an open group on the server. Archive objects
+ * can't be grouped, so there the descriptor is sent last.
+ */
+struct segment_layout {
+    unsigned long long  nsegs;
+    unsigned long long  segsize;
+    unsigned long long  length;
+    unsigned long long  gen;        /* Times the input has changed */
+    char                id[32];
+};
+
+
+/* Filename of segment idx */
+void segment_name(char *buf, size_t len, char *filename,
+                  struct segment_layout *layout, unsigned long long idx)
+{
+    snprintf(buf, len, "%s.%s.%06llu", filename, layout->id, idx);
+}
+
+
+/* Returns 1 if objInfo is that of a segment descriptor */
+int segment_parse(const char *objinfo, int len, struct segment_layout *layout)
+{
+    char    val[DSM_MAX_OBJINFO_LENGTH + 1];
+
+    if(!objinfo_get(objinfo, len, "segments", val, sizeof(val))) {
+        return 0;
+    }
+    layout->nsegs = strtoull(val, NULL, 10);
+    if(!objinfo_get(objinfo, len, "segsize", val, sizeof(val))) {
+        return 0;
+    }
+    layout->segsize = strtoull(val, NULL, 10);
+    if(!objinfo_get(objinfo, len, "length", val, sizeof(val))) {
+        return 0;
+    }
+    layout->length = strtoull(val, NULL, 10);
+    if(!objinfo_get(objinfo, len, "id", layout->id, sizeof(layout->id))) {
+        return 0;
+    }
+    layout->gen = 0;
+    if(objinfo_get(objinfo, len, "gen", val, sizeof(val))) {
+        layout->gen = strtoull(val, NULL, 10);
+    }
+
+    return layout->segsize > 0 && layout->nsegs ==
+           (layout->length + layout->segsize - 1) / layout->segsize;
+}
+
+
+/*
+ * The id of the segments of an input: the same for the same object name,
+ * segment size, input file and generation, as long as the file isn't
+ * modified.
+ */
+void segment_setid(struct segment_layout *layout, char *fsname,
+                   char *filename, struct stat *st)
+{
+    char    buf[DSM_MAX_FSNAME_LENGTH + DSM_MAX_HL_LENGTH +
+                DSM_MAX_LL_LENGTH + 128];
+    size_t  n;
+
+    n = snprintf(buf, sizeof(buf), "%s %s %llu %llu %lu %lu %lu", fsname,
+                 filename, layout->length, layout->segsize,
+                 (unsigned long) st->st_mtime, (unsigned long) st->st_dev,
+                 (unsigned long) st->st_ino);
+    /* The first generation keeps the ids of older uploads */
+    if(layout->gen > 0 && n < sizeof(buf)) {
+        snprintf(buf + n, sizeof(buf) - n, " %llu", layout->gen);
+    }
+    snprintf(layout->id, sizeof(layout->id), "%08x",
+             (unsigned int) crc32c(0, buf, strlen(buf)));
+}
+
+
+struct segdesc_cb_data {
+    struct segment_layout   *layout;
+    char                    *fsname;
+    char                    *filename;
+    struct stat             *st;
+    int                     found;
+    int                     open;       /* Backup group still open */
+    unsigned long long      gen;
+    dsStruct64_t            objId;
+};
+
+/*
+ * Find the latest descriptor of an upload of the input of layout, the one
+ * with the highest generation with an id that is ours
+ */
+int tsm_segdesc_cb(dsmQueryType qType, DataBlk *qResp, void * userdata)
+{
+    struct segdesc_cb_data  *cbdata = userdata;
+    struct segment_layout   layout, id;
+    const char              *objInfo;
+    dsStruct64_t            objId;
+    int                     objInfolen, open = 0;
+
+    if(qType == qtArchive) {
+        qryRespArchiveData *qr = (void *) qResp->bufferPtr;
+
+        objId = qr->objId;
+        objInfo = qr->objInfo;
+        objInfolen = qr->objInfolen;
+    }
+    else if(qType == qtBackup) {
+        qryRespBackupData *qr = (void *) qResp->bufferPtr;
+
+        objId = qr->objId;
+        objInfo = qr->objInfo;
+        objInfolen = qr->objInfolen;
+        open = qr->isGroupLeader && qr->isOpenGroup;
+    }
+    else {
+        fprintf(stderr,
+                "tsm_segdesc_cb: Internal error: Unknown qType %d\n",
+                qType);
+        return -1;
+    }
+
+    if(!segment_parse(objInfo, objInfolen, &layout) ||
+            layout.length != cbdata->layout->length ||
+            layout.segsize != cbdata->layout->segsize ||
+            (cbdata->found && layout.gen <= cbdata->gen))
+    {
+        return 1;
+    }
+    id = layout;
+    segment_setid(&id, cbdata->fsname, cbdata->filename, cbdata->st);
+    if(strcmp(id.id, layout.id) == 0) {
+        cbdata->found = 1;
+        cbdata->open = open;
+        cbdata->gen = layout.gen;
+        cbdata->objId = objId;
+    }
+
+    return 1;
+}
+
+
+struct segment_cb_data {
+    struct segment_layout   *layout;
+    dsStruct64_t            *objIds;
+    char                    *have;
+    struct tsm_sum          *sums;      /* Checksums, if not NULL */
+    dsStruct64_t            *leader;    /* Only members of its group */
+    unsigned long long      nfound;
+};
+
+/*
+ * Collect the objIds of the segments, by segment number, and the checksums
+ * from the objects after them
+ */
+int tsm_segment_cb(dsmQueryType qType, DataBlk *qResp, void * userdata)
+{
+    struct segment_cb_data  *cbdata = userdata;
+    dsmObjName              *objName;
+    dsStruct64_t            objId;
+    unsigned long long      idx;
+    const char              *objInfo;
+    char                    *p, *end;
+    int                     objInfolen;
+
+    if(qType == qtArchive) {
+        qryRespArchiveData *qr = (void *) qResp->bufferPtr;
+
+        objName = &qr->objName;
+        objId = qr->objId;
+        objInfo = qr->objInfo;
+        objInfolen = qr->objInfolen;
+    }
+    else if(qType == qtBackup) {
+        qryRespBackupData *qr = (void *) qResp->bufferPtr;
+
+        if(cbdata->leader && (qr->baseObjId.hi != cbdata->leader->hi ||
+                              qr->baseObjId.lo != cbdata->leader->lo))
+        {
+            return 1;
+        }
+        objName = &qr->objName;
+        objId = qr->objId;
+        objInfo = qr->objInfo;
+        objInfolen = qr->objInfolen;
+    }
+    else {
+        fprintf(stderr,
+                "tsm_segment_cb: Internal error: Unknown qType %d\n",
+                qType);
+        return -1;
+    }
+
+    p = strrchr(objName->ll, '.');
+    if(p == NULL) {
+        return 1;
+    }
+    idx = strtoull(p + 1, &end, 10);
+    if(end == p + 1 || *end != '\0' || idx >= 2 * cbdata->layout->nsegs) {
+        return 1;
+    }
+    if(idx >= cbdata->layout->nsegs) {
+        if(cbdata->sums) {
+            sum_parse(objInfo, objInfolen,
+                      &cbdata->sums[idx - cbdata->layout->nsegs]);
+        }
+        return 1;
+    }
+    if(!cbdata->have[idx]) {
+        cbdata->have[idx] = 1;
+        cbdata->nfound++;
+    }
+    cbdata->objIds[idx] = objId;
+
+    return 1;
+}
+
+
+/*
+ * Find the stored segments of layout, setting have[] and objIds[] for
+ * them, and sums[] if not NULL. With leader, only those in its backup
+ * group count. Returns the number found, or -1 if the query failed.
+ */
+long long segment_query(dsUint32_t sesshandle, char *fsname, char *filename,
+                        char *description, dsmSendType sendtype,
+                        char verbose, struct segment_layout *layout,
+                        dsStruct64_t *leader, dsStruct64_t *objIds,
+                        char *have, struct tsm_sum *sums)
+{
+    struct segment_cb_data  cbdata;
+    char                    name[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 1];
+    dsmObjName              objName;
+    dsInt16_t               rc;
+
+    snprintf(name, sizeof(name), "%s.%s.*", filename, layout->id);
+    tsm_name2obj(fsname, name, &objName);
+
+    cbdata.layout = layout;
+    cbdata.objIds = objIds;
+    cbdata.have = have;
+    cbdata.sums = sums;
+    cbdata.leader = leader;
+    cbdata.nfound = 0;
+
+    rc = tsm_queryname(sesshandle, &objName, description, sendtype, verbose,
+                       tsm_segment_cb, &cbdata);
+    if(rc != DSM_RC_OK && rc != DSM_RC_ABORT_NO_MATCH) {
+        return -1;
+    }
+
+    return cbdata.nfound;
+}
+
+
+/*
+ * Whether ll is that of a segment of filename's ll, name.id.NNNNNN, with
+ * an id other than those of the descriptors in descs
+ */
+int segment_orphan(const char *ll, const char *namell,
+                   struct bulkdel_cb_data *descs)
+{
+    size_t  n = strlen(namell);
+    int     i;
+
+    if(strncmp(ll, namell, n) != 0 || ll[n] != '.' ||
+            strspn(ll + n + 1, "0123456789abcdef") != 8 ||
+            ll[n + 9] != '.' || strlen(ll + n + 10) < 6 ||
+            strspn(ll + n + 10, "0123456789") != strlen(ll + n + 10))
+    {
+        return 0;
+    }
+    for(i = 0; i < descs->nobjs; i++) {
+        if(descs->objs[i].subid &&
+                strncmp(descs->objs[i].subid, ll + n + 1, 8) == 0 &&
+                descs->objs[i].subid[8] == '\0')
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/*
+ * Archive segments only get their descriptor at the end. Delete those of
+ * uploads to filename that never got one, like one interrupted before its
+ * input was modified, which gives it a new id. Our own segments have a
+ * descriptor by now. Returns 0 if that failed.
+ */
+int segment_cleanup(dsUint32_t sesshandle, char *fsname, char *filename,
+                    char *description, dsmSendType sendtype, char verbose)
+{
+    struct bulkdel_cb_data  descs, segs;
+    char                    name[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 1];
+    dsmObjName              objName, segName;
+    dsUint32_t              maxobj;
+    unsigned long long      maxbytes;
+    dsInt16_t               rc;
+    int                     i, n, ok, ntxns = 0;
+
+    tsm_name2obj(fsname, filename, &objName);
+    snprintf(name, sizeof(name), "%s.*", filename);
+    tsm_name2obj(fsname, name, &segName);
+
+    memset(&descs, 0, sizeof(descs));
+    memset(&segs, 0, sizeof(segs));
+    rc = tsm_queryname(sesshandle, &objName, description, sendtype, verbose,
+                       tsm_bulkdel_cb, &descs);
+    ok = rc == DSM_RC_OK || rc == DSM_RC_ABORT_NO_MATCH;
+    if(ok) {
+        rc = tsm_queryname(sesshandle, &segName, description, sendtype,
+                           verbose, tsm_bulkdel_cb, &segs);
+        ok = rc == DSM_RC_OK || rc == DSM_RC_ABORT_NO_MATCH;
+    }
+
+    for(i = 0, n = 0; ok && i < segs.nobjs; i++) {
+        if(strcmp(segs.objs[i].hl, objName.hl) == 0 &&
+                segment_orphan(segs.objs[i].ll, objName.ll, &descs))
+        {
+            segs.objs[n++] = segs.objs[i];
+        }
+        else {
+            bulkdel_freeobj(&segs.objs[i]);
+        }
+    }
+    if(ok) {
+        segs.nobjs = n;
+    }
+
+    if(ok && n > 0) {
+        ok = tsm_txnlimits(sesshandle, &maxobj, &maxbytes) &&
+             bulkdel_run(sesshandle, &segs, dtArchive, maxobj, 1, NULL,
+                         verbose, &ntxns);
+        for(i = 0; ok && i < n; i++) {
+            ok = segs.objs[i].status > 0;
+        }
+        if(catalog != NULL) {
+            bulkdel_forget(sesshandle, &segs, sendtype, verbose);
+        }
+        fprintf(stderr, "tsmpipe: %s %d segments of abandoned uploads to "
+                "%s%s\n", ok ? "Deleted" : "FAILED to delete", n,
+                objName.fs, filename);
+    }
+    bulkdel_free(&descs);
+    bulkdel_free(&segs);
+
+    return ok;
+}
+
+
+/*
+ * Send the descriptor of layout in its own transaction. If leader is not
+ * NULL it opens a backup group, and leader is set to its objId.
+ */
+int segment_senddesc(dsUint32_t sesshandle, dsmObjName *objName,
+                     struct segment_layout *layout, char *description,
+                     dsmSendType sendtype, char verbose, tsmpipe_xfer_t *xfer,
+                     struct tsm_ring *ring, dsStruct64_t *leader)
+{
+    char                    objinfo[DSM_MAX_OBJINFO_LENGTH + 1] = "";
+    char                    text[DSM_MAX_OBJINFO_LENGTH + 2];
+    char                    num[32];
+    tsmpipe_xfer_t          plain = *xfer;
+    dsInt16_t               rc;
+    off_t                   sent;
+
+    snprintf(num, sizeof(num), "%llu", layout->nsegs);
+    objinfo_add(objinfo, sizeof(objinfo), "segments", num);
+    snprintf(num, sizeof(num), "%llu", layout->segsize);
+    objinfo_add(objinfo, sizeof(objinfo), "segsize", num);
+    snprintf(num, sizeof(num), "%llu", layout->length);
+    objinfo_add(objinfo, sizeof(objinfo), "length", num);
+    objinfo_add(objinfo, sizeof(objinfo), "id", layout->id);
+    if(layout->gen > 0) {
+        snprintf(num, sizeof(num), "%llu", layout->gen);
+        objinfo_add(objinfo, sizeof(objinfo), "gen", num);
+    }
+    snprintf(text, sizeof(text), "%s\n", objinfo);
+
+    ring_reset(ring, -1);
+    ring_write(ring, text, strlen(text));
+    ring_close(ring, 0);
+
+    plain.codec = NULL;
+    plain.key = NULL;
+
+    rc = dsmBeginTxn(sesshandle);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmBeginTxn failed");
+        return 0;
+    }
+    if(leader && !tsm_group(sesshandle, DSM_GROUP_ACTION_OPEN,
+                            DSM_MEMBERTYPE_LEADER, NULL, layout->id, objName))
+    {
+        tsm_endtxn(sesshandle, DSM_VOTE_ABORT);
+        return 0;
+    }
+    if(!tsm_sendobj(sesshandle, objName, strlen(text), description, objinfo,
+                    sendtype, -1, verbose, &plain, ring, &sent, NULL))
+    {
+        tsm_endtxn(sesshandle, DSM_VOTE_ABORT);
+        return 0;
+    }
+
+    if(leader) {
+        return tsm_endtxnex(sesshandle, DSM_VOTE_COMMIT, leader);
+    }
+
+    return tsm_endtxn(sesshandle, DSM_VOTE_COMMIT);
+}
+
+
+/*
+ * Send the checksum object of segment idx, within its transaction. Like
+ * with tsm_sendsum() the data is the objInfo as text.
+ */
+int segment_sendsum(dsUint32_t sesshandle, char *fsname, char *filename,
+                    struct segment_layout *layout, unsigned long long idx,
+                    struct tsm_sum *sum, char *description,
+                    dsmSendType sendtype, char verbose, tsmpipe_xfer_t *xfer,
+                    struct tsm_ring *ring)
+{
+    char            objinfo[DSM_MAX_OBJINFO_LENGTH + 1] = "";
+    char            text[DSM_MAX_OBJINFO_LENGTH + 2];
+    char            name[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 1];
+    dsmObjName      objName;
+    tsmpipe_xfer_t  plain = *xfer;
+    off_t           sent;
+
+    segment_name(name, sizeof(name), filename, layout, layout->nsegs + idx);
+    tsm_name2obj(fsname, name, &objName);
+
+    sum_objinfo(objinfo, sizeof(objinfo), sum);
+    snprintf(text, sizeof(text), "%s\n", objinfo);
+
+    ring_reset(ring, -1);
+    ring_write(ring, text, strlen(text));
+    ring_close(ring, 0);
+
+    plain.codec = NULL;
+    plain.key = NULL;
+
+    return tsm_sendobj(sesshandle, &objName, strlen(text), description,
+                       objinfo, sendtype, -1, verbose, &plain, ring, &sent,
+                       NULL);
+}
+
+
+/*
+ * Send segment idx, read from fd with pread, and its checksum object in
+ * their own transaction. With leader they are added to that backup group.
+ */
+int segment_send(dsUint32_t sesshandle, char *fsname, char *filename,
+                 struct segment_layout *layout, unsigned long long idx,
+                 int fd, char *description, dsmSendType sendtype,
+                 char verbose, tsmpipe_xfer_t *xfer, struct tsm_ring *ring,
+                 dsStruct64_t *leader)
+{
+    char        name[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 1];
+    dsmObjName  objName, leaderName;
+    dsInt16_t   rc;
+    off_t       len, sent;
+    int         ok;
+    struct tsm_sum sum;
+
+    segment_name(name, sizeof(name), filename, layout, idx);
+    tsm_name2obj(fsname, name, &objName);
+    tsm_name2obj(fsname, filename, &leaderName);
+
+    len = layout->length - idx * layout->segsize;
+    if(len > (off_t) layout->segsize) {
+        len = layout->segsize;
+    }
+
+    if(verbose > 1) {
+        fprintf(stderr, "tsmpipe: Sending segment %llu, %lld bytes\n", idx,
+                (long long) len);
+    }
+
+    rc = dsmBeginTxn(sesshandle);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmBeginTxn failed");
+        return 0;
+    }
+    if(leader && !tsm_group(sesshandle, DSM_GROUP_ACTION_ADD,
+                            DSM_MEMBERTYPE_MEMBER, leader, layout->id,
+                            &leaderName))
+    {
+        tsm_endtxn(sesshandle, DSM_VOTE_ABORT);
+        return 0;
+    }
+
+    memset(&sum, 0, sizeof(sum));
+    ring->inpos = idx * layout->segsize;
+    ring->inleft = len;
+    ok = tsm_sendobj(sesshandle, &objName, len, description, NULL, sendtype,
+                     fd, verbose, xfer, ring, &sent, &sum);
+    ring->inleft = -1;
+    if(ok && sent != len) {
+        fprintf(stderr, "tsmpipe: Segment %llu: Got %lld bytes from the "
+                "input, expected %lld\n", idx, (long long) sent,
+                (long long) len);
+        ok = 0;
+    }
+    if(ok) {
+        ok = segment_sendsum(sesshandle, fsname, filename, layout, idx, &sum,
+                             description, sendtype, verbose, xfer, ring);
+    }
+    if(!ok) {
+        tsm_endtxn(sesshandle, DSM_VOTE_ABORT);
+        return 0;
+    }
+
+    return tsm_endtxn(sesshandle, DSM_VOTE_COMMIT);
+}
+
+
+/*
+ * Check the stored segments in have[] against fd, reading them and
+ * comparing with the checksums in sums[]. Returns 1 if all of them match,
+ * 0 if not and -1 if fd couldn't be read.
+ */
+int segment_check(int fd, struct segment_layout *layout, const char *have,
+                  const struct tsm_sum *sums, char verbose)
+{
+    unsigned long long  i;
+    dsUint32_t          crc;
+    off_t               pos, len, left;
+    ssize_t             n;
+    char                *buf;
+
+    /* Page aligned, and the reads rounded up, for an O_DIRECT fd */
+    buf = mmap(NULL, BUFTARGET, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(buf == MAP_FAILED) {
+        perror("tsmpipe: mmap");
+        return -1;
+    }
+
+    for(i = 0; i < layout->nsegs; i++) {
+        if(!have[i]) {
+            continue;
+        }
+        pos = i * layout->segsize;
+        len = layout->length - pos;
+        if(len > (off_t) layout->segsize) {
+            len = layout->segsize;
+        }
+        if(!sums[i].valid || sums[i].size != len) {
+            if(verbose > 0) {
+                fprintf(stderr, "tsmpipe: Segment %llu has no checksum\n",
+                        i);
+            }
+            munmap(buf, BUFTARGET);
+            return 0;
+        }
+        crc = 0;
+        for(left = len; left > 0; left -= n, pos += n) {
+            n = left < BUFTARGET ? (left + DIRECT_ALIGN - 1) /
+                                   DIRECT_ALIGN * DIRECT_ALIGN : BUFTARGET;
+            n = pread_full(fd, buf, n, pos);
+            if(n <= 0) {
+                fprintf(stderr, "tsmpipe: Reading the input: %s\n",
+                        n < 0 ? strerror(errno) : "Short read");
+                munmap(buf, BUFTARGET);
+                return -1;
+            }
+            if(n > left) {
+                n = left;
+            }
+            crc = crc32c(crc, buf, n);
+        }
+        if(crc != sums[i].crc) {
+            if(verbose > 0) {
+                fprintf(stderr, "tsmpipe: Segment %llu differs from the "
+                        "input\n", i);
+            }
+            munmap(buf, BUFTARGET);
+            return 0;
+        }
+    }
+    munmap(buf, BUFTARGET);
+
+    return 1;
+}
+
+
+/*
+ * Store infd, the -i file or block device of length bytes, as segments of
+ * segsize bytes, resuming an earlier run of the same upload that didn't
+ * finish if what it stored still matches the input.
+ */
+int tsm_sendsegmented(dsUint32_t sesshandle, char *fsname, char *filename,
+                      int infd, off_t length, char *description,
+                      dsmSendType sendtype, char verbose,
+                      tsmpipe_xfer_t *xfer, off_t segsize)
+{
+    struct segment_layout   layout;
+    struct segdesc_cb_data  desc;
+    struct tsm_ring         ring;
+    struct tsm_sum          *sums = NULL;
+    struct stat             st;
+    dsStruct64_t            *objIds = NULL, leader, *leaderp = NULL;
+    dsmObjName              objName;
+    dsInt16_t               rc;
+    char                    *have = NULL;
+    long long               nhave = 0;
+    unsigned long long      i;
+    off_t                   total = 0;
+    int                     ok = 1, backup, match;
+    double                  start;
+
+    if(fstat(infd, &st) < 0) {
+        perror("tsmpipe: fstat");
+        return 0;
+    }
+
+    memset(&layout, 0, sizeof(layout));
+    layout.segsize = segsize;
+    layout.length = length;
+    layout.nsegs = (layout.length + layout.segsize - 1) / layout.segsize;
+    segment_setid(&layout, fsname, filename, &st);
+
+    tsm_name2obj(fsname, filename, &objName);
+    backup = sendtype == stBackupMountWait || sendtype == stBackup;
+
+    /* Is this upload already done, or started? */
+    memset(&desc, 0, sizeof(desc));
+    desc.layout = &layout;
+    desc.fsname = fsname;
+    desc.filename = filename;
+    desc.st = &st;
+    rc = tsm_queryname(sesshandle, &objName, description, sendtype, verbose,
+                       tsm_segdesc_cb, &desc);
+    if(rc != DSM_RC_OK && rc != DSM_RC_ABORT_NO_MATCH) {
+        return 0;
+    }
+
+    objIds = calloc(layout.nsegs + 1, sizeof(*objIds));
+    have = calloc(layout.nsegs + 1, 1);
+    sums = calloc(layout.nsegs + 1, sizeof(*sums));
+    if(!objIds || !have || !sums) {
+        perror("tsmpipe: malloc");
+        free(objIds);
+        free(have);
+        free(sums);
+        return 0;
+    }
+
+    /*
+     * Segments stored by earlier runs, which must still match the input.
+     * Backup segments can only be found through the group of their
+     * descriptor.
+     */
+    for(;;) {
+        if(desc.found) {
+            layout.gen = desc.gen;
+            segment_setid(&layout, fsname, filename, &st);
+        }
+        memset(objIds, 0, layout.nsegs * sizeof(*objIds));
+        memset(have, 0, layout.nsegs);
+        memset(sums, 0, layout.nsegs * sizeof(*sums));
+        nhave = 0;
+        match = 1;
+        if(!backup || desc.found) {
+            nhave = segment_query(sesshandle, fsname, filename, description,
+                                  sendtype, verbose, &layout,
+                                  desc.found && backup ? &desc.objId : NULL,
+                                  objIds, have, sums);
+            if(nhave < 0) {
+                ok = 0;
+                break;
+            }
+        }
+        if(desc.found && !desc.open &&
+                (unsigned long long) nhave != layout.nsegs)
+        {
+            match = 0;
+        }
+        else if(nhave > 0) {
+            if(verbose > 0) {
+                fprintf(stderr, "tsmpipe: Checking %lld stored segments "
+                        "against the input\n", nhave);
+            }
+            match = segment_check(infd, &layout, have, sums, verbose);
+            if(match < 0) {
+                ok = 0;
+                break;
+            }
+        }
+        if(match) {
+            break;
+        }
+        fprintf(stderr, "tsmpipe: The input has changed since %s%s%s id %s "
+                "was stored, starting over\n", objName.fs, objName.hl,
+                objName.ll, layout.id);
+        desc.found = 0;
+        layout.gen++;
+        segment_setid(&layout, fsname, filename, &st);
+    }
+    if(ok && desc.found && !desc.open) {
+        fprintf(stderr, "tsmpipe: %s%s%s is already stored from this "
+                "input, id %s\n", objName.fs, objName.hl, objName.ll,
+                layout.id);
+        free(objIds);
+        free(have);
+        free(sums);
+        return 1;
+    }
+
+    if(ok && verbose > 0) {
+        fprintf(stderr, "tsmpipe: Starting to send input as %s%s%s in %llu "
+                "segments of %llu bytes, id %s\n", objName.fs, objName.hl,
+                objName.ll, layout.nsegs, layout.segsize, layout.id);
+    }
+
+    if(!ok || !ring_init(&ring, xfer->qdepth, xfer->slotsize,
+                         xfer->hugepages, verbose))
+    {
+        free(objIds);
+        free(have);
+        free(sums);
+        return 0;
+    }
+
+    start = timenow();
+
+    if(backup) {
+        leaderp = &leader;
+        if(desc.found) {
+            leader = desc.objId;
+        }
+        else {
+            ok = segment_senddesc(sesshandle, &objName, &layout, description,
+                                  sendtype, verbose, xfer, &ring, leaderp);
+        }
+    }
+
+    if(ok && nhave > 0) {
+        fprintf(stderr, "tsmpipe: Resuming, %lld of %llu segments are "
+                "already stored\n", nhave, layout.nsegs);
+    }
+
+    for(i = 0; ok && i < layout.nsegs; i++) {
+        if(have[i]) {
+            continue;
+        }
+        ok = segment_send(sesshandle, fsname, filename, &layout, i, infd,
+                          description, sendtype, verbose, xfer, &ring,
+                          leaderp);
+        if(ok) {
+            total += i == layout.nsegs - 1 ?
+                     layout.length - i * layout.segsize : layout.segsize;
+            nhave++;
+        }
+    }
+
+    if(ok && leaderp) {
+        rc = dsmBeginTxn(sesshandle);
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmBeginTxn failed");
+            ok = 0;
+        }
+        else if(tsm_group(sesshandle, DSM_GROUP_ACTION_CLOSE,
+                          DSM_MEMBERTYPE_LEADER, leaderp, layout.id,
+                          &objName))
+        {
+            ok = tsm_endtxn(sesshandle, DSM_VOTE_COMMIT);
+        }
+        else {
+            tsm_endtxn(sesshandle, DSM_VOTE_ABORT);
+            ok = 0;
+        }
+    }
+    else if(ok) {
+        ok = segment_senddesc(sesshandle, &objName, &layout, description,
+                              sendtype, verbose, xfer, &ring, NULL);
+        if(ok) {
+            segment_cleanup(sesshandle, fsname, filename, description,
+                            sendtype, verbose);
+        }
+    }
+
+    if(ok && verbose > 0) {
+        fprintf(stderr, "tsmpipe: Sent %lld bytes in %.1f seconds\n",
+                (long long) total, timenow() - start);
+    }
+    if(!ok) {
+        fprintf(stderr, "tsmpipe: %lld of %llu segments stored, run the "
+                "same command again to resume\n", nhave, layout.nsegs);
+    }
+
+    ring_free(&ring);
+    free(objIds);
+    free(have);
+    free(sums);
+
+    return ok;
+}
+
+
+/*
+ * Get the segments of layout in order, onto outfd or into verify. Returns
+ * 1 if all of them were got.
+ */
+int tsm_restoresegments(dsUint32_t sesshandle, char *fsname, char *filename,
+                        char *description, dsmSendType sendtype,
+                        char verbose, tsmpipe_xfer_t *xfer,
+                        struct segment_layout *layout, int outfd,
+                        struct tsm_verify *verify)
+{
+    dsStruct64_t            *objIds;
+    dsmGetList              getList;
+    dsmGetType              getType;
+    dsInt16_t               rc;
+    char                    *have;
+    long long               nhave;
+    unsigned long long      i, j, n;
+    int                     ok = 1;
+    double                  start;
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: %s%s is %llu bytes in %llu segments of "
+                "%llu bytes\n", fsname, filename, layout->length,
+                layout->nsegs, layout->segsize);
+    }
+
+    objIds = calloc(layout->nsegs + 1, sizeof(*objIds));
+    have = calloc(layout->nsegs + 1, 1);
+    if(!objIds || !have) {
+        perror("tsmpipe: malloc");
+        free(objIds);
+        free(have);
+        return 0;
+    }
+
+    nhave = segment_query(sesshandle, fsname, filename, description,
+                          sendtype, verbose, layout, NULL, objIds, have,
+                          NULL);
+    if(nhave < 0) {
+        ok = 0;
+    }
+    for(i = 0; ok && i < layout->nsegs; i++) {
+        if(!have[i]) {
+            fprintf(stderr, "tsmpipe: FAILED: Segment %llu of %s%s not "
+                    "found\n", i, fsname, filename);
+            ok = 0;
+        }
+    }
+
+    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
+        getType = gtArchive;
+    }
+    else {
+        getType = gtBackup;
+    }
+
+    start = timenow();
+
+    for(i = 0; ok && i < layout->nsegs; i += n) {
+        n = layout->nsegs - i;
+        if(n > DSM_MAX_GET_OBJ) {
+            n = DSM_MAX_GET_OBJ;
+        }
+
+        getList.stVersion = dsmGetListVersion;
+        getList.numObjId = n;
+        getList.objId = objIds + i;
+        getList.partialObjData = NULL;
+
+        rc = dsmBeginGetData(sesshandle, bTrue, getType, &getList);
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmBeginGetData failed");
+            ok = 0;
+            break;
+        }
+
+        for(j = 0; ok && j < n; j++) {
+            ok = tsm_getplain(sesshandle, &objIds[i+j], xfer, outfd, verify,
+                              verbose);
+            if(!ok) {
+                break;
+            }
+            rc = dsmEndGetObj(sesshandle);
+            if(rc != DSM_RC_OK) {
+                tsm_printerr(sesshandle, rc, "dsmEndGetObj failed");
+                ok = 0;
+            }
+        }
+
+        rc = dsmEndGetData(sesshandle);
+        if(ok && rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmEndGetData failed");
+            ok = 0;
+        }
+    }
+
+    if(ok && verbose > 0) {
+        fprintf(stderr, "tsmpipe: Got %llu bytes in %.1f seconds\n",
+                layout->length, timenow() - start);
+    }
+
+    free(objIds);
+    free(have);
+
+    return ok;
+}
+
+
+/* Get the plain, compressed or encrypted object objId onto outfd */
+int tsm_restoreobj(dsUint32_t sesshandle, dsStruct64_t *objId,
+                   dsmSendType sendtype, const struct tsm_codec *codec,
+                   const struct tsm_crypt *crypt, size_t zblock,
+                   tsmpipe_xfer_t *xfer, int outfd, char verbose)
+{
+    dsInt16_t               rc;
+    dsmGetList              getList;
+    dsmGetType              getType;
+    int                     ok;
+
+    getList.stVersion = dsmGetListVersion;
+    getList.numObjId = 1;
+    getList.objId = objId;
+    getList.partialObjData = NULL;
+
+    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
+        getType = gtArchive;
+    }
+    else {
+        getType = gtBackup;
+    }
+
+    rc = dsmBeginGetData(sesshandle, bTrue, getType, &getList);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmBeginGetData failed");
+        return 0;
+    }
+
+    if(codec || crypt) {
+        ok = tsm_getcompressed(sesshandle, objId, codec, crypt, zblock,
+                               xfer, outfd, NULL, verbose);
+    }
+    else {
+        ok = tsm_getplain(sesshandle, objId, xfer, outfd, NULL,
+                          verbose);
+    }
+    if(!ok) {
+        /* Leave the session usable for catalog_recheck() */
+        dsmEndGetData(sesshandle);
+        return 0;
+    }
+
+    rc = dsmEndGetObj(sesshandle);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmEndGetObj failed");
+        return 0;
+    }
+
+    rc = dsmEndGetData(sesshandle);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmEndGetData failed");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+int tsm_restorefile(dsUint32_t sesshandle, char *fsname, char *filename, 
+                   char *description, dsmSendType sendtype, char verbose,
+                   tsmpipe_xfer_t *xfer, char *options,
+                   struct tsm_range *ranges, int nranges, int outfd)
+{
+    dsInt16_t               rc;
+    struct stripe_layout    layout;
+    struct segment_layout   seglayout;
+    char                    striped, segmented;
+    const struct tsm_codec  *codec = NULL;
+    struct tsm_crypt        crypt;
+    size_t                  zblock = 0;
+    int                     compressed, encrypted, ok;
+    struct matchone_cb_data cbdata;
+    dsmObjName              objName;
+    off_t                   end;
+
+    tsm_name2obj(fsname, filename, &objName);
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Restoring file %s%s%s\n",
+                objName.fs, objName.hl, objName.ll);
+    }
+
+    cbdata.numfound = 0;
+
+    rc = tsm_queryfile(sesshandle, &objName, description, sendtype, 
+                       verbose, tsm_matchone_cb, &cbdata);
+    if(rc != DSM_RC_OK) {
+        return 0;
+    }
+
+    if(cbdata.numfound == 0) {
+        fprintf(stderr, "tsmpipe: FAILED: The file specification did not match any file.\n");
+        return(0);
+    }
+
+    striped = stripe_parse(cbdata.objInfo, cbdata.objInfolen, &layout);
+    segmented = segment_parse(cbdata.objInfo, cbdata.objInfolen, &seglayout);
+    if(segmented && nranges > 0) {
+        fprintf(stderr, "tsmpipe: FAILED: Partial restores of segmented "
+                "objects are not supported\n");
+        return 0;
+    }
+
+    compressed = codec_objinfo(cbdata.objInfo, cbdata.objInfolen, &codec,
+                               &zblock);
+    if(compressed < 0) {
+        return 0;
+    }
+    if(compressed) {
+        if(nranges > 0) {
+            fprintf(stderr, "tsmpipe: FAILED: Partial restores of compressed "
+                    "objects are not supported\n");
+            return 0;
+        }
+        if(verbose > 1) {
+            fprintf(stderr, "tsmpipe: Object is compressed with %s, %lu "
+                    "byte blocks\n", codec->name, (unsigned long) zblock);
+        }
+    }
+    encrypted = crypt_objinfo(cbdata.objInfo, cbdata.objInfolen, &crypt,
+                              &zblock);
+    if(encrypted < 0) {
+        return 0;
+    }
+    if(encrypted && verbose > 1) {
+        fprintf(stderr, "tsmpipe: Object is encrypted with %s key %s, %lu "
+                "byte blocks\n", CRYPT_CIPHER, crypt.key->id,
+                (unsigned long) zblock);
+    }
+
+    if(nranges > 0) {
+        return tsm_restoreranges(sesshandle, fsname, filename, description,
+                                 sendtype, verbose, xfer, &cbdata.objId,
+                                 striped ? &layout : NULL,
+                                 encrypted ? &crypt : NULL, zblock, ranges,
+                                 nranges, outfd);
+    }
+
+    /* Preallocating would fill the holes of a sparse object */
+    end = compressed && codec->sparse ? 0 :
+          output_prealloc(outfd, striped ? (off_t) layout.length :
+                                 segmented ? (off_t) seglayout.length :
+                                 (off_t) u64(&cbdata.sizeEstimate), verbose);
+
+    if(striped) {
+        ok = tsm_restorestriped(sesshandle, fsname, filename, description,
+                                sendtype, verbose, xfer, options, &layout,
+                                outfd, NULL);
+    }
+    else if(segmented) {
+        ok = tsm_restoresegments(sesshandle, fsname, filename, description,
+                                 sendtype, verbose, xfer, &seglayout, outfd,
+                                 NULL);
+    }
+    else {
+        ok = tsm_restoreobj(sesshandle, &cbdata.objId, sendtype, codec,
+                            encrypted ? &crypt : NULL, zblock, xfer, outfd,
+                            verbose);
+    }
+
+    output_trim(outfd, end);
+
+    return ok;
+}
+
+
+/*
+ * Packing, -Y. Storing millions of small files as objects of their own
+ * costs a bind, a dsmSendObj and a database entry on the server each.
+ * With -c -Y dir the regular files below dir are instead packed back to
+ * back into container objects filepath.id.NNNNNN of about -e size bytes,
+ * each committed in its own transaction, and an index object under
+ * filepath tells where each file went. The index is text, one line per
+ * file sorted by path:
+ *
+ *   path <TAB> container <TAB> offset <TAB> length <TAB> mode <TAB> mtime
+ *
+ * with backslash, tab and newline in the path escaped as \\, \t and \n.
+ * -x -Y path bisects the index and gets only the bytes of that file from
+ * its container with a partial get. -x of filepath gives the index.
+ */
+
+#define DEF_PACKSIZE    (1024LL*1024*1024)
+
+struct pack_entry {
+    char        *path;      /* To open, below the -Y dir */
+    char        *name;      /* Relative to the -Y dir and escaped */
+    off_t       size;
+    mode_t      mode;
+    time_t      mtime;
+    int         container;
+    off_t       offset;
+    char        failed;     /* Couldn't be read as it was when scanned */
+};
+
+struct tsm_pack {
+    char                *dir;
+    struct pack_entry   *ents;
+    size_t              nents;
+    size_t              alloc;
+    off_t               length;
+    int                 ncontainers;
+    char                id[32];
+    unsigned long       failed;     /* Files and directories */
+    unsigned long       skipped;    /* Not regular files */
+};
+
+/* What the feeder thread packs into one container */
+struct pack_feed {
+    struct tsm_pack     *pack;
+    struct tsm_ring     *ring;
+    size_t              first;
+    size_t              last;
+};
+
+
+/* Path escaped as in the index */
+char *pack_escape(const char *path) {
+    char    *name, *p;
+
+    name = malloc(2 * strlen(path) + 1);
+    if(name == NULL) {
+        perror("tsmpipe: malloc");
+        return NULL;
+    }
+    for(p = name; *path; path++) {
+        if(*path == '\\' || *path == '\t' || *path == '\n') {
+            *p++ = '\\';
+            *p++ = *path == '\t' ? 't' : *path == '\n' ? 'n' : '\\';
+        }
+        else {
+            *p++ = *path;
+        }
+    }
+    *p = '\0';
+
+    return name;
+}
+
+
+int pack_cmp(const void *a, const void *b) {
+    return strcmp(((const struct pack_entry *) a)->name,
+                  ((const struct pack_entry *) b)->name);
+}
+
+
+/*
+ * Add the regular files below pack->dir/rel, recursively. Unreadable
+ * directories are counted as failed. Returns 0 on fatal errors.
+ */
+int pack_scan(struct tsm_pack *pack, const char *rel) {
+    DIR                 *d;
+    struct dirent       *de;
+    struct stat         st;
+    struct pack_entry   *e;
+    char                *dirpath, *path;
+    size_t              dirlen;
+    int                 ok = 1;
+
+    dirlen = strlen(pack->dir) + strlen(rel) + 2;
+    dirpath = malloc(dirlen);
+    if(dirpath == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+    snprintf(dirpath, dirlen, "%s%s%s", pack->dir, *rel ? "/" : "", rel);
+
+    d = opendir(dirpath);
+    if(d == NULL) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", dirpath, strerror(errno));
+        pack->failed++;
+        free(dirpath);
+        return 1;
+    }
+
+    while(ok && (de = readdir(d)) != NULL) {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        path = malloc(dirlen + strlen(de->d_name) + 1);
+        if(path == NULL) {
+            perror("tsmpipe: malloc");
+            ok = 0;
+            break;
+        }
+        sprintf(path, "%s/%s", dirpath, de->d_name);
+        if(lstat(path, &st) < 0) {
+            fprintf(stderr, "tsmpipe: %s: %s\n", path, strerror(errno));
+            pack->failed++;
+            free(path);
+            continue;
+        }
+        if(S_ISDIR(st.st_mode)) {
+            ok = pack_scan(pack, path + strlen(pack->dir) + 1);
+            free(path);
+            continue;
+        }
+        if(!S_ISREG(st.st_mode)) {
+            pack->skipped++;
+            free(path);
+            continue;
+        }
+
+        if(pack->nents == pack->alloc) {
+            pack->alloc = pack->alloc ? 2 * pack->alloc : 1024;
+            e = realloc(pack->ents, pack->alloc * sizeof(*e));
+            if(e == NULL) {
+                perror("tsmpipe: malloc");
+                free(path);
+                ok = 0;
+                break;
+            }
+            pack->ents = e;
+        }
+        e = &pack->ents[pack->nents];
+        memset(e, 0, sizeof(*e));
+        e->path = path;
+        e->name = pack_escape(path + strlen(pack->dir) + 1);
+        if(e->name == NULL) {
+            free(path);
+            ok = 0;
+            break;
+        }
+        e->size = st.st_size;
+        e->mode = st.st_mode & 07777;
+        e->mtime = st.st_mtime;
+        pack->nents++;
+    }
+    closedir(d);
+    free(dirpath);
+
+    return ok;
+}
+
+
+void pack_free(struct tsm_pack *pack) {
+    size_t  i;
+
+    for(i = 0; i < pack->nents; i++) {
+        free(pack->ents[i].path);
+        free(pack->ents[i].name);
+    }
+    free(pack->ents);
+}
+
+
+/* Sort the files and deal them out to containers of about size bytes */
+void pack_plan(struct tsm_pack *pack, off_t size) {
+    struct pack_entry   *e;
+    off_t               used = 0;
+    int                 c = 0;
+    size_t              i;
+
+    qsort(pack->ents, pack->nents, sizeof(*pack->ents), pack_cmp);
+
+    for(i = 0; i < pack->nents; i++) {
+        e = &pack->ents[i];
+        if(used > 0 && used + e->size > size) {
+            c++;
+            used = 0;
+        }
+        e->container = c;
+        e->offset = used;
+        used += e->size;
+        pack->length += e->size;
+    }
+    pack->ncontainers = pack->nents ? c + 1 : 0;
+}
+
+
+/*
+ * Feeder thread: reads the files of one container into the ring, filling
+ * every slot whole. Files that can't be read as they were when scanned
+ * are padded with zeroes and left out of the index.
+ */
+void *pack_feeder(void *arg) {
+    struct pack_feed    *feed = arg;
+    struct tsm_ring     *ring = feed->ring;
+    struct pack_entry   *e;
+    struct stat         st;
+    char                *buf = NULL;
+    size_t              fill = 0, used = 0, n, i;
+    ssize_t             got;
+    off_t               left;
+    int                 fd;
+    double              t;
+
+    block_signals();
+
+    for(i = feed->first; i < feed->last; i++) {
+        e = &feed->pack->ents[i];
+        fd = open(e->path, O_RDONLY|O_NOFOLLOW);
+        if(fd < 0) {
+            fprintf(stderr, "tsmpipe: %s: %s\n", e->path, strerror(errno));
+            e->failed = 1;
+        }
+        for(left = e->size; left > 0; left -= n) {
+            if(buf == NULL) {
+                buf = ring_getfree(ring, &fill);
+                if(buf == NULL) {
+                    if(fd >= 0) {
+                        close(fd);
+                    }
+                    return NULL;
+                }
+                used = 0;
+            }
+            n = fill - used;
+            if((off_t) n > left) {
+                n = left;
+            }
+            got = 0;
+            if(fd >= 0) {
+                t = timenow();
+                got = read_full(fd, buf + used, n);
+                stats_add(stat_input, t, got > 0 ? got : 0);
+                if(got < 0) {
+                    fprintf(stderr, "tsmpipe: %s: %s\n", e->path,
+                            strerror(errno));
+                    got = 0;
+                }
+            }
+            if((size_t) got < n) {
+                memset(buf + used + got, 0, n - got);
+                e->failed = 1;
+            }
+            used += n;
+            if(used == fill) {
+                ring_put(ring, used);
+                buf = NULL;
+            }
+        }
+        if(fd >= 0) {
+            if(fstat(fd, &st) < 0 || st.st_size != e->size) {
+                e->failed = 1;
+            }
+            if(e->failed) {
+                fprintf(stderr, "tsmpipe: %s: Changed as we read it\n",
+                        e->path);
+            }
+            close(fd);
+        }
+    }
+    if(buf != NULL) {
+        ring_put(ring, used);
+    }
+    ring_close(ring, 0);
+
+    return NULL;
+}
+
+
+/* Send container c, the entries [first, last), in its own transaction */
+int pack_send(dsUint32_t sesshandle, char *fsname, char *filename,
+              struct tsm_pack *pack, size_t first, size_t last,
+              char *description, dsmSendType sendtype, char verbose,
+              tsmpipe_xfer_t *xfer, struct tsm_ring *ring)
+{
+    struct pack_entry   *e = &pack->ents[last - 1];
+    struct pack_feed    feed;
+    char                name[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 1];
+    char                objinfo[DSM_MAX_OBJINFO_LENGTH + 1] = "";
+    char                num[32];
+    dsmObjName          objName;
+    pthread_t           feeder;
+    dsInt16_t           rc;
+    off_t               length = e->offset + e->size, sent;
+    int                 err, ok;
+
+    snprintf(name, sizeof(name), "%s.%s.%06d", filename, pack->id,
+             e->container);
+    tsm_name2obj(fsname, name, &objName);
+
+    objinfo_add(objinfo, sizeof(objinfo), "pack", pack->id);
+    snprintf(num, sizeof(num), "%d", e->container);
+    objinfo_add(objinfo, sizeof(objinfo), "container", num);
+    objinfo_addrawlen(objinfo, sizeof(objinfo), length);
+
+    if(verbose > 1) {
+        fprintf(stderr, "tsmpipe: Sending container %d, %lu files, %lld "
+                "bytes\n", e->container, (unsigned long) (last - first),
+                (long long) length);
+    }
+
+    rc = dsmBeginTxn(sesshandle);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmBeginTxn failed");
+        return 0;
+    }
+
+    ring_reset(ring, -1);
+    /* Compression and encryption blocks are always whole */
+    ring_setfill(ring, xfer->codec || xfer->key ? xfer->zblock :
+                                                 xfer->bufsize);
+    feed.pack = pack;
+    feed.ring = ring;
+    feed.first = first;
+    feed.last = last;
+    err = pthread_create(&feeder, NULL, pack_feeder, &feed);
+    if(err) {
+        fprintf(stderr, "tsmpipe: pthread_create: %s\n", strerror(err));
+        tsm_endtxn(sesshandle, DSM_VOTE_ABORT);
+        return 0;
+    }
+
+    ok = tsm_sendobj(sesshandle, &objName, length, description, objinfo,
+                     sendtype, -1, verbose, xfer, ring, &sent, NULL);
+    if(!ok) {
+        ring_abort(ring, 0);
+    }
+    pthread_join(feeder, NULL);
+    if(ok && sent != length) {
+        fprintf(stderr, "tsmpipe: Container %d: Packed %lld bytes, "
+                "expected %lld\n", e->container, (long long) sent,
+                (long long) length);
+        ok = 0;
+    }
+    if(!ok) {
+        tsm_endtxn(sesshandle, DSM_VOTE_ABORT);
+        return 0;
+    }
+
+    return tsm_endtxn(sesshandle, DSM_VOTE_COMMIT);
+}
+
+
+/* Send the index, of the files that were packed as they were scanned */
+int pack_sendindex(dsUint32_t sesshandle, char *fsname, char *filename,
+                   struct tsm_pack *pack, char *description,
+                   dsmSendType sendtype, char verbose, tsmpipe_xfer_t *xfer,
+                   struct tsm_ring *ring)
+{
+    struct pack_entry   *e;
+    char                objinfo[DSM_MAX_OBJINFO_LENGTH + 1] = "";
+    char                num[32];
+    dsmObjName          objName;
+    dsInt16_t           rc;
+    unsigned long       nfiles = 0;
+    off_t               length, sent;
+    FILE                *f;
+    size_t              i;
+    int                 ok;
+
+    f = tmpfile();
+    if(f == NULL) {
+        perror("tsmpipe: tmpfile");
+        return 0;
+    }
+    for(i = 0; i < pack->nents; i++) {
+        e = &pack->ents[i];
+        if(e->failed) {
+            continue;
+        }
+        fprintf(f, "%s\t%d\t%lld\t%lld\t%04o\t%lld\n", e->name, e->container,
+                (long long) e->offset, (long long) e->size,
+                (unsigned int) e->mode, (long long) e->mtime);
+        nfiles++;
+    }
+    length = ftello(f);
+    if(fflush(f) != 0 || length < 0 || fseeko(f, 0, SEEK_SET) != 0) {
+        perror("tsmpipe: index");
+        fclose(f);
+        return 0;
+    }
+
+    objinfo_add(objinfo, sizeof(objinfo), "pack", pack->id);
+    snprintf(num, sizeof(num), "%d", pack->ncontainers);
+    objinfo_add(objinfo, sizeof(objinfo), "containers", num);
+    snprintf(num, sizeof(num), "%lu", nfiles);
+    objinfo_add(objinfo, sizeof(objinfo), "files", num);
+    snprintf(num, sizeof(num), "%lld", (long long) pack->length);
+    objinfo_add(objinfo, sizeof(objinfo), "length", num);
+    objinfo_addrawlen(objinfo, sizeof(objinfo), length);
+
+    tsm_name2obj(fsname, filename, &objName);
+
+    rc = dsmBeginTxn(sesshandle);
+    if(rc != DSM_RC_OK) {
+        tsm_printerr(sesshandle, rc, "dsmBeginTxn failed");
+        fclose(f);
+        return 0;
+    }
+    ok = tsm_sendobj(sesshandle, &objName, length, description, objinfo,
+                     sendtype, fileno(f), verbose, xfer, ring, &sent, NULL);
+    fclose(f);
+    if(!ok) {
+        tsm_endtxn(sesshandle, DSM_VOTE_ABORT);
+        return 0;
+    }
+
+    return tsm_endtxn(sesshandle, DSM_VOTE_COMMIT);
+}
+
+
+/*
+ * Pack the regular files below dir into containers of about packsize
+ * bytes, and send the index last, when all containers are committed.
+ */
+int tsm_sendpack(dsUint32_t sesshandle, char *fsname, char *filename,
+                 char *dir, off_t packsize, char *description,
+                 dsmSendType sendtype, char verbose, tsmpipe_xfer_t *xfer)
+{
+    struct tsm_pack     pack;
+    struct tsm_ring     ring;
+    size_t              first, last;
+    int                 ok = 1;
+    double              start;
+
+    memset(&pack, 0, sizeof(pack));
+    pack.dir = dir;
+    tsm_setid(pack.id, sizeof(pack.id));
+
+    start = timenow();
+
+    if(!pack_scan(&pack, "")) {
+        pack_free(&pack);
+        return 0;
+    }
+    pack_plan(&pack, packsize);
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Packing %lu files, %lld bytes, from %s "
+                "into %d containers as %s%s, id %s\n",
+                (unsigned long) pack.nents, (long long) pack.length, dir,
+                pack.ncontainers, fsname, filename, pack.id);
+        if(pack.skipped) {
+            fprintf(stderr, "tsmpipe: Skipped %lu entries that are not "
+                    "regular files or directories\n", pack.skipped);
+        }
+    }
+
+    if(!ring_init(&ring, xfer->qdepth, xfer->slotsize, xfer->hugepages,
+                  verbose))
+    {
+        pack_free(&pack);
+        return 0;
+    }
+
+    for(first = 0; ok && first < pack.nents; first = last) {
+        for(last = first + 1; last < pack.nents &&
+                pack.ents[last].container == pack.ents[first].container;
+                last++)
+        {
+        }
+        ok = pack_send(sesshandle, fsname, filename, &pack, first, last,
+                       description, sendtype, verbose, xfer, &ring);
+    }
+
+    if(ok) {
+        ok = pack_sendindex(sesshandle, fsname, filename, &pack,
+                            description, sendtype, verbose, xfer, &ring);
+    }
+    ring_free(&ring);
+    /* Without its index a container is of no use to anyone */
+    if(!ok && !tsm_deletesubs(sesshandle, fsname, filename, pack.id,
+                              description, sendtype, verbose))
+    {
+        fprintf(stderr, "tsmpipe: Containers %s%s.%s.* that were stored "
+                "need to be deleted\n", fsname, filename, pack.id);
+    }
+
+    for(first = 0; first < pack.nents; first++) {
+        pack.failed += pack.ents[first].failed;
+    }
+    if(ok && pack.failed) {
+        fprintf(stderr, "tsmpipe: FAILED: %lu files or directories could "
+                "not be read as they were and are left out\n", pack.failed);
+        ok = 0;
+    }
+    else if(ok && verbose > 0) {
+        fprintf(stderr, "tsmpipe: Packed %lu files, %lld bytes in %.1f "
+                "seconds\n", (unsigned long) pack.nents,
+                (long long) pack.length, timenow() - start);
+    }
+    pack_free(&pack);
+
+    return ok;
+}
+
+
+/*
+ * Find the line of name in an index of len bytes, bisecting on the line
+ * starts. Returns NULL if it isn't there.
+ */
+char *pack_find(char *index, size_t len, const char *name) {
+    size_t  lo = 0, hi = len, mid, n, namelen = strlen(name);
+    char    *line, *tab, *nl;
+    int     cmp;
+
+    while(lo < hi) {
+        for(mid = lo + (hi - lo) / 2; mid > lo && index[mid - 1] != '\n';
+                mid--)
+        {
+        }
+        line = index + mid;
+        tab = memchr(line, '\t', len - mid);
+        nl = memchr(line, '\n', len - mid);
+        if(tab == NULL || nl == NULL || tab > nl) {
+            return NULL;
+        }
+        n = tab - line;
+        cmp = memcmp(name, line, namelen < n ? namelen : n);
+        if(cmp == 0) {
+            cmp = namelen < n ? -1 : namelen > n ? 1 : 0;
+        }
+        if(cmp == 0) {
+            return line;
+        }
+        if(cmp < 0) {
+            hi = mid;
+        }
+        else {
+            lo = nl - index + 1;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Get the whole index object objId into a NUL terminated buffer */
+char *pack_getindex(dsUint32_t sesshandle, struct matchone_cb_data *cbdata,
+                    dsmSendType sendtype, char verbose, tsmpipe_xfer_t *xfer,
+                    size_t *len)
+{
+    const struct tsm_codec  *codec = NULL;
+    struct tsm_crypt        crypt;
+    size_t                  zblock = 0;
+    int                     encrypted, ok;
+    char                    *index = NULL;
+    ssize_t                 n;
+    off_t                   size;
+    FILE                    *f;
+
+    if(codec_objinfo(cbdata->objInfo, cbdata->objInfolen, &codec,
+                     &zblock) < 0)
+    {
+        return NULL;
+    }
+    encrypted = crypt_objinfo(cbdata->objInfo, cbdata->objInfolen, &crypt,
+                              &zblock);
+    if(encrypted < 0) {
+        return NULL;
+    }
+
+    f = tmpfile();
+    if(f == NULL) {
+        perror("tsmpipe: tmpfile");
+        return NULL;
+    }
+    ok = tsm_restoreobj(sesshandle, &cbdata->objId, sendtype, codec,
+                        encrypted ? &crypt : NULL, zblock, xfer, fileno(f),
+                        verbose);
+    size = ok ? lseek(fileno(f), 0, SEEK_CUR) : -1;
+    if(ok && size >= 0) {
+        index = malloc(size + 1);
+        if(index == NULL) {
+            perror("tsmpipe: malloc");
+        }
+    }
+    if(index != NULL) {
+        n = pread(fileno(f), index, size, 0);
+        if(n != size) {
+            fprintf(stderr, "tsmpipe: Reading the index: %s\n",
+                    n < 0 ? strerror(errno) : "Short read");
+            free(index);
+            index = NULL;
+        }
+        else {
+            index[size] = '\0';
+            *len = size;
+        }
+    }
+    fclose(f);
+
+    return index;
+}
+
+
+/* Restore the file member of the pack with the index fsname filename */
+int tsm_restoremember(dsUint32_t sesshandle, char *fsname, char *filename,
+                      char *member, char *description, dsmSendType sendtype,
+                      char verbose, tsmpipe_xfer_t *xfer, int outfd)
+{
+    struct matchone_cb_data cbdata;
+    struct tsm_range        range;
+    struct tsm_crypt        crypt;
+    const struct tsm_codec  *codec = NULL;
+    char                    id[DSM_MAX_OBJINFO_LENGTH + 1];
+    char                    name[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 1];
+    char                    *index, *key, *line, *p;
+    size_t                  len, zblock = 0;
+    dsmObjName              objName;
+    dsInt16_t               rc;
+    int                     container, encrypted;
+
+    tsm_name2obj(fsname, filename, &objName);
+
+    cbdata.numfound = 0;
+    rc = tsm_queryfile(sesshandle, &objName, description, sendtype,
+                       verbose, tsm_matchone_cb, &cbdata);
+    if(rc != DSM_RC_OK) {
+        return 0;
+    }
+    if(cbdata.numfound == 0) {
+        fprintf(stderr, "tsmpipe: FAILED: The file specification did not match any file.\n");
+        return 0;
+    }
+    if(!objinfo_get(cbdata.objInfo, cbdata.objInfolen, "pack", id,
+                    sizeof(id)))
+    {
+        fprintf(stderr, "tsmpipe: FAILED: %s%s%s is not a -Y pack\n",
+                objName.fs, objName.hl, objName.ll);
+        return 0;
+    }
+
+    index = pack_getindex(sesshandle, &cbdata, sendtype, verbose, xfer,
+                          &len);
+    if(index == NULL) {
+        return 0;
+    }
+
+    while(*member == '/') {
+        member++;
+    }
+    key = pack_escape(member);
+    line = key ? pack_find(index, len, key) : NULL;
+    if(key && line == NULL) {
+        fprintf(stderr, "tsmpipe: FAILED: %s is not in the pack\n", member);
+    }
+    free(key);
+    if(line == NULL) {
+        free(index);
+        return 0;
+    }
+
+    p = strchr(line, '\t');
+    container = strtol(p + 1, &p, 10);
+    range.offset = strtoll(p + 1, &p, 10);
+    range.length = strtoll(p + 1, &p, 10);
+    range.obj = 0;
+    free(index);
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: %s is %lld bytes at %lld in container "
+                "%d\n", member, (long long) range.length,
+                (long long) range.offset, container);
+    }
+    if(range.length == 0) {
+        return 1;
+    }
+
+    snprintf(name, sizeof(name), "%s.%s.%06d", filename, id, container);
+    tsm_name2obj(fsname, name, &objName);
+    cbdata.numfound = 0;
+    rc = tsm_queryname(sesshandle, &objName, description, sendtype,
+                       verbose, tsm_matchone_cb, &cbdata);
+    if(rc == DSM_RC_ABORT_NO_MATCH) {
+        rc = DSM_RC_OK;
+    }
+    if(rc == DSM_RC_OK && cbdata.numfound == 0) {
+        fprintf(stderr, "tsmpipe: FAILED: Container %s%s%s not found\n",
+                objName.fs, objName.hl, objName.ll);
+    }
+    if(rc != DSM_RC_OK || cbdata.numfound == 0) {
+        return 0;
+    }
+
+    if(codec_objinfo(cbdata.objInfo, cbdata.objInfolen, &codec,
+                     &zblock) != 0)
+    {
+        fprintf(stderr, "tsmpipe: FAILED: Container %s%s%s is compressed\n",
+                objName.fs, objName.hl, objName.ll);
+        return 0;
+    }
+    encrypted = crypt_objinfo(cbdata.objInfo, cbdata.objInfolen, &crypt,
+                              &zblock);
+    if(encrypted < 0) {
+        return 0;
+    }
+
+    return tsm_restoreranges(sesshandle, fsname, name, description,
+                             sendtype, verbose, xfer, &cbdata.objId, NULL,
+                             encrypted ? &crypt : NULL, zblock, &range, 1,
+                             outfd);
+}
+
+
+/* How -V and -X get each object */
+typedef enum
+{
+    verify_plain = 0,
+    verify_compressed,      /* Compressed and/or encrypted */
+    verify_striped,
+    verify_segmented,
+    verify_skip             /* Sub-object of a striped or segmented object */
+} tsmpipe_verifykind_t;
+
+struct verify_obj {
+    tsmpipe_verifykind_t    kind;
+    struct tsm_sum          expected;
+    const struct tsm_codec  *codec;
+    struct tsm_crypt        crypt;
+    int                     encrypted;
+    size_t                  zblock;
+    struct stripe_layout    layout;
+    struct segment_layout   seglayout;
+    off_t                   rawlen;     /* See objinfo_rawlen() */
+};
+
+/* Checksum companions seen by a query, sorted by id */
+struct sumlist_sum {
+    char            *id;
+    struct tsm_sum  sum;
+};
+
+
+int sumlist_cmp(const void *a, const void *b) {
+    return strcmp(((const struct sumlist_sum *) a)->id,
+                  ((const struct sumlist_sum *) b)->id);
+}
+
+
+/*
+ * Sort out how to get an object from its objInfo into vobj. Returns 0 if
+ * we can't, the reason has been printed.
+ */
+int verify_kind(const char *objinfo, int len, struct verify_obj *vobj) {
+    memset(vobj, 0, sizeof(*vobj));
+    vobj->rawlen = objinfo_rawlen(objinfo, len);
+
+    if(stripe_parse(objinfo, len, &vobj->layout)) {
+        vobj->kind = verify_striped;
+        return 1;
+    }
+    if(segment_parse(objinfo, len, &vobj->seglayout)) {
+        vobj->kind = verify_segmented;
+        return 1;
+    }
+    switch(codec_objinfo(objinfo, len, &vobj->codec, &vobj->zblock)) {
+        case -1:
+            /* Not plain data either, fail like -x does */
+            return 0;
+        case 1:
+            vobj->kind = verify_compressed;
+            break;
+    }
+    vobj->encrypted = crypt_objinfo(objinfo, len, &vobj->crypt,
+                                    &vobj->zblock);
+    if(vobj->encrypted < 0) {
+        return 0;
+    }
+    if(vobj->encrypted) {
+        vobj->kind = verify_compressed;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Returns 1 if the object name, with the filespace, high and low level
+ * names run together, is a sub-object of the descriptor descname
+ */
+int verify_issub(const char *name, const char *descname,
+                 const struct verify_obj *desc)
+{
+    const char  *id;
+    size_t      len = strlen(descname);
+
+    if(desc->kind == verify_striped) {
+        id = desc->layout.id;
+    }
+    else if(desc->kind == verify_segmented) {
+        id = desc->seglayout.id;
+    }
+    else {
+        return 0;
+    }
+
+    return strncmp(name, descname, len) == 0 && name[len] == '.' &&
+           strncmp(name + len + 1, id, strlen(id)) == 0 &&
+           name[len + 1 + strlen(id)] == '.';
+}
+
+
+/*
+ * Restore order. Every query response has a 160-bit restoreOrderExt, and
+ * getting objects sorted by it reads each volume once, front to back,
+ * instead of remounting and seeking tapes. The top word is the volume:
+ * objects are got in one dsmBeginGetData per volume.
+ */
+int order_cmp(const dsUint160_t *a, const dsUint160_t *b) {
+    if(a->top != b->top) {
+        return a->top < b->top ? -1 : 1;
+    }
+    if(a->hi_hi != b->hi_hi) {
+        return a->hi_hi < b->hi_hi ? -1 : 1;
+    }
+    if(a->hi_lo != b->hi_lo) {
+        return a->hi_lo < b->hi_lo ? -1 : 1;
+    }
+    if(a->lo_hi != b->lo_hi) {
+        return a->lo_hi < b->lo_hi ? -1 : 1;
+    }
+    if(a->lo_lo != b->lo_lo) {
+        return a->lo_lo < b->lo_lo ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+int order_samevol(const dsUint160_t *a, const dsUint160_t *b) {
+    return a->top == b->top;
+}
+
+
+time_t tsm_date2time(dsmDate *date) {
+    struct tm   tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year  = date->year - 1900;
+    tm.tm_mon   = date->month - 1;
+    tm.tm_mday  = date->day;
+    tm.tm_hour  = date->hour;
+    tm.tm_min   = date->minute;
+    tm.tm_sec   = date->second;
+    tm.tm_isdst = -1;
+
+    return mktime(&tm);
+}
+
+
+/*
+ * Listing output, -t, -T and -F. With millions of objects the time goes
+ * to stdio and printf(), so records are formatted by hand into a large
+ * buffer that is written out in big writes.
+ */
+
+#define LISTBUFSIZE     (4*1024*1024)
+
+/*
+ * Largest record, with every string character escaped as \u00XX and room
+ * for the numbers and keys
+ */
+#define LISTRECMAX      (6 * (DSM_MAX_FSNAME_LENGTH + DSM_MAX_HL_LENGTH + \
+                              DSM_MAX_LL_LENGTH + DSM_MAX_OWNER_LENGTH + \
+                              DSM_MAX_MC_NAME_LENGTH + DSM_MAX_DESCR_LENGTH) \
+                         + 1024)
+
+/*
+ * The -F bin record is a fixed header, with the record length at
+ * LISTBIN_RECLENAT, followed by the strings, each a 16-bit length and
+ * that many bytes
+ */
+#define LISTBIN_HDRLEN      64
+#define LISTBIN_RECLENAT    60
+
+/* Object states in listings */
+#define LISTSTATE_ARCHIVE   0
+#define LISTSTATE_ACTIVE    1
+#define LISTSTATE_INACTIVE  2
+
+/*
+ * A formatted record held back until the size of its -k object is known,
+ * and the ones after it to keep the order
+ */
+struct listout_held {
+    char                *rec;
+    size_t              len;
+    size_t              sizeat, sizelen;    /* The size field in rec */
+    char                *sumid;             /* NULL if not waiting */
+    dsmObjName          objName;
+};
+
+/*
+ * A formatted record of what looks like a sub-object, name.id.NNN, held
+ * back until we know whether the listing has its descriptor
+ */
+struct listout_sub {
+    char                *key;               /* The name without .NNN */
+    char                *rec;
+    size_t              len;
+};
+
+struct tsm_listout {
+    tsmpipe_listmode_t  mode;
+    tsmpipe_listfmt_t   fmt;
+    int                 fd;
+    char                *buf;
+    size_t              len;
+    unsigned long long  nobjs;
+    size_t              sizeat, sizelen;    /* Of the last record formatted */
+    int                 nheld, maxheld;
+    struct listout_held *held;
+    int                 nsums, maxsums;     /* Companions seen */
+    struct sumlist_sum  *sums;
+    int                 showsubs;           /* -u */
+    int                 ndescs, maxdescs;   /* name.id of descriptors */
+    char                **descs;
+    int                 nsubs, maxsubs;
+    struct listout_sub  *subs;
+};
+
+/* What we list of an object, pointing into the query response */
+struct listrec {
+    dsmObjName          *objName;
+    char                *owner;
+    char                *mcName;
+    char                *descr;         /* NULL for backup objects */
+    dsStruct64_t        *objId;
+    dsmDate             *insDate;
+    dsmDate             *expDate;
+    dsUint160_t         *restoreOrder;
+    dsStruct64_t        *sizeEst;
+    char                *objInfo;
+    dsUint16_t          objInfolen;
+    int                 state;
+};
+
+static const char digits2[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+
+/* Format v in decimal at p, returns the end */
+char *fmt_u64(char *p, unsigned long long v) {
+    char    tmp[20], *t = tmp + sizeof(tmp);
+    size_t  n;
+
+    while(v >= 100) {
+        t -= 2;
+        memcpy(t, digits2 + (v % 100) * 2, 2);
+        v /= 100;
+    }
+    if(v >= 10) {
+        t -= 2;
+        memcpy(t, digits2 + v * 2, 2);
+    }
+    else {
+        *--t = '0' + v;
+    }
+    n = tmp + sizeof(tmp) - t;
+    memcpy(p, t, n);
+
+    return p + n;
+}
+
+
+/* Format v as exactly width decimal digits, zero padded */
+char *fmt_pad(char *p, unsigned int v, int width) {
+    int i;
+
+    for(i = width - 1; i >= 0; i--) {
+        p[i] = '0' + v % 10;
+        v /= 10;
+    }
+
+    return p + width;
+}
+
+
+char *fmt_hex32(char *p, dsUint32_t v) {
+    static const char   hex[] = "0123456789abcdef";
+    int                 i;
+
+    for(i = 7; i >= 0; i--) {
+        p[i] = hex[v & 0xf];
+        v >>= 4;
+    }
+
+    return p + 8;
+}
+
+
+/* Copy a string of at most max characters, without the NUL */
+char *fmt_str(char *p, const char *s, size_t max) {
+    size_t  n = strnlen(s, max);
+
+    memcpy(p, s, n);
+
+    return p + n;
+}
+
+
+/* A JSON string, with quotes and escapes. Other bytes are passed as is */
+char *fmt_json(char *p, const char *s, size_t max) {
+    static const char   hex[] = "0123456789abcdef";
+    const unsigned char *u = (const unsigned char *) s;
+    size_t              i;
+
+    *p++ = '"';
+    for(i = 0; i < max && u[i] != '\0'; i++) {
+        if(u[i] == '"' || u[i] == '\\') {
+            *p++ = '\\';
+            *p++ = u[i];
+        }
+        else if(u[i] < 0x20) {
+            memcpy(p, "\\u00", 4);
+            p[4] = hex[u[i] >> 4];
+            p[5] = hex[u[i] & 0xf];
+            p += 6;
+        }
+        else {
+            *p++ = u[i];
+        }
+    }
+    *p++ = '"';
+
+    return p;
+}
+
+
+/* YYYY-MM-DD HH:MM:SS, or never for objects that don't expire */
+char *fmt_date(char *p, const dsmDate *d) {
+    if(d->year == DATE_PLUS_INFINITE) {
+        memcpy(p, "never", 5);
+        return p + 5;
+    }
+    p = fmt_pad(p, d->year, 4);
+    *p++ = '-';
+    p = fmt_pad(p, d->month, 2);
+    *p++ = '-';
+    p = fmt_pad(p, d->day, 2);
+    *p++ = ' ';
+    p = fmt_pad(p, d->hour, 2);
+    *p++ = ':';
+    p = fmt_pad(p, d->minute, 2);
+    *p++ = ':';
+    p = fmt_pad(p, d->second, 2);
+
+    return p;
+}
+
+
+/* The 160-bit restore order as 40 hex digits, most significant first */
+char *fmt_order(char *p, const dsUint160_t *o) {
+    p = fmt_hex32(p, o->top);
+    p = fmt_hex32(p, o->hi_hi);
+    p = fmt_hex32(p, o->hi_lo);
+    p = fmt_hex32(p, o->lo_hi);
+    p = fmt_hex32(p, o->lo_lo);
+
+    return p;
+}
+
+
+/* Big endian integers and length prefixed strings for -F bin */
+char *put_be(char *p, unsigned long long v, int bytes) {
+    int i;
+
+    for(i = bytes - 1; i >= 0; i--) {
+        ((unsigned char *) p)[i] = v & 0xff;
+        v >>= 8;
+    }
+
+    return p + bytes;
+}
+
+
+char *put_date(char *p, const dsmDate *d) {
+    p = put_be(p, d->year, 2);
+    *p++ = d->month;
+    *p++ = d->day;
+    *p++ = d->hour;
+    *p++ = d->minute;
+    *p++ = d->second;
+
+    return p;
+}
+
+
+char *put_str(char *p, const char *s, size_t max) {
+    size_t  n = strnlen(s, max);
+
+    p = put_be(p, n, 2);
+    memcpy(p, s, n);
+
+    return p + n;
+}
+
+
+/*
+ * The exact size, if the objInfo has it (the rawlen of -i inputs, the
+ * length of striped and segmented objects and -k sums kept inline),
+ * otherwise -1. Other -k objects have theirs in the companion, see
+ * listout_hold().
+ */
+long long listrec_size(const struct listrec *rec) {
+    struct stripe_layout    layout;
+    struct segment_layout   seglayout;
+    struct tsm_sum          sum;
+    off_t                   rawlen;
+
+    rawlen = objinfo_rawlen(rec->objInfo, rec->objInfolen);
+    if(rawlen >= 0) {
+        return rawlen;
+    }
+    if(stripe_parse(rec->objInfo, rec->objInfolen, &layout)) {
+        return layout.length;
+    }
+    if(segment_parse(rec->objInfo, rec->objInfolen, &seglayout)) {
+        return seglayout.length;
+    }
+    if(sum_parse(rec->objInfo, rec->objInfolen, &sum)) {
+        return sum.size;
+    }
+
+    return -1;
+}
+
+
+/*
+ * If rec is named like a sub-object, name.id.NNN with a hex id, put the
+ * name.id it would have in key and return 1
+ */
+int listrec_subkey(const struct listrec *rec, char *key, size_t len) {
+    const char  *ll = rec->objName->ll;
+    size_t      n = strlen(ll), digits = 0, hex = 0;
+
+    while(digits < n && isdigit((unsigned char) ll[n - digits - 1])) {
+        digits++;
+    }
+    if(digits < 3 || digits + 1 >= n || ll[n - digits - 1] != '.') {
+        return 0;
+    }
+    n -= digits + 1;
+    while(hex < n && strchr("0123456789abcdef", ll[n - hex - 1])) {
+        hex++;
+    }
+    if(hex == 0 || hex == n || ll[n - hex - 1] != '.') {
+        return 0;
+    }
+    snprintf(key, len, "%s%s%.*s", rec->objName->fs, rec->objName->hl,
+             (int) n, ll);
+
+    return 1;
+}
+
+
+int listout_init(struct tsm_listout *out, tsmpipe_listmode_t mode,
+                 tsmpipe_listfmt_t fmt)
+{
+    memset(out, 0, sizeof(*out));
+    out->mode = mode;
+    out->fmt = fmt;
+    out->fd = STDOUT_FILENO;
+    out->buf = malloc(LISTBUFSIZE);
+    if(out->buf == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+int listout_flush(struct tsm_listout *out) {
+    if(out->len > 0 && write_full(out->fd, out->buf, out->len) < 0) {
+        fprintf(stderr, "tsmpipe: Writing listing: %s\n", strerror(errno));
+        out->len = 0;
+        return 0;
+    }
+    out->len = 0;
+
+    return 1;
+}
+
+
+void listout_free(struct tsm_listout *out) {
+    int i;
+
+    for(i = 0; i < out->nheld; i++) {
+        free(out->held[i].rec);
+        free(out->held[i].sumid);
+    }
+    free(out->held);
+    for(i = 0; i < out->nsums; i++) {
+        free(out->sums[i].id);
+    }
+    free(out->sums);
+    for(i = 0; i < out->ndescs; i++) {
+        free(out->descs[i]);
+    }
+    free(out->descs);
+    for(i = 0; i < out->nsubs; i++) {
+        free(out->subs[i].key);
+        free(out->subs[i].rec);
+    }
+    free(out->subs);
+    free(out->buf);
+}
+
+
+/* Format rec at p, returns the end */
+char *listout_format(struct tsm_listout *out, struct listrec *rec, char *p)
+{
+    static const char   *states[] = { "archive", "active", "inactive" };
+    long long           size = listrec_size(rec);
+    char                *start = p;
+
+    out->sizeat = out->sizelen = 0;
+    switch(out->fmt) {
+        case listfmt_text:
+            if(out->mode == listmode_volser) {
+                p = fmt_u64(p, rec->restoreOrder->top);
+            }
+            else if(size >= 0) {
+                p = fmt_u64(p, size);
+            }
+            else {
+                p = fmt_u64(p, u64(rec->sizeEst));
+            }
+            *p++ = ' ';
+            p = fmt_str(p, rec->objName->fs, DSM_MAX_FSNAME_LENGTH);
+            p = fmt_str(p, rec->objName->hl, DSM_MAX_HL_LENGTH);
+            p = fmt_str(p, rec->objName->ll, DSM_MAX_LL_LENGTH);
+            *p++ = '\n';
+            break;
+
+        case listfmt_nul:
+            p = fmt_u64(p, u64(rec->objId));
+            *p++ = '\0';
+            p = fmt_u64(p, u64(rec->sizeEst));
+            *p++ = '\0';
+            out->sizeat = p - start;
+            if(size < 0) {
+                *p++ = '-';
+            }
+            else {
+                p = fmt_u64(p, size);
+            }
+            out->sizelen = p - start - out->sizeat;
+            *p++ = '\0';
+            p = fmt_date(p, rec->insDate);
+            *p++ = '\0';
+            p = fmt_date(p, rec->expDate);
+            *p++ = '\0';
+            p = fmt_order(p, rec->restoreOrder);
+            *p++ = '\0';
+            p = fmt_str(p, states[rec->state], 8);
+            *p++ = '\0';
+            p = fmt_str(p, rec->mcName, DSM_MAX_MC_NAME_LENGTH);
+            *p++ = '\0';
+            p = fmt_str(p, rec->owner, DSM_MAX_OWNER_LENGTH);
+            *p++ = '\0';
+            p = fmt_str(p, rec->objName->fs, DSM_MAX_FSNAME_LENGTH);
+            *p++ = '\0';
+            p = fmt_str(p, rec->objName->hl, DSM_MAX_HL_LENGTH);
+            *p++ = '\0';
+            p = fmt_str(p, rec->objName->ll, DSM_MAX_LL_LENGTH);
+            *p++ = '\0';
+            if(rec->descr) {
+                p = fmt_str(p, rec->descr, DSM_MAX_DESCR_LENGTH);
+            }
+            *p++ = '\0';
+            break;
+
+        case listfmt_json:
+            memcpy(p, "{\"objid\":", 9);
+            p = fmt_u64(p + 9, u64(rec->objId));
+            memcpy(p, ",\"estimate\":", 12);
+            p = fmt_u64(p + 12, u64(rec->sizeEst));
+            memcpy(p, ",\"size\":", 8);
+            p += 8;
+            out->sizeat = p - start;
+            if(size < 0) {
+                memcpy(p, "null", 4);
+                p += 4;
+            }
+            else {
+                p = fmt_u64(p, size);
+            }
+            out->sizelen = p - start - out->sizeat;
+            memcpy(p, ",\"insdate\":\"", 12);
+            p = fmt_date(p + 12, rec->insDate);
+            memcpy(p, "\",\"expdate\":\"", 13);
+            p = fmt_date(p + 13, rec->expDate);
+            memcpy(p, "\",\"restoreorder\":\"", 18);
+            p = fmt_order(p + 18, rec->restoreOrder);
+            memcpy(p, "\",\"state\":", 10);
+            p = fmt_json(p + 10, states[rec->state], 8);
+            memcpy(p, ",\"mgmtclass\":", 13);
+            p = fmt_json(p + 13, rec->mcName, DSM_MAX_MC_NAME_LENGTH);
+            memcpy(p, ",\"owner\":", 9);
+            p = fmt_json(p + 9, rec->owner, DSM_MAX_OWNER_LENGTH);
+            memcpy(p, ",\"fs\":", 6);
+            p = fmt_json(p + 6, rec->objName->fs, DSM_MAX_FSNAME_LENGTH);
+            memcpy(p, ",\"hl\":", 6);
+            p = fmt_json(p + 6, rec->objName->hl, DSM_MAX_HL_LENGTH);
+            memcpy(p, ",\"ll\":", 6);
+            p = fmt_json(p + 6, rec->objName->ll, DSM_MAX_LL_LENGTH);
+            memcpy(p, ",\"description\":", 15);
+            p += 15;
+            if(rec->descr) {
+                p = fmt_json(p, rec->descr, DSM_MAX_DESCR_LENGTH);
+            }
+            else {
+                memcpy(p, "null", 4);
+                p += 4;
+            }
+            memcpy(p, "}\n", 2);
+            p += 2;
+            break;
+
+        case listfmt_bin:
+            p = put_be(p, u64(rec->objId), 8);
+            p = put_be(p, u64(rec->sizeEst), 8);
+            out->sizeat = p - start;
+            out->sizelen = 8;
+            p = put_be(p, size, 8);
+            p = put_be(p, rec->restoreOrder->top, 4);
+            p = put_be(p, rec->restoreOrder->hi_hi, 4);
+            p = put_be(p, rec->restoreOrder->hi_lo, 4);
+            p = put_be(p, rec->restoreOrder->lo_hi, 4);
+            p = put_be(p, rec->restoreOrder->lo_lo, 4);
+            p = put_date(p, rec->insDate);
+            p = put_date(p, rec->expDate);
+            *p++ = rec->state;
+            memset(p, 0, LISTBIN_HDRLEN - (p - start));
+            p = start + LISTBIN_HDRLEN;
+            p = put_str(p, rec->objName->fs, DSM_MAX_FSNAME_LENGTH);
+            p = put_str(p, rec->objName->hl, DSM_MAX_HL_LENGTH);
+            p = put_str(p, rec->objName->ll, DSM_MAX_LL_LENGTH);
+            p = put_str(p, rec->owner, DSM_MAX_OWNER_LENGTH);
+            p = put_str(p, rec->mcName, DSM_MAX_MC_NAME_LENGTH);
+            p = put_str(p, rec->descr ? rec->descr : "", DSM_MAX_DESCR_LENGTH);
+            put_be(start + LISTBIN_RECLENAT, p - start, 4);
+            break;
+    }
+
+    return p;
+}
+
+
+/* Remember the size from a checksum companion in the listing */
+int listout_addsum(struct tsm_listout *out, const char *id,
+                   const struct listrec *rec)
+{
+    struct sumlist_sum  *s;
+    void                *p;
+
+    if(out->nsums == out->maxsums) {
+        out->maxsums = out->maxsums ? out->maxsums * 2 : 1024;
+        p = realloc(out->sums, out->maxsums * sizeof(*out->sums));
+        if(p == NULL) {
+            perror("tsmpipe: malloc");
+            return 0;
+        }
+        out->sums = p;
+    }
+    s = &out->sums[out->nsums];
+    if(!sum_parse(rec->objInfo, rec->objInfolen, &s->sum)) {
+        return 1;
+    }
+    s->id = strdup(id);
+    if(s->id == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+    out->nsums++;
+
+    return 1;
+}
+
+
+/*
+ * Format rec and hold it back, waiting for the size from the companion
+ * with sumid if not NULL
+ */
+int listout_hold(struct tsm_listout *out, struct listrec *rec,
+                 const char *sumid)
+{
+    struct listout_held *h;
+    char                *p;
+    void                *q;
+
+    if(out->nheld == out->maxheld) {
+        out->maxheld = out->maxheld ? out->maxheld * 2 : 1024;
+        q = realloc(out->held, out->maxheld * sizeof(*out->held));
+        if(q == NULL) {
+            perror("tsmpipe: malloc");
+            return 0;
+        }
+        out->held = q;
+    }
+    h = &out->held[out->nheld];
+    memset(h, 0, sizeof(*h));
+
+    p = malloc(LISTRECMAX);
+    if(p == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+    h->len = listout_format(out, rec, p) - p;
+    h->rec = realloc(p, h->len);
+    if(h->rec == NULL) {
+        h->rec = p;
+    }
+    h->sizeat = out->sizeat;
+    h->sizelen = out->sizelen;
+    h->objName = *rec->objName;
+    out->nheld++;
+    if(sumid && (h->sumid = strdup(sumid)) == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Write the held records, with the sizes from the companions seen by the
+ * query or, for those that weren't, looked up
+ */
+int listout_release(dsUint32_t sesshandle, struct tsm_listout *out,
+                    char *description, dsmSendType sendtype, char verbose)
+{
+    struct listout_held *h;
+    struct sumlist_sum  key, *s;
+    struct tsm_sum      sum;
+    char                objinfo[DSM_MAX_OBJINFO_LENGTH + 1];
+    long long           size;
+    char                *p;
+    int                 i;
+
+    qsort(out->sums, out->nsums, sizeof(*out->sums), sumlist_cmp);
+    for(i = 0; i < out->nheld; i++) {
+        h = &out->held[i];
+        size = -1;
+        if(h->sumid) {
+            key.id = h->sumid;
+            s = bsearch(&key, out->sums, out->nsums, sizeof(*out->sums),
+                        sumlist_cmp);
+            if(s) {
+                size = s->sum.size;
+            }
+            else {
+                objinfo[0] = '\0';
+                objinfo_add(objinfo, sizeof(objinfo), "sum", h->sumid);
+                if(tsm_findsum(sesshandle, &h->objName, objinfo,
+                               strlen(objinfo), description, sendtype,
+                               verbose, &sum) < 0)
+                {
+                    return 0;
+                }
+                size = sum.valid ? sum.size : -1;
+            }
+        }
+
+        if(LISTBUFSIZE - out->len < LISTRECMAX && !listout_flush(out)) {
+            return 0;
+        }
+        p = out->buf + out->len;
+        if(size < 0) {
+            memcpy(p, h->rec, h->len);
+            p += h->len;
+        }
+        else if(out->fmt == listfmt_bin) {
+            memcpy(p, h->rec, h->len);
+            put_be(p + h->sizeat, size, 8);
+            p += h->len;
+        }
+        else {
+            memcpy(p, h->rec, h->sizeat);
+            p = fmt_u64(p + h->sizeat, size);
+            memcpy(p, h->rec + h->sizeat + h->sizelen,
+                   h->len - h->sizeat - h->sizelen);
+            p += h->len - h->sizeat - h->sizelen;
+        }
+        out->len = p - out->buf;
+    }
+
+    return 1;
+}
+
+
+int listout_strcmp(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/* Remember that the listing has the sub-objects of rec with id */
+int listout_adddesc(struct tsm_listout *out, const struct listrec *rec,
+                    const char *id)
+{
+    char    key[DSM_MAX_FSNAME_LENGTH + DSM_MAX_HL_LENGTH +
+                DSM_MAX_LL_LENGTH + DSM_MAX_OBJINFO_LENGTH + 2];
+    void    *p;
+
+    if(out->ndescs == out->maxdescs) {
+        out->maxdescs = out->maxdescs ? out->maxdescs * 2 : 1024;
+        p = realloc(out->descs, out->maxdescs * sizeof(*out->descs));
+        if(p == NULL) {
+            perror("tsmpipe: malloc");
+            return 0;
+        }
+        out->descs = p;
+    }
+    snprintf(key, sizeof(key), "%s%s%s.%s", rec->objName->fs,
+             rec->objName->hl, rec->objName->ll, id);
+    out->descs[out->ndescs] = strdup(key);
+    if(out->descs[out->ndescs] == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+    out->ndescs++;
+
+    return 1;
+}
+
+
+/* Format rec, which looks like a sub-object with key, and hold it back */
+int listout_addsub(struct tsm_listout *out, struct listrec *rec,
+                   const char *key)
+{
+    struct listout_sub  *sub;
+    char                *p;
+    void                *q;
+
+    if(out->nsubs == out->maxsubs) {
+        out->maxsubs = out->maxsubs ? out->maxsubs * 2 : 1024;
+        q = realloc(out->subs, out->maxsubs * sizeof(*out->subs));
+        if(q == NULL) {
+            perror("tsmpipe: malloc");
+            return 0;
+        }
+        out->subs = q;
+    }
+    p = malloc(LISTRECMAX);
+    if(p == NULL) {
+        perror("tsmpipe: malloc");
+        return 0;
+    }
+    sub = &out->subs[out->nsubs];
+    sub->len = listout_format(out, rec, p) - p;
+    sub->rec = realloc(p, sub->len);
+    sub->key = strdup(key);
+    if(sub->rec == NULL || sub->key == NULL) {
+        perror("tsmpipe: malloc");
+        free(sub->rec ? sub->rec : p);
+        free(sub->key);
+        return 0;
+    }
+    out->nsubs++;
+
+    return 1;
+}
+
+
+/*
+ * Write the held records that looked like sub-objects but whose
+ * descriptor wasn't listed, abandoned ones or just names like that
+ */
+int listout_releasesubs(struct tsm_listout *out) {
+    char    *key;
+    int     i;
+
+    qsort(out->descs, out->ndescs, sizeof(*out->descs), listout_strcmp);
+    for(i = 0; i < out->nsubs; i++) {
+        key = out->subs[i].key;
+        if(bsearch(&key, out->descs, out->ndescs, sizeof(*out->descs),
+                   listout_strcmp))
+        {
+            continue;
+        }
+        if(LISTBUFSIZE - out->len < LISTRECMAX && !listout_flush(out)) {
+            return 0;
+        }
+        memcpy(out->buf + out->len, out->subs[i].rec, out->subs[i].len);
+        out->len += out->subs[i].len;
+        out->nobjs++;
+    }
+
+    return 1;
+}
+
+
+int tsm_listfile_cb(dsmQueryType qType, DataBlk *qResp, void * userdata)
+{
+    struct tsm_listout  *out;
+    struct listrec      rec;
+    char                id[DSM_MAX_OBJINFO_LENGTH + 1];
+    char                key[DSM_MAX_FSNAME_LENGTH + DSM_MAX_HL_LENGTH +
+                            DSM_MAX_LL_LENGTH + 1];
+    int                 needsum;
+
+    if(userdata == NULL ) {
+        fprintf(stderr, "tsm_listfile_cb: Internal error: userdata == NULL");
+        return -1;
+    }
+
+    out = userdata;
+
+    if(out->mode == listmode_unknown) {
+        fprintf(stderr, "tsm_listfile_cb: Internal error: listmode == unknown");
+        return -1;
+    }
+
+    if(qType == qtArchive) {
+        qryRespArchiveData *qr = (void *) qResp->bufferPtr;
+        
+        rec.objName      = &qr->objName;
+        rec.owner        = qr->owner;
+        rec.mcName       = qr->mcName;
+        rec.descr        = qr->descr;
+        rec.objId        = &qr->objId;
+        rec.insDate      = &qr->insDate;
+        rec.expDate      = &qr->expDate;
+        rec.restoreOrder = &qr->restoreOrderExt;
+        rec.sizeEst      = &qr->sizeEstimate;
+        rec.objInfo      = qr->objInfo;
+        rec.objInfolen   = qr->objInfolen;
+        rec.state        = LISTSTATE_ARCHIVE;
+    }
+    else if(qType == qtBackup) {
+        qryRespBackupData *qr = (void *) qResp->bufferPtr;
+
+        rec.objName      = &qr->objName;
+        rec.owner        = qr->owner;
+        rec.mcName       = qr->mcName;
+        rec.descr        = NULL;
+        rec.objId        = &qr->objId;
+        rec.insDate      = &qr->insDate;
+        rec.expDate      = &qr->expDate;
+        rec.restoreOrder = &qr->restoreOrderExt;
+        rec.sizeEst      = &qr->sizeEstimate;
+        rec.objInfo      = qr->objInfo;
+        rec.objInfolen   = qr->objInfolen;
+        rec.state        = qr->objState == DSM_INACTIVE ?
+                                LISTSTATE_INACTIVE : LISTSTATE_ACTIVE;
+    }
+    else {
+        fprintf(stderr,
+                "tsm_listfile_cb: Internal error: Unknown qType %d\n", qType);
+        return -1;
+    }
+
+    if(out->mode != listmode_fsize && out->mode != listmode_volser) {
+        fprintf(stderr, "tsm_listfile_cb: Internal error: listmode %d unknown",
+                out->mode);
+        return -1;
+    }
+
+    /* Checksum companions are part of their object */
+    if(objinfo_get(rec.objInfo, rec.objInfolen, "sumof", id, sizeof(id))) {
+        if(out->fmt != listfmt_text && !listout_addsum(out, id, &rec)) {
+            return -1;
+        }
+        if(!out->showsubs) {
+            return 1;
+        }
+    }
+    /* And so are stripes, segments and pack containers */
+    else if(!out->showsubs) {
+        if(tsm_subid(rec.objInfo, rec.objInfolen, id, sizeof(id)) &&
+                !listout_adddesc(out, &rec, id))
+        {
+            return -1;
+        }
+        if(listrec_subkey(&rec, key, sizeof(key))) {
+            return listout_addsub(out, &rec, key) ? 1 : -1;
+        }
+    }
+
+    out->nobjs++;
+    needsum = out->fmt != listfmt_text && listrec_size(&rec) < 0 &&
+              objinfo_get(rec.objInfo, rec.objInfolen, "sum", id,
+                          sizeof(id));
+    if(needsum || out->nheld > 0) {
+        return listout_hold(out, &rec, needsum ? id : NULL) ? 1 : -1;
+    }
+
+    if(LISTBUFSIZE - out->len < LISTRECMAX && !listout_flush(out)) {
+        return -1;
+    }
+    out->len = listout_format(out, &rec, out->buf + out->len) - out->buf;
+
+    return 1;
+}
+
+
+/* Objects collected by tsm_listsums() */
+struct sumlist_ent {
+    dsStruct64_t    objId;
+    dsUint160_t     restoreOrder;
+    char            *fs, *hl, *ll;
+    off_t           estimate;
+    dsmDate         insDate;
+    char            owner[DSM_MAX_OWNER_LENGTH + 1];
+    dsUint16_t      objInfolen;
+    char            objInfo[DSM_MAX_OBJINFO_LENGTH];
+};
+
+
+struct sumlist_cb_data {
+    int                 nobjs, maxobjs;
+    struct sumlist_ent  *objs;
+    int                 nsums, maxsums;
+    struct sumlist_sum  *sums;
+};
+
+
+int tsm_sumlist_cb(dsmQueryType qType, DataBlk *qResp, void * userdata)
+{
+    struct sumlist_cb_data  *cbdata = userdata;
+    struct sumlist_ent      *ent;
+    struct sumlist_sum      *s;
+    dsStruct64_t            *rObjId;
+    dsUint160_t             *rOrder;
+    dsmDate                 *rDate;
+    char                    *rOwner;
+    dsmObjName              *rObjName;
+    dsStruct64_t            *rSizeEst;
+    char                    *rObjInfo;
+    dsUint16_t              rObjInfolen;
+    char                    id[DSM_MAX_OBJINFO_LENGTH + 1];
+    void                    *p;
+
+    if(qType == qtArchive) {
+        qryRespArchiveData *qr = (void *) qResp->bufferPtr;
+
+        rObjId = &qr->objId;
+        rOrder = &qr->restoreOrderExt;
+        rDate = &qr->insDate;
+        rOwner = qr->owner;
+        rObjName = &qr->objName;
+        rSizeEst = &qr->sizeEstimate;
+        rObjInfo = qr->objInfo;
+        rObjInfolen = qr->objInfolen;
+    }
+    else if(qType == qtBackup) {
+        qryRespBackupData *qr = (void *) qResp->bufferPtr;
+
+        rObjId = &qr->objId;
+        rOrder = &qr->restoreOrderExt;
+        rDate = &qr->insDate;
+        rOwner = qr->owner;
+        rObjName = &qr->objName;
+        rSizeEst = &qr->sizeEstimate;
+        rObjInfo = qr->objInfo;
+        rObjInfolen = qr->objInfolen;
+    }
+    else {
+        fprintf(stderr,
+                "tsm_sumlist_cb: Internal error: Unknown qType %d\n", qType);
+        return -1;
+    }
+
+    if(objinfo_get(rObjInfo, rObjInfolen, "sumof", id, sizeof(id))) {
+        if(cbdata->nsums == cbdata->maxsums) {
+            cbdata->maxsums = cbdata->maxsums ? cbdata->maxsums * 2 : 64;
+            p = realloc(cbdata->sums, cbdata->maxsums * sizeof(*s));
+            if(p == NULL) {
+                perror("tsmpipe: realloc");
+                return -1;
+            }
+            cbdata->sums = p;
+        }
+        s = &cbdata->sums[cbdata->nsums];
+        s->id = strdup(id);
+        if(s->id == NULL) {
+            perror("tsmpipe: malloc");
+            return -1;
+        }
+        sum_parse(rObjInfo, rObjInfolen, &s->sum);
+        cbdata->nsums++;
+
+        return 1;
+    }
+
+    if(cbdata->nobjs == cbdata->maxobjs) {
+        cbdata->maxobjs = cbdata->maxobjs ? cbdata->maxobjs * 2 : 64;
+        p = realloc(cbdata->objs, cbdata->maxobjs * sizeof(*ent));
+        if(p == NULL) {
+            perror("tsmpipe: realloc");
+            return -1;
+        }
+        cbdata->objs = p;
+    }
+    ent = &cbdata->objs[cbdata->nobjs];
+    ent->objId = *rObjId;
+    ent->restoreOrder = *rOrder;
+    ent->fs = strdup(rObjName->fs);
+    ent->hl = strdup(rObjName->hl);
+    ent->ll = strdup(rObjName->ll);
+    if(!ent->fs || !ent->hl || !ent->ll) {
+        perror("tsmpipe: malloc");
+        return -1;
+    }
+    ent->estimate = ((off_t) rSizeEst->hi << 32) | rSizeEst->lo;
+    ent->insDate = *rDate;
+    snprintf(ent->owner, sizeof(ent->owner), "%s", rOwner);
+    ent->objInfolen = rObjInfolen;
+    memcpy(ent->objInfo, rObjInfo, rObjInfolen);
+    cbdata->nobjs++;
+
+    return 1;
+}
+
+
+int sumlist_ordercmp(const void *a, const void *b) {
+    return order_cmp(&((const struct sumlist_ent *) a)->restoreOrder,
+                     &((const struct sumlist_ent *) b)->restoreOrder);
+}
+
+
+/*
+ * Query the objects matching objName into cbdata, with the checksum
+ * companions sorted for sumlist_find().
+ */
+int sumlist_query(dsUint32_t sesshandle, dsmObjName *objName,
+                  char *description, dsmSendType sendtype, char verbose,
+                  struct sumlist_cb_data *cbdata)
+{
+    dsInt16_t   rc;
+
+    memset(cbdata, 0, sizeof(*cbdata));
+
+    rc = tsm_queryfile(sesshandle, objName, description, sendtype,
+                       verbose, tsm_sumlist_cb, cbdata);
+    if(rc != DSM_RC_OK && rc != DSM_RC_ABORT_NO_MATCH) {
+        return 0;
+    }
+
+    if(cbdata->nsums > 0) {
+        qsort(cbdata->sums, cbdata->nsums, sizeof(*cbdata->sums),
+              sumlist_cmp);
+    }
+
+    return 1;
+}
+
+
+/*
+ * Find the size and checksum of ent, among the companions in cbdata or
+ * with a query. Returns like tsm_findsum().
+ */
+int sumlist_find(dsUint32_t sesshandle, struct sumlist_cb_data *cbdata,
+                 struct sumlist_ent *ent, char *description,
+                 dsmSendType sendtype, char verbose, struct tsm_sum *sum)
+{
+    struct sumlist_sum  key, *found = NULL;
+    dsmObjName          name;
+    char                id[DSM_MAX_OBJINFO_LENGTH + 1];
+
+    if(objinfo_get(ent->objInfo, ent->objInfolen, "sum", id, sizeof(id)) &&
+            cbdata->nsums > 0)
+    {
+        key.id = id;
+        found = bsearch(&key, cbdata->sums, cbdata->nsums,
+                        sizeof(*cbdata->sums), sumlist_cmp);
+    }
+    if(found) {
+        *sum = found->sum;
+        return sum->valid;
+    }
+
+    snprintf(name.fs, sizeof(name.fs), "%s", ent->fs);
+    snprintf(name.hl, sizeof(name.hl), "%s", ent->hl);
+    snprintf(name.ll, sizeof(name.ll), "%s", ent->ll);
+    name.objType = DSM_OBJ_FILE;
+
+    return tsm_findsum(sesshandle, &name, ent->objInfo, ent->objInfolen,
+                       description, sendtype, verbose, sum);
+}
+
+
+void sumlist_free(struct sumlist_cb_data *cbdata) {
+    int i;
+
+    for(i = 0; i < cbdata->nobjs; i++) {
+        free(cbdata->objs[i].fs);
+        free(cbdata->objs[i].hl);
+        free(cbdata->objs[i].ll);
+    }
+    free(cbdata->objs);
+    for(i = 0; i < cbdata->nsums; i++) {
+        free(cbdata->sums[i].id);
+    }
+    free(cbdata->sums);
+}
+
+
+/*
+ * -t with -k: list size estimate, true size and checksum of each object.
+ * The companions are paired up with their objects when the file
+ * specification matched them too, otherwise they are looked up one by
+ * one after the listing query.
+ */
+int tsm_listsums(dsUint32_t sesshandle, dsmObjName *objName,
+                 char *description, dsmSendType sendtype, char verbose)
+{
+    struct sumlist_cb_data  cbdata;
+    struct sumlist_ent      *ent;
+    struct tsm_sum          sum;
+    char                    size[32], crc[16];
+    int                     i, ok;
+
+    ok = sumlist_query(sesshandle, objName, description, sendtype, verbose,
+                       &cbdata);
+
+    for(i = 0; ok && i < cbdata.nobjs; i++) {
+        ent = &cbdata.objs[i];
+
+        if(sumlist_find(sesshandle, &cbdata, ent, description, sendtype,
+                        verbose, &sum) < 0)
+        {
+            ok = 0;
+            break;
+        }
+
+        if(sum.valid) {
+            snprintf(size, sizeof(size), "%lld", (long long) sum.size);
+            snprintf(crc, sizeof(crc), "%08x", (unsigned int) sum.crc);
+        }
+        else {
+            strcpy(size, "-");
+            strcpy(crc, "-");
+        }
+        printf("%lld %s %s %s%s%s\n", (long long) ent->estimate, size, crc,
+               ent->fs, ent->hl, ent->ll);
+    }
+
+    sumlist_free(&cbdata);
+
+    return ok;
+}
+
+
+/*
+ * Print the outcome for one object on stdout.
+ * Returns 1 if OK, 0 if failed and 2 if there was nothing to check against.
+ */
+int verify_report(struct sumlist_ent *ent, struct tsm_verify *v,
+                  struct tsm_sum *expected, int gotok)
+{
+    char    why[128];
+
+    *why = '\0';
+    if(!gotok) {
+        strcpy(why, "Could not get the object");
+    }
+    else if(v->hasref && v->differs >= 0 && v->differs < v->sum.size &&
+            v->differs < v->reflen)
+    {
+        snprintf(why, sizeof(why), "Differs from the reference at offset "
+                 "%lld", (long long) v->differs);
+    }
+    else if(v->hasref && v->sum.size != v->reflen) {
+        snprintf(why, sizeof(why), "Size %lld, the reference is %lld",
+                 (long long) v->sum.size, (long long) v->reflen);
+    }
+    else if(expected->valid && expected->size != v->sum.size) {
+        snprintf(why, sizeof(why), "Size %lld, expected %lld",
+                 (long long) v->sum.size, (long long) expected->size);
+    }
+    else if(expected->valid && expected->crc != v->sum.crc) {
+        snprintf(why, sizeof(why), "crc32c %08x, expected %08x",
+                 (unsigned int) v->sum.crc, (unsigned int) expected->crc);
+    }
+
+    if(*why) {
+        printf("FAILED\t%s%s%s\t%s\n", ent->fs, ent->hl, ent->ll, why);
+        return 0;
+    }
+
+    printf("%s\t%s%s%s\t%lld\t%08x\n",
+           v->hasref || expected->valid ? "OK" : "UNCHECKED",
+           ent->fs, ent->hl, ent->ll, (long long) v->sum.size,
+           (unsigned int) v->sum.crc);
+
+    return v->hasref || expected->valid ? 1 : 2;
+}
+
+
+/*
+ * Sort out how to get and check each object for tsm_verifyall(). Returns
+ * 0 on fatal errors.
+ */
+int verify_plan(dsUint32_t sesshandle, struct sumlist_cb_data *cbdata,
+                struct verify_obj *vobjs, char *description,
+                dsmSendType sendtype, char verbose)
+{
+    struct sumlist_ent  *ent;
+    char                desc[DSM_MAX_FSNAME_LENGTH + DSM_MAX_HL_LENGTH +
+                             DSM_MAX_LL_LENGTH + 1];
+    char                name[DSM_MAX_FSNAME_LENGTH + DSM_MAX_HL_LENGTH +
+                             DSM_MAX_LL_LENGTH + 1];
+    int                 i, j;
+
+    for(i = 0; i < cbdata->nobjs; i++) {
+        ent = &cbdata->objs[i];
+        if(!verify_kind(ent->objInfo, ent->objInfolen, &vobjs[i])) {
+            fprintf(stderr, "tsmpipe: Can't get %s%s%s\n", ent->fs,
+                    ent->hl, ent->ll);
+            return 0;
+        }
+    }
+
+    /* The sub-objects are checked through their descriptor */
+    for(i = 0; i < cbdata->nobjs; i++) {
+        if(vobjs[i].kind != verify_striped &&
+                vobjs[i].kind != verify_segmented)
+        {
+            continue;
+        }
+        ent = &cbdata->objs[i];
+        snprintf(desc, sizeof(desc), "%s%s%s", ent->fs, ent->hl, ent->ll);
+        for(j = 0; j < cbdata->nobjs; j++) {
+            snprintf(name, sizeof(name), "%s%s%s", cbdata->objs[j].fs,
+                     cbdata->objs[j].hl, cbdata->objs[j].ll);
+            if(verify_issub(name, desc, &vobjs[i])) {
+                vobjs[j].kind = verify_skip;
+            }
+        }
+    }
+
+    /* Look up all checksums before getting any data */
+    for(i = 0; i < cbdata->nobjs; i++) {
+        if(vobjs[i].kind != verify_skip &&
+                sumlist_find(sesshandle, cbdata, &cbdata->objs[i],
+                             description, sendtype, verbose,
+                             &vobjs[i].expected) < 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/* Get and check one object of the current dsmBeginGetData list */
+int verify_getobj(dsUint32_t sesshandle, struct sumlist_ent *ent,
+                  struct verify_obj *vobj, struct tsm_verify *v,
+                  tsmpipe_xfer_t *xfer, char verbose)
+{
+    if(vobj->kind == verify_compressed) {
+        return tsm_getcompressed(sesshandle, &ent->objId, vobj->codec,
+                                 vobj->encrypted ? &vobj->crypt : NULL,
+                                 vobj->zblock, xfer, -1, v, verbose);
+    }
+
+    return tsm_getplain(sesshandle, &ent->objId, xfer, -1, v, verbose);
+}
+
+
+/*
+ * pax (POSIX.1-2001 tar) output for -X. Each object becomes a regular file
+ * member with a ustar header. Names that don't fit the 100 byte name field
+ * and sizes that don't fit in 11 octal digits get a pax extended header
+ * in front of the member.
+ */
+
+#define TAR_BLOCK       512
+
+/* Largest size that fits in the ustar size field */
+#define TAR_MAXSIZE     077777777777ULL
+
+struct tar_header {
+    char    name[100];
+    char    mode[8];
+    char    uid[8];
+    char    gid[8];
+    char    size[12];
+    char    mtime[12];
+    char    chksum[8];
+    char    typeflag;
+    char    linkname[100];
+    char    magic[6];
+    char    version[2];
+    char    uname[32];
+    char    gname[32];
+    char    devmajor[8];
+    char    devminor[8];
+    char    prefix[155];
+    char    pad[12];
+};
+
+
+/* Zero padded octal number filling all but the last byte of the field */
+void tar_octal(char *field, size_t len, unsigned long long val) {
+    field[--len] = '\0';
+    while(len > 0) {
+        field[--len] = '0' + (val & 7);
+        val >>= 3;
+    }
+}
+
+
+void tar_mkheader(struct tar_header *hdr, const char *name, char typeflag,
+                  unsigned long long size, time_t mtime, const char *owner)
+{
+    unsigned int    sum = 0;
+    unsigned char   *p;
+    size_t          i;
+
+    memset(hdr, 0, sizeof(*hdr));
+    /* Longer names are in a pax path record, this is just a fallback */
+    strncpy(hdr->name, name, sizeof(hdr->name) - 1);
+    tar_octal(hdr->mode, sizeof(hdr->mode), 0644);
+    tar_octal(hdr->uid, sizeof(hdr->uid), 0);
+    tar_octal(hdr->gid, sizeof(hdr->gid), 0);
+    tar_octal(hdr->size, sizeof(hdr->size),
+              size > TAR_MAXSIZE ? 0 : size);
+    tar_octal(hdr->mtime, sizeof(hdr->mtime), mtime > 0 ? mtime : 0);
+    hdr->typeflag = typeflag;
+    memcpy(hdr->magic, "ustar", 6);
+    memcpy(hdr->version, "00", 2);
+    if(owner != NULL) {
+        strncpy(hdr->uname, owner, sizeof(hdr->uname) - 1);
+    }
+
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+    p = (unsigned char *) hdr;
+    for(i = 0; i < sizeof(*hdr); i++) {
+        sum += p[i];
+    }
+    tar_octal(hdr->chksum, 7, sum);
+}
+
+
+/*
+ * Append a "len key=value\n" record to buf, where len counts the whole
+ * record including itself. Returns the new length of buf, or 0 if it
+ * doesn't fit.
+ */
+size_t pax_record(char *buf, size_t buflen, size_t size, const char *key,
+                  const char *value)
+{
+    size_t  len, reclen, prev, n;
+
+    /* The length counts its own digits, iterate until it's stable */
+    len = strlen(key) + strlen(value) + 3;
+    reclen = len;
+    do {
+        prev = reclen;
+        for(reclen = len, n = prev; n > 0; n /= 10) {
+            reclen++;
+        }
+    } while(reclen != prev);
+
+    if(buflen + reclen + 1 > size) {
+        return 0;
+    }
+    snprintf(buf + buflen, size - buflen, "%lu %s=%s\n",
+             (unsigned long) reclen, key, value);
+
+    return buflen + reclen;
+}
+
+
+/* Write the header(s) for a member. Returns 0 if the writer has aborted. */
+int tar_putheader(struct tsm_ring *ring, const char *name,
+                  unsigned long long size, time_t mtime, const char *owner)
+{
+    struct tar_header   hdr;
+    char                pax[2*(DSM_MAX_FSNAME_LENGTH + DSM_MAX_HL_LENGTH +
+                               DSM_MAX_LL_LENGTH)];
+    char                num[32];
+    size_t              paxlen = 0;
+
+    if(strlen(name) >= sizeof(hdr.name)) {
+        paxlen = pax_record(pax, paxlen, sizeof(pax), "path", name);
+    }
+    if(size > TAR_MAXSIZE) {
+        snprintf(num, sizeof(num), "%llu", size);
+        paxlen = pax_record(pax, paxlen, sizeof(pax), "size", num);
+    }
+
+    if(paxlen > 0) {
+        tar_mkheader(&hdr, "././@PaxHeader", 'x', paxlen, mtime, NULL);
+        if(!ring_write(ring, (char *) &hdr, sizeof(hdr)) ||
+           !ring_write(ring, pax, paxlen) ||
+           !ring_write(ring, NULL, (TAR_BLOCK - paxlen % TAR_BLOCK) % TAR_BLOCK))
+        {
+            return 0;
+        }
+    }
+
+    tar_mkheader(&hdr, name, '0', size, mtime, owner);
+
+    return ring_write(ring, (char *) &hdr, sizeof(hdr));
+}
+
+
+/* What -X needs to know about each member */
+struct tsm_objent {
+    struct sumlist_ent  *ent;       /* From the query */
+    struct verify_obj   how;
+    off_t               size;
+    int                 exact;      /* Or size is only the estimate */
+    char                *name;      /* Relative member name */
+};
+
+
+int matchall_cmp(const void *a, const void *b) {
+    const struct sumlist_ent    *ea = a, *eb = b;
+    int                         c;
+
+    c = order_cmp(&ea->restoreOrder, &eb->restoreOrder);
+    if(c == 0 && ea->objId.hi != eb->objId.hi) {
+        c = ea->objId.hi < eb->objId.hi ? -1 : 1;
+    }
+    if(c == 0 && ea->objId.lo != eb->objId.lo) {
+        c = ea->objId.lo < eb->objId.lo ? -1 : 1;
+    }
+
+    return c;
+}
+
+
+/*
+ * Query each filepath, wildcards allowed, listed one per line in namelist
+ * (- for stdin) into cbdata. Names without match are counted in missing.
+ * Returns 0 on fatal errors.
+ */
+int matchall_list(dsUint32_t sesshandle, char *fsname, char *namelist,
+                  char *description, dsmSendType sendtype, char verbose,
+                  struct sumlist_cb_data *cbdata, int *missing)
+{
+    char        line[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 2];
+    dsmObjName  objName;
+    dsInt16_t   rc;
+    FILE        *f;
+    int         ok = 1;
+
+    f = strcmp(namelist, "-") == 0 ? stdin : fopen(namelist, "r");
+    if(f == NULL) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", namelist, strerror(errno));
+        return 0;
+    }
+
+    while(ok && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if(*line == '\0') {
+            continue;
+        }
+        tsm_name2obj(fsname, line, &objName);
+        rc = tsm_queryfile(sesshandle, &objName, description, sendtype,
+                           verbose, tsm_sumlist_cb, cbdata);
+        if(rc == DSM_RC_ABORT_NO_MATCH) {
+            fprintf(stderr, "tsmpipe: %s%s%s: No match\n", objName.fs,
+                    objName.hl, objName.ll);
+            (*missing)++;
+        }
+        else if(rc != DSM_RC_OK) {
+            ok = 0;
+        }
+    }
+    if(ok && ferror(f)) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", namelist, strerror(errno));
+        ok = 0;
+    }
+    if(f != stdin) {
+        fclose(f);
+    }
+
+    if(cbdata->nsums > 0) {
+        qsort(cbdata->sums, cbdata->nsums, sizeof(*cbdata->sums),
+              sumlist_cmp);
+    }
+
+    return ok;
+}
+
+
+/*
+ * Sort out the members from the objects in cbdata: in restore order,
+ * without those matched more than once by -J, and with the sub-objects
+ * of striped and segmented objects left to their descriptor. The member
+ * size is the length of a striped or segmented object and the size
+ * stored with -k, or else only the size estimate.
+ *
+ * Returns the members in *objs, or 0 on fatal errors.
+ */
+int matchall_plan(dsUint32_t sesshandle, struct sumlist_cb_data *cbdata,
+                  char *description, dsmSendType sendtype, char verbose,
+                  struct tsm_objent **objs, int *nobjs)
+{
+    struct sumlist_ent  *ent;
+    struct verify_obj   *vobjs;
+    struct tsm_objent   *o;
+    char                *name;
+    int                 i, n = 0, ok = 1;
+
+    *objs = NULL;
+    *nobjs = 0;
+    if(cbdata->nobjs == 0) {
+        return 1;
+    }
+
+    qsort(cbdata->objs, cbdata->nobjs, sizeof(*cbdata->objs), matchall_cmp);
+    for(i = 0; i < cbdata->nobjs; i++) {
+        if(n > 0 && matchall_cmp(&cbdata->objs[n - 1],
+                                 &cbdata->objs[i]) == 0)
+        {
+            free(cbdata->objs[i].fs);
+            free(cbdata->objs[i].hl);
+            free(cbdata->objs[i].ll);
+            continue;
+        }
+        cbdata->objs[n++] = cbdata->objs[i];
+    }
+    cbdata->nobjs = n;
+
+    vobjs = calloc(cbdata->nobjs, sizeof(*vobjs));
+    *objs = calloc(cbdata->nobjs, sizeof(**objs));
+    if(vobjs == NULL || *objs == NULL) {
+        perror("tsmpipe: malloc");
+        free(vobjs);
+        return 0;
+    }
+    if(!verify_plan(sesshandle, cbdata, vobjs, description, sendtype,
+                    verbose))
+    {
+        free(vobjs);
+        return 0;
+    }
+
+    for(i = 0; ok && i < cbdata->nobjs; i++) {
+        if(vobjs[i].kind == verify_skip) {
+            continue;
+        }
+        ent = &cbdata->objs[i];
+        o = &(*objs)[*nobjs];
+        o->ent = ent;
+        o->how = vobjs[i];
+        o->exact = 1;
+        if(o->how.kind == verify_striped) {
+            o->size = o->how.layout.length;
+        }
+        else if(o->how.kind == verify_segmented) {
+            o->size = o->how.seglayout.length;
+        }
+        else if(o->how.expected.valid) {
+            o->size = o->how.expected.size;
+        }
+        else if(o->how.rawlen >= 0) {
+            o->size = o->how.rawlen;
+        }
+        else {
+            o->size = ent->estimate;
+            o->exact = 0;
+        }
+
+        /* Archive member names are relative */
+        name = ent->fs;
+        while(*name == '/') {
+            name++;
+        }
+        o->name = malloc(strlen(name) + strlen(ent->hl) + strlen(ent->ll) + 1);
+        if(o->name == NULL) {
+            perror("tsmpipe: malloc");
+            ok = 0;
+            break;
+        }
+        sprintf(o->name, "%s%s%s", name, ent->hl, ent->ll);
+        (*nobjs)++;
+    }
+    free(vobjs);
+
+    return ok;
+}
+
+
+/* Returns the number of volumes the members are on */
+int matchall_nvols(struct tsm_objent *objs, int nobjs) {
+    int i, nvols = 0;
+
+    for(i = 0; i < nobjs; i++) {
+        if(i == 0 || !order_samevol(&objs[i - 1].ent->restoreOrder,
+                                    &objs[i].ent->restoreOrder))
+        {
+            nvols++;
+        }
+    }
+
+    return nvols;
+}
+
+
+/*
+ * -p: print the restore plan instead of extracting, a line per volume
+ * with its number of objects and bytes, and with -v the objects on it.
+ */
+void tsm_paxplan(struct tsm_objent *objs, int nobjs, char verbose) {
+    long long   bytes, total = 0;
+    int         i, j, first, nvols = 0, nlists = 0;
+
+    for(first = 0; first < nobjs; first = i) {
+        bytes = 0;
+        for(i = first; i < nobjs &&
+                order_samevol(&objs[first].ent->restoreOrder,
+                              &objs[i].ent->restoreOrder); i++)
+        {
+            bytes += objs[i].size;
+        }
+        printf("VOLUME\t%u\t%d\t%lld\n",
+               (unsigned int) objs[first].ent->restoreOrder.top, i - first,
+               bytes);
+        if(verbose > 0) {
+            for(j = first; j < i; j++) {
+                printf("OBJECT\t%u\t%lld\t%s\n",
+                       (unsigned int) objs[j].ent->restoreOrder.top,
+                       (long long) objs[j].size, objs[j].name);
+            }
+        }
+        nvols++;
+        nlists += (i - first + DSM_MAX_GET_OBJ - 1) / DSM_MAX_GET_OBJ;
+        total += bytes;
+    }
+
+    fprintf(stderr, "tsmpipe: Plan: %d objects, %lld bytes on %d volumes in "
+            "%d get lists\n", nobjs, total, nvols, nlists);
+}
+
+
+int pax_putheader(struct tsm_ring *ring, struct tsm_objent *o, char verbose) {
+    if(verbose > 1) {
+        fprintf(stderr, "tsmpipe: %s (%lld bytes)\n", o->name,
+                (long long) o->size);
+    }
+
+    return tar_putheader(ring, o->name, o->size,
+                         tsm_date2time(&o->ent->insDate), o->ent->owner);
+}
+
+
+/*
+ * Check that a streamed member got all of its data and pad it to the
+ * next block. Once the header is out there is no way to fix up the
+ * member, so the archive is cut off rather than get one with other
+ * data. Returns 0 if so.
+ */
+int pax_finish(struct tsm_ring *ring, struct tsm_objent *o, int ok,
+               off_t got)
+{
+    if(!ok || got != o->size) {
+        fprintf(stderr, "tsmpipe: FAILED: %s: got %lld of %lld bytes, "
+                "archive cut off\n", o->name, (long long) got,
+                (long long) o->size);
+        return 0;
+    }
+
+    return ring_write(ring, NULL, (TAR_BLOCK - o->size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+
+/* Copy len bytes from fd into the ring. Returns 0 on errors. */
+int pax_copy(struct tsm_ring *ring, int fd, off_t len) {
+    char    *buf;
+    size_t  fill;
+    ssize_t n;
+
+    while(len > 0) {
+        buf = ring_getfree(ring, &fill);
+        if(buf == NULL) {
+            return 0;
+        }
+        if((off_t) fill > len) {
+            fill = len;
+        }
+        n = read(fd, buf, fill);
+        if(n <= 0) {
+            fprintf(stderr, "tsmpipe: read temporary file: %s\n",
+                    n < 0 ? strerror(errno) : "Unexpected end of file");
+            return 0;
+        }
+        ring_put(ring, n);
+        len -= n;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Put the current object in a dsmBeginGetData list into the ring as a
+ * member. Objects of known size are streamed, the others, sent from stdin
+ * or by older versions, first got into a temporary file to find out.
+ * Returns 1 if it went well, 0 if it was skipped and -1 on fatal errors.
+ */
+int pax_getobj(dsUint32_t sesshandle, struct tsm_objent *o,
+               struct tsm_ring *ring, tsmpipe_xfer_t *xfer,
+               struct tsm_adapt *adapt, char verbose)
+{
+    const struct tsm_crypt  *crypt = o->how.encrypted ? &o->how.crypt : NULL;
+    struct tsm_verify       v;
+    off_t                   got;
+    FILE                    *f;
+    int                     ok;
+
+    if(o->exact && o->how.kind == verify_plain) {
+        if(!pax_putheader(ring, o, verbose)) {
+            return -1;
+        }
+        ok = tsm_getobj(sesshandle, &o->ent->objId, ring, xfer, adapt,
+                        o->size, &got, verbose);
+        if(ok == 0) {
+            return -1;
+        }
+        /* 2 means that there was more */
+        return pax_finish(ring, o, ok == 1, ok == 1 ? got : -1) ? 1 : -1;
+    }
+
+    if(o->exact) {
+        if(!pax_putheader(ring, o, verbose)) {
+            return -1;
+        }
+        verify_init(&v, NULL);
+        v.pass = ring;
+        v.passleft = o->size;
+        ok = tsm_getcompressed(sesshandle, &o->ent->objId, o->how.codec,
+                               crypt, o->how.zblock, xfer, -1, &v, verbose);
+        return pax_finish(ring, o, ok, v.sum.size) ? 1 : -1;
+    }
+
+    f = tmpfile();
+    if(f == NULL) {
+        fprintf(stderr, "tsmpipe: tmpfile: %s\n", strerror(errno));
+        return -1;
+    }
+    if(o->how.kind == verify_plain) {
+        ok = tsm_getplain(sesshandle, &o->ent->objId, xfer, fileno(f), NULL,
+                          verbose);
+    }
+    else {
+        ok = tsm_getcompressed(sesshandle, &o->ent->objId, o->how.codec,
+                               crypt, o->how.zblock, xfer, fileno(f), NULL,
+                               verbose);
+    }
+    if(!ok) {
+        fprintf(stderr, "tsmpipe: FAILED: %s: skipped\n", o->name);
+        fclose(f);
+        return 0;
+    }
+    o->size = lseek(fileno(f), 0, SEEK_END);
+    ok = o->size >= 0 && lseek(fileno(f), 0, SEEK_SET) == 0 &&
+         pax_putheader(ring, o, verbose) && pax_copy(ring, fileno(f), o->size) &&
+         ring_write(ring, NULL, (TAR_BLOCK - o->size % TAR_BLOCK) % TAR_BLOCK);
+    fclose(f);
+
+    return ok ? 1 : -1;
+}
+
+
+/* Put a striped or segmented object, put back together, into the ring */
+int pax_getparts(dsUint32_t sesshandle, struct tsm_objent *o,
+                 char *description, dsmSendType sendtype,
+                 struct tsm_ring *ring, tsmpipe_xfer_t *xfer, char *options,
+                 char verbose)
+{
+    struct tsm_verify   v;
+    char                name[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 1];
+    int                 ok;
+
+    if(!pax_putheader(ring, o, verbose)) {
+        return 0;
+    }
+    verify_init(&v, NULL);
+    v.pass = ring;
+    v.passleft = o->size;
+
+    snprintf(name, sizeof(name), "%s%s", o->ent->hl, o->ent->ll);
+    if(o->how.kind == verify_segmented) {
+        ok = tsm_restoresegments(sesshandle, o->ent->fs, name, description,
+                                 sendtype, verbose, xfer, &o->how.seglayout,
+                                 -1, &v);
+    }
+    else {
+        ok = tsm_restorestriped(sesshandle, o->ent->fs, name, description,
+                                sendtype, verbose, xfer, options,
+                                &o->how.layout, -1, &v);
+    }
+
+    return pax_finish(ring, o, ok, v.sum.size);
+}
+
+
+/*
+ * Stream the members into the ring: the plain and compressed objects in
+ * restore order, a dsmBeginGetData per volume of at most DSM_MAX_GET_OBJ
+ * objects, and then the striped and segmented ones.
+ *
+ * Returns the number of skipped objects, or -1 on fatal errors.
+ */
+int tsm_paxobjs(dsUint32_t sesshandle, struct tsm_objent *objs, int nobjs,
+                char *description, dsmSendType sendtype,
+                struct tsm_ring *ring, tsmpipe_xfer_t *xfer, char *options,
+                char verbose)
+{
+    dsInt16_t           rc;
+    struct tsm_adapt    adapt;
+    dsStruct64_t        objIds[DSM_MAX_GET_OBJ];
+    int                 idx[DSM_MAX_GET_OBJ];
+    dsmGetList          getList;
+    dsmGetType          getType;
+    int                 i, j, n, status;
+    int                 failed = 0;
+
+    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
+        getType = gtArchive;
+    }
+    else {
+        getType = gtBackup;
+    }
+    adapt_init(&adapt, xfer);
+
+    for(i = 0; i < nobjs; ) {
+        for(n = 0; i < nobjs && n < DSM_MAX_GET_OBJ; i++) {
+            if(objs[i].how.kind == verify_striped ||
+                    objs[i].how.kind == verify_segmented)
+            {
+                continue;
+            }
+            if(n > 0 && !order_samevol(&objs[idx[0]].ent->restoreOrder,
+                                       &objs[i].ent->restoreOrder))
+            {
+                break;
+            }
+            idx[n] = i;
+            objIds[n++] = objs[i].ent->objId;
+        }
+        if(n == 0) {
+            break;
+        }
+
+        getList.stVersion = dsmGetListVersion;
+        getList.numObjId = n;
+        getList.objId = objIds;
+        getList.partialObjData = NULL;
+
+        rc = dsmBeginGetData(sesshandle, bTrue, getType, &getList);
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmBeginGetData failed");
+            return -1;
+        }
+
+        /* Objects must be got in the order of the list */
+        for(j = 0; j < n; j++) {
+            status = pax_getobj(sesshandle, &objs[idx[j]], ring, xfer,
+                                &adapt, verbose);
+            if(status < 0) {
+                return -1;
+            }
+            failed += status == 0;
+
+            rc = dsmEndGetObj(sesshandle);
+            if(rc != DSM_RC_OK) {
+                tsm_printerr(sesshandle, rc, "dsmEndGetObj failed");
+                return -1;
+            }
+        }
+
+        rc = dsmEndGetData(sesshandle);
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmEndGetData failed");
+            return -1;
+        }
+    }
+
+    for(i = 0; i < nobjs; i++) {
+        if((objs[i].how.kind == verify_striped ||
+                objs[i].how.kind == verify_segmented) &&
+                !pax_getparts(sesshandle, &objs[i], description, sendtype,
+                              ring, xfer, options, verbose))
+        {
+            return -1;
+        }
+    }
+
+    /* End of archive */
+    if(!ring_write(ring, NULL, 2*TAR_BLOCK)) {
+        return -1;
+    }
+
+    return failed;
+}
+
+
+/*
+ * Extract all objects matching the file specification, or those listed in
+ * namelist (-J), as one pax archive on stdout. Plain and compressed
+ * objects are got in restore order in one session, striped ones with
+ * their own sessions and segmented ones a segment at a time, like -V
+ * does. With planonly (-p) only the plan for that is printed.
+ *
+ * Returns the number of skipped or missing objects, or -1 on fatal errors.
+ */
+int tsm_extractall(dsUint32_t sesshandle, char *fsname, char *filename,
+                   char *namelist, char *description, dsmSendType sendtype,
+                   char verbose, tsmpipe_xfer_t *xfer, char *options,
+                   char planonly)
+{
+    struct tsm_ring         ring;
+    pthread_t               writer;
+    int                     err, i, ok, nobjs = 0, missing = 0;
+    int                     failed = -1;
+    struct sumlist_cb_data  cbdata;
+    struct tsm_objent       *objs = NULL;
+    dsmObjName              objName;
+
+    memset(&cbdata, 0, sizeof(cbdata));
+
+    if(namelist) {
+        if(verbose > 0) {
+            fprintf(stderr, "tsmpipe: Extracting files listed in %s\n",
+                    namelist);
+        }
+        ok = matchall_list(sesshandle, fsname, namelist, description,
+                           sendtype, verbose, &cbdata, &missing);
+    }
+    else {
+        tsm_name2obj(fsname, filename, &objName);
+
+        if(verbose > 0) {
+            fprintf(stderr, "tsmpipe: Extracting files matching %s%s%s\n",
+                    objName.fs, objName.hl, objName.ll);
+        }
+
+        ok = sumlist_query(sesshandle, &objName, description, sendtype,
+                           verbose, &cbdata);
+    }
+    if(ok) {
+        ok = matchall_plan(sesshandle, &cbdata, description, sendtype,
+                           verbose, &objs, &nobjs);
+    }
+
+    if(ok && nobjs == 0 && missing == 0) {
+        fprintf(stderr, "tsmpipe: FAILED: The file specification did not match any file.\n");
+    }
+    else if(ok && planonly) {
+        tsm_paxplan(objs, nobjs, verbose);
+        failed = missing;
+    }
+    else if(ok && ring_init(&ring, xfer->qdepth, xfer->slotsize, xfer->hugepages,
+                      verbose))
+    {
+        if(verbose > 0) {
+            fprintf(stderr, "tsmpipe: %d files matched on %d volumes\n",
+                    nobjs, matchall_nvols(objs, nobjs));
+        }
+
+        ring_reset(&ring, STDOUT_FILENO);
+        ring_output(&ring, verbose);
+        ring_setfill(&ring, xfer->bufsize);
+        set_pipesize(STDOUT_FILENO, PIPESIZE, verbose);
+
+        err = pthread_create(&writer, NULL, tsm_writer, &ring);
+        if(err) {
+            fprintf(stderr, "tsmpipe: pthread_create: %s\n", strerror(err));
+        }
+        else {
+            failed = tsm_paxobjs(sesshandle, objs, nobjs, description,
+                                 sendtype, &ring, xfer, options, verbose);
+            if(failed >= 0) {
+                failed += missing;
+            }
+            if(failed < 0) {
+                stop_helper(&ring, writer);
+            }
+            else {
+                ring_close(&ring, 0);
+                pthread_join(writer, NULL);
+                if(verbose > 0) {
+                    ring_report(&ring, "stdout");
+                }
+            }
+            if(ring.err) {
+                fprintf(stderr, "tsmpipe: write: %s\n", strerror(ring.err));
+                failed = -1;
+            }
         }
-        if(usercb == NULL) {
-            continue;
+        ring_free(&ring);
+    }
+
+    for(i = 0; i < nobjs; i++) {
+        free(objs[i].name);
+    }
+    free(objs);
+    sumlist_free(&cbdata);
+
+    return failed;
+}
+
+
+/*
+ * Verify all objects matching the file specification, -V. Each object is
+ * read and checksummed, but not written anywhere, and compared with its
+ * stored checksum (-k) and/or a reference file: reference itself if only
+ * one object matches, otherwise reference is a directory with the files
+ * at their filepath below it. Plain and compressed objects are got in
+ * restore order in one session, striped ones with their own sessions and
+ * segmented ones a segment at a time.
+ *
+ * Returns the number of objects that failed, or -1 on fatal errors.
+ */
+int tsm_verifyall(dsUint32_t sesshandle, char *fsname, char *filename,
+                  char *description, dsmSendType sendtype, char verbose,
+                  tsmpipe_xfer_t *xfer, char *options, char *reference)
+{
+    struct sumlist_cb_data  cbdata;
+    struct sumlist_ent      *ent;
+    struct verify_obj       *vobjs = NULL;
+    struct tsm_verify       v;
+    struct stat             st;
+    dsStruct64_t            objIds[DSM_MAX_GET_OBJ];
+    int                     idx[DSM_MAX_GET_OBJ];
+    char                    path[PATH_MAX + DSM_MAX_HL_LENGTH +
+                                 DSM_MAX_LL_LENGTH + 1];
+    char                    name[DSM_MAX_HL_LENGTH + DSM_MAX_LL_LENGTH + 1];
+    char                    *ref = reference, refdir = 0;
+    dsmGetList              getList;
+    dsmGetType              getType;
+    dsmObjName              objName;
+    dsInt16_t               rc;
+    long long               total = 0;
+    int                     i, j, n, ok, result;
+    int                     nverified = 0, failed = 0, unchecked = 0;
+    int                     fatal = 0;
+    double                  start, t;
+
+    tsm_name2obj(fsname, filename, &objName);
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Verifying files matching %s%s%s\n",
+                objName.fs, objName.hl, objName.ll);
+    }
+
+    if(!sumlist_query(sesshandle, &objName, description, sendtype, verbose,
+                      &cbdata))
+    {
+        return -1;
+    }
+    if(cbdata.nobjs == 0) {
+        fprintf(stderr, "tsmpipe: FAILED: The file specification did not match any file.\n");
+        fatal = 1;
+    }
+    else {
+        qsort(cbdata.objs, cbdata.nobjs, sizeof(*cbdata.objs),
+              sumlist_ordercmp);
+    }
+
+    if(!fatal) {
+        vobjs = calloc(cbdata.nobjs, sizeof(*vobjs));
+        if(vobjs == NULL) {
+            perror("tsmpipe: malloc");
+            fatal = 1;
         }
-        cbret = usercb(qType, &qResp, userdata);
-        if (cbret < 0) {
-            return DSM_RC_UNKNOWN_ERROR;
+    }
+    if(!fatal && !verify_plan(sesshandle, &cbdata, vobjs, description,
+                              sendtype, verbose))
+    {
+        fatal = 1;
+    }
+
+    /* Files, not the sub-objects verify_plan() found */
+    if(!fatal && reference) {
+        for(i = 0, n = 0; i < cbdata.nobjs; i++) {
+            n += vobjs[i].kind != verify_skip;
         }
-        else if(cbret == 0) {
+        if(stat(reference, &st) < 0) {
+            fprintf(stderr, "tsmpipe: %s: %s\n", reference, strerror(errno));
+            fatal = 1;
+        }
+        else if(S_ISDIR(st.st_mode)) {
+            refdir = 1;
+        }
+        else if(n > 1) {
+            fprintf(stderr, "tsmpipe: ERROR: %d files matched, -r must be "
+                    "a directory\n", n);
+            fatal = 1;
+        }
+    }
+
+    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
+        getType = gtArchive;
+    }
+    else {
+        getType = gtBackup;
+    }
+
+    start = timenow();
+
+    /*
+     * Plain and compressed objects in restore order, in a list of at most
+     * DSM_MAX_GET_OBJ per volume
+     */
+    for(i = 0; !fatal && i < cbdata.nobjs; ) {
+        for(n = 0; i < cbdata.nobjs && n < DSM_MAX_GET_OBJ; i++) {
+            if(vobjs[i].kind == verify_plain ||
+                    vobjs[i].kind == verify_compressed)
+            {
+                if(n > 0 && !order_samevol(&cbdata.objs[idx[0]].restoreOrder,
+                                           &cbdata.objs[i].restoreOrder))
+                {
+                    break;
+                }
+                idx[n] = i;
+                objIds[n] = cbdata.objs[i].objId;
+                n++;
+            }
+        }
+        if(n == 0) {
+            break;
+        }
+
+        getList.stVersion = dsmGetListVersion;
+        getList.numObjId = n;
+        getList.objId = objIds;
+        getList.partialObjData = NULL;
+
+        rc = dsmBeginGetData(sesshandle, bTrue, getType, &getList);
+        if(rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmBeginGetData failed");
+            fatal = 1;
             break;
         }
+
+        for(j = 0; j < n; j++) {
+            ent = &cbdata.objs[idx[j]];
+            if(refdir) {
+                snprintf(path, sizeof(path), "%s%s%s", reference, ent->hl,
+                         ent->ll);
+                ref = path;
+            }
+            if(!verify_init(&v, ref)) {
+                /* Skip it, the next dsmGetObj moves past it */
+                printf("FAILED\t%s%s%s\tNo reference file\n", ent->fs,
+                       ent->hl, ent->ll);
+                failed++;
+                continue;
+            }
+
+            t = timenow();
+            ok = verify_getobj(sesshandle, ent, &vobjs[idx[j]], &v, xfer,
+                               verbose);
+            rc = dsmEndGetObj(sesshandle);
+            if(rc != DSM_RC_OK) {
+                tsm_printerr(sesshandle, rc, "dsmEndGetObj failed");
+                verify_free(&v);
+                fatal = 1;
+                break;
+            }
+            if(verbose > 0) {
+                fprintf(stderr, "tsmpipe: %s%s%s: %lld bytes in %.1f "
+                        "seconds\n", ent->fs, ent->hl, ent->ll,
+                        (long long) v.sum.size, timenow() - t);
+            }
+
+            result = verify_report(ent, &v, &vobjs[idx[j]].expected, ok);
+            failed += result == 0;
+            unchecked += result == 2;
+            nverified++;
+            total += v.sum.size;
+            verify_free(&v);
+        }
+
+        rc = dsmEndGetData(sesshandle);
+        if(!fatal && rc != DSM_RC_OK) {
+            tsm_printerr(sesshandle, rc, "dsmEndGetData failed");
+            fatal = 1;
+        }
     }
 
-    if(rc != DSM_RC_FINISHED && rc != DSM_RC_MORE_DATA) {
-        tsm_printerr(sesshandle, rc, "dsmGetNextObj failed");
-        return rc;
+    /* Striped objects over their own sessions, and segmented ones */
+    for(i = 0; !fatal && i < cbdata.nobjs; i++) {
+        if(vobjs[i].kind != verify_striped &&
+                vobjs[i].kind != verify_segmented)
+        {
+            continue;
+        }
+        ent = &cbdata.objs[i];
+        if(refdir) {
+            snprintf(path, sizeof(path), "%s%s%s", reference, ent->hl,
+                     ent->ll);
+            ref = path;
+        }
+        if(!verify_init(&v, ref)) {
+            printf("FAILED\t%s%s%s\tNo reference file\n", ent->fs, ent->hl,
+                   ent->ll);
+            failed++;
+            continue;
+        }
+
+        snprintf(name, sizeof(name), "%s%s", ent->hl, ent->ll);
+        if(vobjs[i].kind == verify_segmented) {
+            ok = tsm_restoresegments(sesshandle, ent->fs, name, description,
+                                     sendtype, verbose, xfer,
+                                     &vobjs[i].seglayout, -1, &v);
+        }
+        else {
+            ok = tsm_restorestriped(sesshandle, ent->fs, name, description,
+                                    sendtype, verbose, xfer, options,
+                                    &vobjs[i].layout, -1, &v);
+        }
+        result = verify_report(ent, &v, &vobjs[i].expected, ok);
+        failed += result == 0;
+        unchecked += result == 2;
+        nverified++;
+        total += v.sum.size;
+        verify_free(&v);
     }
 
-    rc = dsmEndQuery(sesshandle);
-    if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmEndQuery failed");
-        return rc;
+    if(!fatal) {
+        t = timenow() - start;
+        fprintf(stderr, "tsmpipe: Verified %d objects, %lld bytes in %.1f "
+                "seconds (%.1f MB/s), %d failed, %d unchecked\n", nverified,
+                total, t, t > 0 ? total / t / (1024*1024) : 0.0, failed,
+                unchecked);
     }
 
-    return DSM_RC_OK;
+    free(vobjs);
+    sumlist_free(&cbdata);
+
+    return fatal ? -1 : failed;
 }
 
-struct matchone_cb_data {
-    int             numfound;
-    dsStruct64_t    objId;
-    dsUint32_t      copyGroup;
-};
 
-int tsm_matchone_cb(dsmQueryType qType, DataBlk *qResp, void * userdata)
+int tsm_listfile(dsUint32_t sesshandle, char *fsname, char *filename, 
+                   char *description, dsmSendType sendtype, char verbose,
+                   tsmpipe_listmode_t listmode, tsmpipe_listfmt_t listfmt,
+                   int showsubs)
 {
-    struct matchone_cb_data *cbdata = userdata;
+    struct tsm_listout  out;
+    dsInt16_t           rc;
+    dsmObjName          objName;
 
-    cbdata->numfound++;
+    tsm_name2obj(fsname, filename, &objName);
 
-    if(qType == qtArchive) {
-        qryRespArchiveData *qr = (void *) qResp->bufferPtr;
-        
-        cbdata->objId = qr->objId;
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Listing file(s) %s%s%s\n",
+                objName.fs, objName.hl, objName.ll);
     }
-    else if(qType == qtBackup) {
-        qryRespBackupData *qr = (void *) qResp->bufferPtr;
-        
-        cbdata->objId       = qr->objId;
-        cbdata->copyGroup   = qr->copyGroup;
+
+    if(listmode == listmode_sums) {
+        return tsm_listsums(sesshandle, &objName, description, sendtype,
+                            verbose);
+    }
+
+    if(!listout_init(&out, listmode, listfmt)) {
+        return 0;
+    }
+    out.showsubs = showsubs;
+
+    rc = tsm_queryfile(sesshandle, &objName, description, sendtype, 
+                       verbose, tsm_listfile_cb, &out);
+    if(rc != DSM_RC_OK && rc != DSM_RC_ABORT_NO_MATCH) {
+        listout_free(&out);
+        return 0;
+    }
+    if(!listout_release(sesshandle, &out, description, sendtype, verbose) ||
+            !listout_releasesubs(&out) || !listout_flush(&out))
+    {
+        listout_free(&out);
+        return 0;
+    }
+
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Listed %llu objects\n", out.nobjs);
+    }
+
+    listout_free(&out);
+
+    return 1;
+}
+
+int copy_env(const char *from, const char *to) {
+    char *e;
+    char n[PATH_MAX+1];
+
+    e = getenv(from);
+    if(!e) {
+        fprintf(stderr, "tsmpipe: Environment variable %s not set\n", from);
+        return(0);
+    }
+    n[PATH_MAX] = '\0';
+    snprintf(n, PATH_MAX, "%s=%s", to, e);
+    if(putenv(strdup(n))) {
+        perror("tsmpipe: Setting up environment");
+        return(0);
+    }
+
+    return(1);
+}
+
+
+/* Set up transfer buffer sizes once we know the TCPBUFFSIZE */
+int xfer_setup(tsmpipe_xfer_t *xfer, dsUint32_t sesshandle, char *options,
+               off_t bufsize, off_t ringsize, char verbose)
+{
+    size_t n;
+
+    xfer->tcpbuff = tsm_tcpbuffsize(sesshandle, options, verbose);
+
+    if(bufsize) {
+        xfer->bufsize = bufsize;
     }
     else {
-        fprintf(stderr,
-                "tsm_matchone_cb: Internal error: Unknown qType %d\n",
-                qType);
-        return -1;
+        n = BUFTARGET / xfer->tcpbuff;
+        if(n < 1) {
+            n = 1;
+        }
+        xfer->bufsize = n * xfer->tcpbuff - 4;
     }
 
-    if(cbdata->numfound > 1) {
-        fprintf(stderr, "tsmpipe: FAILED: The file specification matched multiple files.\n");
-        return -1;
+    xfer->slotsize = xfer->bufsize;
+    if(xfer->adaptive) {
+        n = ADAPT_MAXBUF / xfer->tcpbuff;
+        if(n * xfer->tcpbuff - 4 > xfer->slotsize) {
+            xfer->slotsize = n * xfer->tcpbuff - 4;
+        }
+    }
+    if((xfer->codec || xfer->key) && xfer->slotsize < xfer->zblock) {
+        xfer->slotsize = xfer->zblock;
+    }
+
+    if(ringsize) {
+        if((size_t) ringsize < xfer->slotsize || 
+                ringsize / xfer->slotsize > INT_MAX)
+        {
+            fprintf(stderr, "tsmpipe: ERROR: -m size must be at least %lu "
+                    "bytes\n", (unsigned long) xfer->slotsize);
+            return 0;
+        }
+        xfer->qdepth = ringsize / xfer->slotsize;
+    }
+
+    if(verbose > 1) {
+        fprintf(stderr, "tsmpipe: Using %d buffers of %lu bytes%s\n",
+                xfer->qdepth, (unsigned long) xfer->bufsize,
+                xfer->adaptive?", adaptive":"");
+        if(xfer->codec) {
+            fprintf(stderr, "tsmpipe: Compressing with %s level %d in %lu "
+                    "byte blocks, %d threads\n", xfer->codec->name,
+                    xfer->zlevel, (unsigned long) xfer->zblock,
+                    xfer->zthreads);
+        }
+        if(xfer->key) {
+            fprintf(stderr, "tsmpipe: Encrypting with %s key %s in %lu "
+                    "byte blocks\n", CRYPT_CIPHER, xfer->key->id,
+                    (unsigned long) xfer->zblock);
+        }
+    }
+
+    return 1;
+}
+
+
+/* Signals, environment and API setup, once per process */
+int tsm_apisetup(void) {
+    /* Let the TSM api get the signals */
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+
+    if(!copy_env("DSM_DIR", "DSMI_DIR")) {
+        return 0;
+    }
+
+    if(!copy_env("DSM_CONFIG", "DSMI_CONFIG")) {
+        return 0;
+    }
+
+    if(!tsm_checkapi()) {
+        return 0;
+    }
+
+    return tsm_setup();
+}
+
+
+/*
+ * Metrics, -M [secs][,json=file][,prom=file]. Progress every secs seconds
+ * on stderr with how busy each stage was since the last report, a JSON
+ * summary at the end (- for stderr), and a Prometheus textfile for the
+ * node_exporter textfile collector, replaced atomically.
+ */
+struct tsm_metrics {
+    double          interval;
+    char            *json;
+    char            *prom;
+    const char      *mode;
+    const char      *type;
+    char            *fs;
+    char            *name;
+    char            verbose;
+    char            running;
+    char            stop;
+    pthread_t       thread;
+};
+
+pthread_mutex_t     metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t      metrics_cond = PTHREAD_COND_INITIALIZER;
+struct tsm_metrics  metrics;
+
+
+int metrics_parse(char *spec) {
+    char    *tok, *save = NULL, *end;
+    int     first = 1;
+
+    for(tok = strtok_r(spec, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save), first = 0)
+    {
+        if(strncmp(tok, "json=", 5) == 0 && tok[5] != '\0') {
+            metrics.json = tok + 5;
+        }
+        else if(strncmp(tok, "prom=", 5) == 0 && tok[5] != '\0') {
+            metrics.prom = tok + 5;
+        }
+        else if(first) {
+            metrics.interval = strtod(tok, &end);
+            if(*end != '\0' || metrics.interval <= 0) {
+                return 0;
+            }
+        }
+        else {
+            return 0;
+        }
     }
 
     return 1;
 }
 
 
-int tsm_deletefile(dsUint32_t sesshandle, char *fsname, char *filename, 
-                   char *description, dsmSendType sendtype, char verbose)
+void metrics_progress(const struct tsm_stats *prev,
+                      const struct tsm_stats *cur, double dt)
 {
-    dsInt16_t           rc;
-    dsUint16_t          reason=0;
-    dsmDelInfo          *dInfoP;
-    dsmDelType          dType;
-    struct matchone_cb_data  cbdata;
-    delArch             daInfo;
-    delBack             dbInfo;
-    dsmObjName          objName;
+    double  busy[STAT_STAGES];
+    int     i;
 
-    tsm_name2obj(fsname, filename, &objName);
-
-    if(verbose > 0) {
-        fprintf(stderr, "tsmpipe: Deleting file %s%s%s\n",
-                objName.fs, objName.hl, objName.ll);
+    for(i = 0; i < STAT_STAGES; i++) {
+        busy[i] = dt > 0 ? 100 * (cur->seconds[i] - prev->seconds[i]) / dt : 0;
     }
 
-    cbdata.numfound = 0;
-    rc = tsm_queryfile(sesshandle, &objName, description, sendtype, 
-                       verbose, tsm_matchone_cb, &cbdata);
-    if(rc != DSM_RC_OK) {
-        return 0;
-    }
+    fprintf(stderr, "tsmpipe: Progress %.1f s: input %.1f MB, api %.1f MB "
+            "(%.1f MB/s), output %.1f MB; busy input %.0f%%, api %.0f%%, "
+            "output %.0f%%\n", timenow() - cur->start,
+            cur->bytes[stat_input] / 1048576.0,
+            cur->bytes[stat_api] / 1048576.0,
+            dt > 0 ? (cur->bytes[stat_api] - prev->bytes[stat_api]) /
+                     1048576.0 / dt : 0,
+            cur->bytes[stat_output] / 1048576.0,
+            busy[stat_input], busy[stat_api], busy[stat_output]);
+}
 
-    if(cbdata.numfound == 0) {
-        fprintf(stderr, "tsmpipe: FAILED: The file specification did not match any file.\n");
-        return(0);
+
+void *metrics_thread(void *arg) {
+    struct tsm_metrics  *m = arg;
+    struct tsm_stats    prev, cur;
+    struct timespec     ts;
+    double              last, next;
+
+    block_signals();
+
+    stats_get(&prev);
+    last = timenow();
+
+    pthread_mutex_lock(&metrics_mutex);
+    while(!m->stop) {
+        next = last + m->interval;
+        ts.tv_sec = next;
+        ts.tv_nsec = (next - ts.tv_sec) * 1000000000;
+        if(pthread_cond_timedwait(&metrics_cond, &metrics_mutex, &ts) !=
+                ETIMEDOUT)
+        {
+            continue;
+        }
+        stats_get(&cur);
+        metrics_progress(&prev, &cur, timenow() - last);
+        prev = cur;
+        last = next;
     }
+    pthread_mutex_unlock(&metrics_mutex);
 
-    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
-        dType = dtArchive;
+    return NULL;
+}
 
-        daInfo.stVersion    = delArchVersion;
-        daInfo.objId        = cbdata.objId;
 
-        dInfoP = (dsmDelInfo *) &daInfo;
+/* Start counting, and reporting progress if asked to */
+void metrics_start(void) {
+    stats_reset();
+
+    if(metrics.interval > 0) {
+        metrics.stop = 0;
+        if(pthread_create(&metrics.thread, NULL, metrics_thread, &metrics) != 0) {
+            fprintf(stderr, "tsmpipe: Warning: No progress reports: %s\n",
+                    strerror(errno));
+            return;
+        }
+        metrics.running = 1;
     }
-    else {
-        dType = dtBackup;
+}
 
-        dbInfo.stVersion    = delBackVersion;
-        dbInfo.objNameP     = &objName;
-        dbInfo.copyGroup    = cbdata.copyGroup;
 
-        dInfoP = (dsmDelInfo *) &dbInfo;
+void metrics_json(const struct tsm_stats *s, double elapsed, int code) {
+    FILE    *f = stderr;
+    char    fs[DSM_MAX_FSNAME_LENGTH * 6 + 3];
+    char    name[PATH_MAX * 6 + 3];
+    int     i;
+
+    if(strcmp(metrics.json, "-") != 0 &&
+            (f = fopen(metrics.json, "w")) == NULL)
+    {
+        fprintf(stderr, "tsmpipe: %s: %s\n", metrics.json, strerror(errno));
+        return;
     }
 
-    rc = dsmBeginTxn(sesshandle);
-    if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmBeginTxn failed");
-        return 0;
+    strcpy(fs, "null");
+    if(metrics.fs) {
+        *fmt_json(fs, metrics.fs, DSM_MAX_FSNAME_LENGTH) = '\0';
+    }
+    strcpy(name, "null");
+    if(metrics.name) {
+        *fmt_json(name, metrics.name, PATH_MAX) = '\0';
     }
 
-    rc = dsmDeleteObj(sesshandle, dType, *dInfoP);
-    if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmDeleteObj failed");
-        return 0;
+    fprintf(f, "{\"mode\":\"%s\",\"type\":\"%s\",\"fs\":%s,\"name\":%s,"
+            "\"exit\":%d,\"elapsed\":%.3f,\"objects\":%llu",
+            metrics.mode, metrics.type, fs, name, code, elapsed, s->objects);
+    for(i = 0; i < STAT_STAGES; i++) {
+        fprintf(f, ",\"%s\":{\"seconds\":%.3f,\"calls\":%llu,\"bytes\":%llu}",
+                stat_names[i], s->seconds[i], s->calls[i], s->bytes[i]);
+    }
+    fprintf(f, ",\"server\":{\"sent\":%llu,\"compressed\":%llu,"
+            "\"lanfree\":%llu,\"deduplicated\":%llu,"
+            "\"compressed_objects\":%llu,\"deduplicated_objects\":%llu}}\n",
+            s->srvsent, s->srvcompressed, s->srvlanfree, s->srvdedup,
+            s->compressedobjs, s->dedupobjs);
+
+    if(f != stderr && fclose(f) != 0) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", metrics.json, strerror(errno));
     }
+}
 
-    rc = dsmEndTxn(sesshandle, DSM_VOTE_COMMIT, &reason);
-    if(rc == DSM_RC_CHECK_REASON_CODE || 
-            (rc == DSM_RC_OK && reason != DSM_RC_OK))
+
+void metrics_prom(const struct tsm_stats *s, double elapsed, int code) {
+    FILE    *f;
+    char    tmp[PATH_MAX];
+    char    labels[64];
+    int     i;
+
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", metrics.prom) >=
+            (int) sizeof(tmp))
     {
-        tsm_printerr(sesshandle, reason, "dsmEndTxn failed, reason");
-        return(0);
+        fprintf(stderr, "tsmpipe: %s: %s\n", metrics.prom,
+                strerror(ENAMETOOLONG));
+        return;
     }
-    else if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmEndTxn failed");
-        return(0);
+    f = fopen(tmp, "w");
+    if(f == NULL) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    snprintf(labels, sizeof(labels), "mode=\"%s\",type=\"%s\"",
+             metrics.mode, metrics.type);
+
+    fprintf(f, "# HELP tsmpipe_stage_seconds Time blocked in each stage "
+            "of the last run.\n"
+            "# TYPE tsmpipe_stage_seconds gauge\n");
+    for(i = 0; i < STAT_STAGES; i++) {
+        fprintf(f, "tsmpipe_stage_seconds{%s,stage=\"%s\"} %.6f\n",
+                labels, stat_names[i], s->seconds[i]);
+    }
+    fprintf(f, "# HELP tsmpipe_stage_calls Calls in each stage of the "
+            "last run.\n"
+            "# TYPE tsmpipe_stage_calls gauge\n");
+    for(i = 0; i < STAT_STAGES; i++) {
+        fprintf(f, "tsmpipe_stage_calls{%s,stage=\"%s\"} %llu\n",
+                labels, stat_names[i], s->calls[i]);
+    }
+    fprintf(f, "# HELP tsmpipe_stage_bytes Bytes through each stage of "
+            "the last run.\n"
+            "# TYPE tsmpipe_stage_bytes gauge\n");
+    for(i = stat_input; i <= stat_output; i++) {
+        fprintf(f, "tsmpipe_stage_bytes{%s,stage=\"%s\"} %llu\n",
+                labels, stat_names[i], s->bytes[i]);
+    }
+    fprintf(f, "# HELP tsmpipe_server_bytes Bytes as reported by the "
+            "server for the objects sent in the last run.\n"
+            "# TYPE tsmpipe_server_bytes gauge\n"
+            "tsmpipe_server_bytes{%s,kind=\"sent\"} %llu\n"
+            "tsmpipe_server_bytes{%s,kind=\"compressed\"} %llu\n"
+            "tsmpipe_server_bytes{%s,kind=\"lanfree\"} %llu\n"
+            "tsmpipe_server_bytes{%s,kind=\"deduplicated\"} %llu\n",
+            labels, s->srvsent, labels, s->srvcompressed,
+            labels, s->srvlanfree, labels, s->srvdedup);
+    fprintf(f, "# HELP tsmpipe_objects Objects sent or restored in the "
+            "last run.\n"
+            "# TYPE tsmpipe_objects gauge\n"
+            "tsmpipe_objects{%s} %llu\n"
+            "# HELP tsmpipe_elapsed_seconds Duration of the last run.\n"
+            "# TYPE tsmpipe_elapsed_seconds gauge\n"
+            "tsmpipe_elapsed_seconds{%s} %.3f\n"
+            "# HELP tsmpipe_exit_code Exit code of the last run.\n"
+            "# TYPE tsmpipe_exit_code gauge\n"
+            "tsmpipe_exit_code{%s} %d\n"
+            "# HELP tsmpipe_last_run_timestamp_seconds End of the last "
+            "run.\n"
+            "# TYPE tsmpipe_last_run_timestamp_seconds gauge\n"
+            "tsmpipe_last_run_timestamp_seconds{%s} %.0f\n",
+            labels, s->objects, labels, elapsed, labels, code,
+            labels, s->start + elapsed);
+
+    if(fclose(f) != 0) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+    if(rename(tmp, metrics.prom) < 0) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", metrics.prom, strerror(errno));
+        unlink(tmp);
     }
-
-    return(1);
 }
 
 
-int tsm_restorefile(dsUint32_t sesshandle, char *fsname, char *filename, 
-                   char *description, dsmSendType sendtype, char verbose)
-{
-    dsInt16_t               rc;
-    struct matchone_cb_data cbdata;
-    dsmGetList              getList;
-    dsmGetType              getType;
-    DataBlk                 dataBlk;
-    dsmObjName              objName;
+/* Stop the progress reports and give the summaries, passes code on */
+int metrics_end(int code) {
+    struct tsm_stats    s;
+    double              elapsed;
 
-    tsm_name2obj(fsname, filename, &objName);
+    if(metrics.running) {
+        pthread_mutex_lock(&metrics_mutex);
+        metrics.stop = 1;
+        pthread_cond_signal(&metrics_cond);
+        pthread_mutex_unlock(&metrics_mutex);
+        pthread_join(metrics.thread, NULL);
+        metrics.running = 0;
+    }
 
-    if(verbose > 0) {
-        fprintf(stderr, "tsmpipe: Restoring file %s%s%s\n",
-                objName.fs, objName.hl, objName.ll);
+    stats_get(&s);
+    elapsed = timenow() - s.start;
+
+    if(metrics.verbose > 0 && s.calls[stat_api] > 0) {
+        fprintf(stderr, "tsmpipe: Time in input %.1f s, api %.1f s, "
+                "output %.1f s, session %.1f s, query %.1f s, "
+                "commit %.1f s of %.1f s\n",
+                s.seconds[stat_input], s.seconds[stat_api],
+                s.seconds[stat_output], s.seconds[stat_session],
+                s.seconds[stat_query], s.seconds[stat_commit], elapsed);
+        if(s.calls[stat_throttle] > 0) {
+            fprintf(stderr, "tsmpipe: Throttled %llu times for %.1f s\n",
+                    s.calls[stat_throttle], s.seconds[stat_throttle]);
+        }
+        if(s.srvsent > 0) {
+            fprintf(stderr, "tsmpipe: Server got %llu bytes, %llu "
+                    "compressed, %llu LAN-free, %llu deduplicated\n",
+                    s.srvsent, s.srvcompressed, s.srvlanfree, s.srvdedup);
+        }
+    }
+    if(metrics.json) {
+        metrics_json(&s, elapsed, code);
+    }
+    if(metrics.prom) {
+        metrics_prom(&s, elapsed, code);
     }
 
-    cbdata.numfound = 0;
+    return code;
+}
 
-    rc = tsm_queryfile(sesshandle, &objName, description, sendtype, 
-                       verbose, tsm_matchone_cb, &cbdata);
-    if(rc != DSM_RC_OK) {
-        return 0;
+
+/* End a command, keeping the session if it belongs to the daemon pool */
+int cmd_end(dsUint32_t sesshandle, char ownsess, int code) {
+    metrics_end(code);
+    if(ownsess) {
+        dsmTerminate(sesshandle);
     }
 
-    if(cbdata.numfound == 0) {
-        fprintf(stderr, "tsmpipe: FAILED: The file specification did not match any file.\n");
-        return(0);
+    return code;
+}
+
+
+/*
+ * Daemon, -W socket. Starting a process and a session for every small
+ * store, list or delete costs more than the operation itself, so a
+ * supervisor keeps a pool of worker processes with initialized sessions
+ * that accept command lines on a Unix domain socket. The client, any
+ * tsmpipe with TSMPIPE_SOCKET set, sends its arguments along with its
+ * stdin, stdout, stderr and working directory as descriptors
+ * (SCM_RIGHTS), and gets the exit code back.
+ *
+ * A worker runs one command at a time through tsm_command(), just like
+ * the command line does. It is replaced by a fresh one after a failed
+ * command, after DAEMON_MAXCMDS commands, or when it has been idle for
+ * DAEMON_MAXIDLE seconds, before the server drops the idle session. If
+ * the client hangs up while its command runs, the input stops and the
+ * transaction is aborted instead of committed, see daemon_hungup(), and
+ * the worker exits with code 4.
+ */
+
+#define DEF_WORKERS     4
+#define DAEMON_MAGIC    "tsmpipe1"
+#define DAEMON_MAXARGS  65536
+#define DAEMON_MAXCMDS  10000
+#define DAEMON_MAXIDLE  600
+#define DAEMON_NFDS     4           /* stdin, stdout, stderr, cwd */
+
+int tsm_command(int argc, char *argv[], dsUint32_t poolsess, char *poolopts);
+
+struct daemon_req {
+    char        magic[8];
+    dsUint32_t  argc;
+    dsUint32_t  arglen;             /* NUL terminated arguments follow */
+};
+
+union daemon_ctl {
+    struct cmsghdr  hdr;
+    char            buf[CMSG_SPACE(DAEMON_NFDS * sizeof(int))];
+};
+
+
+/*
+ * Run the command line in the daemon listening on path. Returns its exit
+ * code, or -1 if there is no daemon and the command should run here.
+ */
+int daemon_client(const char *path, int argc, char *argv[]) {
+    struct sockaddr_un  addr;
+    struct daemon_req   req;
+    struct msghdr       msg;
+    struct iovec        iov[2];
+    union daemon_ctl    ctl;
+    struct cmsghdr      *cmsg;
+    int                 fds[DAEMON_NFDS];
+    dsInt32_t           code;
+    char                *args, *p;
+    size_t              len = 0;
+    int                 sock, i, ok;
+
+    for(i = 1; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+    if(strlen(path) >= sizeof(addr.sun_path) || len > DAEMON_MAXARGS) {
+        return -1;
     }
 
-    getList.stVersion = dsmGetListVersion;
-    getList.numObjId = 1;
-    getList.objId = &cbdata.objId;
-    getList.partialObjData = NULL;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0) {
+        return -1;
+    }
+    if(connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
 
-    if(sendtype == stArchiveMountWait || sendtype == stArchive) {
-        getType = gtArchive;
+    fds[0] = STDIN_FILENO;
+    fds[1] = STDOUT_FILENO;
+    fds[2] = STDERR_FILENO;
+    fds[3] = open(".", O_RDONLY);
+    args = malloc(len + 1);
+    if(fds[3] < 0 || args == NULL) {
+        if(fds[3] >= 0) {
+            close(fds[3]);
+        }
+        free(args);
+        close(sock);
+        return -1;
     }
-    else {
-        getType = gtBackup;
+    for(p = args, i = 1; i < argc; i++) {
+        p += sprintf(p, "%s", argv[i]) + 1;
     }
 
-    rc = dsmBeginGetData(sesshandle, bTrue, getType, &getList);
-    if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmBeginGetData failed");
-        return 0;
+    memcpy(req.magic, DAEMON_MAGIC, sizeof(req.magic));
+    req.argc = argc - 1;
+    req.arglen = len;
+    iov[0].iov_base = (void *) &req;
+    iov[0].iov_len = sizeof(req);
+    iov[1].iov_base = args;
+    iov[1].iov_len = len;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    /* Fails if we have no stdin, stdout or stderr to pass on */
+    ok = sendmsg(sock, &msg, 0) == (ssize_t) (sizeof(req) + len);
+    close(fds[3]);
+    free(args);
+    if(!ok) {
+        close(sock);
+        return -1;
     }
 
-    dataBlk.stVersion = DataBlkVersion;
-    dataBlk.bufferPtr = malloc(BUFLEN);
-    if(!dataBlk.bufferPtr) {
-        perror("tsmpipe: malloc");
-        return 0;
+    if(read_full(sock, (char *) &code, sizeof(code)) != sizeof(code)) {
+        fprintf(stderr, "tsmpipe: Lost the connection to the daemon at "
+                "%s\n", path);
+        code = 2;
     }
-    dataBlk.bufferLen = BUFLEN;
-    dataBlk.numBytes = 0;
-    rc = dsmGetObj(sesshandle, &cbdata.objId, &dataBlk);
-    while(rc == DSM_RC_MORE_DATA) {
-        if(write_full(STDOUT_FILENO, dataBlk.bufferPtr, dataBlk.numBytes) < 0) {
-            perror("tsmpipe: write");
-            return 0;
+    close(sock);
+
+    return code;
+}
+
+
+/*
+ * Receive a command line, as argv with our name first pointing into args,
+ * and the client's descriptors. Returns argc, or -1 if the request is
+ * broken.
+ */
+int daemon_recv(int conn, char ***argvp, char **argsp,
+                int fds[DAEMON_NFDS])
+{
+    struct daemon_req   req;
+    struct msghdr       msg;
+    struct iovec        iov;
+    union daemon_ctl    ctl;
+    struct cmsghdr      *cmsg;
+    char                **argv = NULL, *args = NULL, *p;
+    ssize_t             n;
+    int                 i, nfds = 0;
+
+    iov.iov_base = (void *) &req;
+    iov.iov_len = sizeof(req);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    n = recvmsg(conn, &msg, MSG_WAITALL);
+    for(cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
         }
-        dataBlk.numBytes = 0;
-        rc = dsmGetData(sesshandle, &dataBlk);
     }
-    if(rc != DSM_RC_FINISHED) {
-        tsm_printerr(sesshandle, rc, "dsmGetObj/dsmGetData failed");
-        return 0;
+    if(n != sizeof(req) || nfds != DAEMON_NFDS ||
+            memcmp(req.magic, DAEMON_MAGIC, sizeof(req.magic)) != 0 ||
+            req.arglen > DAEMON_MAXARGS || req.argc > req.arglen)
+    {
+        /* Nothing at all is someone checking if we're running */
+        if(n != 0) {
+            fprintf(stderr, "tsmpipe: Worker %d got a broken request\n",
+                    (int) getpid());
+        }
+        for(i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        return -1;
     }
-    if(write_full(STDOUT_FILENO, dataBlk.bufferPtr, dataBlk.numBytes) < 0) {
-        perror("tsmpipe: write");
-        return 0;
+
+    args = malloc(req.arglen + 1);
+    argv = malloc((req.argc + 2) * sizeof(*argv));
+    if(args == NULL || argv == NULL ||
+            read_full(conn, args, req.arglen) != (ssize_t) req.arglen)
+    {
+        free(args);
+        free(argv);
+        for(i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        return -1;
     }
+    args[req.arglen] = '\0';
 
-    rc = dsmEndGetObj(sesshandle);
-    if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmEndGetObj failed");
-        return 0;
+    argv[0] = "tsmpipe";
+    for(p = args, i = 1; i <= (int) req.argc; i++) {
+        if(p >= args + req.arglen) {
+            break;
+        }
+        argv[i] = p;
+        p += strlen(p) + 1;
     }
+    argv[i] = NULL;
+    *argvp = argv;
+    *argsp = args;
 
-    rc = dsmEndGetData(sesshandle);
-    if(rc != DSM_RC_OK) {
-        tsm_printerr(sesshandle, rc, "dsmEndGetData failed");
-        return 0;
+    return i;
+}
+
+
+/*
+ * Run a received command with the client's descriptors as stdin, stdout
+ * and stderr, in its directory, and put our own back afterwards.
+ */
+int daemon_run(dsUint32_t sesshandle, char *options, int argc, char **argv,
+               int fds[DAEMON_NFDS], int logfd, int nullfd)
+{
+    int     code, i;
+
+    dup2(fds[0], STDIN_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[2], STDERR_FILENO);
+    if(fchdir(fds[3]) < 0) {
+        fprintf(stderr, "tsmpipe: Daemon can't change to the working "
+                "directory: %s\n", strerror(errno));
+        code = 1;
+    }
+    else {
+        /* Start getopt() over, 0 also resets glibc's internal state */
+#ifdef __GLIBC__
+        optind = 0;
+#else
+        optind = 1;
+#endif
+        qfilter = NULL;
+        code = tsm_command(argc, argv, sesshandle, options);
+        catalog_free();
+        qfilter = NULL;
     }
+    fflush(stdout);
+    fflush(stderr);
 
-    return 1;
+    /* Drop anything stdin has buffered from this client */
+    if(freopen("/dev/null", "r", stdin) == NULL) {
+        code = 2;
+    }
+    dup2(nullfd, STDOUT_FILENO);
+    dup2(logfd, STDERR_FILENO);
+    clearerr(stdout);
+    clearerr(stderr);
+    if(chdir("/") < 0) {
+        code = 2;
+    }
+    for(i = 0; i < DAEMON_NFDS; i++) {
+        close(fds[i]);
+    }
+
+    return code;
 }
 
-int tsm_listfile_cb(dsmQueryType qType, DataBlk *qResp, void * userdata)
+
+/* A worker: serve commands on lsock with a session of its own */
+void daemon_worker(int lsock, char *options, int logfd, int nullfd,
+                   char verbose)
 {
-    unsigned long long   filesize;
-    dsStruct64_t        *rSizeEst;
-    dsmObjName          *rObjName;
-    dsUint160_t         *rOrder;
-    tsmpipe_listmode_t  *listmode;
+    struct pollfd   pfd;
+    dsUint32_t      sesshandle;
+    dsInt32_t       code = 0;
+    sigset_t        set;
+    char            **argv, *args, cmdline[256];
+    size_t          len;
+    int             conn, argc, i, ncmds = 0, hungup = 0;
+    int             fds[DAEMON_NFDS];
+
+    sigemptyset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, NULL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+
+    if(!tsm_apisetup()) {
+        exit(2);
+    }
+    sesshandle = tsm_initsess(options);
+    if(!sesshandle) {
+        exit(3);
+    }
+    if(verbose > 1) {
+        fprintf(stderr, "tsmpipe: Worker %d session initiated\n",
+                (int) getpid());
+    }
 
-    if(userdata == NULL ) {
-        fprintf(stderr, "tsm_listfile_cb: Internal error: userdata == NULL");
-        return -1;
+    while(ncmds < DAEMON_MAXCMDS && code <= 1) {
+        pfd.fd = lsock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, DAEMON_MAXIDLE * 1000) == 0) {
+            break;
+        }
+        /* All workers wake up, one of them gets it */
+        conn = accept(lsock, NULL, NULL);
+        if(conn < 0) {
+            continue;
+        }
+        argc = daemon_recv(conn, &argv, &args, fds);
+        if(argc < 0) {
+            close(conn);
+            continue;
+        }
+        daemon_conn = conn;
+        code = daemon_run(sesshandle, options, argc, argv, fds, logfd,
+                          nullfd);
+        hungup = daemon_hungup();
+        daemon_conn = -1;
+        if(hungup && code <= 1) {
+            /* Its input may have been cut off, replace the worker */
+            code = 2;
+        }
+        if(verbose > 0 || hungup) {
+            *cmdline = '\0';
+            for(i = 0, len = 0; i < argc && len < sizeof(cmdline); i++) {
+                len += snprintf(cmdline + len, sizeof(cmdline) - len, "%s%s",
+                                i ? " " : "", argv[i]);
+            }
+            fprintf(stderr, "tsmpipe: Worker %d exit code %d%s: %s\n",
+                    (int) getpid(), (int) code,
+                    hungup ? ", the client went away" : "", cmdline);
+        }
+        free(args);
+        free(argv);
+        if(!hungup) {
+            write_full(conn, (char *) &code, sizeof(code));
+        }
+        close(conn);
+        ncmds++;
     }
 
-    listmode = userdata;
+    dsmTerminate(sesshandle);
+    dsmCleanUp(DSM_MULTITHREAD);
+    exit(hungup ? 4 : 0);
+}
+
 
-    if(*listmode == listmode_unknown) {
-        fprintf(stderr, "tsm_listfile_cb: Internal error: listmode == unknown");
+/* Listen on path, unless another daemon already does */
+int daemon_listen(const char *path) {
+    struct sockaddr_un  addr;
+    mode_t              mask;
+    struct stat         st;
+    int                 sock;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "tsmpipe: ERROR: -W socket path too long\n");
         return -1;
     }
-
-    if(qType == qtArchive) {
-        qryRespArchiveData *qr = (void *) qResp->bufferPtr;
-        
-        rSizeEst = &qr->sizeEstimate;
-        rObjName = &qr->objName;
-        rOrder   = &qr->restoreOrderExt;
+    /* A stale socket is replaced, anything else is not ours to remove */
+    if(lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "tsmpipe: ERROR: -W %s exists and is not a socket\n",
+                path);
+        return -1;
     }
-    else if(qType == qtBackup) {
-        qryRespBackupData *qr = (void *) qResp->bufferPtr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
 
-        rSizeEst = &qr->sizeEstimate;
-        rObjName = &qr->objName;
-        rOrder   = &qr->restoreOrderExt;
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0) {
+        perror("tsmpipe: socket");
+        return -1;
     }
-    else {
-        fprintf(stderr,
-                "tsm_listfile_cb: Internal error: Unknown qType %d\n", qType);
+    if(connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "tsmpipe: ERROR: A daemon is already running on "
+                "%s\n", path);
+        close(sock);
+        return -1;
+    }
+    close(sock);
+    if(unlink(path) < 0 && errno != ENOENT) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", path, strerror(errno));
         return -1;
     }
 
-    if(*listmode == listmode_fsize) {
-        filesize = rSizeEst->hi;
-        filesize <<= 32;
-        filesize |= rSizeEst->lo;
-        printf("%lld %s%s%s\n", 
-                filesize, rObjName->fs, rObjName->hl, rObjName->ll);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0) {
+        perror("tsmpipe: socket");
+        return -1;
     }
-    else if(*listmode == listmode_volser) {
-        printf("%u %s%s%s\n", 
-                rOrder->top, rObjName->fs, rObjName->hl, rObjName->ll);
+    /* Only our own user gets to run commands with our sessions */
+    mask = umask(077);
+    if(bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "tsmpipe: %s: %s\n", path, strerror(errno));
+        umask(mask);
+        close(sock);
+        return -1;
     }
-    else {
-        fprintf(stderr, "tsm_listfile_cb: Internal error: listmode %d unknown",
-                *listmode);
+    umask(mask);
+    if(listen(sock, SOMAXCONN) < 0 ||
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        perror("tsmpipe: listen");
+        close(sock);
+        unlink(path);
         return -1;
     }
 
-    return 1;
+    return sock;
 }
 
 
-int tsm_listfile(dsUint32_t sesshandle, char *fsname, char *filename, 
-                   char *description, dsmSendType sendtype, char verbose,
-                   tsmpipe_listmode_t listmode)
+pid_t daemon_spawn(int lsock, char *options, int logfd, int nullfd,
+                   char verbose)
 {
-    dsInt16_t   rc;
-    dsmObjName  objName;
+    pid_t   pid;
 
-    tsm_name2obj(fsname, filename, &objName);
+    pid = fork();
+    if(pid < 0) {
+        perror("tsmpipe: fork");
+    }
+    else if(pid == 0) {
+        daemon_worker(lsock, options, logfd, nullfd, verbose);
+    }
+
+    return pid;
+}
+
+
+/*
+ * Run the daemon on path with nworkers workers until SIGTERM, SIGINT or
+ * SIGHUP. Returns the exit code.
+ */
+int tsm_daemon(char *path, int nworkers, char *options, char verbose) {
+    pid_t       *pids, pid;
+    sigset_t    set;
+    time_t      *started;
+    int         lsock, logfd, nullfd, sig, status, i;
+
+    pids = calloc(nworkers, sizeof(*pids));
+    started = calloc(nworkers, sizeof(*started));
+    if(pids == NULL || started == NULL) {
+        perror("tsmpipe: malloc");
+        return 1;
+    }
+
+    lsock = daemon_listen(path);
+    if(lsock < 0) {
+        return 1;
+    }
+    logfd = dup(STDERR_FILENO);
+    nullfd = open("/dev/null", O_RDWR);
+    if(logfd < 0 || nullfd < 0 || chdir("/") < 0) {
+        perror("tsmpipe: daemon setup");
+        unlink(path);
+        return 1;
+    }
+    if(freopen("/dev/null", "r", stdin) == NULL ||
+            dup2(nullfd, STDOUT_FILENO) < 0)
+    {
+        perror("tsmpipe: daemon setup");
+        unlink(path);
+        return 1;
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for(i = 0; i < nworkers; i++) {
+        pids[i] = daemon_spawn(lsock, options, logfd, nullfd, verbose);
+        started[i] = time(NULL);
+    }
+    if(verbose > 0) {
+        fprintf(stderr, "tsmpipe: Daemon %d on %s with %d workers\n",
+                (int) getpid(), path, nworkers);
+    }
+
+    for(;;) {
+        if(sigwait(&set, &sig) != 0) {
+            continue;
+        }
+        if(sig != SIGCHLD) {
+            break;
+        }
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for(i = 0; i < nworkers && pids[i] != pid; i++) {
+            }
+            if(i == nworkers) {
+                continue;
+            }
+            if(verbose > 1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+                fprintf(stderr, "tsmpipe: Worker %d ended, %s %d\n",
+                        (int) pid, WIFEXITED(status) ? "exit code" : "signal",
+                        WIFEXITED(status) ? WEXITSTATUS(status) :
+                                            WTERMSIG(status));
+            }
+            /* Don't spin on a server or setup that doesn't work */
+            if(time(NULL) - started[i] < 1) {
+                sleep(1);
+            }
+            pids[i] = daemon_spawn(lsock, options, logfd, nullfd, verbose);
+            started[i] = time(NULL);
+        }
+    }
 
     if(verbose > 0) {
-        fprintf(stderr, "tsmpipe: Listing file(s) %s%s%s\n",
-                objName.fs, objName.hl, objName.ll);
+        fprintf(stderr, "tsmpipe: Daemon got signal %d, stopping\n", sig);
     }
-
-    rc = tsm_queryfile(sesshandle, &objName, description, sendtype, 
-                       verbose, tsm_listfile_cb, &listmode);
-    if(rc != DSM_RC_OK && rc != DSM_RC_ABORT_NO_MATCH) {
-        return 0;
+    close(lsock);
+    unlink(path);
+    for(i = 0; i < nworkers; i++) {
+        if(pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
+    }
+    for(i = 0; i < nworkers; i++) {
+        if(pids[i] > 0) {
+            waitpid(pids[i], NULL, 0);
+        }
     }
+    free(pids);
+    free(started);
 
-    return 1;
+    return 0;
 }
 
-int copy_env(const char *from, const char *to) {
-    char *e;
-    char n[PATH_MAX+1];
 
-    e = getenv(from);
-    if(!e) {
-        fprintf(stderr, "tsmpipe: Environment variable %s not set\n", from);
-        return(0);
+void usage(void) {
+    const struct tsm_codec *codec;
+    char    codeclist[128] = "";
+
+    for(codec = codecs; codec->name != NULL; codec++) {
+        if(*codeclist) {
+            strncat(codeclist, ", ", sizeof(codeclist) - strlen(codeclist) - 1);
+        }
+        strncat(codeclist, codec->name,
+                sizeof(codeclist) - strlen(codeclist) - 1);
     }
-    n[PATH_MAX] = '\0';
-    snprintf(n, PATH_MAX, "%s=%s", to, e);
-    if(putenv(strdup(n))) {
-        perror("tsmpipe: Setting up environment");
-        return(0);
+    if(*codeclist == '\0') {
+        strcpy(codeclist, "none available");
     }
 
-    return(1);
-}
-
-
-void usage(void) {
     fprintf(stderr,
     "tsmpipe $Revision: 1.8 $, usage:\n"
-    "tsmpipe [-A|-B] [-c|-x|-d|-t] -s fsname -f filepath [-l len]\n"
+    "tsmpipe [-A|-B] [-c|-x|-X|-d|-t] -s fsname -f filepath [-l len|-i path]\n"
+    "        [-S n [-Z size]] [-w outfile] [-o offset] [-L length] [-R ranges]\n"
+    "        [-z codec[:level]] [-j threads] [-k] [-K keys] [-F format] [-u]\n"
+    "        [-g dir[:age] [-G]] [-I from,to] [-E from,to] [-y state]\n"
+    "        [-P date] [-M [secs][,json=file][,prom=file]]\n"
+    "        [-Q [bytes/s][,ops=n][,burst=size][,file=path]]\n"
+    "tsmpipe [-A|-B] -c -s fsname -f filepath -i path -e size\n"
+    "tsmpipe [-A|-B] -c|-x -s fsname -f filepath -Y dir|path [-e size]\n"
+    "        [-K keys]\n"
+    "tsmpipe [-A|-B] -C manifest [-z codec[:level]] [-j threads] [-k]\n"
+    "        [-K keys]\n"
+    "tsmpipe [-A|-B] -V -s fsname -f filepath [-r reference] [-j threads]\n"
+    "        [-K keys]\n"
+    "tsmpipe [-A|-B] -U|-N age -s fsname -f filepath [-S n] [-n]\n"
+    "tsmpipe [-A|-B] -X -s fsname -f filepath|-J list [-p] [-j threads]\n"
+    "        [-K keys]\n"
+    "tsmpipe -W socket [-S n] [-O options]\n"
     "   -A and -B are mutually exclusive:\n"
     "       -A  Use Archive objects\n"
     "       -B  Use Backup objects\n"
-    "   -c, -x, -d and -t are mutually exclusive:\n"
-    "       -c  Create:  Read from stdin and store in TSM\n"
+    "   -c, -x, -X, -d, -t, -C, -V and -U are mutually exclusive:\n"
+    "       -c  Create:  Read from stdin (or -i path) and store in TSM\n"
     "       -x  eXtract: Recall from TSM and write to stdout\n"
+    "       -X  eXtract all matching objects as a pax archive to stdout,\n"
+    "           in tape order\n"
     "       -d  Delete:  Delete object from TSM\n"
     "       -t  lisT:    Print filelist with filesizes to stdout\n"
     "       -T  lisT:    Print filelist with volser ids to stdout\n"
-    "   -s and -f are required arguments:\n"
+    "       -C  Create from manifest (- for stdin), one object per line:\n"
+    "           source<TAB>fsname<TAB>filepath[<TAB>length[<TAB>desc]]\n"
+    "           source is a file, fd:N or - for stdin. length can be left\n"
+    "           out for files. Prints OK/FAILED<TAB>lineno<TAB>... per object\n"
+    "       -V  Verify:  Read all matching objects and check them against\n"
+    "           their -k checksum and/or -r reference, writing nothing.\n"
+    "           Prints OK/FAILED/UNCHECKED<TAB>filepath<TAB>... per object\n"
+    "       -U  Delete all matching objects, in as few transactions as\n"
+    "           possible. Prints DELETED/FAILED<TAB>objid<TAB>filepath\n"
+    "   -s and -f are required arguments, except with -C:\n"
     "       -s fsname   Name of filesystem in TSM\n"
     "       -f filepath Path to file within filesystem in TSM\n"
     "   -l length   Length of object to store. If guesstimating too large\n"
     "               is better than too small\n"
     "   -D desc     Description of archive object\n"
+    "   -S n        Stripe the object over n sessions when creating, -x\n"
+    "               finds out by itself. With -U, delete over n sessions\n"
+    "   -Z size     Stripe size with -S, default %dkB\n"
+    "   -i path     Read the file or block device path instead of stdin\n"
+    "               with -c, its size makes -l unnecessary. Read with\n"
+    "               O_DIRECT, or dropped from the page cache after reading\n"
+    "   -e size     Store -i path in segments of size (k/M/G) with -c, each\n"
+    "               in its own transaction. If interrupted, the same\n"
+    "               command resumes. -x finds out by itself\n"
+    "   -Y dir      Pack the files below dir into containers of -e size\n"
+    "               (default 1G) with -c, with an index under filepath\n"
+    "   -Y path     Extract the file path from such a pack with -x\n"
+    "   -w outfile  Write to outfile instead of stdout with -x\n"
+    "   -o offset   Only extract from offset, with optional k/M/G suffix\n"
+    "   -L length   Only extract length bytes, with optional k/M/G suffix\n"
+    "   -R ranges   Only extract these ranges, concatenated. Either\n"
+    "               offset:length[,offset:length...] or @file with one\n"
+    "               \"offset length\" per line (@- for stdin)\n"
+    "   -z codec    Compress with codec when creating, optionally with\n"
+    "               :level. -x decompresses by itself. sparse only drops\n"
+    "               the zeroes, sparse+codec before compressing. Have:\n"
+    "               %s\n"
+    "   -j threads  Threads for compression, decompression and\n"
+    "               encryption, default the number of CPUs\n"
+    "   -K keys     Encrypt with AES-256-GCM when creating, with the first\n"
+    "               key in the file keys (or fd:N), \"id hexkey\" per line.\n"
+    "               -x, -X and -V find the key by its id\n"
+    "   -k          Store the exact size and a CRC32C checksum with -c/-C,\n"
+    "               list estimate, size and checksum with -t\n"
+    "   -r ref      Compare with the file ref with -V, or the files below\n"
+    "               the directory ref if several objects match\n"
+    "   -I from,to  Only archive objects inserted from/to these dates,\n"
+    "               YYYY-MM-DD[ HH:MM[:SS]] or N[smhdw] ago. Either can be\n"
+    "               left out\n"
+    "   -E from,to  Only archive objects expiring from/to these dates\n"
+    "   -y state    Backup objects in state active (default), inactive or\n"
+    "               any\n"
+    "   -P date     Backup objects as they were at date (point in time)\n"
+    "   -N age      Retention sweep: -U of archive objects inserted more\n"
+    "               than age (N[smhdw], or a date like -I) ago\n"
+    "   -n          Dry run, only print DRYRUN<TAB>objid<TAB>filepath of\n"
+    "               what -U or -N would delete\n"
+    "   -J list     Extract the filepaths listed one per line in list\n"
+    "               (- for stdin) with -X, instead of -f\n"
+    "   -p          Only print the -X restore plan, VOLUME<TAB>volume<TAB>\n"
+    "               objects<TAB>bytes per volume, with -v also the objects\n"
+    "   -g dir[:age] Answer queries from a catalog of the filespace in dir,\n"
+    "               refreshed first if older than age seconds (default 0)\n"
+    "   -G          Rebuild the -g catalog with a full query\n"
+    "   -F format   Listing format with -t/-T: text (default), nul (NUL\n"
+    "               separated fields), json (JSON lines) or bin (length\n"
+    "               prefixed records), the last three with all fields\n"
+    "   -u          List the stripes, segments, pack containers and -k\n"
+    "               objects that -t/-T leave out as parts of their object\n"
     "   -O options  Extra options to pass to dsmInitEx\n"
-    "   -v          Verbose. More -v's gives more verbosity\n"
+    "   -W socket   Daemon: keep n (-S, default 4) sessions ready for\n"
+    "               commands on the Unix socket, any tsmpipe with\n"
+    "               TSMPIPE_SOCKET=socket runs in the daemon\n"
+    "   -q depth    Number of buffers queued between stdin/stdout and TSM,\n"
+    "               default %d\n"
+    "   -m size     Memory to use for queued buffers instead of -q, with\n"
+    "               optional k/M/G suffix\n"
+    "   -H          Use huge pages for queued buffers\n"
+    "   -b size     Buffer size, default n*TCPBUFFSIZE-4 close to %dkB\n"
+    "   -a          Adapt the buffer size to the throughput during transfer\n"
+    "   -M spec     Metrics: progress every secs seconds with how busy\n"
+    "               input, TSM and output were, a JSON summary at the end\n"
+    "               to json=file (- for stderr), a Prometheus textfile to\n"
+    "               prom=file\n"
+    "   -Q limits   Throttle to bytes/s (k/M/G) and ops=n objects/s, over\n"
+    "               all stripes, allowing burst=size bytes at once (default\n"
+    "               a second's worth). file=path is checked every second\n"
+    "               for new limits in the same form, 0 is unlimited\n"
+    "   -v          Verbose. More -v's gives more verbosity\n",
+    DEF_STRIPESIZE/1024, codeclist, DEF_QUEUEDEPTH,
+    BUFTARGET/1024
     );
 }
 
 
-int main(int argc, char *argv[]) {
+/*
+ * Run a command line, in the process itself or in a daemon worker with
+ * its pooled session poolsess, opened with poolopts. Returns the exit
+ * code.
+ */
+int tsm_command(int argc, char *argv[], dsUint32_t poolsess, char *poolopts)
+{
     int         c;
     extern int  optind, optopt;
     extern char *optarg;
     char        archmode=0, backmode=0, create=0, xtract=0, delete=0, verbose=0;
-    char        list=0;
+    char        list=0, xtractall=0, verify=0, bulkdel=0, dryrun=0;
+    char        planonly=0, ownsess;
+    char        *sweepstr=NULL, *namelist=NULL, *daemonsock=NULL;
     char        *space=NULL, *filename=NULL, *lenstr=NULL, *desc=NULL;
-    char        *options=NULL;
-    off_t       length;
+    char        *options=NULL, *manifest=NULL;
+    char        *ringstr=NULL, *bufstr=NULL, *stripestr=NULL, *outfile=NULL;
+    off_t       length, ringsize=0, bufsize=0, stripesize=0;
+    int         nstripes=0, outfd=STDOUT_FILENO, infd=STDIN_FILENO, ok;
+    char        *offstr=NULL, *rlenstr=NULL, *rangestr=NULL;
+    char        *segstr=NULL, *inpath=NULL, *metricstr=NULL;
+    char        *throttlestr=NULL, *keystr=NULL, *packstr=NULL;
+    double      rate, ops, burst;
+    off_t       segsize=0;
+    char        *codecstr=NULL, *reference=NULL;
+    struct tsm_range *ranges=NULL;
+    int         nranges=0;
+    tsmpipe_xfer_t xfer;
     dsUint32_t  sesshandle;
     dsmSendType sendtype;
     tsmpipe_listmode_t listmode=listmode_unknown;
+    tsmpipe_listfmt_t listfmt=listfmt_text;
+    char        *fmtstr=NULL, *catstr=NULL, rebuild=0, showsubs=0;
+    char        *insstr=NULL, *expstr=NULL, *statestr=NULL, *pitstr=NULL;
+    struct tsm_qfilter filter;
+
+    memset(&xfer, 0, sizeof(xfer));
+    memset(&metrics, 0, sizeof(metrics));
+    memset(&throttle, 0, sizeof(throttle));
+    keyring_clear();
 
-    while ((c = getopt(argc, argv, "hABcxdtTvs:f:l:D:O:")) != -1) {
+    while ((c = getopt(argc, argv, "hABcxXdtTvs:f:l:D:O:q:m:Hb:aC:S:Z:w:o:L:R:z:j:kVr:F:ug:GI:E:y:P:UN:npJ:W:e:i:M:Q:K:Y:")) != -1) {
         switch(c) {
             case 'h':
                 usage();
-                exit(1);
+                return 1;
             case 'A':
                 archmode = 1;
                 break;
@@ -888,6 +13637,9 @@ int main(int argc, char *argv[]) {
             case 'x':
                 xtract = 1;
                 break;
+            case 'X':
+                xtractall = 1;
+                break;
             case 'd':
                 delete = 1;
                 break;
@@ -917,125 +13669,731 @@ int main(int argc, char *argv[]) {
             case 'O':
                 options = optarg;
                 break;
+            case 'q':
+                xfer.qdepth = atoi(optarg);
+                if(xfer.qdepth < 1) {
+                    fprintf(stderr, "tsmpipe: ERROR: -q depth must be at least 1\n");
+                    return 1;
+                }
+                break;
+            case 'm':
+                ringstr = optarg;
+                break;
+            case 'H':
+                xfer.hugepages = 1;
+                break;
+            case 'b':
+                bufstr = optarg;
+                break;
+            case 'a':
+                xfer.adaptive = 1;
+                break;
+            case 'C':
+                manifest = optarg;
+                break;
+            case 'S':
+                nstripes = atoi(optarg);
+                if(nstripes < 1 || nstripes > MAX_STRIPES) {
+                    fprintf(stderr, "tsmpipe: ERROR: -S must be 1 to %d\n",
+                            MAX_STRIPES);
+                    return 1;
+                }
+                break;
+            case 'Z':
+                stripestr = optarg;
+                break;
+            case 'w':
+                outfile = optarg;
+                break;
+            case 'o':
+                offstr = optarg;
+                break;
+            case 'L':
+                rlenstr = optarg;
+                break;
+            case 'R':
+                rangestr = optarg;
+                break;
+            case 'z':
+                codecstr = optarg;
+                break;
+            case 'k':
+                xfer.checksum = 1;
+                break;
+            case 'V':
+                verify = 1;
+                break;
+            case 'r':
+                reference = optarg;
+                break;
+            case 'F':
+                fmtstr = optarg;
+                break;
+            case 'u':
+                showsubs = 1;
+                break;
+            case 'g':
+                catstr = optarg;
+                break;
+            case 'G':
+                rebuild = 1;
+                break;
+            case 'I':
+                insstr = optarg;
+                break;
+            case 'E':
+                expstr = optarg;
+                break;
+            case 'y':
+                statestr = optarg;
+                break;
+            case 'P':
+                pitstr = optarg;
+                break;
+            case 'U':
+                bulkdel = 1;
+                break;
+            case 'N':
+                sweepstr = optarg;
+                break;
+            case 'n':
+                dryrun = 1;
+                break;
+            case 'p':
+                planonly = 1;
+                break;
+            case 'J':
+                namelist = optarg;
+                break;
+            case 'W':
+                daemonsock = optarg;
+                break;
+            case 'e':
+                segstr = optarg;
+                break;
+            case 'i':
+                inpath = optarg;
+                break;
+            case 'M':
+                metricstr = optarg;
+                break;
+            case 'Q':
+                throttlestr = optarg;
+                break;
+            case 'K':
+                keystr = optarg;
+                break;
+            case 'Y':
+                packstr = optarg;
+                break;
+            case 'j':
+                xfer.zthreads = atoi(optarg);
+                if(xfer.zthreads < 1 || xfer.zthreads > MAX_ZTHREADS) {
+                    fprintf(stderr, "tsmpipe: ERROR: -j must be 1 to %d\n",
+                            MAX_ZTHREADS);
+                    return 1;
+                }
+                break;
             case ':':
                 fprintf(stderr, "tsmpipe: Option -%c requires an operand\n", optopt);
-                exit(1);
+                return 1;
             case '?':
                 fprintf(stderr, "tsmpipe: Unrecognized option: -%c\n", optopt);
-                exit(1);
+                return 1;
         }
     }
 
+    if(daemonsock) {
+        if(poolsess) {
+            fprintf(stderr, "tsmpipe: ERROR: -W socket not through the daemon\n");
+            return 1;
+        }
+        if(archmode || backmode || space || filename || manifest) {
+            fprintf(stderr, "tsmpipe: ERROR: -W socket only with -S n, -O options and -v\n");
+            return 1;
+        }
+        return tsm_daemon(daemonsock, nstripes ? nstripes : DEF_WORKERS,
+                          options, verbose);
+    }
     if(archmode+backmode != 1) {
         fprintf(stderr, "tsmpipe: ERROR: Must give one of -A or -B\n");
-        exit(1);
+        return 1;
     }
-    if(create+xtract+delete+list != 1) {
-        fprintf(stderr, "tsmpipe: ERROR: Must give one of -c, -x, -d or -t\n");
-        exit(1);
+    if(sweepstr) {
+        bulkdel = 1;
     }
-    if(!space) {
+    if(create+xtract+xtractall+delete+list+verify+bulkdel+(manifest!=NULL) != 1) {
+        fprintf(stderr, "tsmpipe: ERROR: Must give one of -c, -x, -X, -d, -t, -C, -V or -U\n");
+        return 1;
+    }
+    if(manifest && (space || filename || desc)) {
+        fprintf(stderr, "tsmpipe: ERROR: -s, -f and -D are given in the manifest with -C\n");
+        return 1;
+    }
+    if(!space && !manifest) {
         fprintf(stderr, "tsmpipe: ERROR: Must give -s filespacename\n");
-        exit(1);
+        return 1;
     }
-    if(!filename) {
+    if(!filename && !manifest && !namelist) {
         fprintf(stderr, "tsmpipe: ERROR: Must give -f filename\n");
-        exit(1);
+        return 1;
     }
-    if(create && !lenstr) {
-        fprintf(stderr, "tsmpipe: ERROR: Must give -l length with -c\n");
-        exit(1);
+    if(namelist && filename) {
+        fprintf(stderr, "tsmpipe: ERROR: -J list and -f filename are mutually exclusive\n");
+        return 1;
+    }
+    if((namelist || planonly) && !xtractall) {
+        fprintf(stderr, "tsmpipe: ERROR: -J list and -p only with -X\n");
+        return 1;
+    }
+    if(segstr && !inpath && !packstr) {
+        fprintf(stderr, "tsmpipe: ERROR: Must give -i path or -Y dir with -e size\n");
+        return 1;
+    }
+    if(packstr && !create && !xtract) {
+        fprintf(stderr, "tsmpipe: ERROR: -Y only with -c or -x\n");
+        return 1;
+    }
+    if(packstr && create && (inpath || lenstr || nstripes || codecstr ||
+                             xfer.checksum))
+    {
+        fprintf(stderr, "tsmpipe: ERROR: -Y dir not with -i, -l, -S, -z or -k\n");
+        return 1;
+    }
+    if(inpath && !create) {
+        fprintf(stderr, "tsmpipe: ERROR: -i path only with -c\n");
+        return 1;
+    }
+    if(inpath && lenstr) {
+        fprintf(stderr, "tsmpipe: ERROR: -l length useless with -i path, the size is known\n");
+        return 1;
+    }
+    if(segstr && !create) {
+        fprintf(stderr, "tsmpipe: ERROR: -e size only with -c, -x finds the segments by itself\n");
+        return 1;
+    }
+    if(segstr && (nstripes || codecstr || xfer.checksum)) {
+        fprintf(stderr, "tsmpipe: ERROR: -e size not with -S, -z or -k\n");
+        return 1;
+    }
+    if(segstr) {
+        segsize = atosize(segstr);
+        if(segsize <= 0) {
+            fprintf(stderr, "tsmpipe: ERROR: Invalid -e size %s\n", segstr);
+            return 1;
+        }
+    }
+    if(create && !lenstr && !inpath && !packstr) {
+        fprintf(stderr, "tsmpipe: ERROR: Must give -l length, -i path or -Y dir with -c\n");
+        return 1;
     }
     if(!create && lenstr) {
         fprintf(stderr, "tsmpipe: ERROR: -l length useless without -c\n");
-        exit(1);
+        return 1;
     }
     if(!archmode && desc) {
         fprintf(stderr, "tsmpipe: ERROR: -D desc useless without -A\n");
-        exit(1);
+        return 1;
     }
-
-    if(archmode) {
-        sendtype = stArchiveMountWait;
+    if(xfer.qdepth && ringstr) {
+        fprintf(stderr, "tsmpipe: ERROR: -q depth and -m size are mutually exclusive\n");
+        return 1;
+    }
+    if(ringstr) {
+        ringsize = atosize(ringstr);
+        if(ringsize <= 0) {
+            fprintf(stderr, "tsmpipe: ERROR: Invalid -m size %s\n", ringstr);
+            return 1;
+        }
+    }
+    else if(!xfer.qdepth) {
+        xfer.qdepth = DEF_QUEUEDEPTH;
+    }
+    if(nstripes && !create && !bulkdel) {
+        fprintf(stderr, "tsmpipe: ERROR: -S n only with -c or -U, -x finds the stripes by itself\n");
+        return 1;
+    }
+    if(stripestr && bulkdel) {
+        fprintf(stderr, "tsmpipe: ERROR: -Z size useless with -U\n");
+        return 1;
+    }
+    if(dryrun && !bulkdel) {
+        fprintf(stderr, "tsmpipe: ERROR: -n only with -U or -N\n");
+        return 1;
+    }
+    if(sweepstr && !archmode) {
+        fprintf(stderr, "tsmpipe: ERROR: -N age only with -A\n");
+        return 1;
+    }
+    if(sweepstr && insstr) {
+        fprintf(stderr, "tsmpipe: ERROR: -N age and -I dates are mutually exclusive\n");
+        return 1;
+    }
+    if(stripestr && !nstripes) {
+        fprintf(stderr, "tsmpipe: ERROR: -Z size useless without -S\n");
+        return 1;
+    }
+    if(stripestr) {
+        stripesize = atosize(stripestr);
+        if(stripesize <= 0) {
+            fprintf(stderr, "tsmpipe: ERROR: Invalid -Z size %s\n", stripestr);
+            return 1;
+        }
     }
     else {
-        sendtype = stBackupMountWait;
+        stripesize = DEF_STRIPESIZE;
+    }
+    if(outfile && !xtract) {
+        fprintf(stderr, "tsmpipe: ERROR: -w outfile only with -x\n");
+        return 1;
+    }
+    if((offstr || rlenstr || rangestr) && !xtract) {
+        fprintf(stderr, "tsmpipe: ERROR: -o, -L and -R only with -x\n");
+        return 1;
     }
+    if(packstr && (offstr || rlenstr || rangestr)) {
+        fprintf(stderr, "tsmpipe: ERROR: -Y path not with -o, -L or -R\n");
+        return 1;
+    }
+    if(rangestr && (offstr || rlenstr)) {
+        fprintf(stderr, "tsmpipe: ERROR: -R ranges and -o/-L are mutually exclusive\n");
+        return 1;
+    }
+    if(offstr || rlenstr) {
+        off_t offset = offstr ? atosize(offstr) : 0;
+        off_t rlen = rlenstr ? atosize(rlenstr) : 0;
 
-    /* Let the TSM api get the signals */
-    signal(SIGPIPE, SIG_IGN);
-    signal(SIGINT, SIG_IGN);
-    signal(SIGUSR1, SIG_IGN);
+        if(offset < 0 || rlen < 0 || (rlenstr && rlen == 0)) {
+            fprintf(stderr, "tsmpipe: ERROR: Invalid -o offset or -L length\n");
+            return 1;
+        }
+        if(!range_add(&ranges, &nranges, offset, rlen, 0)) {
+            return 1;
+        }
+    }
+    if(rangestr && !range_parse(rangestr, &ranges, &nranges)) {
+        fprintf(stderr, "tsmpipe: ERROR: No valid ranges in -R %s\n", rangestr);
+        return 1;
+    }
+    if(xfer.checksum && !create && !manifest && listmode != listmode_fsize) {
+        fprintf(stderr, "tsmpipe: ERROR: -k only with -c, -C or -t\n");
+        return 1;
+    }
+    if(xfer.checksum && list) {
+        listmode = listmode_sums;
+    }
+    if(fmtstr && !list) {
+        fprintf(stderr, "tsmpipe: ERROR: -F format only with -t or -T\n");
+        return 1;
+    }
+    if(showsubs && !list) {
+        fprintf(stderr, "tsmpipe: ERROR: -u only with -t or -T\n");
+        return 1;
+    }
+    if(fmtstr && xfer.checksum) {
+        fprintf(stderr, "tsmpipe: ERROR: -F format and -k are mutually exclusive\n");
+        return 1;
+    }
+    if(fmtstr) {
+        if(strcmp(fmtstr, "text") == 0) {
+            listfmt = listfmt_text;
+        }
+        else if(strcmp(fmtstr, "nul") == 0) {
+            listfmt = listfmt_nul;
+        }
+        else if(strcmp(fmtstr, "json") == 0) {
+            listfmt = listfmt_json;
+        }
+        else if(strcmp(fmtstr, "bin") == 0) {
+            listfmt = listfmt_bin;
+        }
+        else {
+            fprintf(stderr, "tsmpipe: ERROR: Unknown -F format %s, use text, nul, json or bin\n", fmtstr);
+            return 1;
+        }
+    }
+    if(codecstr && !create && !manifest) {
+        fprintf(stderr, "tsmpipe: ERROR: -z codec only with -c or -C, -x finds out by itself\n");
+        return 1;
+    }
+    if(codecstr && nstripes) {
+        fprintf(stderr, "tsmpipe: ERROR: -z codec and -S n are mutually exclusive\n");
+        return 1;
+    }
+    if(xfer.zthreads && !create && !manifest && !xtract && !xtractall &&
+            !verify)
+    {
+        fprintf(stderr, "tsmpipe: ERROR: -j threads only with -c, -C, -x, -X or -V\n");
+        return 1;
+    }
+    if(reference && !verify) {
+        fprintf(stderr, "tsmpipe: ERROR: -r reference only with -V\n");
+        return 1;
+    }
+    if(keystr && !create && !manifest && !xtract && !xtractall && !verify) {
+        fprintf(stderr, "tsmpipe: ERROR: -K keys only with -c, -C, -x, -X or -V\n");
+        return 1;
+    }
+    if(keystr && (nstripes || (segstr && !packstr))) {
+        fprintf(stderr, "tsmpipe: ERROR: -K keys not with -S or -e\n");
+        return 1;
+    }
+#ifndef HAVE_OPENSSL
+    if(keystr) {
+        fprintf(stderr, "tsmpipe: ERROR: -K keys needs tsmpipe built with OpenSSL\n");
+        return 1;
+    }
+#endif
+    if(keystr && !keyring_load(keystr)) {
+        return 1;
+    }
+    if(keystr && (create || manifest)) {
+        /* The first key encrypts, the others are for restores */
+        xfer.key = &keyring[0];
+    }
+    if(codecstr && !codec_parse(&xfer, codecstr)) {
+        return 1;
+    }
+    xfer.zblock = DEF_ZBLOCK;
+    if(!xfer.zthreads) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
 
-    if(!copy_env("DSM_DIR", "DSMI_DIR")) {
-        exit(2);
+        xfer.zthreads = ncpu < 1 ? 1 : ncpu > MAX_ZTHREADS ? MAX_ZTHREADS : ncpu;
+    }
+    if((insstr || expstr || statestr || pitstr) && (create || manifest)) {
+        fprintf(stderr, "tsmpipe: ERROR: -I, -E, -y and -P not with -c or -C\n");
+        return 1;
+    }
+    if((insstr || expstr) && !archmode) {
+        fprintf(stderr, "tsmpipe: ERROR: -I and -E dates only with -A\n");
+        return 1;
+    }
+    if((statestr || pitstr) && !backmode) {
+        fprintf(stderr, "tsmpipe: ERROR: -y state and -P date only with -B\n");
+        return 1;
+    }
+    if(insstr || expstr || statestr || pitstr || sweepstr) {
+        qfilter_default(&filter);
+        qfilter = &filter;
+    }
+    if(sweepstr && !qfilter_date(sweepstr, &filter.insUpper, 0)) {
+        fprintf(stderr, "tsmpipe: ERROR: Invalid -N age %s\n", sweepstr);
+        return 1;
+    }
+    if(insstr && !qfilter_range(insstr, &filter.insLower, &filter.insUpper)) {
+        fprintf(stderr, "tsmpipe: ERROR: Invalid -I date range %s\n", insstr);
+        return 1;
+    }
+    if(expstr && !qfilter_range(expstr, &filter.expLower, &filter.expUpper)) {
+        fprintf(stderr, "tsmpipe: ERROR: Invalid -E date range %s\n", expstr);
+        return 1;
+    }
+    if(statestr) {
+        if(strcmp(statestr, "active") == 0) {
+            filter.objState = DSM_ACTIVE;
+        }
+        else if(strcmp(statestr, "inactive") == 0) {
+            filter.objState = DSM_INACTIVE;
+        }
+        else if(strcmp(statestr, "any") == 0) {
+            filter.objState = DSM_ANY_MATCH;
+        }
+        else {
+            fprintf(stderr, "tsmpipe: ERROR: Unknown -y state %s, use active, inactive or any\n", statestr);
+            return 1;
+        }
+    }
+    if(pitstr && !qfilter_date(pitstr, &filter.pitDate, 1)) {
+        fprintf(stderr, "tsmpipe: ERROR: Invalid -P date %s\n", pitstr);
+        return 1;
+    }
+    if(rebuild && !catstr) {
+        fprintf(stderr, "tsmpipe: ERROR: -G useless without -g dir\n");
+        return 1;
+    }
+    if(catstr && (create || manifest)) {
+        fprintf(stderr, "tsmpipe: ERROR: -g dir not with -c or -C\n");
+        return 1;
+    }
+    if(catstr && !catalog_init(catstr, rebuild)) {
+        return 1;
+    }
+    if(bufstr) {
+        bufsize = atosize(bufstr);
+        if(bufsize <= 0 || bufsize > MAX_BUFSIZE) {
+            fprintf(stderr, "tsmpipe: ERROR: Invalid -b size %s\n", bufstr);
+            return 1;
+        }
+    }
+    if(metricstr && !metrics_parse(metricstr)) {
+        fprintf(stderr, "tsmpipe: ERROR: Invalid -M, use "
+                "[secs][,json=file][,prom=file]\n");
+        return 1;
+    }
+    if(throttlestr) {
+        if(!throttle_parse(throttlestr, &rate, &ops, &burst, &throttle.file)) {
+            fprintf(stderr, "tsmpipe: ERROR: Invalid -Q, use "
+                    "[bytes/s][,ops=n][,burst=size][,file=path]\n");
+            return 1;
+        }
+        throttle.verbose = verbose;
+        throttle_set(rate, ops, burst);
     }
 
-    if(!copy_env("DSM_CONFIG", "DSMI_CONFIG")) {
-        exit(2);
+    if(archmode) {
+        sendtype = stArchiveMountWait;
+    }
+    else {
+        sendtype = stBackupMountWait;
     }
 
-    if(!tsm_checkapi()) {
-        exit(2);
+    metrics.mode = create ? "create" : manifest ? "batch" :
+                   delete ? "delete" : bulkdel ? "bulkdelete" :
+                   xtract ? "extract" : xtractall ? "extractall" :
+                   verify ? "verify" : "list";
+    metrics.type = archmode ? "archive" : "backup";
+    metrics.fs = space;
+    metrics.name = filename;
+    metrics.verbose = verbose;
+    metrics_start();
+
+    if(poolsess && (options == NULL) == (poolopts == NULL) &&
+            (options == NULL || strcmp(options, poolopts) == 0))
+    {
+        sesshandle = poolsess;
     }
+    else {
+        if(!poolsess && !tsm_apisetup()) {
+            return metrics_end(2);
+        }
 
-    sesshandle = tsm_initsess(options);
-    if(!sesshandle) {
-        exit(3);
+        sesshandle = tsm_initsess(options);
+        if(!sesshandle) {
+            return metrics_end(3);
+        }
+
+        if(verbose > 1) {
+            fprintf(stderr, "tsmpipe: Session initiated\n");
+        }
     }
+    ownsess = sesshandle != poolsess;
 
-    if(verbose > 1) {
-        fprintf(stderr, "tsmpipe: Session initiated\n");
+    if(create || xtract || xtractall || manifest || verify) {
+        if(!xfer_setup(&xfer, sesshandle, options, bufsize, ringsize, verbose)) {
+            return cmd_end(sesshandle, ownsess, 1);
+        }
     }
 
     if(create) {
+        char    oldid[DSM_MAX_OBJINFO_LENGTH + 1] = "";
+        char    newid[DSM_MAX_OBJINFO_LENGTH + 1];
+
         if(!tsm_regfs(sesshandle, space)) {
-            exit(4);
+            return cmd_end(sesshandle, ownsess, 4);
         }
-        length = atooff(lenstr);
-        if(length <= 0) {
+        /* A new backup version replaces the sub-objects of the active one */
+        if((sendtype == stBackupMountWait || sendtype == stBackup) &&
+                !tsm_activesubid(sesshandle, space, filename, desc, verbose,
+                                 oldid, sizeof(oldid)))
+        {
+            return cmd_end(sesshandle, ownsess, 6);
+        }
+        if(inpath) {
+            /* Striping reads stripe sized pieces, not kept aligned */
+            infd = input_open(inpath, !nstripes &&
+                              segsize % DIRECT_ALIGN == 0, &length);
+            if(infd < 0) {
+                return cmd_end(sesshandle, ownsess, 5);
+            }
+        }
+        else if(!packstr && (length = atooff(lenstr)) <= 0) {
             fprintf(stderr, "tsmpipe: ERROR: Provide positive length, overestimate if guessing");
-            exit(5);
+            return cmd_end(sesshandle, ownsess, 5);
+        }
+        if(packstr) {
+            ok = tsm_sendpack(sesshandle, space, filename, packstr,
+                              segstr ? segsize : DEF_PACKSIZE, desc, sendtype,
+                              verbose, &xfer);
+        }
+        else if(segstr) {
+            ok = tsm_sendsegmented(sesshandle, space, filename, infd, length,
+                                   desc, sendtype, verbose, &xfer, segsize);
         }
-        if(!tsm_sendfile(sesshandle, space, filename, length, desc, sendtype, verbose)){
-            dsmTerminate(sesshandle);
-            exit(6);
+        else if(nstripes) {
+            ok = tsm_sendstriped(sesshandle, space, filename, length, infd,
+                                 desc, sendtype, verbose, &xfer, options,
+                                 nstripes, stripesize);
+        }
+        else {
+            ok = tsm_sendfile(sesshandle, space, filename, length, infd,
+                              desc, sendtype, verbose, &xfer);
+        }
+        if(inpath) {
+            close(infd);
+        }
+        if(!ok) {
+            return cmd_end(sesshandle, ownsess, 6);
+        }
+        if(*oldid && (!tsm_activesubid(sesshandle, space, filename, desc,
+                                       verbose, newid, sizeof(newid)) ||
+                      (strcmp(oldid, newid) != 0 &&
+                       !tsm_deletesubs(sesshandle, space, filename, oldid,
+                                       desc, sendtype, verbose))))
+        {
+            fprintf(stderr, "tsmpipe: Sub-objects %s%s.%s.* of the replaced "
+                    "version need to be inactivated\n", space, filename,
+                    oldid);
+        }
+    }
+
+    if(manifest) {
+        int failed = tsm_sendbatch(sesshandle, manifest, sendtype, verbose, &xfer);
+
+        if(failed < 0) {
+            return cmd_end(sesshandle, ownsess, 6);
+        }
+        else if(failed > 0) {
+            fprintf(stderr, "tsmpipe: %d object(s) failed\n", failed);
+            return cmd_end(sesshandle, ownsess, 10);
         }
     }
 
     if(delete) {
-        if(!tsm_deletefile(sesshandle, space, filename, desc, sendtype, verbose)) {
-            dsmTerminate(sesshandle);
-            exit(7);
+        ok = tsm_deletefile(sesshandle, space, filename, desc, sendtype,
+                            verbose);
+        if(!ok && catalog_recheck(sesshandle, space, filename, desc,
+                                  sendtype, verbose))
+        {
+            ok = tsm_deletefile(sesshandle, space, filename, desc, sendtype,
+                                verbose);
+        }
+        if(!ok) {
+            return cmd_end(sesshandle, ownsess, 7);
         }
     }
 
-    if(xtract) {
-        if(!tsm_restorefile(sesshandle, space, filename, desc, sendtype, verbose))
+    if(bulkdel) {
+        int failed = tsm_bulkdelete(sesshandle, space, filename, desc, sendtype,
+                                    verbose, options, nstripes ? nstripes : 1,
+                                    dryrun);
+
+        if(failed > 0 && catalog_recheck(sesshandle, space, filename, desc,
+                                         sendtype, verbose))
         {
-            dsmTerminate(sesshandle);
-            exit(8);
+            failed = tsm_bulkdelete(sesshandle, space, filename, desc,
+                                    sendtype, verbose, options,
+                                    nstripes ? nstripes : 1, dryrun);
+        }
+
+        if(failed < 0) {
+            return cmd_end(sesshandle, ownsess, 7);
+        }
+        else if(failed > 0) {
+            return cmd_end(sesshandle, ownsess, 13);
+        }
+    }
+
+    if(xtract) {
+        if(outfile) {
+            outfd = open(outfile, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+            if(outfd < 0) {
+                fprintf(stderr, "tsmpipe: %s: %s\n", outfile, strerror(errno));
+                return cmd_end(sesshandle, ownsess, 8);
+            }
+        }
+        if(packstr) {
+            ok = tsm_restoremember(sesshandle, space, filename, packstr, desc,
+                                   sendtype, verbose, &xfer, outfd);
+        }
+        else {
+            ok = tsm_restorefile(sesshandle, space, filename, desc, sendtype,
+                                 verbose, &xfer, options, ranges, nranges,
+                                 outfd);
+            /* Nothing was got of an object that is gone */
+            if(!ok && catalog_recheck(sesshandle, space, filename, desc,
+                                      sendtype, verbose))
+            {
+                ok = tsm_restorefile(sesshandle, space, filename, desc,
+                                     sendtype, verbose, &xfer, options,
+                                     ranges, nranges, outfd);
+            }
+        }
+        if(!ok) {
+            return cmd_end(sesshandle, ownsess, 8);
+        }
+        if(outfile && close(outfd) < 0) {
+            fprintf(stderr, "tsmpipe: %s: %s\n", outfile, strerror(errno));
+            return cmd_end(sesshandle, ownsess, 8);
+        }
+    }
+
+    if(xtractall) {
+        int failed = tsm_extractall(sesshandle, space, filename, namelist,
+                                    desc, sendtype, verbose, &xfer, options,
+                                    planonly);
+
+        if(failed < 0) {
+            return cmd_end(sesshandle, ownsess, 8);
+        }
+        else if(failed > 0) {
+            fprintf(stderr, "tsmpipe: %d object(s) were skipped or missing\n",
+                    failed);
+            return cmd_end(sesshandle, ownsess, 11);
+        }
+    }
+
+    if(verify) {
+        int failed = tsm_verifyall(sesshandle, space, filename, desc, sendtype,
+                                   verbose, &xfer, options, reference);
+
+        if(failed < 0) {
+            return cmd_end(sesshandle, ownsess, 8);
+        }
+        else if(failed > 0) {
+            return cmd_end(sesshandle, ownsess, 12);
         }
     }
 
     if(list) {
-        if(!tsm_listfile(sesshandle, space, filename, desc, sendtype, verbose, listmode))
+        if(!tsm_listfile(sesshandle, space, filename, desc, sendtype, verbose,
+                         listmode, listfmt, showsubs))
         {
-            dsmTerminate(sesshandle);
-            exit(9);
+            return cmd_end(sesshandle, ownsess, 9);
         }
     }
 
+    metrics_end(0);
     if(verbose > 0) {
         fprintf(stderr, "tsmpipe: Success!\n");
     }
 
-    dsmTerminate(sesshandle);
+    if(ownsess) {
+        dsmTerminate(sesshandle);
+    }
+    if(!poolsess) {
+        dsmCleanUp(DSM_MULTITHREAD);
+    }
 
     return(0);
 }
 
 
+int main(int argc, char *argv[]) {
+    char    *sock;
+    int     rc;
+
+    sock = getenv("TSMPIPE_SOCKET");
+    if(sock && *sock) {
+        rc = daemon_client(sock, argc, argv);
+        if(rc >= 0) {
+            return rc;
+        }
+    }
+
+    return tsm_command(argc, argv, 0, NULL);
+}
+
+
 /*
 vim:ts=4:sw=4:et:cindent
 */